@@ -17,6 +17,8 @@
 #define LOG_TAG "r_submix"
 //#define LOG_NDEBUG 0
 
+#include <atomic>
+
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -32,6 +34,9 @@
 #include <log/log.h>
 #include <utils/String8.h>
 
+#include <audio_utils/format.h>
+#include <audio_utils/primitives.h>
+#include <audio_utils/resampler.h>
 #include <hardware/audio.h>
 #include <hardware/hardware.h>
 #include <system/audio.h>
@@ -68,12 +73,6 @@ namespace android {
 // read from the sink.  The maximum latency of the device is the size of the MonoPipe's buffer
 // the minimum latency is the MonoPipe buffer size divided by this value.
 #define DEFAULT_PIPE_PERIOD_COUNT    4
-// The duration of MAX_READ_ATTEMPTS * READ_ATTEMPT_SLEEP_MS must be stricly inferior to
-//   the duration of a record buffer at the current record sample rate (of the device, not of
-//   the recording itself). Here we have:
-//      3 * 5ms = 15ms < 1024 frames * 1000 / 48000 = 21.333ms
-#define MAX_READ_ATTEMPTS            3
-#define READ_ATTEMPT_SLEEP_MS        5 // 5ms between two read attempts when pipe is empty
 #define DEFAULT_SAMPLE_RATE_HZ       48000 // default sample rate
 // See NBAIO_Format frameworks/av/include/media/nbaio/NBAIO.h.
 #define DEFAULT_FORMAT               AUDIO_FORMAT_PCM_16_BIT
@@ -83,6 +82,17 @@ namespace android {
 // multiple input streams from this device.  If this option is enabled, each input stream returned
 // is *the same stream* which means that readers will race to read data from these streams.
 #define ENABLE_LEGACY_INPUT_OPEN     1
+// Maximum number of input streams reading from a broadcast route in addition to the first one.
+#define MAX_BROADCAST_INPUTS         4
+// Device parameters enabling and disabling broadcast for the route of the address they are set
+// to.  Each input stream opened on a broadcast route reads everything written by the output
+// stream from a pipe of its own, instead of all input streams sharing the same stream.  This
+// takes effect for input streams opened after the parameter is set.
+#define SUBMIX_PARAMETER_BROADCAST    "r_submix_broadcast"
+#define SUBMIX_PARAMETER_NO_BROADCAST "r_submix_no_broadcast"
+// Input stream parameter selecting the submix_overrun_policy_t of the stream, "block",
+// "drop_oldest" or "drop_newest".
+#define SUBMIX_PARAMETER_OVERRUN      "r_submix_overrun"
 
 #if LOG_STREAMS_TO_FILES
 // Folder to save stream log files to.
@@ -120,19 +130,33 @@ namespace android {
 
 // Configuration of the submix pipe.
 struct submix_config {
-    // Channel mask field in this data structure is set to either input_channel_mask or
-    // output_channel_mask depending upon the last stream to be opened on this device.
+    // Config of the stream which created the pipe, its channel mask is either an input or an
+    // output channel mask.
     struct audio_config common;
-    // Input stream and output stream channel masks.  This is required since input and output
-    // channel bitfields are not equivalent.
-    audio_channel_mask_t input_channel_mask;
+    // Output stream channel mask.  Input streams keep their own config as they convert the
+    // frames of the pipe when they don't match it.
     audio_channel_mask_t output_channel_mask;
     size_t pipe_frame_size;  // Number of bytes in each audio frame in the pipe.
+    uint32_t pipe_channel_count;  // Number of channels in each audio frame in the pipe.
     size_t buffer_size_frames; // Size of the audio pipe in frames.
     // Maximum number of frames buffered by the input and output streams.
     size_t buffer_period_size_frames;
 };
 
+// What the output stream does when the pipe read by an input stream can't hold the frames
+// written.
+typedef enum {
+    // Wait for the input stream to read, unless the input stream is in standby after having
+    // been active.
+    SUBMIX_OVERRUN_BLOCK,
+    // Discard the oldest frames in the pipe to make space, so that an input stream reading late
+    // catches up with the most recent frames.
+    SUBMIX_OVERRUN_DROP_OLDEST,
+    // Discard the frames that don't fit in the pipe, so that an input stream reading late
+    // doesn't hold up the output stream and the other input streams of a broadcast route.
+    SUBMIX_OVERRUN_DROP_NEWEST,
+} submix_overrun_policy_t;
+
 #define MAX_ROUTES 10
 typedef struct route_config {
     struct submix_config config;
@@ -151,13 +175,32 @@ typedef struct route_config {
     // destroyed if both and input and output streams are destroyed.
     struct submix_stream_out *output;
     struct submix_stream_in *input;
+    // Input streams reading from a broadcast route in addition to input, each from its own pipe.
+    struct submix_stream_in *broadcast_inputs[MAX_BROADCAST_INPUTS];
+    // Buffer the size of the pipe, frames discarded from the pipes of the route on overrun are
+    // read into it.  Only used with the route lock held.
+    void *flush_buffer;
+    // Route lock, protects rsxSink, rsxSource, output, input, broadcast_inputs and flush_buffer.
+    // These are only modified with both the device lock and the route lock held, so either lock
+    // is enough to read them.  The input and output streams only take the lock of their own
+    // route, and only to copy the pipe references, check the state of the peer stream and make
+    // space in the pipes.
+    pthread_mutex_t lock;
+    // Signalled with the route lock held when frames are written to rsxSink while readers_waiting
+    // is non-zero, or when the output stream goes into standby or is closed.  Uses
+    // CLOCK_MONOTONIC for timed waits.
+    pthread_cond_t frames_written_cond;
+    // Number of input stream reads waiting on frames_written_cond.
+    std::atomic<int32_t> readers_waiting;
 } route_config_t;
 
 struct submix_audio_device {
     struct audio_hw_device device;
     route_config_t routes[MAX_ROUTES];
-    // Device lock, also used to protect access to submix_audio_device from the input and output
-    // streams.
+    // Addresses set with SUBMIX_PARAMETER_BROADCAST, empty strings in unused slots.
+    char broadcast_addresses[MAX_ROUTES][AUDIO_DEVICE_MAX_ADDRESS_LEN];
+    // Device lock, serializes opening and closing streams and the assignment of routes to
+    // addresses.  Must be acquired before the lock of a route.
     pthread_mutex_t lock;
 };
 
@@ -165,25 +208,61 @@ struct submix_stream_out {
     struct audio_stream_out stream;
     struct submix_audio_device *dev;
     int route_handle;
-    bool output_standby;
-    uint64_t frames_written;
-    uint64_t frames_written_since_standby;
+    // Written by the output stream, read by the input stream of the route and the position
+    // queries without locking.
+    std::atomic<bool> output_standby;
+    std::atomic<uint64_t> frames_written;
+    std::atomic<uint64_t> frames_written_since_standby;
 #if LOG_STREAMS_TO_FILES
     int log_fd;
 #endif // LOG_STREAMS_TO_FILES
 };
 
+// Converts the frames read from a pipe to the sample rate, format and channel count of an input
+// stream which doesn't match the pipe.  Only used by the thread reading the input stream.
+struct submix_converter {
+    // Provides the frames of the pipe to resampler, remixed and converted to 16-bit.
+    struct resampler_buffer_provider provider;
+    audio_format_t pipe_format;
+    uint32_t pipe_channel_count;
+    audio_format_t format;
+    uint32_t channel_count;
+    // NULL if the sample rate of the input stream matches the pipe.
+    struct resampler_itfe *resampler;
+    // Pipe read by the provider while resampler is running.
+    MonoPipeReader *source;
+    // Size in frames of each of the following buffers.
+    size_t buffer_frames;
+    void *pipe_buffer;             // Frames read from the pipe.
+    float *remix_buffer;           // Frames being remixed, in float.
+    int16_t *provider_buffer;      // Frames handed to resampler.
+    int16_t *resampler_buffer;     // Frames produced by resampler.
+};
+
 struct submix_stream_in {
     struct audio_stream_in stream;
     struct submix_audio_device *dev;
     int route_handle;
-    bool input_standby;
+    // Sample rate, format and channel mask of the stream.
+    struct audio_config config;
+    // Non-NULL if config doesn't match the pipe read by the stream.
+    struct submix_converter *converter;
+    std::atomic<bool> input_standby;
     bool output_standby_rec_thr; // output standby state as seen from record thread
     // wall clock when recording starts
     struct timespec record_start_time;
     // how many frames have been requested to be read
-    uint64_t read_counter_frames;
-    uint64_t read_counter_frames_since_standby;
+    std::atomic<uint64_t> read_counter_frames;
+    std::atomic<uint64_t> read_counter_frames_since_standby;
+    std::atomic<submix_overrun_policy_t> overrun_policy;
+    // Held while reading from the pipe, and by the output stream while it discards frames from
+    // the pipe so that the pipe never has two readers at once.  Acquired after the route lock.
+    pthread_mutex_t read_lock;
+    // Pipe of an input stream in broadcast_inputs of its route, NULL for the input stream of the
+    // route which reads from the pipe of the route.  Modified with the device lock and the route
+    // lock held.
+    sp<MonoPipe> rsxSink;
+    sp<MonoPipeReader> rsxSource;
 
 #if ENABLE_LEGACY_INPUT_OPEN
     // Number of references to this input stream.
@@ -196,6 +275,18 @@ struct submix_stream_in {
     volatile uint16_t read_error_count;
 };
 
+// Determine whether the specified format is supported by the submix module.
+static bool format_supported(const audio_format_t format)
+{
+    // Set of formats that can be converted by memcpy_by_audio_format().
+    static const audio_format_t supported_formats[] = {
+        AUDIO_FORMAT_PCM_16_BIT, AUDIO_FORMAT_PCM_FLOAT, AUDIO_FORMAT_PCM_24_BIT_PACKED,
+    };
+    bool return_value;
+    SUBMIX_VALUE_IN_SET(format, supported_formats, &return_value);
+    return return_value;
+}
+
 // Determine whether the specified sample rate is supported by the submix module.
 static bool sample_rate_supported(const uint32_t sample_rate)
 {
@@ -213,6 +304,24 @@ static size_t pipe_size_in_frames(const uint32_t sample_rate)
     return DEFAULT_PIPE_SIZE_IN_FRAMES * ((float) sample_rate / DEFAULT_SAMPLE_RATE_HZ);
 }
 
+// Advance the specified time by ns nanoseconds.
+static void timespec_add_ns(struct timespec * const time, const int64_t ns)
+{
+    const int64_t nsec = time->tv_nsec + ns;
+    time->tv_sec += nsec / 1000000000;
+    time->tv_nsec = nsec % 1000000000;
+    if (time->tv_nsec < 0) {
+        time->tv_sec--;
+        time->tv_nsec += 1000000000;
+    }
+}
+
+// Returns true if time a is later than time b.
+static bool timespec_after(const struct timespec * const a, const struct timespec * const b)
+{
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
 // Determine whether the specified sample rate is supported, if it is return the specified sample
 // rate, otherwise return the default sample rate for the submix module.
 static uint32_t get_supported_sample_rate(uint32_t sample_rate)
@@ -312,36 +421,216 @@ static struct submix_audio_device * audio_hw_device_get_submix_audio_device(
         offsetof(struct submix_audio_device, device));
 }
 
-// Compare an audio_config with input channel mask and an audio_config with output channel mask
+// Compare the audio_config of an input or output stream with the config of the pipe of a route
 // returning false if they do *not* match, true otherwise.
-static bool audio_config_compare(const audio_config * const input_config,
-        const audio_config * const output_config)
-{
-    const uint32_t input_channels = audio_channel_count_from_in_mask(input_config->channel_mask);
-    const uint32_t output_channels = audio_channel_count_from_out_mask(output_config->channel_mask);
-    if (input_channels != output_channels) {
-        ALOGE("audio_config_compare() channel count mismatch input=%d vs. output=%d",
-              input_channels, output_channels);
+static bool submix_pipe_config_compare(const struct submix_config * const pipe_config,
+                                       const audio_config * const config,
+                                       const bool is_input)
+{
+    const uint32_t channels = is_input ?
+            audio_channel_count_from_in_mask(config->channel_mask) :
+            audio_channel_count_from_out_mask(config->channel_mask);
+    if (channels != pipe_config->pipe_channel_count) {
+        ALOGV("submix_pipe_config_compare() channel count mismatch %u vs. pipe %u",
+              channels, pipe_config->pipe_channel_count);
         return false;
     }
-
-    if (input_config->sample_rate != output_config->sample_rate) {
-        ALOGE("audio_config_compare() sample rate mismatch %ul vs. %ul",
-              input_config->sample_rate, output_config->sample_rate);
+    if (config->sample_rate != pipe_config->common.sample_rate) {
+        ALOGV("submix_pipe_config_compare() sample rate mismatch %u vs. pipe %u",
+              config->sample_rate, pipe_config->common.sample_rate);
         return false;
     }
-    if (input_config->format != output_config->format) {
-        ALOGE("audio_config_compare() format mismatch %x vs. %x",
-              input_config->format, output_config->format);
+    if (config->format != pipe_config->common.format) {
+        ALOGV("submix_pipe_config_compare() format mismatch %x vs. pipe %x",
+              config->format, pipe_config->common.format);
         return false;
     }
     // This purposely ignores offload_info as it's not required for the submix device.
     return true;
 }
 
+// Convert frames read from the pipe into dst, in dst_format and the channel count of the input
+// stream.
+static void submix_converter_remix(const struct submix_converter * const converter,
+                                   const size_t frames, void * const dst,
+                                   const audio_format_t dst_format)
+{
+    const void *src = converter->pipe_buffer;
+    audio_format_t src_format = converter->pipe_format;
+    if (converter->pipe_channel_count != converter->channel_count) {
+        // Only mono and stereo are supported, remix in place.
+        memcpy_by_audio_format(converter->remix_buffer, AUDIO_FORMAT_PCM_FLOAT, src, src_format,
+                               frames * converter->pipe_channel_count);
+        if (converter->channel_count == 1) {
+            downmix_to_mono_float_from_stereo_float(converter->remix_buffer,
+                                                    converter->remix_buffer, frames);
+        } else {
+            upmix_to_stereo_float_from_mono_float(converter->remix_buffer,
+                                                  converter->remix_buffer, frames);
+        }
+        src = converter->remix_buffer;
+        src_format = AUDIO_FORMAT_PCM_FLOAT;
+    }
+    memcpy_by_audio_format(dst, dst_format, src, src_format, frames * converter->channel_count);
+}
+
+// resampler_buffer_provider implementation, reads the frames available in the pipe without
+// waiting and returns a NULL buffer if there are none.
+static int submix_converter_get_next_buffer(struct resampler_buffer_provider *provider,
+                                            struct resampler_buffer *buffer)
+{
+    struct submix_converter * const converter = reinterpret_cast<struct submix_converter *>(
+            reinterpret_cast<uint8_t *>(provider) - offsetof(struct submix_converter, provider));
+    const ssize_t frames_read = converter->source->read(
+            converter->pipe_buffer, min(buffer->frame_count, converter->buffer_frames));
+    if (frames_read <= 0) {
+        buffer->raw = NULL;
+        buffer->frame_count = 0;
+        return frames_read < 0 ? frames_read : -ENODATA;
+    }
+    submix_converter_remix(converter, frames_read, converter->provider_buffer,
+                           AUDIO_FORMAT_PCM_16_BIT);
+    buffer->i16 = converter->provider_buffer;
+    buffer->frame_count = frames_read;
+    return 0;
+}
+
+static void submix_converter_release_buffer(struct resampler_buffer_provider *provider,
+                                            struct resampler_buffer *buffer)
+{
+    (void)provider;
+    (void)buffer;
+}
+
+static void submix_converter_destroy(struct submix_converter * const converter)
+{
+    if (converter->resampler != NULL) {
+        release_resampler(converter->resampler);
+    }
+    free(converter->pipe_buffer);
+    free(converter->remix_buffer);
+    free(converter->provider_buffer);
+    free(converter->resampler_buffer);
+    free(converter);
+}
+
+// Create a converter from the pipe described by pipe_config to the config of an input stream,
+// working on up to buffer_period_size_frames frames of the pipe at a time.  Returns NULL if
+// memory can't be allocated.
+static struct submix_converter * submix_converter_create(
+        const struct submix_config * const pipe_config, const struct audio_config * const config)
+{
+    struct submix_converter * const converter =
+            (struct submix_converter *)calloc(1, sizeof(struct submix_converter));
+    if (converter == NULL) {
+        return NULL;
+    }
+    converter->provider.get_next_buffer = submix_converter_get_next_buffer;
+    converter->provider.release_buffer = submix_converter_release_buffer;
+    converter->pipe_format = pipe_config->common.format;
+    converter->pipe_channel_count = pipe_config->pipe_channel_count;
+    converter->format = config->format;
+    converter->channel_count = audio_channel_count_from_in_mask(config->channel_mask);
+    converter->buffer_frames = pipe_config->buffer_period_size_frames;
+    const size_t max_channel_count = max(converter->pipe_channel_count, converter->channel_count);
+    converter->pipe_buffer = malloc(converter->buffer_frames * pipe_config->pipe_frame_size);
+    converter->remix_buffer =
+            (float *)malloc(converter->buffer_frames * max_channel_count * sizeof(float));
+    bool allocated = converter->pipe_buffer != NULL && converter->remix_buffer != NULL;
+    if (allocated && config->sample_rate != pipe_config->common.sample_rate) {
+        const size_t resampler_buffer_size =
+                converter->buffer_frames * converter->channel_count * sizeof(int16_t);
+        converter->provider_buffer = (int16_t *)malloc(resampler_buffer_size);
+        converter->resampler_buffer = (int16_t *)malloc(resampler_buffer_size);
+        allocated = converter->provider_buffer != NULL && converter->resampler_buffer != NULL &&
+                create_resampler(pipe_config->common.sample_rate, config->sample_rate,
+                                 converter->channel_count, RESAMPLER_QUALITY_DEFAULT,
+                                 &converter->provider, &converter->resampler) == 0;
+    }
+    if (!allocated) {
+        ALOGE("submix_converter_create(): failed to allocate converter");
+        submix_converter_destroy(converter);
+        return NULL;
+    }
+    ALOGI("submix_converter_create(): %u Hz %u ch format %x -> %u Hz %u ch format %x",
+          pipe_config->common.sample_rate, converter->pipe_channel_count, converter->pipe_format,
+          config->sample_rate, converter->channel_count, converter->format);
+    return converter;
+}
+
+// Discard the frames buffered by the converter.
+static void submix_converter_reset(struct submix_converter * const converter)
+{
+    if (converter->resampler != NULL) {
+        converter->resampler->reset(converter->resampler);
+    }
+}
+
+// Read up to frames frames from source into buffer, converted to the config of the input stream.
+// Returns the number of frames read, or the value returned by source->read() if no frames were
+// read.
+static ssize_t submix_converter_read(struct submix_converter * const converter,
+                                     const sp<MonoPipeReader>& source, void * const buffer,
+                                     const size_t frames)
+{
+    const size_t frame_size =
+            converter->channel_count * audio_bytes_per_sample(converter->format);
+    size_t frames_read = 0;
+    ssize_t ret = 0;
+    while (frames_read < frames) {
+        uint8_t * const dst = (uint8_t *)buffer + frames_read * frame_size;
+        size_t chunk_frames = min(frames - frames_read, converter->buffer_frames);
+        if (converter->resampler != NULL) {
+            // The resampler keeps the frames of the pipe it hasn't consumed yet.
+            converter->source = source.get();
+            converter->resampler->resample_from_provider(converter->resampler,
+                                                         converter->resampler_buffer,
+                                                         &chunk_frames);
+            converter->source = NULL;
+            memcpy_by_audio_format(dst, converter->format, converter->resampler_buffer,
+                                   AUDIO_FORMAT_PCM_16_BIT,
+                                   chunk_frames * converter->channel_count);
+        } else {
+            ret = source->read(converter->pipe_buffer, chunk_frames);
+            if (ret <= 0) {
+                break;
+            }
+            chunk_frames = ret;
+            submix_converter_remix(converter, chunk_frames, dst, converter->format);
+        }
+        if (chunk_frames == 0) {
+            break;
+        }
+        frames_read += chunk_frames;
+    }
+    return frames_read > 0 ? (ssize_t)frames_read : ret;
+}
+
+// Create a pipe of buffer_size_frames frames in the specified format.
+static void submix_create_pipe(const NBAIO_Format& format, const size_t buffer_size_frames,
+                               sp<MonoPipe> * const pipe_sink,
+                               sp<MonoPipeReader> * const pipe_source)
+{
+    const NBAIO_Format offers[1] = {format};
+    size_t numCounterOffers = 0;
+    // Create a MonoPipe with optional blocking set to true.
+    MonoPipe* sink = new MonoPipe(buffer_size_frames, format, true /*writeCanBlock*/);
+    // Negotiation between the source and sink cannot fail as the device open operation
+    // creates both ends of the pipe using the same audio format.
+    ssize_t index = sink->negotiate(offers, 1, NULL, numCounterOffers);
+    ALOG_ASSERT(index == 0);
+    MonoPipeReader* source = new MonoPipeReader(sink);
+    numCounterOffers = 0;
+    index = source->negotiate(offers, 1, NULL, numCounterOffers);
+    ALOG_ASSERT(index == 0);
+    ALOGV("submix_create_pipe(): created pipe");
+    *pipe_sink = sink;
+    *pipe_source = source;
+}
+
 // If one doesn't exist, create a pipe for the submix audio device rsxadev of size
 // buffer_size_frames and optionally associate "in" or "out" with the submix audio device.
-// Must be called with lock held on the submix_audio_device
+// Must be called with lock held on the submix_audio_device, takes the lock of the route.
 static void submix_audio_device_create_pipe_l(struct submix_audio_device * const rsxadev,
                                             const struct audio_config * const config,
                                             const size_t buffer_size_frames,
@@ -356,18 +645,19 @@ static void submix_audio_device_create_pipe_l(struct submix_audio_device * const
     ALOG_ASSERT(route_idx < MAX_ROUTES);
     ALOGD("submix_audio_device_create_pipe_l(addr=%s, idx=%d)", address, route_idx);
 
-    // Save a reference to the specified input or output stream and the associated channel
-    // mask.
+    route_config_t * const route = &rsxadev->routes[route_idx];
+    // Save a reference to the specified input or output stream and the output channel mask.
+    pthread_mutex_lock(&route->lock);
     if (in) {
         in->route_handle = route_idx;
         rsxadev->routes[route_idx].input = in;
-        rsxadev->routes[route_idx].config.input_channel_mask = config->channel_mask;
     }
     if (out) {
         out->route_handle = route_idx;
         rsxadev->routes[route_idx].output = out;
         rsxadev->routes[route_idx].config.output_channel_mask = config->channel_mask;
     }
+    pthread_mutex_unlock(&route->lock);
     // Save the address
     strncpy(rsxadev->routes[route_idx].address, address, AUDIO_DEVICE_MAX_ADDRESS_LEN);
     ALOGD("  now using address %s for route %d", rsxadev->routes[route_idx].address, route_idx);
@@ -386,28 +676,26 @@ static void submix_audio_device_create_pipe_l(struct submix_audio_device * const
 
         const NBAIO_Format format = Format_from_SR_C(config->sample_rate, pipe_channel_count,
             config->format);
-        const NBAIO_Format offers[1] = {format};
-        size_t numCounterOffers = 0;
-        // Create a MonoPipe with optional blocking set to true.
-        MonoPipe* sink = new MonoPipe(buffer_size_frames, format, true /*writeCanBlock*/);
-        // Negotiation between the source and sink cannot fail as the device open operation
-        // creates both ends of the pipe using the same audio format.
-        ssize_t index = sink->negotiate(offers, 1, NULL, numCounterOffers);
-        ALOG_ASSERT(index == 0);
-        MonoPipeReader* source = new MonoPipeReader(sink);
-        numCounterOffers = 0;
-        index = source->negotiate(offers, 1, NULL, numCounterOffers);
-        ALOG_ASSERT(index == 0);
-        ALOGV("submix_audio_device_create_pipe_l(): created pipe");
+        sp<MonoPipe> sink;
+        sp<MonoPipeReader> source;
+        submix_create_pipe(format, buffer_size_frames, &sink, &source);
+        void * const flush_buffer = malloc(
+                sink->maxFrames() * audio_bytes_per_frame(pipe_channel_count, config->format));
+        ALOGE_IF(flush_buffer == NULL, "submix_audio_device_create_pipe_l(): failed to allocate "
+                 "flush buffer, frames that don't fit in the pipe will be dropped");
 
         // Save references to the source and sink.
+        pthread_mutex_lock(&route->lock);
         ALOG_ASSERT(rsxadev->routes[route_idx].rsxSink == NULL);
         ALOG_ASSERT(rsxadev->routes[route_idx].rsxSource == NULL);
         rsxadev->routes[route_idx].rsxSink = sink;
         rsxadev->routes[route_idx].rsxSource = source;
+        rsxadev->routes[route_idx].flush_buffer = flush_buffer;
+        pthread_mutex_unlock(&route->lock);
         // Store the sanitized audio format in the device so that it's possible to determine
         // the format of the pipe source when opening the input device.
         memcpy(&device_config->common, config, sizeof(device_config->common));
+        device_config->pipe_channel_count = pipe_channel_count;
         device_config->buffer_size_frames = sink->maxFrames();
         device_config->buffer_period_size_frames = device_config->buffer_size_frames /
                 buffer_period_count;
@@ -423,7 +711,7 @@ static void submix_audio_device_create_pipe_l(struct submix_audio_device * const
 // Release references to the sink and source.  Input and output threads may maintain references
 // to these objects via StrongPointer (sp<MonoPipe> and sp<MonoPipeReader>) which they can use
 // before they shutdown.
-// Must be called with lock held on the submix_audio_device
+// Must be called with lock held on the submix_audio_device, takes the lock of the route.
 static void submix_audio_device_release_pipe_l(struct submix_audio_device * const rsxadev,
         int route_idx)
 {
@@ -431,42 +719,143 @@ static void submix_audio_device_release_pipe_l(struct submix_audio_device * cons
     ALOG_ASSERT(route_idx < MAX_ROUTES);
     ALOGD("submix_audio_device_release_pipe_l(idx=%d) addr=%s", route_idx,
             rsxadev->routes[route_idx].address);
-    if (rsxadev->routes[route_idx].rsxSink != 0) {
-        rsxadev->routes[route_idx].rsxSink.clear();
+    // The pipe is destroyed after the route lock is released if no stream uses it anymore.
+    sp<MonoPipe> sink;
+    sp<MonoPipeReader> source;
+    pthread_mutex_lock(&rsxadev->routes[route_idx].lock);
+    sink = rsxadev->routes[route_idx].rsxSink;
+    rsxadev->routes[route_idx].rsxSink.clear();
+    source = rsxadev->routes[route_idx].rsxSource;
+    rsxadev->routes[route_idx].rsxSource.clear();
+    void * const flush_buffer = rsxadev->routes[route_idx].flush_buffer;
+    rsxadev->routes[route_idx].flush_buffer = NULL;
+    pthread_mutex_unlock(&rsxadev->routes[route_idx].lock);
+    free(flush_buffer);
+    memset(rsxadev->routes[route_idx].address, 0, AUDIO_DEVICE_MAX_ADDRESS_LEN);
+}
+
+// Determine whether input streams opened on the route of the specified address read from it in
+// broadcast mode.
+// Must be called with lock held on the submix_audio_device
+static bool submix_is_broadcast_address_l(const struct submix_audio_device * const rsxadev,
+                                          const char *address)
+{
+    for (int i = 0; i < MAX_ROUTES; i++) {
+        if (rsxadev->broadcast_addresses[i][0] != '\0' &&
+                strncmp(rsxadev->broadcast_addresses[i], address,
+                        AUDIO_DEVICE_MAX_ADDRESS_LEN) == 0) {
+            return true;
+        }
     }
-    if (rsxadev->routes[route_idx].rsxSource != 0) {
-        rsxadev->routes[route_idx].rsxSource.clear();
+    return false;
+}
+
+// Determine whether input streams other than the input stream of the route read from it.
+// Must be called with lock held on the submix_audio_device or on the route.
+static bool submix_route_has_broadcast_inputs_l(const route_config_t * const route)
+{
+    for (int i = 0; i < MAX_BROADCAST_INPUTS; i++) {
+        if (route->broadcast_inputs[i] != NULL) {
+            return true;
+        }
     }
-    memset(rsxadev->routes[route_idx].address, 0, AUDIO_DEVICE_MAX_ADDRESS_LEN);
+    return false;
+}
+
+// Add the specified input stream to the broadcast inputs of a route, with a pipe of its own
+// created in the format of the pipe of the route.  Returns false if the route has the maximum
+// number of broadcast inputs already.
+// Must be called with lock held on the submix_audio_device, takes the lock of the route.
+static bool submix_audio_device_add_broadcast_input_l(
+        struct submix_audio_device * const rsxadev, struct submix_stream_in * const in,
+        int route_idx)
+{
+    route_config_t * const route = &rsxadev->routes[route_idx];
+    for (int i = 0; i < MAX_BROADCAST_INPUTS; i++) {
+        if (route->broadcast_inputs[i] != NULL) {
+            continue;
+        }
+        const NBAIO_Format format = Format_from_SR_C(route->config.common.sample_rate,
+                route->config.pipe_channel_count, route->config.common.format);
+        sp<MonoPipe> sink;
+        sp<MonoPipeReader> source;
+        submix_create_pipe(format, route->config.buffer_size_frames, &sink, &source);
+        in->route_handle = route_idx;
+        pthread_mutex_lock(&route->lock);
+        in->rsxSink = sink;
+        in->rsxSource = source;
+        route->broadcast_inputs[i] = in;
+        pthread_mutex_unlock(&route->lock);
+        ALOGD("submix_audio_device_add_broadcast_input_l(): route %d broadcast input %d",
+              route_idx, i);
+        return true;
+    }
+    ALOGE("submix_audio_device_add_broadcast_input_l(): route %d has %d broadcast inputs",
+          route_idx, MAX_BROADCAST_INPUTS);
+    return false;
+}
+
+// Remove the specified input stream from the broadcast inputs of its route and release its pipe.
+// Returns false if the input stream isn't a broadcast input.
+// Must be called with lock held on the submix_audio_device, takes the lock of the route.
+static bool submix_audio_device_remove_broadcast_input_l(
+        struct submix_audio_device * const rsxadev, struct submix_stream_in * const in)
+{
+    route_config_t * const route = &rsxadev->routes[in->route_handle];
+    for (int i = 0; i < MAX_BROADCAST_INPUTS; i++) {
+        if (route->broadcast_inputs[i] != in) {
+            continue;
+        }
+        // The pipe is destroyed after the route lock is released if no stream uses it anymore.
+        sp<MonoPipe> sink;
+        sp<MonoPipeReader> source;
+        pthread_mutex_lock(&route->lock);
+        route->broadcast_inputs[i] = NULL;
+        sink = in->rsxSink;
+        in->rsxSink.clear();
+        source = in->rsxSource;
+        in->rsxSource.clear();
+        pthread_mutex_unlock(&route->lock);
+        return true;
+    }
+    return false;
 }
 
 // Remove references to the specified input and output streams.  When the device no longer
 // references input and output streams destroy the associated pipe.
-// Must be called with lock held on the submix_audio_device
+// Must be called with lock held on the submix_audio_device, takes the lock of the route.
 static void submix_audio_device_destroy_pipe_l(struct submix_audio_device * const rsxadev,
                                              const struct submix_stream_in * const in,
                                              const struct submix_stream_out * const out)
 {
     ALOGV("submix_audio_device_destroy_pipe_l()");
     int route_idx = -1;
-    if (in != NULL) {
+    if (in != NULL && submix_audio_device_remove_broadcast_input_l(
+            rsxadev, const_cast<struct submix_stream_in*>(in))) {
+        // Broadcast inputs are never shared.
+#if ENABLE_LEGACY_INPUT_OPEN
+        const_cast<struct submix_stream_in*>(in)->ref_count--;
+#endif // ENABLE_LEGACY_INPUT_OPEN
+        route_idx = in->route_handle;
+    } else if (in != NULL) {
         bool shut_down = false;
 #if ENABLE_LEGACY_INPUT_OPEN
         const_cast<struct submix_stream_in*>(in)->ref_count--;
         route_idx = in->route_handle;
         ALOG_ASSERT(rsxadev->routes[route_idx].input == in);
         if (in->ref_count == 0) {
-            rsxadev->routes[route_idx].input = NULL;
             shut_down = true;
         }
         ALOGV("submix_audio_device_destroy_pipe_l(): input ref_count %d", in->ref_count);
 #else
         route_idx = in->route_handle;
         ALOG_ASSERT(rsxadev->routes[route_idx].input == in);
-        rsxadev->routes[route_idx].input = NULL;
         shut_down = true;
 #endif // ENABLE_LEGACY_INPUT_OPEN
         if (shut_down) {
+            pthread_mutex_lock(&rsxadev->routes[route_idx].lock);
+            rsxadev->routes[route_idx].input = NULL;
+            pthread_mutex_unlock(&rsxadev->routes[route_idx].lock);
             sp <MonoPipe> sink = rsxadev->routes[in->route_handle].rsxSink;
             if (sink != NULL) {
               sink->shutdown(true);
@@ -476,10 +865,15 @@ static void submix_audio_device_destroy_pipe_l(struct submix_audio_device * cons
     if (out != NULL) {
         route_idx = out->route_handle;
         ALOG_ASSERT(rsxadev->routes[route_idx].output == out);
+        pthread_mutex_lock(&rsxadev->routes[route_idx].lock);
         rsxadev->routes[route_idx].output = NULL;
+        // Don't leave a reader waiting for frames that will never be written.
+        pthread_cond_broadcast(&rsxadev->routes[route_idx].frames_written_cond);
+        pthread_mutex_unlock(&rsxadev->routes[route_idx].lock);
     }
     if (route_idx != -1 &&
-            rsxadev->routes[route_idx].input == NULL && rsxadev->routes[route_idx].output == NULL) {
+            rsxadev->routes[route_idx].input == NULL && rsxadev->routes[route_idx].output == NULL &&
+            !submix_route_has_broadcast_inputs_l(&rsxadev->routes[route_idx])) {
         submix_audio_device_release_pipe_l(rsxadev, route_idx);
         ALOGD("submix_audio_device_destroy_pipe_l(): pipe destroyed");
     }
@@ -491,27 +885,27 @@ static void submix_sanitize_config(struct audio_config * const config, const boo
     config->channel_mask = is_input_format ? get_supported_channel_in_mask(config->channel_mask) :
             get_supported_channel_out_mask(config->channel_mask);
     config->sample_rate = get_supported_sample_rate(config->sample_rate);
-    config->format = DEFAULT_FORMAT;
+    if (!format_supported(config->format)) {
+        config->format = DEFAULT_FORMAT;
+    }
 }
 
-// Verify a submix input or output stream can be opened.
+// Verify a submix input or output stream can be opened, broadcast is true when opening an input
+// stream on a broadcast route.
 // Must be called with lock held on the submix_audio_device
 static bool submix_open_validate_l(const struct submix_audio_device * const rsxadev,
                                  int route_idx,
                                  const struct audio_config * const config,
-                                 const bool opening_input)
+                                 const bool opening_input,
+                                 const bool broadcast)
 {
-    bool input_open;
-    bool output_open;
-    audio_config pipe_config;
-
-    // Query the device for the current audio config and whether input and output streams are open.
-    output_open = rsxadev->routes[route_idx].output != NULL;
-    input_open = rsxadev->routes[route_idx].input != NULL;
-    memcpy(&pipe_config, &rsxadev->routes[route_idx].config.common, sizeof(pipe_config));
+    const route_config_t * const route = &rsxadev->routes[route_idx];
+    // Query the device for whether input and output streams are open.
+    const bool output_open = route->output != NULL;
+    const bool input_open = route->input != NULL;
 
     // If the stream is already open, don't open it again.
-    if (opening_input ? !ENABLE_LEGACY_INPUT_OPEN && input_open : output_open) {
+    if (opening_input ? !ENABLE_LEGACY_INPUT_OPEN && !broadcast && input_open : output_open) {
         ALOGE("submix_open_validate_l(): %s stream already open.", opening_input ? "Input" :
                 "Output");
         return false;
@@ -521,16 +915,11 @@ static bool submix_open_validate_l(const struct submix_audio_device * const rsxa
                  "%s_channel_mask=%x", config->sample_rate, config->format,
                  opening_input ? "in" : "out", config->channel_mask);
 
-    // If either stream is open, verify the existing audio config the pipe matches the user
-    // specified config.
-    if (input_open || output_open) {
-        const audio_config * const input_config = opening_input ? config : &pipe_config;
-        const audio_config * const output_config = opening_input ? &pipe_config : config;
-        // Get the channel mask of the open device.
-        pipe_config.channel_mask =
-            opening_input ? rsxadev->routes[route_idx].config.output_channel_mask :
-                rsxadev->routes[route_idx].config.input_channel_mask;
-        if (!audio_config_compare(input_config, output_config)) {
+    // If input streams are reading the pipe, verify the user specified config matches the pipe.
+    // Input streams convert the frames they read when they don't match the pipe, so only the
+    // output stream needs to match.
+    if (!opening_input && (input_open || submix_route_has_broadcast_inputs_l(route))) {
+        if (!submix_pipe_config_compare(&route->config, config, false)) {
             ALOGE("submix_open_validate_l(): Unsupported format.");
             return false;
         }
@@ -652,14 +1041,15 @@ static int out_standby(struct audio_stream *stream)
 {
     ALOGI("out_standby()");
     struct submix_stream_out * const out = audio_stream_get_submix_stream_out(stream);
-    struct submix_audio_device * const rsxadev = out->dev;
+    route_config_t * const route = &out->dev->routes[out->route_handle];
 
-    pthread_mutex_lock(&rsxadev->lock);
+    pthread_mutex_lock(&route->lock);
 
     out->output_standby = true;
     out->frames_written_since_standby = 0;
+    pthread_cond_broadcast(&route->frames_written_cond);
 
-    pthread_mutex_unlock(&rsxadev->lock);
+    pthread_mutex_unlock(&route->lock);
 
     return 0;
 }
@@ -681,22 +1071,20 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
     //       converted to use audio HAL extensions required to support tunneling
     if ((parms.getInt(String8(AUDIO_PARAMETER_KEY_EXITING), exiting) == NO_ERROR)
             && (exiting > 0)) {
-        struct submix_audio_device * const rsxadev =
-                audio_stream_get_submix_stream_out(stream)->dev;
-        pthread_mutex_lock(&rsxadev->lock);
+        const struct submix_stream_out * const out = audio_stream_get_submix_stream_out(stream);
+        route_config_t * const route = &out->dev->routes[out->route_handle];
+        pthread_mutex_lock(&route->lock);
         { // using the sink
-            sp<MonoPipe> sink =
-                    rsxadev->routes[audio_stream_get_submix_stream_out(stream)->route_handle]
-                                    .rsxSink;
+            sp<MonoPipe> sink = route->rsxSink;
             if (sink == NULL) {
-                pthread_mutex_unlock(&rsxadev->lock);
+                pthread_mutex_unlock(&route->lock);
                 return 0;
             }
 
             ALOGD("out_set_parameters(): shutting down MonoPipe sink");
             sink->shutdown(true);
         } // done using the sink
-        pthread_mutex_unlock(&rsxadev->lock);
+        pthread_mutex_unlock(&route->lock);
     }
     return 0;
 }
@@ -733,6 +1121,81 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
     return -ENOSYS;
 }
 
+// Wake up the input stream reads waiting for frames on the specified route.  Only takes the
+// route lock if a read is waiting.
+static void submix_route_signal_frames_written(route_config_t * const route)
+{
+    // Order the write to the pipe before the check for waiters, see in_wait_for_frames().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (route->readers_waiting.load(std::memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&route->lock);
+        pthread_cond_broadcast(&route->frames_written_cond);
+        pthread_mutex_unlock(&route->lock);
+    }
+}
+
+// Discard up to frames of the oldest frames in the pipe read from source by the input stream in,
+// or by no input stream if in is NULL.  The frames are consumed with a single read into the flush
+// buffer of the route.
+// Must be called with the route lock held.
+static void submix_pipe_discard_l(const route_config_t * const route,
+                                  struct submix_stream_in * const in,
+                                  const sp<MonoPipeReader>& source,
+                                  const size_t frames)
+{
+    if (route->flush_buffer == NULL) {
+        return;
+    }
+    SUBMIX_ALOGV("out_write(): flushing %zu frames from the pipe to avoid blocking", frames);
+    if (in != NULL) {
+        pthread_mutex_lock(&in->read_lock);
+    }
+    // read does not block
+    source->read(route->flush_buffer, min(frames, route->config.buffer_size_frames));
+    if (in != NULL) {
+        pthread_mutex_unlock(&in->read_lock);
+    }
+}
+
+// Prepare writing frames to the pipe read by the input stream in and return the number of frames
+// to write to it.  If the write to the sink would block, make space according to the overrun
+// policy of the input stream:
+// - SUBMIX_OVERRUN_BLOCK: flush enough frames from the pipe to make space to write the most
+//   recent data if no peer input stream is present, or if the peer input is in standby AFTER
+//   having been active.  Block otherwise, so that the first frames in the pipe are not
+//   discarded in case capture start was delayed.
+// - SUBMIX_OVERRUN_DROP_OLDEST: flush enough frames from the pipe to make space.
+// - SUBMIX_OVERRUN_DROP_NEWEST: only write the frames that fit.
+// Must be called with the route lock held.
+static size_t submix_prepare_write_l(const route_config_t * const route,
+                                     struct submix_stream_in * const in,
+                                     const sp<MonoPipe>& sink,
+                                     const sp<MonoPipeReader>& source,
+                                     const size_t frames)
+{
+    const size_t availableToWrite = sink->availableToWrite();
+    if (availableToWrite >= frames) {
+        return frames;
+    }
+    const submix_overrun_policy_t policy =
+            in == NULL ? SUBMIX_OVERRUN_DROP_OLDEST : in->overrun_policy.load();
+    switch (policy) {
+    case SUBMIX_OVERRUN_BLOCK:
+        if (in->input_standby && in->read_counter_frames_since_standby != 0) {
+            submix_pipe_discard_l(route, in, source, frames - availableToWrite);
+        }
+        break;
+    case SUBMIX_OVERRUN_DROP_OLDEST:
+        submix_pipe_discard_l(route, in, source, frames - availableToWrite);
+        break;
+    case SUBMIX_OVERRUN_DROP_NEWEST:
+        SUBMIX_ALOGV("out_write(): dropping %zu frames that don't fit in the pipe",
+                     frames - availableToWrite);
+        return availableToWrite;
+    }
+    return frames;
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
@@ -740,69 +1203,68 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     ssize_t written_frames = 0;
     const size_t frame_size = audio_stream_out_frame_size(stream);
     struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(stream);
-    struct submix_audio_device * const rsxadev = out->dev;
+    route_config_t * const route = &out->dev->routes[out->route_handle];
     const size_t frames = bytes / frame_size;
 
-    pthread_mutex_lock(&rsxadev->lock);
-
     out->output_standby = false;
 
-    sp<MonoPipe> sink = rsxadev->routes[out->route_handle].rsxSink;
-    if (sink != NULL) {
-        if (sink->isShutdown()) {
-            sink.clear();
-            pthread_mutex_unlock(&rsxadev->lock);
-            SUBMIX_ALOGV("out_write(): pipe shutdown, ignoring the write.");
-            // the pipe has already been shutdown, this buffer will be lost but we must
-            //   simulate timing so we don't drain the output faster than realtime
-            usleep(frames * 1000000 / out_get_sample_rate(&stream->common));
-
-            pthread_mutex_lock(&rsxadev->lock);
-            out->frames_written += frames;
-            out->frames_written_since_standby += frames;
-            pthread_mutex_unlock(&rsxadev->lock);
-            return bytes;
-        }
-    } else {
-        pthread_mutex_unlock(&rsxadev->lock);
+    pthread_mutex_lock(&route->lock);
+
+    sp<MonoPipe> sink = route->rsxSink;
+    if (sink == NULL) {
+        pthread_mutex_unlock(&route->lock);
         ALOGE("out_write without a pipe!");
         ALOG_ASSERT("out_write without a pipe!");
         return 0;
     }
 
-    // If the write to the sink would block, flush enough frames
-    // from the pipe to make space to write the most recent data.
-    // We DO NOT block if:
-    // - no peer input stream is present
-    // - the peer input is in standby AFTER having been active.
-    // We DO block if:
-    // - the input was never activated to avoid discarding first frames
-    // in the pipe in case capture start was delayed
-    {
-        const size_t availableToWrite = sink->availableToWrite();
-        // NOTE: rsxSink has been checked above and sink and source life cycles are synchronized
-        sp<MonoPipeReader> source = rsxadev->routes[out->route_handle].rsxSource;
-        const struct submix_stream_in *in = rsxadev->routes[out->route_handle].input;
-        const bool dont_block = (in == NULL)
-                || (in->input_standby && (in->read_counter_frames_since_standby != 0));
-        if (dont_block && availableToWrite < frames) {
-            static uint8_t flush_buffer[64];
-            const size_t flushBufferSizeFrames = sizeof(flush_buffer) / frame_size;
-            size_t frames_to_flush_from_source = frames - availableToWrite;
-            SUBMIX_ALOGV("out_write(): flushing %llu frames from the pipe to avoid blocking",
-                    (unsigned long long)frames_to_flush_from_source);
-            while (frames_to_flush_from_source) {
-                const size_t flush_size = min(frames_to_flush_from_source, flushBufferSizeFrames);
-                frames_to_flush_from_source -= flush_size;
-                // read does not block
-                source->read(flush_buffer, flush_size);
-            }
+    // The input streams of a broadcast route other than the input stream of the route read the
+    // same frames from their own pipes.
+    sp<MonoPipe> broadcast_sinks[MAX_BROADCAST_INPUTS];
+    size_t broadcast_frames[MAX_BROADCAST_INPUTS];
+    size_t broadcast_sink_count = 0;
+    for (int i = 0; i < MAX_BROADCAST_INPUTS; i++) {
+        struct submix_stream_in * const in = route->broadcast_inputs[i];
+        if (in != NULL) {
+            broadcast_frames[broadcast_sink_count] = submix_prepare_write_l(
+                    route, in, in->rsxSink, in->rsxSource, frames);
+            broadcast_sinks[broadcast_sink_count++] = in->rsxSink;
         }
     }
 
-    pthread_mutex_unlock(&rsxadev->lock);
+    const bool shutdown = sink->isShutdown();
+    size_t frames_to_write = frames;
+    if (!shutdown) {
+        // NOTE: rsxSink has been checked above and sink and source life cycles are synchronized
+        frames_to_write = submix_prepare_write_l(route, route->input, sink, route->rsxSource,
+                                                 frames);
+    }
+
+    pthread_mutex_unlock(&route->lock);
+
+    for (size_t i = 0; i < broadcast_sink_count; i++) {
+        const ssize_t broadcast_written_frames =
+                broadcast_sinks[i]->write(buffer, broadcast_frames[i]);
+        ALOGE_IF(broadcast_written_frames < 0,
+                 "out_write() write to broadcast pipe returned %zd", broadcast_written_frames);
+    }
+    if (broadcast_sink_count > 0) {
+        submix_route_signal_frames_written(route);
+    }
 
-    written_frames = sink->write(buffer, frames);
+    if (shutdown) {
+        sink.clear();
+        SUBMIX_ALOGV("out_write(): pipe shutdown, ignoring the write.");
+        // the pipe has already been shutdown, this buffer will be lost but we must
+        //   simulate timing so we don't drain the output faster than realtime
+        usleep(frames * 1000000 / out_get_sample_rate(&stream->common));
+
+        out->frames_written += frames;
+        out->frames_written_since_standby += frames;
+        return bytes;
+    }
+
+    written_frames = sink->write(buffer, frames_to_write);
 
 #if LOG_STREAMS_TO_FILES
     if (out->log_fd >= 0) write(out->log_fd, buffer, written_frames * frame_size);
@@ -811,27 +1273,24 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     if (written_frames < 0) {
         if (written_frames == (ssize_t)NEGOTIATE) {
             ALOGE("out_write() write to pipe returned NEGOTIATE");
-
-            pthread_mutex_lock(&rsxadev->lock);
-            sink.clear();
-            pthread_mutex_unlock(&rsxadev->lock);
-
-            written_frames = 0;
             return 0;
         } else {
             // write() returned UNDERRUN or WOULD_BLOCK, retry
             ALOGE("out_write() write to pipe returned unexpected %zd", written_frames);
-            written_frames = sink->write(buffer, frames);
+            written_frames = sink->write(buffer, frames_to_write);
         }
     }
+    if (written_frames == (ssize_t)frames_to_write) {
+        // the frames dropped because the input stream reads late are consumed all the same
+        written_frames = frames;
+    }
 
-    pthread_mutex_lock(&rsxadev->lock);
-    sink.clear();
     if (written_frames > 0) {
         out->frames_written_since_standby += written_frames;
         out->frames_written += written_frames;
+        // Wake up the input stream if it's waiting for these frames.
+        submix_route_signal_frames_written(route);
     }
-    pthread_mutex_unlock(&rsxadev->lock);
 
     if (written_frames < 0) {
         ALOGE("out_write() failed writing to pipe with %zd", written_frames);
@@ -851,26 +1310,26 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
 
     const submix_stream_out *out = audio_stream_out_get_submix_stream_out(
             const_cast<struct audio_stream_out *>(stream));
-    struct submix_audio_device * const rsxadev = out->dev;
+    route_config_t * const route = &out->dev->routes[out->route_handle];
 
     int ret = -EWOULDBLOCK;
-    pthread_mutex_lock(&rsxadev->lock);
-    sp<MonoPipeReader> source = rsxadev->routes[out->route_handle].rsxSource;
+    pthread_mutex_lock(&route->lock);
+    sp<MonoPipeReader> source = route->rsxSource;
+    pthread_mutex_unlock(&route->lock);
     if (source == NULL) {
         ALOGW("%s called on released output", __FUNCTION__);
-        pthread_mutex_unlock(&rsxadev->lock);
         return -ENODEV;
     }
 
+    const uint64_t frames_written = out->frames_written;
     const ssize_t frames_in_pipe = source->availableToRead();
     if (CC_UNLIKELY(frames_in_pipe < 0)) {
-        *frames = out->frames_written;
+        *frames = frames_written;
         ret = 0;
-    } else if (out->frames_written >= (uint64_t)frames_in_pipe) {
-        *frames = out->frames_written - frames_in_pipe;
+    } else if (frames_written >= (uint64_t)frames_in_pipe) {
+        *frames = frames_written - frames_in_pipe;
         ret = 0;
     }
-    pthread_mutex_unlock(&rsxadev->lock);
 
     if (ret == 0) {
         clock_gettime(CLOCK_MONOTONIC, timestamp);
@@ -892,24 +1351,24 @@ static int out_get_render_position(const struct audio_stream_out *stream,
 
     const submix_stream_out *out = audio_stream_out_get_submix_stream_out(
             const_cast<struct audio_stream_out *>(stream));
-    struct submix_audio_device * const rsxadev = out->dev;
+    route_config_t * const route = &out->dev->routes[out->route_handle];
 
-    pthread_mutex_lock(&rsxadev->lock);
-    sp<MonoPipeReader> source = rsxadev->routes[out->route_handle].rsxSource;
+    pthread_mutex_lock(&route->lock);
+    sp<MonoPipeReader> source = route->rsxSource;
+    pthread_mutex_unlock(&route->lock);
     if (source == NULL) {
         ALOGW("%s called on released output", __FUNCTION__);
-        pthread_mutex_unlock(&rsxadev->lock);
         return -ENODEV;
     }
 
+    const uint64_t frames_written_since_standby = out->frames_written_since_standby;
     const ssize_t frames_in_pipe = source->availableToRead();
     if (CC_UNLIKELY(frames_in_pipe < 0)) {
-        *dsp_frames = (uint32_t)out->frames_written_since_standby;
+        *dsp_frames = (uint32_t)frames_written_since_standby;
     } else {
-        *dsp_frames = out->frames_written_since_standby > (uint64_t) frames_in_pipe ?
-                (uint32_t)(out->frames_written_since_standby - frames_in_pipe) : 0;
+        *dsp_frames = frames_written_since_standby > (uint64_t) frames_in_pipe ?
+                (uint32_t)(frames_written_since_standby - frames_in_pipe) : 0;
     }
-    pthread_mutex_unlock(&rsxadev->lock);
 
     return 0;
 }
@@ -941,7 +1400,7 @@ static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
         const_cast<struct audio_stream*>(stream));
-    const uint32_t rate = in->dev->routes[in->route_handle].config.common.sample_rate;
+    const uint32_t rate = in->config.sample_rate;
     SUBMIX_ALOGV("in_get_sample_rate() returns %u", rate);
     return rate;
 }
@@ -949,11 +1408,12 @@ static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(stream);
-    if (!sample_rate_supported(rate)) {
+    // The converter of the stream, if any, is set up for the sample rate the stream was opened
+    // with.
+    if (rate != in->config.sample_rate) {
         ALOGE("in_set_sample_rate(rate=%u) rate unsupported", rate);
         return -ENOSYS;
     }
-    in->dev->routes[in->route_handle].config.common.sample_rate = rate;
     SUBMIX_ALOGV("in_set_sample_rate() set %u", rate);
     return 0;
 }
@@ -965,8 +1425,11 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
     const struct submix_config * const config = &in->dev->routes[in->route_handle].config;
     const size_t stream_frame_size =
                             audio_stream_in_frame_size((const struct audio_stream_in *)stream);
+    // Scale the period of the pipe to the sample rate of the stream.
+    const size_t period_size_frames = (uint64_t)config->buffer_period_size_frames *
+            in->config.sample_rate / config->common.sample_rate;
     size_t buffer_size_frames = calculate_stream_pipe_size_in_frames(
-        stream, config, config->buffer_period_size_frames, stream_frame_size);
+        stream, config, period_size_frames, stream_frame_size);
     const size_t buffer_size_bytes = buffer_size_frames * stream_frame_size;
     SUBMIX_ALOGV("in_get_buffer_size() returns %zu bytes, %zu frames", buffer_size_bytes,
                  buffer_size_frames);
@@ -977,8 +1440,7 @@ static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
             const_cast<struct audio_stream*>(stream));
-    const audio_channel_mask_t channel_mask =
-            in->dev->routes[in->route_handle].config.input_channel_mask;
+    const audio_channel_mask_t channel_mask = in->config.channel_mask;
     SUBMIX_ALOGV("in_get_channels() returns %x", channel_mask);
     return channel_mask;
 }
@@ -987,7 +1449,7 @@ static audio_format_t in_get_format(const struct audio_stream *stream)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
             const_cast<struct audio_stream*>(stream));
-    const audio_format_t format = in->dev->routes[in->route_handle].config.common.format;
+    const audio_format_t format = in->config.format;
     SUBMIX_ALOGV("in_get_format() returns %x", format);
     return format;
 }
@@ -995,7 +1457,7 @@ static audio_format_t in_get_format(const struct audio_stream *stream)
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(stream);
-    if (format != in->dev->routes[in->route_handle].config.common.format) {
+    if (format != in->config.format) {
         ALOGE("in_set_format(format=%x) format unsupported", format);
         return -ENOSYS;
     }
@@ -1007,14 +1469,9 @@ static int in_standby(struct audio_stream *stream)
 {
     ALOGI("in_standby()");
     struct submix_stream_in * const in = audio_stream_get_submix_stream_in(stream);
-    struct submix_audio_device * const rsxadev = in->dev;
-
-    pthread_mutex_lock(&rsxadev->lock);
 
     in->input_standby = true;
 
-    pthread_mutex_unlock(&rsxadev->lock);
-
     return 0;
 }
 
@@ -1027,9 +1484,26 @@ static int in_dump(const struct audio_stream *stream, int fd)
 
 static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
-    (void)stream;
-    (void)kvpairs;
-    return 0;
+    struct submix_stream_in * const in = audio_stream_get_submix_stream_in(stream);
+    struct str_parms * const parms = str_parms_create_str(kvpairs);
+    char value[32];
+    int ret = 0;
+    SUBMIX_ALOGV("in_set_parameters() kvpairs='%s'", kvpairs);
+
+    if (str_parms_get_str(parms, SUBMIX_PARAMETER_OVERRUN, value, sizeof(value)) >= 0) {
+        if (strcmp(value, "block") == 0) {
+            in->overrun_policy = SUBMIX_OVERRUN_BLOCK;
+        } else if (strcmp(value, "drop_oldest") == 0) {
+            in->overrun_policy = SUBMIX_OVERRUN_DROP_OLDEST;
+        } else if (strcmp(value, "drop_newest") == 0) {
+            in->overrun_policy = SUBMIX_OVERRUN_DROP_NEWEST;
+        } else {
+            ALOGE("in_set_parameters(): unknown overrun policy %s", value);
+            ret = -EINVAL;
+        }
+    }
+    str_parms_destroy(parms);
+    return ret;
 }
 
 static char * in_get_parameters(const struct audio_stream *stream,
@@ -1047,62 +1521,119 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
+// Get the source of the pipe read by the specified input stream.
+// Must be called with the lock of the route of the input stream held.
+static sp<MonoPipeReader> in_get_source_l(const struct submix_stream_in * const in)
+{
+    return in->rsxSource != NULL ? in->rsxSource : in->dev->routes[in->route_handle].rsxSource;
+}
+
+// Wait for frames to be written into the pipe read from source by the specified input stream,
+// until the specified CLOCK_MONOTONIC deadline.  Returns false without waiting if the output
+// stream is closed or in standby since no frames will be written, true if frames can be read.
+static bool in_wait_for_frames(route_config_t * const route,
+                               const sp<MonoPipeReader>& source,
+                               const struct timespec * const deadline)
+{
+    bool frames_available;
+    pthread_mutex_lock(&route->lock);
+    // out_write() only signals frames_written_cond while readers are waiting, so make the
+    // increment visible before checking the pipe for the frames it may have just written.
+    route->readers_waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!(frames_available = source->availableToRead() > 0)) {
+        if (route->output == NULL || route->output->output_standby) {
+            break;
+        }
+        if (pthread_cond_timedwait(&route->frames_written_cond, &route->lock,
+                                   deadline) == ETIMEDOUT) {
+            frames_available = source->availableToRead() > 0;
+            break;
+        }
+    }
+    route->readers_waiting.fetch_sub(1);
+    pthread_mutex_unlock(&route->lock);
+    return frames_available;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
     struct submix_stream_in * const in = audio_stream_in_get_submix_stream_in(stream);
-    struct submix_audio_device * const rsxadev = in->dev;
+    route_config_t * const route = &in->dev->routes[in->route_handle];
     const size_t frame_size = audio_stream_in_frame_size(stream);
     const size_t frames_to_read = bytes / frame_size;
 
     SUBMIX_ALOGV("in_read bytes=%zu", bytes);
-    pthread_mutex_lock(&rsxadev->lock);
+    pthread_mutex_lock(&route->lock);
+    const bool output_standby = route->output == NULL || route->output->output_standby;
+    // about to read from audio source
+    sp<MonoPipeReader> source = in_get_source_l(in);
+    pthread_mutex_unlock(&route->lock);
 
-    const bool output_standby = rsxadev->routes[in->route_handle].output == NULL
-            ? true : rsxadev->routes[in->route_handle].output->output_standby;
     const bool output_standby_transition = (in->output_standby_rec_thr != output_standby);
     in->output_standby_rec_thr = output_standby;
 
-    if (in->input_standby || output_standby_transition) {
-        in->input_standby = false;
+    if (in->input_standby.exchange(false) || output_standby_transition) {
         // keep track of when we exit input standby (== first read == start "real recording")
         // or when we start recording silence, and reset projected time
         int rc = clock_gettime(CLOCK_MONOTONIC, &in->record_start_time);
         if (rc == 0) {
             in->read_counter_frames_since_standby = 0;
         }
+        if (in->converter != NULL) {
+            submix_converter_reset(in->converter);
+        }
     }
 
     in->read_counter_frames += frames_to_read;
-    in->read_counter_frames_since_standby += frames_to_read;
+    const uint64_t read_counter_frames_since_standby =
+            in->read_counter_frames_since_standby += frames_to_read;
     size_t remaining_frames = frames_to_read;
 
+    // Wait for missing frames until the projected time at which this read returns, so that only
+    // frames that were not written in time are replaced with silence.  While the output stream is
+    // active, wait at least for a pipe period so that a late read doesn't return silence in place
+    // of frames that are about to be written.
+    const uint32_t sample_rate = in_get_sample_rate(&stream->common);
+    struct timespec read_deadline = in->record_start_time;
+    read_deadline.tv_sec += read_counter_frames_since_standby / sample_rate;
+    timespec_add_ns(&read_deadline,
+            (int64_t)(read_counter_frames_since_standby % sample_rate) * 1000000000 /
+                    sample_rate);
+    if (!output_standby) {
+        struct timespec period_deadline;
+        clock_gettime(CLOCK_MONOTONIC, &period_deadline);
+        timespec_add_ns(&period_deadline,
+                (int64_t)route->config.buffer_period_size_frames *
+                        1000000000 / route->config.common.sample_rate);
+        if (timespec_after(&period_deadline, &read_deadline)) {
+            read_deadline = period_deadline;
+        }
+    }
+
     {
-        // about to read from audio source
-        sp<MonoPipeReader> source = rsxadev->routes[in->route_handle].rsxSource;
         if (source == NULL) {
             in->read_error_count++;// ok if it rolls over
             ALOGE_IF(in->read_error_count < MAX_READ_ERROR_LOGS,
                     "no audio pipe yet we're trying to read! (not all errors will be logged)");
-            pthread_mutex_unlock(&rsxadev->lock);
             usleep(frames_to_read * 1000000 / in_get_sample_rate(&stream->common));
             memset(buffer, 0, bytes);
             return bytes;
         }
 
-        pthread_mutex_unlock(&rsxadev->lock);
-
-        // read the data from the pipe (it's non blocking)
-        int attempts = 0;
+        // read the data from the pipe (it's non blocking), waiting for the output stream to
+        // write more when it's empty
         char* buff = (char*)buffer;
 
-        while ((remaining_frames > 0) && (attempts < MAX_READ_ATTEMPTS)) {
-            ssize_t frames_read = -1977;
-            size_t read_frames = remaining_frames;
-
+        while (remaining_frames > 0) {
             SUBMIX_ALOGV("in_read(): frames available to read %zd", source->availableToRead());
 
-            frames_read = source->read(buff, read_frames);
+            pthread_mutex_lock(&in->read_lock);
+            const ssize_t frames_read = in->converter != NULL ?
+                    submix_converter_read(in->converter, source, buff, remaining_frames) :
+                    source->read(buff, remaining_frames);
+            pthread_mutex_unlock(&in->read_lock);
 
             SUBMIX_ALOGV("in_read(): frames read %zd", frames_read);
 
@@ -1113,18 +1644,17 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 
                 remaining_frames -= frames_read;
                 buff += frames_read * frame_size;
-                SUBMIX_ALOGV("  in_read (att=%d) got %zd frames, remaining=%zu",
-                             attempts, frames_read, remaining_frames);
+                SUBMIX_ALOGV("  in_read got %zd frames, remaining=%zu",
+                             frames_read, remaining_frames);
             } else {
-                attempts++;
                 SUBMIX_ALOGE("  in_read read returned %zd", frames_read);
-                usleep(READ_ATTEMPT_SLEEP_MS * 1000);
+                if (!in_wait_for_frames(route, source, &read_deadline)) {
+                    break;
+                }
             }
         }
         // done using the source
-        pthread_mutex_lock(&rsxadev->lock);
         source.clear();
-        pthread_mutex_unlock(&rsxadev->lock);
     }
 
     if (remaining_frames > 0) {
@@ -1138,7 +1668,6 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct timespec time_after_read;// wall clock after reading from the pipe
     struct timespec record_duration;// observed record duration
     int rc = clock_gettime(CLOCK_MONOTONIC, &time_after_read);
-    const uint32_t sample_rate = in_get_sample_rate(&stream->common);
     if (rc == 0) {
         // for how long have we been recording?
         record_duration.tv_sec  = time_after_read.tv_sec - in->record_start_time.tv_sec;
@@ -1153,7 +1682,7 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         // how long we've been recording for, which gives us how long we must wait to sync the
         // projected recording time, and the observed recording time.
         long projected_vs_observed_offset_us =
-                ((int64_t)(in->read_counter_frames_since_standby
+                ((int64_t)(read_counter_frames_since_standby
                             - (record_duration.tv_sec*sample_rate)))
                         * 1000000 / sample_rate
                 - (record_duration.tv_nsec / 1000);
@@ -1186,20 +1715,21 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
 
     struct submix_stream_in * const in = audio_stream_in_get_submix_stream_in(
             (struct audio_stream_in*)stream);
-    struct submix_audio_device * const rsxadev = in->dev;
+    route_config_t * const route = &in->dev->routes[in->route_handle];
 
-    pthread_mutex_lock(&rsxadev->lock);
-    sp<MonoPipeReader> source = rsxadev->routes[in->route_handle].rsxSource;
+    pthread_mutex_lock(&route->lock);
+    sp<MonoPipeReader> source = in_get_source_l(in);
+    pthread_mutex_unlock(&route->lock);
     if (source == NULL) {
         ALOGW("%s called on released input", __FUNCTION__);
-        pthread_mutex_unlock(&rsxadev->lock);
         return -ENODEV;
     }
     *frames = in->read_counter_frames;
     const ssize_t frames_in_pipe = source->availableToRead();
-    pthread_mutex_unlock(&rsxadev->lock);
     if (frames_in_pipe > 0) {
-        *frames += frames_in_pipe;
+        // Frames in the pipe are at the sample rate of the pipe.
+        *frames += (int64_t)frames_in_pipe * in->config.sample_rate /
+                route->config.common.sample_rate;
     }
 
     struct timespec timestamp;
@@ -1253,7 +1783,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         return res;
     }
 
-    if (!submix_open_validate_l(rsxadev, route_idx, config, false)) {
+    if (!submix_open_validate_l(rsxadev, route_idx, config, false, false)) {
         ALOGE("adev_open_output_stream(): Unable to open output stream for address %s", address);
         pthread_mutex_unlock(&rsxadev->lock);
         return -EINVAL;
@@ -1334,9 +1864,42 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
-    (void)dev;
-    (void)kvpairs;
-    return -ENOSYS;
+    struct submix_audio_device * const rsxadev = audio_hw_device_get_submix_audio_device(dev);
+    struct str_parms * const parms = str_parms_create_str(kvpairs);
+    char address[AUDIO_DEVICE_MAX_ADDRESS_LEN];
+    int ret = -ENOSYS;
+
+    pthread_mutex_lock(&rsxadev->lock);
+    if (str_parms_get_str(parms, SUBMIX_PARAMETER_BROADCAST, address, sizeof(address)) >= 0) {
+        ret = -ENOMEM;
+        if (submix_is_broadcast_address_l(rsxadev, address)) {
+            ret = 0;
+        } else {
+            for (int i = 0; i < MAX_ROUTES; i++) {
+                if (rsxadev->broadcast_addresses[i][0] == '\0') {
+                    strncpy(rsxadev->broadcast_addresses[i], address,
+                            AUDIO_DEVICE_MAX_ADDRESS_LEN);
+                    ret = 0;
+                    break;
+                }
+            }
+        }
+        ALOGI_IF(ret == 0, "adev_set_parameters(): broadcast enabled for address %s", address);
+        ALOGE_IF(ret != 0, "adev_set_parameters(): too many broadcast addresses");
+    }
+    if (str_parms_get_str(parms, SUBMIX_PARAMETER_NO_BROADCAST, address, sizeof(address)) >= 0) {
+        for (int i = 0; i < MAX_ROUTES; i++) {
+            if (strncmp(rsxadev->broadcast_addresses[i], address,
+                        AUDIO_DEVICE_MAX_ADDRESS_LEN) == 0) {
+                memset(rsxadev->broadcast_addresses[i], 0, AUDIO_DEVICE_MAX_ADDRESS_LEN);
+            }
+        }
+        ALOGI("adev_set_parameters(): broadcast disabled for address %s", address);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&rsxadev->lock);
+    str_parms_destroy(parms);
+    return ret;
 }
 
 static char * adev_get_parameters(const struct audio_hw_device *dev,
@@ -1469,14 +2032,27 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     // Make sure it's possible to open the device given the current audio config.
     submix_sanitize_config(config, true);
-    if (!submix_open_validate_l(rsxadev, route_idx, config, true)) {
+    const bool broadcast = submix_is_broadcast_address_l(rsxadev, address);
+    if (!submix_open_validate_l(rsxadev, route_idx, config, true, broadcast)) {
         ALOGE("adev_open_input_stream(): Unable to open input stream.");
         pthread_mutex_unlock(&rsxadev->lock);
         return -EINVAL;
     }
 
 #if ENABLE_LEGACY_INPUT_OPEN
-    in = rsxadev->routes[route_idx].input;
+    // Input streams of broadcast routes are never shared.
+    in = broadcast ? NULL : rsxadev->routes[route_idx].input;
+    if (in && (in->config.sample_rate != config->sample_rate ||
+               in->config.format != config->format ||
+               in->config.channel_mask != config->channel_mask)) {
+        // The shared input stream can't be read in another config, suggest its config instead.
+        ALOGE("adev_open_input_stream(): config doesn't match the open input stream.");
+        config->sample_rate = in->config.sample_rate;
+        config->format = in->config.format;
+        config->channel_mask = in->config.channel_mask;
+        pthread_mutex_unlock(&rsxadev->lock);
+        return -EINVAL;
+    }
     if (in) {
         in->ref_count++;
         sp<MonoPipe> sink = rsxadev->routes[route_idx].rsxSink;
@@ -1493,6 +2069,14 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         } else {
             ALOGE("NULL sink when opening input stream, refcount=%d", in->ref_count);
         }
+        // Without a pipe, one is created below in the config of the input stream, whose frames
+        // then need no conversion.
+        if (rsxadev->routes[route_idx].rsxSink == NULL && in->converter != NULL) {
+            pthread_mutex_lock(&in->read_lock);
+            submix_converter_destroy(in->converter);
+            in->converter = NULL;
+            pthread_mutex_unlock(&in->read_lock);
+        }
     }
 #else
     in = NULL;
@@ -1500,7 +2084,10 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     if (!in) {
         in = (struct submix_stream_in *)calloc(1, sizeof(struct submix_stream_in));
-        if (!in) return -ENOMEM;
+        if (!in) {
+            pthread_mutex_unlock(&rsxadev->lock);
+            return -ENOMEM;
+        }
 #if ENABLE_LEGACY_INPUT_OPEN
         in->ref_count = 1;
 #endif
@@ -1524,9 +2111,24 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         in->stream.get_capture_position = in_get_capture_position;
 
         in->dev = rsxadev;
+        memcpy(&in->config, config, sizeof(in->config));
+        pthread_mutex_init(&in->read_lock, NULL);
 #if LOG_STREAMS_TO_FILES
         in->log_fd = -1;
 #endif
+
+        // If a pipe exists in a different config, convert the frames read from it.
+        const struct submix_config * const pipe_config = &rsxadev->routes[route_idx].config;
+        if (rsxadev->routes[route_idx].rsxSink != NULL &&
+                !submix_pipe_config_compare(pipe_config, config, true)) {
+            in->converter = submix_converter_create(pipe_config, config);
+            if (in->converter == NULL) {
+                pthread_mutex_destroy(&in->read_lock);
+                free(in);
+                pthread_mutex_unlock(&rsxadev->lock);
+                return -ENOMEM;
+            }
+        }
     }
 
     // Initialize the input stream.
@@ -1540,16 +2142,29 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     }
 
     in->read_error_count = 0;
-    // Initialize the pipe.
-    const size_t pipeSizeInFrames = pipe_size_in_frames(config->sample_rate);
-    ALOGI("adev_open_input_stream(): about to create pipe at index %d, rate %u, pipe size %zu",
-          route_idx, config->sample_rate, pipeSizeInFrames);
-    submix_audio_device_create_pipe_l(rsxadev, config, pipeSizeInFrames,
-                                    DEFAULT_PIPE_PERIOD_COUNT, in, NULL, address, route_idx);
-
-    sp <MonoPipe> sink = rsxadev->routes[route_idx].rsxSink;
-    if (sink != NULL) {
-        sink->shutdown(false);
+    if (broadcast && rsxadev->routes[route_idx].input != NULL) {
+        // Read from a pipe of its own, next to the input stream of the route.
+        if (!submix_audio_device_add_broadcast_input_l(rsxadev, in, route_idx)) {
+            if (in->converter != NULL) {
+                submix_converter_destroy(in->converter);
+            }
+            pthread_mutex_destroy(&in->read_lock);
+            free(in);
+            pthread_mutex_unlock(&rsxadev->lock);
+            return -ENOMEM;
+        }
+    } else {
+        // Initialize the pipe.
+        const size_t pipeSizeInFrames = pipe_size_in_frames(config->sample_rate);
+        ALOGI("adev_open_input_stream(): about to create pipe at index %d, rate %u, "
+              "pipe size %zu", route_idx, config->sample_rate, pipeSizeInFrames);
+        submix_audio_device_create_pipe_l(rsxadev, config, pipeSizeInFrames,
+                                        DEFAULT_PIPE_PERIOD_COUNT, in, NULL, address, route_idx);
+
+        sp <MonoPipe> sink = rsxadev->routes[route_idx].rsxSink;
+        if (sink != NULL) {
+            sink->shutdown(false);
+        }
     }
 
 #if LOG_STREAMS_TO_FILES
@@ -1580,10 +2195,17 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
     if (in->log_fd >= 0) close(in->log_fd);
 #endif // LOG_STREAMS_TO_FILES
 #if ENABLE_LEGACY_INPUT_OPEN
-    if (in->ref_count == 0) free(in);
+    const bool release = in->ref_count == 0;
 #else
-    free(in);
+    const bool release = true;
 #endif // ENABLE_LEGACY_INPUT_OPEN
+    if (release) {
+        if (in->converter != NULL) {
+            submix_converter_destroy(in->converter);
+        }
+        pthread_mutex_destroy(&in->read_lock);
+        free(in);
+    }
 
     pthread_mutex_unlock(&rsxadev->lock);
 }
@@ -1609,6 +2231,12 @@ static int adev_dump(const audio_hw_device_t *device, int fd)
 static int adev_close(hw_device_t *device)
 {
     ALOGI("adev_close()");
+    struct submix_audio_device * const rsxadev = audio_hw_device_get_submix_audio_device(
+            reinterpret_cast<struct audio_hw_device *>(device));
+    for (int i=0 ; i < MAX_ROUTES ; i++) {
+        pthread_cond_destroy(&rsxadev->routes[i].frames_written_cond);
+        pthread_mutex_destroy(&rsxadev->routes[i].lock);
+    }
     free(device);
     return 0;
 }
@@ -1649,10 +2277,16 @@ static int adev_open(const hw_module_t* module, const char* name,
     rsxadev->device.close_input_stream = adev_close_input_stream;
     rsxadev->device.dump = adev_dump;
 
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
     for (int i=0 ; i < MAX_ROUTES ; i++) {
             memset(&rsxadev->routes[i], 0, sizeof(route_config));
             strcpy(rsxadev->routes[i].address, "");
+            pthread_mutex_init(&rsxadev->routes[i].lock, NULL);
+            pthread_cond_init(&rsxadev->routes[i].frames_written_cond, &cond_attr);
         }
+    pthread_condattr_destroy(&cond_attr);
 
     *device = &rsxadev->device.common;
 
@@ -22,6 +22,9 @@
 #define LOG_TAG "RemoteSubmixTest"
 
 #include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include <gtest/gtest.h>
 #include <hardware/audio.h>
@@ -222,6 +225,61 @@ TEST_F(RemoteSubmixTest, OutputAndInput) {
     mDev->close_output_stream(mDev, streamOut);
 }
 
+// Verifies that a read waiting on an empty pipe returns the frames written while it waits
+// instead of silence.
+TEST_F(RemoteSubmixTest, InputWaitsForOutput) {
+    const char* address = "1";
+    audio_stream_out_t* streamOut;
+    OpenOutputStream(address, true /*mono*/, 48000, &streamOut);
+    audio_stream_in_t* streamIn;
+    OpenInputStream(address, true /*mono*/, 48000, &streamIn);
+    // 4096 bytes of 16-bit mono at 48 kHz last 42.7 ms, write them in two halves 20 ms apart.
+    const size_t bufferSize = 4096;
+    std::unique_ptr<char[]> outBuffer(new char[bufferSize]), inBuffer(new char[bufferSize]);
+    GenerateData(outBuffer.get(), bufferSize);
+    std::thread writer([&] {
+        usleep(5000);
+        WriteIntoStream(streamOut, outBuffer.get(), bufferSize / 2);
+        usleep(20000);
+        WriteIntoStream(streamOut, outBuffer.get() + bufferSize / 2, bufferSize / 2);
+    });
+    memset(inBuffer.get(), 0, bufferSize);
+    ReadFromStream(streamIn, inBuffer.get(), bufferSize);
+    writer.join();
+    EXPECT_EQ(0, memcmp(outBuffer.get(), inBuffer.get(), bufferSize));
+    mDev->close_input_stream(mDev, streamIn);
+    mDev->close_output_stream(mDev, streamOut);
+}
+
+// Verifies that routes stream independently while streams of other routes are opened and closed.
+TEST_F(RemoteSubmixTest, ConcurrentRoutes) {
+    const char* addresses[] = { "1", "2" };
+    const size_t routeCount = sizeof(addresses) / sizeof(addresses[0]);
+    audio_stream_out_t* streamOut[routeCount];
+    audio_stream_in_t* streamIn[routeCount];
+    for (size_t i = 0; i < routeCount; ++i) {
+        OpenOutputStream(addresses[i], true /*mono*/, 48000, &streamOut[i]);
+        OpenInputStream(addresses[i], true /*mono*/, 48000, &streamIn[i]);
+    }
+    const size_t bufferSize = 1024;
+    std::thread routes[routeCount];
+    for (size_t i = 0; i < routeCount; ++i) {
+        routes[i] = std::thread([&, i] {
+            VerifyOutputInput(streamOut[i], bufferSize, streamIn[i], bufferSize, 16);
+        });
+    }
+    for (size_t i = 0; i < 16; ++i) {
+        audio_stream_out_t* otherStreamOut;
+        OpenOutputStream("3", true /*mono*/, 48000, &otherStreamOut);
+        mDev->close_output_stream(mDev, otherStreamOut);
+    }
+    for (size_t i = 0; i < routeCount; ++i) {
+        routes[i].join();
+        mDev->close_input_stream(mDev, streamIn[i]);
+        mDev->close_output_stream(mDev, streamOut[i]);
+    }
+}
+
 // Verifies that reading and writing into a closed stream fails gracefully.
 TEST_F(RemoteSubmixTest, OutputAndInputAfterClose) {
     const char* address = "1";
@@ -239,6 +297,32 @@ TEST_F(RemoteSubmixTest, OutputAndInputAfterClose) {
     VerifyBufferAllZeroes(buffer.get(), bufferSize);
 }
 
+// Verifies that an input stream reopened after its pipe was shut down reads the recreated pipe,
+// which is in the config of the input, without converting its frames from the previous config.
+// This requires ENABLE_LEGACY_INPUT_OPEN to be set in the HAL module
+TEST_F(RemoteSubmixTest, ReopenInputAfterMismatchedOutput) {
+    const char* address = "1";
+    audio_stream_out_t* streamOut;
+    OpenOutputStream(address, true /*mono*/, 48000, &streamOut);
+    const size_t streamInCount = 3;
+    audio_stream_in_t* streamIn[streamInCount];
+    OpenInputStream(address, false /*mono*/, 48000, &streamIn[0]);
+    OpenInputStream(address, false /*mono*/, 48000, &streamIn[1]);
+    const size_t bufferSize = 1024;
+    VerifyOutputInput(streamOut, bufferSize, streamIn[0], bufferSize * 2, 16);
+    // Shut the pipe down and close both streams, the input stream stays open for its other user.
+    ASSERT_EQ(0, streamOut->common.set_parameters(&streamOut->common, "exiting=1"));
+    mDev->close_output_stream(mDev, streamOut);
+    mDev->close_input_stream(mDev, streamIn[0]);
+    // Reopening the input stream recreates the pipe in the config of the input.
+    OpenInputStream(address, false /*mono*/, 48000, &streamIn[2]);
+    OpenOutputStream(address, false /*mono*/, 48000, &streamOut);
+    VerifyOutputInput(streamOut, bufferSize * 2, streamIn[2], bufferSize * 2, 16);
+    mDev->close_input_stream(mDev, streamIn[1]);
+    mDev->close_input_stream(mDev, streamIn[2]);
+    mDev->close_output_stream(mDev, streamOut);
+}
+
 TEST_F(RemoteSubmixTest, PresentationPosition) {
     const char* address = "1";
     audio_stream_out_t* streamOut;
@@ -274,7 +358,6 @@ TEST_F(RemoteSubmixTest, RenderPosition) {
     mDev->close_output_stream(mDev, streamOut);
 }
 
-// This requires ENABLE_CHANNEL_CONVERSION to be set in the HAL module
 TEST_F(RemoteSubmixTest, MonoToStereoConversion) {
     const char* address = "1";
     audio_stream_out_t* streamOut;
@@ -287,7 +370,6 @@ TEST_F(RemoteSubmixTest, MonoToStereoConversion) {
     mDev->close_output_stream(mDev, streamOut);
 }
 
-// This requires ENABLE_CHANNEL_CONVERSION to be set in the HAL module
 TEST_F(RemoteSubmixTest, StereoToMonoConversion) {
     const char* address = "1";
     audio_stream_out_t* streamOut;
@@ -300,7 +382,6 @@ TEST_F(RemoteSubmixTest, StereoToMonoConversion) {
     mDev->close_output_stream(mDev, streamOut);
 }
 
-// This requires ENABLE_RESAMPLING to be set in the HAL module
 TEST_F(RemoteSubmixTest, OutputAndInputResampling) {
     const char* address = "1";
     audio_stream_out_t* streamOut;
@@ -313,6 +394,43 @@ TEST_F(RemoteSubmixTest, OutputAndInputResampling) {
     mDev->close_output_stream(mDev, streamOut);
 }
 
+// Verifies that a float stereo output can be captured as 16-bit mono at a lower sample rate.
+TEST_F(RemoteSubmixTest, FloatOutputToPcm16Input) {
+    const char* address = "1";
+    struct audio_config configOut = {};
+    configOut.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    configOut.sample_rate = 48000;
+    configOut.format = AUDIO_FORMAT_PCM_FLOAT;
+    audio_stream_out_t* streamOut = nullptr;
+    ASSERT_EQ(OK, mDev->open_output_stream(mDev,
+            AUDIO_IO_HANDLE_NONE, AUDIO_DEVICE_NONE, AUDIO_OUTPUT_FLAG_NONE,
+            &configOut, &streamOut, address));
+    EXPECT_EQ(AUDIO_FORMAT_PCM_FLOAT, streamOut->common.get_format(&streamOut->common));
+    struct audio_config configIn = {};
+    configIn.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    configIn.sample_rate = 16000;
+    configIn.format = AUDIO_FORMAT_PCM_16_BIT;
+    audio_stream_in_t* streamIn = nullptr;
+    ASSERT_EQ(OK, mDev->open_input_stream(mDev,
+            AUDIO_IO_HANDLE_NONE, AUDIO_DEVICE_NONE, &configIn,
+            &streamIn, AUDIO_INPUT_FLAG_NONE, address, AUDIO_SOURCE_DEFAULT));
+    EXPECT_EQ(16000U, streamIn->common.get_sample_rate(&streamIn->common));
+    EXPECT_EQ(AUDIO_FORMAT_PCM_16_BIT, streamIn->common.get_format(&streamIn->common));
+    EXPECT_EQ(AUDIO_CHANNEL_IN_MONO, streamIn->common.get_channels(&streamIn->common));
+    std::vector<float> outBuffer(960 * 2, 0.5f);
+    std::vector<int16_t> inBuffer(320);
+    for (size_t i = 0; i < 8; ++i) {
+        WriteIntoStream(streamOut, reinterpret_cast<const char*>(outBuffer.data()),
+                outBuffer.size() * sizeof(float));
+        ReadFromStream(streamIn, reinterpret_cast<char*>(inBuffer.data()),
+                inBuffer.size() * sizeof(int16_t));
+    }
+    // Past the delay of the resampler, the input holds the output at half scale.
+    EXPECT_NEAR(16384, inBuffer.back(), 256);
+    mDev->close_input_stream(mDev, streamIn);
+    mDev->close_output_stream(mDev, streamOut);
+}
+
 // This requires ENABLE_LEGACY_INPUT_OPEN to be set in the HAL module
 TEST_F(RemoteSubmixTest, OpenInputMultipleTimes) {
     const char* address = "1";
@@ -330,3 +448,82 @@ TEST_F(RemoteSubmixTest, OpenInputMultipleTimes) {
     }
     mDev->close_output_stream(mDev, streamOut);
 }
+
+TEST_F(RemoteSubmixTest, BroadcastInputs) {
+    const char* address = "1";
+    ASSERT_EQ(0, mDev->set_parameters(mDev, "r_submix_broadcast=1"));
+    audio_stream_out_t* streamOut;
+    OpenOutputStream(address, true /*mono*/, 48000, &streamOut);
+    const size_t streamInCount = 3;
+    audio_stream_in_t* streamIn[streamInCount];
+    for (size_t i = 0; i < streamInCount; ++i) {
+        OpenInputStream(address, true /*mono*/, 48000, &streamIn[i]);
+    }
+    ASSERT_NE(streamIn[0], streamIn[1]);
+    const size_t bufferSize = 1024;
+    std::unique_ptr<char[]> outBuffer(new char[bufferSize]), inBuffer(new char[bufferSize]);
+    GenerateData(outBuffer.get(), bufferSize);
+    for (size_t i = 0; i < 16; ++i) {
+        WriteIntoStream(streamOut, outBuffer.get(), bufferSize);
+        for (size_t j = 0; j < streamInCount; ++j) {
+            memset(inBuffer.get(), 0, bufferSize);
+            ReadFromStream(streamIn[j], inBuffer.get(), bufferSize);
+            ASSERT_EQ(0, memcmp(outBuffer.get(), inBuffer.get(), bufferSize));
+        }
+    }
+    for (size_t i = 0; i < streamInCount; ++i) {
+        mDev->close_input_stream(mDev, streamIn[i]);
+    }
+    mDev->close_output_stream(mDev, streamOut);
+}
+
+// Verifies that a broadcast input dropping the newest frames doesn't hold up the route.
+TEST_F(RemoteSubmixTest, BroadcastInputDropsNewest) {
+    const char* address = "1";
+    ASSERT_EQ(0, mDev->set_parameters(mDev, "r_submix_broadcast=1"));
+    audio_stream_out_t* streamOut;
+    OpenOutputStream(address, true /*mono*/, 48000, &streamOut);
+    audio_stream_in_t* streamIn;
+    OpenInputStream(address, true /*mono*/, 48000, &streamIn);
+    audio_stream_in_t* lateStreamIn;
+    OpenInputStream(address, true /*mono*/, 48000, &lateStreamIn);
+    ASSERT_EQ(0, lateStreamIn->common.set_parameters(
+            &lateStreamIn->common, "r_submix_overrun=drop_newest"));
+    const size_t bufferSize = 1024;
+    std::unique_ptr<char[]> buffer(new char[bufferSize]);
+    ReadFromStream(lateStreamIn, buffer.get(), bufferSize);
+    // Write more than the pipe of lateStreamIn holds.
+    VerifyOutputInput(streamOut, bufferSize, streamIn, bufferSize, 64);
+    memset(buffer.get(), 0, bufferSize);
+    ReadFromStream(lateStreamIn, buffer.get(), bufferSize);
+    VerifyBufferNotZeroes(buffer.get(), bufferSize);
+    mDev->close_input_stream(mDev, lateStreamIn);
+    mDev->close_input_stream(mDev, streamIn);
+    mDev->close_output_stream(mDev, streamOut);
+}
+
+// Verifies that an input dropping the oldest frames doesn't block the output while active, and
+// reads the most recent frames afterwards.
+TEST_F(RemoteSubmixTest, InputDropsOldest) {
+    const char* address = "1";
+    audio_stream_out_t* streamOut;
+    OpenOutputStream(address, true /*mono*/, 48000, &streamOut);
+    audio_stream_in_t* streamIn;
+    OpenInputStream(address, true /*mono*/, 48000, &streamIn);
+    ASSERT_EQ(0, streamIn->common.set_parameters(
+            &streamIn->common, "r_submix_overrun=drop_oldest"));
+    const size_t bufferSize = 1024;
+    std::unique_ptr<char[]> buffer(new char[bufferSize]);
+    ReadFromStream(streamIn, buffer.get(), bufferSize);
+    // Write twice what the pipe holds without reading.
+    const size_t pipeSize = streamIn->common.get_buffer_size(&streamIn->common) * 4;
+    const size_t writes = 2 * pipeSize / bufferSize;
+    for (size_t i = 0; i < writes; ++i) {
+        memset(buffer.get(), static_cast<int>(i + 1), bufferSize);
+        WriteIntoStream(streamOut, buffer.get(), bufferSize);
+    }
+    ReadFromStream(streamIn, buffer.get(), bufferSize);
+    EXPECT_EQ(static_cast<char>(writes / 2 + 1), buffer[0]);
+    mDev->close_input_stream(mDev, streamIn);
+    mDev->close_output_stream(mDev, streamOut);
+}
@@ -45,8 +45,11 @@ v4l2_src_files := \
   arc/cached_frame.cpp \
   arc/exif_utils.cpp \
   arc/frame_buffer.cpp \
+  arc/frame_buffer_pool.cpp \
   arc/image_processor.cpp \
   arc/jpeg_compressor.cpp \
+  arc/jpeg_decompressor.cpp \
+  arc/parallel_jpeg_compressor.cpp \
   camera.cpp \
   capture_request.cpp \
   format_metadata_factory.cpp \
@@ -63,6 +66,10 @@ v4l2_src_files := \
   v4l2_wrapper.cpp \
 
 v4l2_test_files := \
+  arc/frame_buffer_pool_test.cpp \
+  arc/image_processor_test.cpp \
+  arc/jpeg_decompressor_test.cpp \
+  arc/parallel_jpeg_compressor_test.cpp \
   format_metadata_factory_test.cpp \
   metadata/control_test.cpp \
   metadata/default_option_delegate_test.cpp \
@@ -121,4 +128,28 @@ LOCAL_SRC_FILES := \
 
 include $(BUILD_NATIVE_TEST)
 
+# Frame pipeline benchmark for V4L2 Camera HAL, run against a fake device.
+# ==============================================================================
+include $(CLEAR_VARS)
+LOCAL_MODULE := camera.v4l2_benchmark
+LOCAL_LICENSE_KINDS := SPDX-license-identifier-Apache-2.0 SPDX-license-identifier-BSD
+LOCAL_LICENSE_CONDITIONS := notice
+LOCAL_NOTICE_FILE := $(LOCAL_PATH)/../../../NOTICE
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += $(v4l2_cflags)
+LOCAL_SHARED_LIBRARIES := \
+  $(v4l2_shared_libs) \
+  libui \
+
+LOCAL_HEADER_LIBRARIES := libgtest_prod_headers
+LOCAL_STATIC_LIBRARIES := $(v4l2_static_libs)
+
+LOCAL_C_INCLUDES += $(v4l2_c_includes)
+LOCAL_SRC_FILES := \
+  $(v4l2_src_files) \
+  v4l2_camera_benchmark.cpp \
+  v4l2_wrapper_fake.cpp \
+
+include $(BUILD_EXECUTABLE)
+
 endif # USE_CAMERA_V4L2_HAL
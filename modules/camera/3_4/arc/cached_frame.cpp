@@ -14,16 +14,26 @@ namespace arc {
 
 using android::CameraMetadata;
 
-CachedFrame::CachedFrame()
-    : source_frame_(nullptr),
-      cropped_buffer_capacity_(0),
-      yu12_frame_(new AllocatedFrameBuffer(0)),
-      scaled_frame_(new AllocatedFrameBuffer(0)) {}
-
-CachedFrame::~CachedFrame() { UnsetSource(); }
+CachedFrame::CachedFrame(FrameBufferPool* pool)
+    : pool_(pool),
+      source_frame_(nullptr),
+      cropped_frame_(pool ? nullptr : new AllocatedFrameBuffer(0)),
+      yu12_frame_(pool ? nullptr : new AllocatedFrameBuffer(0)),
+      scaled_frame_(pool ? nullptr : new AllocatedFrameBuffer(0)),
+      scaled_frame_valid_(false) {}
+
+CachedFrame::~CachedFrame() {
+  UnsetSource();
+  if (pool_) {
+    pool_->Release(std::move(cropped_frame_));
+    pool_->Release(std::move(yu12_frame_));
+    pool_->Release(std::move(scaled_frame_));
+  }
+}
 
 int CachedFrame::SetSource(const FrameBuffer* frame, int rotate_degree) {
   source_frame_ = frame;
+  scaled_frame_valid_ = false;
   int res = ConvertToYU12();
   if (res != 0) {
     return res;
@@ -71,23 +81,33 @@ int CachedFrame::Convert(const CameraMetadata& metadata, FrameBuffer* out_frame,
   }
 
   FrameBuffer* source_frame = yu12_frame_.get();
-  if (GetWidth() != out_frame->GetWidth() ||
-      GetHeight() != out_frame->GetHeight()) {
+  if (scaled_frame_valid_ &&
+      scaled_frame_->GetWidth() == out_frame->GetWidth() &&
+      scaled_frame_->GetHeight() == out_frame->GetHeight()) {
+    // Another output of the same size already scaled this frame.
+    source_frame = scaled_frame_.get();
+  } else if (GetWidth() != out_frame->GetWidth() ||
+             GetHeight() != out_frame->GetHeight()) {
     size_t cache_size = ImageProcessor::GetConvertedSize(
         yu12_frame_->GetFourcc(), out_frame->GetWidth(),
         out_frame->GetHeight());
     if (cache_size == 0) {
       return -EINVAL;
-    } else if (cache_size > scaled_frame_->GetBufferSize()) {
-      scaled_frame_.reset(new AllocatedFrameBuffer(cache_size));
     }
+    ReserveFrame(&scaled_frame_, cache_size);
     scaled_frame_->SetWidth(out_frame->GetWidth());
     scaled_frame_->SetHeight(out_frame->GetHeight());
-    ImageProcessor::Scale(*yu12_frame_.get(), scaled_frame_.get());
+    int res = ImageProcessor::Scale(*yu12_frame_.get(), scaled_frame_.get());
+    if (res) {
+      scaled_frame_valid_ = false;
+      return res;
+    }
+    scaled_frame_valid_ = true;
 
     source_frame = scaled_frame_.get();
   }
-  return ImageProcessor::ConvertFormat(metadata, *source_frame, out_frame);
+  return ImageProcessor::ConvertFormat(metadata, *source_frame, out_frame,
+                                       pool_);
 }
 
 int CachedFrame::ConvertToYU12() {
@@ -97,6 +117,7 @@ int CachedFrame::ConvertToYU12() {
   if (cache_size == 0) {
     return -EINVAL;
   }
+  ReserveFrame(&yu12_frame_, cache_size);
   yu12_frame_->SetDataSize(cache_size);
   yu12_frame_->SetFourcc(V4L2_PIX_FMT_YUV420);
   yu12_frame_->SetWidth(source_frame_->GetWidth());
@@ -153,11 +174,8 @@ int CachedFrame::CropRotateScale(int rotate_degree) {
   int rotated_uv_stride = rotated_width / 2;
   size_t rotated_size =
       rotated_y_stride * rotated_height + rotated_uv_stride * rotated_height;
-  if (rotated_size > cropped_buffer_capacity_) {
-    cropped_buffer_.reset(new uint8_t[rotated_size]);
-    cropped_buffer_capacity_ = rotated_size;
-  }
-  uint8_t* rotated_y_plane = cropped_buffer_.get();
+  ReserveFrame(&cropped_frame_, rotated_size);
+  uint8_t* rotated_y_plane = cropped_frame_->GetData();
   uint8_t* rotated_u_plane =
       rotated_y_plane + rotated_y_stride * rotated_height;
   uint8_t* rotated_v_plane =
@@ -215,4 +233,17 @@ int CachedFrame::CropRotateScale(int rotate_degree) {
   return res;
 }
 
+void CachedFrame::ReserveFrame(std::unique_ptr<AllocatedFrameBuffer>* frame,
+                               size_t size) {
+  if (*frame && (*frame)->GetBufferSize() >= size) {
+    return;
+  }
+  if (pool_) {
+    pool_->Release(std::move(*frame));
+    *frame = pool_->Acquire(size);
+  } else {
+    frame->reset(new AllocatedFrameBuffer(size));
+  }
+}
+
 }  // namespace arc
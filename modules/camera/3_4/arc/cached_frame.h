@@ -9,6 +9,7 @@
 #include <memory>
 
 #include <camera/CameraMetadata.h>
+#include "arc/frame_buffer_pool.h"
 #include "arc/image_processor.h"
 
 namespace arc {
@@ -18,7 +19,9 @@ namespace arc {
 // format of libyuv, to allow convenient processing.
 class CachedFrame {
  public:
-  CachedFrame();
+  // If |pool| is given, intermediate buffers are borrowed from it and
+  // returned on destruction instead of being allocated for each frame.
+  explicit CachedFrame(FrameBufferPool* pool = nullptr);
   ~CachedFrame();
 
   // SetSource() doesn't take ownership of |frame|. The caller can only release
@@ -48,7 +51,8 @@ class CachedFrame {
 
   // Caller should fill everything except |data_size| and |fd| of |out_frame|.
   // The function will do format conversion and scale to fit |out_frame|
-  // requirement.
+  // requirement. It may be called repeatedly for one source to produce
+  // several outputs from the same cached YU12 frame.
   // If |video_hack| is true, it outputs YU12 when |hal_pixel_format| is YV12
   // (swapping U/V planes). Caller should fill |fourcc|, |data|, and
   // Return non-zero error code on failure; return 0 on success.
@@ -65,19 +69,25 @@ class CachedFrame {
   // CameraInfo.orientation. Framework would then tell HAL how much the frame
   // needs to rotate clockwise by |rotate_degree|.
   int CropRotateScale(int rotate_degree);
+  // Makes sure |*frame| can hold |size| bytes, borrowing from |pool_| if set.
+  void ReserveFrame(std::unique_ptr<AllocatedFrameBuffer>* frame, size_t size);
+
+  FrameBufferPool* pool_;
 
   const FrameBuffer* source_frame_;
   // const V4L2FrameBuffer* source_frame_;
 
   // Temporary buffer for cropped and rotated results.
-  std::unique_ptr<uint8_t[]> cropped_buffer_;
-  size_t cropped_buffer_capacity_;
+  std::unique_ptr<AllocatedFrameBuffer> cropped_frame_;
 
   // Cache YU12 decoded results.
   std::unique_ptr<AllocatedFrameBuffer> yu12_frame_;
 
   // Temporary buffer for scaled results.
   std::unique_ptr<AllocatedFrameBuffer> scaled_frame_;
+  // Whether |scaled_frame_| holds the current source, so that several outputs
+  // of the same size only scale once.
+  bool scaled_frame_valid_;
 };
 
 }  // namespace arc
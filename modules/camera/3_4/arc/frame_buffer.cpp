@@ -57,6 +57,45 @@ int AllocatedFrameBuffer::SetDataSize(size_t size) {
   return 0;
 }
 
+int FrameBuffer::GetYuvLayout(YuvLayout* layout) const {
+  size_t y_size = width_ * height_;
+  layout->y = data_;
+  layout->y_stride = width_;
+  switch (fourcc_) {
+    case V4L2_PIX_FMT_YUV420:  // YU12
+      layout->cb = data_ + y_size;
+      layout->cr = layout->cb + y_size / 4;
+      layout->c_stride = width_ / 2;
+      layout->chroma_step = 1;
+      return 0;
+    case V4L2_PIX_FMT_YVU420: {  // YV12
+      // The stride of Y, U, and V planes is a multiple of 16 pixels.
+      layout->y_stride = (width_ + 15) & ~15;
+      layout->c_stride = (width_ / 2 + 15) & ~15;
+      layout->cr = data_ + layout->y_stride * height_;
+      layout->cb = layout->cr + layout->c_stride * height_ / 2;
+      layout->chroma_step = 1;
+      return 0;
+    }
+    case V4L2_PIX_FMT_NV12:
+      layout->cb = data_ + y_size;
+      layout->cr = layout->cb + 1;
+      layout->c_stride = width_;
+      layout->chroma_step = 2;
+      return 0;
+    case V4L2_PIX_FMT_NV21:
+      layout->cr = data_ + y_size;
+      layout->cb = layout->cr + 1;
+      layout->c_stride = width_;
+      layout->chroma_step = 2;
+      return 0;
+    default:
+      LOGF(ERROR) << "Pixel format " << FormatToString(fourcc_)
+                  << " is not YUV 4:2:0";
+      return -EINVAL;
+  }
+}
+
 void AllocatedFrameBuffer::Reset() { memset(data_, 0, buffer_size_); }
 
 V4L2FrameBuffer::V4L2FrameBuffer(base::ScopedFD fd, int buffer_size,
@@ -107,6 +146,7 @@ GrallocFrameBuffer::GrallocFrameBuffer(buffer_handle_t buffer, uint32_t width,
                                        uint32_t stream_usage)
     : buffer_(buffer),
       is_mapped_(false),
+      has_ycbcr_(false),
       device_buffer_length_(device_buffer_length),
       stream_usage_(stream_usage) {
   const hw_module_t* module = nullptr;
@@ -139,11 +179,13 @@ int GrallocFrameBuffer::Map() {
   switch (fourcc_) {
     case V4L2_PIX_FMT_YUV420:
     case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
     case V4L2_PIX_FMT_YUYV:
-      android_ycbcr yuv_data;
       ret = gralloc_module_->lock_ycbcr(gralloc_module_, buffer_, stream_usage_,
-                                        0, 0, width_, height_, &yuv_data);
-      addr = yuv_data.y;
+                                        0, 0, width_, height_, &ycbcr_);
+      has_ycbcr_ = ret == 0;
+      addr = ycbcr_.y;
       break;
     case V4L2_PIX_FMT_JPEG:
       ret = gralloc_module_->lock(gralloc_module_, buffer_, stream_usage_, 0, 0,
@@ -165,9 +207,13 @@ int GrallocFrameBuffer::Map() {
 
   data_ = static_cast<uint8_t*>(addr);
   if (fourcc_ == V4L2_PIX_FMT_YVU420 || fourcc_ == V4L2_PIX_FMT_YUV420 ||
-      fourcc_ == V4L2_PIX_FMT_NV21 || fourcc_ == V4L2_PIX_FMT_RGB32 ||
-      fourcc_ == V4L2_PIX_FMT_BGR32) {
+      fourcc_ == V4L2_PIX_FMT_NV12 || fourcc_ == V4L2_PIX_FMT_NV21 ||
+      fourcc_ == V4L2_PIX_FMT_RGB32 || fourcc_ == V4L2_PIX_FMT_BGR32) {
     buffer_size_ = ImageProcessor::GetConvertedSize(fourcc_, width_, height_);
+  } else if (fourcc_ == V4L2_PIX_FMT_JPEG) {
+    // The whole BLOB buffer is locked, so JPEG data can be encoded into it
+    // directly.
+    buffer_size_ = device_buffer_length_;
   }
 
   is_mapped_ = true;
@@ -181,6 +227,20 @@ int GrallocFrameBuffer::Unmap() {
     return -EINVAL;
   }
   is_mapped_ = false;
+  has_ycbcr_ = false;
+  return 0;
+}
+
+int GrallocFrameBuffer::GetYuvLayout(YuvLayout* layout) const {
+  if (!has_ycbcr_ || fourcc_ == V4L2_PIX_FMT_YUYV) {
+    return FrameBuffer::GetYuvLayout(layout);
+  }
+  layout->y = static_cast<uint8_t*>(ycbcr_.y);
+  layout->cb = static_cast<uint8_t*>(ycbcr_.cb);
+  layout->cr = static_cast<uint8_t*>(ycbcr_.cr);
+  layout->y_stride = ycbcr_.ystride;
+  layout->c_stride = ycbcr_.cstride;
+  layout->chroma_step = ycbcr_.chroma_step;
   return 0;
 }
 
@@ -15,6 +15,18 @@
 
 namespace arc {
 
+// Where the planes of a YUV 4:2:0 frame are. Consecutive chroma samples of a
+// plane are |chroma_step| bytes apart: 1 for planar layouts and 2 for
+// semi-planar ones, where |cb| and |cr| are interleaved.
+struct YuvLayout {
+  uint8_t* y;
+  uint8_t* cb;
+  uint8_t* cr;
+  int y_stride;
+  int c_stride;
+  int chroma_step;
+};
+
 class FrameBuffer {
  public:
   FrameBuffer();
@@ -37,6 +49,11 @@ class FrameBuffer {
   void SetFourcc(uint32_t fourcc) { fourcc_ = fourcc; }
   virtual int SetDataSize(size_t data_size);
 
+  // Fills |layout| for a YUV 4:2:0 |fourcc_|. By default that is the tightly
+  // packed layout ImageProcessor::GetConvertedSize() assumes. Returns -EINVAL
+  // for other formats.
+  virtual int GetYuvLayout(YuvLayout* layout) const;
+
  protected:
   uint8_t* data_;
 
@@ -109,6 +126,9 @@ class GrallocFrameBuffer : public FrameBuffer {
 
   int Map() override;
   int Unmap() override;
+  // The layout gralloc locked the buffer with, which may have padded strides
+  // or interleaved chroma whatever |fourcc_| is.
+  int GetYuvLayout(YuvLayout* layout) const override;
 
  private:
   // The currently used buffer for |buffer_mapper_| operations.
@@ -118,6 +138,9 @@ class GrallocFrameBuffer : public FrameBuffer {
   const gralloc_module_t* gralloc_module_;
 
   bool is_mapped_;
+  // The planes, if the buffer is locked with lock_ycbcr().
+  bool has_ycbcr_;
+  android_ycbcr ycbcr_;
 
   // Lock to guard |is_mapped_|.
   base::Lock lock_;
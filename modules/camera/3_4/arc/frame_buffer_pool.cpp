@@ -0,0 +1,83 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/frame_buffer_pool.h"
+
+#include <utility>
+
+#include "arc/common.h"
+
+namespace arc {
+
+FrameBufferPool::FrameBufferPool() : stats_() {}
+
+FrameBufferPool::~FrameBufferPool() {}
+
+void FrameBufferPool::Reserve(const std::vector<size_t>& buffer_sizes,
+                              size_t count) {
+  base::AutoLock l(lock_);
+  buffers_.clear();
+  for (size_t size : buffer_sizes) {
+    for (size_t i = 0; i < count; ++i) {
+      buffers_.emplace(
+          size, std::unique_ptr<AllocatedFrameBuffer>(
+                    new AllocatedFrameBuffer(size)));
+      stats_.reserved++;
+      stats_.reserved_bytes += size;
+    }
+  }
+  VLOGF(1) << "Reserved " << buffers_.size() << " conversion buffers";
+}
+
+std::unique_ptr<AllocatedFrameBuffer> FrameBufferPool::Acquire(size_t size) {
+  std::unique_ptr<AllocatedFrameBuffer> buffer;
+  {
+    base::AutoLock l(lock_);
+    stats_.acquired++;
+    auto it = buffers_.lower_bound(size);
+    if (it != buffers_.end()) {
+      buffer = std::move(it->second);
+      buffers_.erase(it);
+    } else {
+      stats_.allocated++;
+      stats_.allocated_bytes += size;
+    }
+  }
+  if (!buffer) {
+    VLOGF(1) << "No pooled buffer fits " << size << " bytes, allocating";
+    buffer.reset(new AllocatedFrameBuffer(size));
+  }
+  buffer->SetDataSize(size);
+  return buffer;
+}
+
+void FrameBufferPool::Release(std::unique_ptr<AllocatedFrameBuffer> buffer) {
+  if (!buffer) {
+    return;
+  }
+  base::AutoLock l(lock_);
+  size_t capacity = buffer->GetBufferSize();
+  buffers_.emplace(capacity, std::move(buffer));
+}
+
+FrameBufferPool::Stats FrameBufferPool::GetStats() const {
+  base::AutoLock l(lock_);
+  Stats stats = stats_;
+  stats.pooled = buffers_.size();
+  return stats;
+}
+
+}  // namespace arc
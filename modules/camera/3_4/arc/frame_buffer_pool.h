@@ -0,0 +1,76 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HAL_USB_FRAME_BUFFER_POOL_H_
+#define HAL_USB_FRAME_BUFFER_POOL_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <base/synchronization/lock.h>
+
+#include "arc/frame_buffer.h"
+
+namespace arc {
+
+// FrameBufferPool keeps intermediate conversion buffers alive between frames,
+// so that once the pool is reserved for the configured streams converting a
+// frame doesn't touch the heap. This class is thread-safe.
+class FrameBufferPool {
+ public:
+  struct Stats {
+    // Buffers handed out by Acquire().
+    uint64_t acquired;
+    // Buffers Acquire() had to allocate because none in the pool fit.
+    uint64_t allocated;
+    uint64_t allocated_bytes;
+    // Buffers allocated up front by Reserve().
+    uint64_t reserved;
+    uint64_t reserved_bytes;
+    // Buffers currently idle in the pool.
+    size_t pooled;
+  };
+
+  FrameBufferPool();
+  ~FrameBufferPool();
+
+  // Drops all pooled buffers and allocates |count| buffers for each size in
+  // |buffer_sizes|. Buffers currently borrowed are kept when released.
+  void Reserve(const std::vector<size_t>& buffer_sizes, size_t count);
+
+  // Borrows the smallest pooled buffer of at least |size| bytes, allocating a
+  // new one only if none fits. The data size of the buffer is set to |size|.
+  std::unique_ptr<AllocatedFrameBuffer> Acquire(size_t size);
+
+  // Returns a buffer from Acquire() to the pool.
+  void Release(std::unique_ptr<AllocatedFrameBuffer> buffer);
+
+  Stats GetStats() const;
+
+ private:
+  // Idle buffers, keyed by capacity.
+  std::multimap<size_t, std::unique_ptr<AllocatedFrameBuffer>> buffers_;
+  Stats stats_;
+
+  // Lock to guard |buffers_| and |stats_|.
+  mutable base::Lock lock_;
+};
+
+}  // namespace arc
+
+#endif  // HAL_USB_FRAME_BUFFER_POOL_H_
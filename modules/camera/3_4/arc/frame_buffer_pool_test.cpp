@@ -0,0 +1,73 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/frame_buffer_pool.h"
+
+#include <gtest/gtest.h>
+
+using testing::Test;
+
+namespace arc {
+
+class FrameBufferPoolTest : public Test {
+ protected:
+  FrameBufferPool dut_;
+};
+
+TEST_F(FrameBufferPoolTest, ReservedBuffersAreReused) {
+  dut_.Reserve({100, 200}, 1);
+
+  std::unique_ptr<AllocatedFrameBuffer> small = dut_.Acquire(50);
+  std::unique_ptr<AllocatedFrameBuffer> large = dut_.Acquire(150);
+  // Smallest fitting buffer first.
+  EXPECT_EQ(small->GetBufferSize(), 100u);
+  EXPECT_EQ(small->GetDataSize(), 50u);
+  EXPECT_EQ(large->GetBufferSize(), 200u);
+  dut_.Release(std::move(small));
+  dut_.Release(std::move(large));
+
+  FrameBufferPool::Stats stats = dut_.GetStats();
+  EXPECT_EQ(stats.acquired, 2u);
+  EXPECT_EQ(stats.allocated, 0u);
+  EXPECT_EQ(stats.reserved, 2u);
+  EXPECT_EQ(stats.reserved_bytes, 300u);
+  EXPECT_EQ(stats.pooled, 2u);
+}
+
+TEST_F(FrameBufferPoolTest, AllocatesWhenNothingFits) {
+  dut_.Reserve({100}, 1);
+
+  std::unique_ptr<AllocatedFrameBuffer> buffer = dut_.Acquire(300);
+  EXPECT_GE(buffer->GetBufferSize(), 300u);
+  FrameBufferPool::Stats stats = dut_.GetStats();
+  EXPECT_EQ(stats.allocated, 1u);
+  EXPECT_EQ(stats.allocated_bytes, 300u);
+  EXPECT_EQ(stats.pooled, 1u);
+
+  // The new buffer is kept for next time.
+  dut_.Release(std::move(buffer));
+  buffer = dut_.Acquire(300);
+  EXPECT_EQ(dut_.GetStats().allocated, 1u);
+  dut_.Release(std::move(buffer));
+}
+
+TEST_F(FrameBufferPoolTest, ReserveReplacesIdleBuffers) {
+  dut_.Reserve({100}, 2);
+  dut_.Reserve({50}, 1);
+  EXPECT_EQ(dut_.GetStats().pooled, 1u);
+}
+
+}  // namespace arc
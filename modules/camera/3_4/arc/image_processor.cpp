@@ -9,10 +9,13 @@
 #include <ctime>
 #include <string>
 
+#include <hardware/camera3.h>
 #include <libyuv.h>
 #include "arc/common.h"
 #include "arc/exif_utils.h"
 #include "arc/jpeg_compressor.h"
+#include "arc/jpeg_decompressor.h"
+#include "arc/parallel_jpeg_compressor.h"
 
 namespace arc {
 
@@ -52,11 +55,16 @@ using android::CameraMetadata;
 
 // YV12 horizontal stride should be a multiple of 16 pixels for each plane.
 // |dst_stride_uv| is the pixel stride of u or v plane.
-static int YU12ToYV12(const void* yv12, void* yu12, int width, int height,
-                      int dst_stride_y, int dst_stride_uv);
-static int YU12ToNV21(const void* yv12, void* nv21, int width, int height);
+static int I420ToFrame(const uint8_t* src_y, int src_stride_y,
+                       const uint8_t* src_u, const uint8_t* src_v,
+                       int src_stride_uv, FrameBuffer* out_frame);
+static int I420ToLayout(const uint8_t* src_y, int src_stride_y,
+                        const uint8_t* src_u, const uint8_t* src_v,
+                        int src_stride_uv, const YuvLayout& dst, int width,
+                        int height);
 static bool ConvertToJpeg(const CameraMetadata& metadata,
-                          const FrameBuffer& in_frame, FrameBuffer* out_frame);
+                          const FrameBuffer& in_frame, FrameBuffer* out_frame,
+                          FrameBufferPool* pool);
 static bool SetExifTags(const CameraMetadata& metadata, ExifUtils* utils);
 
 // How precise the float-to-rational conversion for EXIF tags would be.
@@ -65,6 +73,10 @@ static const int kRationalPrecision = 10000;
 // Default JPEG quality settings.
 static const int DEFAULT_JPEG_QUALITY = 80;
 
+// Images of at least this many pixels are JPEG compressed in parallel strips.
+static const uint32_t kParallelJpegMinPixels = 1920 * 1080;
+static const int kNumJpegStrips = 4;
+
 inline static size_t Align16(size_t value) { return (value + 15) & ~15; }
 
 size_t ImageProcessor::GetConvertedSize(int fourcc, uint32_t width,
@@ -80,6 +92,8 @@ size_t ImageProcessor::GetConvertedSize(int fourcc, uint32_t width,
       return Align16(width) * height + Align16(width / 2) * height;
     case V4L2_PIX_FMT_YUV420:  // YU12
     // Fall-through.
+    case V4L2_PIX_FMT_NV12:  // NV12
+    // Fall-through.
     case V4L2_PIX_FMT_NV21:  // NV21
       return width * height * 3 / 2;
     case V4L2_PIX_FMT_BGR32:
@@ -102,9 +116,9 @@ bool ImageProcessor::SupportsConversion(uint32_t from_fourcc,
     case V4L2_PIX_FMT_YUV420:
       return (
           to_fourcc == V4L2_PIX_FMT_YUV420 ||
-          to_fourcc == V4L2_PIX_FMT_YVU420 || to_fourcc == V4L2_PIX_FMT_NV21 ||
-          to_fourcc == V4L2_PIX_FMT_RGB32 || to_fourcc == V4L2_PIX_FMT_BGR32 ||
-          to_fourcc == V4L2_PIX_FMT_JPEG);
+          to_fourcc == V4L2_PIX_FMT_YVU420 || to_fourcc == V4L2_PIX_FMT_NV12 ||
+          to_fourcc == V4L2_PIX_FMT_NV21 || to_fourcc == V4L2_PIX_FMT_RGB32 ||
+          to_fourcc == V4L2_PIX_FMT_BGR32 || to_fourcc == V4L2_PIX_FMT_JPEG);
     case V4L2_PIX_FMT_MJPEG:
       return (to_fourcc == V4L2_PIX_FMT_YUV420);
     default:
@@ -114,7 +128,8 @@ bool ImageProcessor::SupportsConversion(uint32_t from_fourcc,
 
 int ImageProcessor::ConvertFormat(const CameraMetadata& metadata,
                                   const FrameBuffer& in_frame,
-                                  FrameBuffer* out_frame) {
+                                  FrameBuffer* out_frame,
+                                  FrameBufferPool* pool) {
   if ((in_frame.GetWidth() % 2) || (in_frame.GetHeight() % 2)) {
     LOGF(ERROR) << "Width or height is not even (" << in_frame.GetWidth()
                 << " x " << in_frame.GetHeight() << ")";
@@ -161,65 +176,22 @@ int ImageProcessor::ConvertFormat(const CameraMetadata& metadata,
     // planes are swapped.
     switch (out_frame->GetFourcc()) {
       case V4L2_PIX_FMT_YVU420:  // YV12
-      {
-        int ystride = Align16(in_frame.GetWidth());
-        int uvstride = Align16(in_frame.GetWidth() / 2);
-        int res = YU12ToYV12(in_frame.GetData(), out_frame->GetData(),
-                             in_frame.GetWidth(), in_frame.GetHeight(), ystride,
-                             uvstride);
-        LOGF_IF(ERROR, res) << "YU12ToYV12() returns " << res;
-        return res ? -EINVAL : 0;
-      }
       case V4L2_PIX_FMT_YUV420:  // YU12
-      {
-        memcpy(out_frame->GetData(), in_frame.GetData(),
-               in_frame.GetDataSize());
-        return 0;
-      }
-      case V4L2_PIX_FMT_NV21:  // NV21
-      {
-        // TODO(henryhsu): Use libyuv::I420ToNV21.
-        int res = YU12ToNV21(in_frame.GetData(), out_frame->GetData(),
-                             in_frame.GetWidth(), in_frame.GetHeight());
-        LOGF_IF(ERROR, res) << "YU12ToNV21() returns " << res;
-        return res ? -EINVAL : 0;
-      }
-      case V4L2_PIX_FMT_BGR32: {
-        int res = libyuv::I420ToABGR(
-            in_frame.GetData(),  /* src_y */
-            in_frame.GetWidth(), /* src_stride_y */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight(), /* src_u */
-            in_frame.GetWidth() / 2,                        /* src_stride_u */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight() * 5 / 4, /* src_v */
-            in_frame.GetWidth() / 2,   /* src_stride_v */
-            out_frame->GetData(),      /* dst_abgr */
-            out_frame->GetWidth() * 4, /* dst_stride_abgr */
-            in_frame.GetWidth(), in_frame.GetHeight());
-        LOGF_IF(ERROR, res) << "I420ToABGR() returns " << res;
-        return res ? -EINVAL : 0;
-      }
+      case V4L2_PIX_FMT_NV12:
+      case V4L2_PIX_FMT_NV21:
+      case V4L2_PIX_FMT_BGR32:
       case V4L2_PIX_FMT_RGB32: {
-        int res = libyuv::I420ToARGB(
-            in_frame.GetData(),  /* src_y */
-            in_frame.GetWidth(), /* src_stride_y */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight(), /* src_u */
-            in_frame.GetWidth() / 2,                        /* src_stride_u */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight() * 5 / 4, /* src_v */
-            in_frame.GetWidth() / 2,   /* src_stride_v */
-            out_frame->GetData(),      /* dst_argb */
-            out_frame->GetWidth() * 4, /* dst_stride_argb */
-            in_frame.GetWidth(), in_frame.GetHeight());
-        LOGF_IF(ERROR, res) << "I420ToARGB() returns " << res;
-        return res ? -EINVAL : 0;
+        YuvLayout src;
+        if (in_frame.GetYuvLayout(&src)) {
+          return -EINVAL;
+        }
+        return I420ToFrame(src.y, src.y_stride, src.cb, src.cr, src.c_stride,
+                           out_frame);
       }
       case V4L2_PIX_FMT_JPEG: {
-        bool res = ConvertToJpeg(metadata, in_frame, out_frame);
+        bool res = ConvertToJpeg(metadata, in_frame, out_frame, pool);
         LOGF_IF(ERROR, !res) << "ConvertToJpeg() returns " << res;
-        return res ? -EINVAL : 0;
+        return res ? 0 : -EINVAL;
       }
       default:
         LOGF(ERROR) << "Destination pixel format "
@@ -298,58 +270,167 @@ int ImageProcessor::Scale(const FrameBuffer& in_frame, FrameBuffer* out_frame) {
   return ret;
 }
 
-static int YU12ToYV12(const void* yu12, void* yv12, int width, int height,
-                      int dst_stride_y, int dst_stride_uv) {
-  if ((width % 2) || (height % 2)) {
-    LOGF(ERROR) << "Width or height is not even (" << width << " x " << height
-                << ")";
-    return -EINVAL;
+int ImageProcessor::DecodeMjpeg(const FrameBuffer& in_frame,
+                                FrameBuffer* out_frame,
+                                FrameBufferPool* pool) {
+  uint32_t fourcc = out_frame->GetFourcc();
+  if (in_frame.GetFourcc() != V4L2_PIX_FMT_MJPEG ||
+      fourcc == V4L2_PIX_FMT_JPEG ||
+      !SupportsConversion(V4L2_PIX_FMT_YUV420, fourcc)) {
+    return -ENOTSUP;
   }
-  if (dst_stride_y < width || dst_stride_uv < width / 2) {
-    LOGF(ERROR) << "Y plane stride (" << dst_stride_y
-                << ") or U/V plane stride (" << dst_stride_uv
-                << ") is invalid for width " << width;
+  size_t data_size = GetConvertedSize(fourcc, out_frame->GetWidth(),
+                                      out_frame->GetHeight());
+  if (data_size == 0 || out_frame->SetDataSize(data_size)) {
+    LOGF(ERROR) << "Set data size failed";
     return -EINVAL;
   }
 
-  const uint8_t* src = reinterpret_cast<const uint8_t*>(yu12);
-  uint8_t* dst = reinterpret_cast<uint8_t*>(yv12);
-  const uint8_t* u_src = src + width * height;
-  uint8_t* u_dst = dst + dst_stride_y * height + dst_stride_uv * height / 2;
-  const uint8_t* v_src = src + width * height * 5 / 4;
-  uint8_t* v_dst = dst + dst_stride_y * height;
+  JpegDecompressor decompressor(pool);
+  if (!decompressor.Decompress(in_frame.GetData(), in_frame.GetDataSize(),
+                               out_frame->GetWidth(),
+                               out_frame->GetHeight())) {
+    return -ENOTSUP;
+  }
+  if (decompressor.GetWidth() == out_frame->GetWidth() &&
+      decompressor.GetHeight() == out_frame->GetHeight()) {
+    return I420ToFrame(decompressor.GetY(), decompressor.GetYStride(),
+                       decompressor.GetU(), decompressor.GetV(),
+                       decompressor.GetUVStride(), out_frame);
+  }
 
-  return libyuv::I420Copy(src, width, u_src, width / 2, v_src, width / 2, dst,
-                          dst_stride_y, u_dst, dst_stride_uv, v_dst,
-                          dst_stride_uv, width, height);
+  // DCT scaling only goes in powers of two; scale the rest of the way, into
+  // the output directly if it is YU12.
+  uint32_t width = out_frame->GetWidth();
+  uint32_t height = out_frame->GetHeight();
+  std::unique_ptr<AllocatedFrameBuffer> scaled;
+  uint8_t* scaled_data = out_frame->GetData();
+  if (fourcc != V4L2_PIX_FMT_YUV420) {
+    size_t scaled_size = GetConvertedSize(V4L2_PIX_FMT_YUV420, width, height);
+    if (pool) {
+      scaled = pool->Acquire(scaled_size);
+    } else {
+      scaled.reset(new AllocatedFrameBuffer(scaled_size));
+    }
+    scaled_data = scaled->GetData();
+  }
+  int res = libyuv::I420Scale(
+      decompressor.GetY(), decompressor.GetYStride(), decompressor.GetU(),
+      decompressor.GetUVStride(), decompressor.GetV(),
+      decompressor.GetUVStride(), decompressor.GetWidth(),
+      decompressor.GetHeight(), scaled_data, width,
+      scaled_data + width * height, width / 2,
+      scaled_data + width * height * 5 / 4, width / 2, width, height,
+      libyuv::FilterMode::kFilterNone);
+  if (res) {
+    LOGF(ERROR) << "I420Scale failed: " << res;
+  } else if (scaled) {
+    res = I420ToFrame(scaled_data, width, scaled_data + width * height,
+                      scaled_data + width * height * 5 / 4, width / 2,
+                      out_frame);
+  }
+  if (pool) {
+    pool->Release(std::move(scaled));
+  }
+  return res ? -EINVAL : 0;
 }
 
-static int YU12ToNV21(const void* yu12, void* nv21, int width, int height) {
+// Writes the I420 planes, which are the size of |out_frame|, to |out_frame| in
+// its format. YUV frames are written with the plane layout they report, so
+// padded or interleaved gralloc buffers are filled in place.
+static int I420ToFrame(const uint8_t* src_y, int src_stride_y,
+                       const uint8_t* src_u, const uint8_t* src_v,
+                       int src_stride_uv, FrameBuffer* out_frame) {
+  int width = out_frame->GetWidth();
+  int height = out_frame->GetHeight();
   if ((width % 2) || (height % 2)) {
     LOGF(ERROR) << "Width or height is not even (" << width << " x " << height
                 << ")";
     return -EINVAL;
   }
+  int res;
+  switch (out_frame->GetFourcc()) {
+    case V4L2_PIX_FMT_YVU420:  // YV12
+    case V4L2_PIX_FMT_YUV420:  // YU12
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21: {
+      YuvLayout dst;
+      if (out_frame->GetYuvLayout(&dst)) {
+        return -EINVAL;
+      }
+      return I420ToLayout(src_y, src_stride_y, src_u, src_v, src_stride_uv,
+                          dst, width, height);
+    }
+    case V4L2_PIX_FMT_BGR32:
+      res = libyuv::I420ToABGR(src_y, src_stride_y, src_u, src_stride_uv, src_v,
+                               src_stride_uv, out_frame->GetData(), width * 4,
+                               width, height);
+      break;
+    case V4L2_PIX_FMT_RGB32:
+      res = libyuv::I420ToARGB(src_y, src_stride_y, src_u, src_stride_uv, src_v,
+                               src_stride_uv, out_frame->GetData(), width * 4,
+                               width, height);
+      break;
+    default:
+      LOGF(ERROR) << "Destination pixel format "
+                  << FormatToString(out_frame->GetFourcc())
+                  << " is unsupported for I420 planes.";
+      return -EINVAL;
+  }
+  LOGF_IF(ERROR, res) << "Converting I420 planes to "
+                      << FormatToString(out_frame->GetFourcc())
+                      << " returns " << res;
+  return res ? -EINVAL : 0;
+}
 
-  const uint8_t* src = reinterpret_cast<const uint8_t*>(yu12);
-  uint8_t* dst = reinterpret_cast<uint8_t*>(nv21);
-  const uint8_t* u_src = src + width * height;
-  const uint8_t* v_src = src + width * height * 5 / 4;
-  uint8_t* vu_dst = dst + width * height;
-
-  memcpy(dst, src, width * height);
+// Writes the I420 planes to the |width|x|height| YUV 4:2:0 frame |dst|. The
+// common planar and semi-planar layouts use libyuv's SIMD row functions.
+static int I420ToLayout(const uint8_t* src_y, int src_stride_y,
+                        const uint8_t* src_u, const uint8_t* src_v,
+                        int src_stride_uv, const YuvLayout& dst, int width,
+                        int height) {
+  if (dst.y_stride < width || dst.c_stride < width / 2 * dst.chroma_step) {
+    LOGF(ERROR) << "Y plane stride (" << dst.y_stride
+                << ") or chroma plane stride (" << dst.c_stride
+                << ") is invalid for width " << width;
+    return -EINVAL;
+  }
 
-  for (int i = 0; i < height / 2; i++) {
-    for (int j = 0; j < width / 2; j++) {
-      *vu_dst++ = *v_src++;
-      *vu_dst++ = *u_src++;
+  int res;
+  if (dst.chroma_step == 1) {
+    res = libyuv::I420Copy(src_y, src_stride_y, src_u, src_stride_uv, src_v,
+                           src_stride_uv, dst.y, dst.y_stride, dst.cb,
+                           dst.c_stride, dst.cr, dst.c_stride, width, height);
+  } else if (dst.chroma_step == 2 && dst.cr == dst.cb + 1) {
+    res = libyuv::I420ToNV12(src_y, src_stride_y, src_u, src_stride_uv, src_v,
+                             src_stride_uv, dst.y, dst.y_stride, dst.cb,
+                             dst.c_stride, width, height);
+  } else if (dst.chroma_step == 2 && dst.cb == dst.cr + 1) {
+    res = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_uv, src_v,
+                             src_stride_uv, dst.y, dst.y_stride, dst.cr,
+                             dst.c_stride, width, height);
+  } else {
+    // Some other arrangement; place the chroma samples one by one.
+    libyuv::CopyPlane(src_y, src_stride_y, dst.y, dst.y_stride, width, height);
+    for (int row = 0; row < height / 2; ++row) {
+      const uint8_t* u = src_u + row * src_stride_uv;
+      const uint8_t* v = src_v + row * src_stride_uv;
+      uint8_t* cb = dst.cb + row * dst.c_stride;
+      uint8_t* cr = dst.cr + row * dst.c_stride;
+      for (int col = 0; col < width / 2; ++col) {
+        cb[col * dst.chroma_step] = u[col];
+        cr[col * dst.chroma_step] = v[col];
+      }
     }
+    res = 0;
   }
-  return 0;
+  LOGF_IF(ERROR, res) << "Converting I420 planes returns " << res;
+  return res ? -EINVAL : 0;
 }
 
 static bool ConvertToJpeg(const CameraMetadata& metadata,
-                          const FrameBuffer& in_frame, FrameBuffer* out_frame) {
+                          const FrameBuffer& in_frame, FrameBuffer* out_frame,
+                          FrameBufferPool* pool) {
   ExifUtils utils;
   int jpeg_quality, thumbnail_jpeg_quality;
   camera_metadata_ro_entry entry;
@@ -369,6 +450,29 @@ static bool ConvertToJpeg(const CameraMetadata& metadata,
     thumbnail_jpeg_quality = jpeg_quality;
   }
 
+  // The framework expects a camera3_jpeg_blob_t at the very end of the BLOB
+  // buffer; everything before it is available for the image, so encode
+  // straight into it.
+  size_t buffer_size = out_frame->GetBufferSize();
+  if (buffer_size < sizeof(camera3_jpeg_blob_t)) {
+    LOGF(ERROR) << "JPEG buffer of " << buffer_size << " bytes is too small";
+    return false;
+  }
+  size_t capacity = buffer_size - sizeof(camera3_jpeg_blob_t);
+
+  // Large images are compressed in strips on worker threads, while the
+  // thumbnail and the rest of the EXIF data are generated here.
+  ParallelJpegCompressor parallel_compressor(pool);
+  bool parallel = in_frame.GetWidth() * in_frame.GetHeight() >=
+                  kParallelJpegMinPixels;
+  if (parallel &&
+      !parallel_compressor.Start(in_frame.GetData(), in_frame.GetWidth(),
+                                 in_frame.GetHeight(), jpeg_quality,
+                                 kNumJpegStrips)) {
+    LOGF(ERROR) << "Starting JPEG image compression failed";
+    return false;
+  }
+
   if (!utils.Initialize(in_frame.GetData(), in_frame.GetWidth(),
                         in_frame.GetHeight(), thumbnail_jpeg_quality)) {
     LOGF(ERROR) << "ExifUtils initialization failed.";
@@ -382,19 +486,40 @@ static bool ConvertToJpeg(const CameraMetadata& metadata,
     LOGF(ERROR) << "Generating APP1 segment failed.";
     return false;
   }
-  JpegCompressor compressor;
-  if (!compressor.CompressImage(in_frame.GetData(), in_frame.GetWidth(),
-                                in_frame.GetHeight(), jpeg_quality,
-                                utils.GetApp1Buffer(), utils.GetApp1Length())) {
-    LOGF(ERROR) << "JPEG image compression failed";
-    return false;
+  size_t jpeg_size;
+  if (parallel) {
+    if (!parallel_compressor.Finish(utils.GetApp1Buffer(),
+                                    utils.GetApp1Length(),
+                                    out_frame->GetData(), capacity,
+                                    &jpeg_size)) {
+      LOGF(ERROR) << "JPEG image compression failed";
+      return false;
+    }
+  } else {
+    JpegCompressor compressor(pool);
+    if (!compressor.CompressImage(in_frame.GetData(), in_frame.GetWidth(),
+                                  in_frame.GetHeight(), jpeg_quality,
+                                  utils.GetApp1Buffer(),
+                                  utils.GetApp1Length(), out_frame->GetData(),
+                                  capacity)) {
+      LOGF(ERROR) << "JPEG image compression failed";
+      return false;
+    }
+    jpeg_size = compressor.GetCompressedImageSize();
+    if (!compressor.IsCompressedInPlace()) {
+      LOGF(ERROR) << "JPEG image of " << jpeg_size
+                  << " bytes does not fit in the " << capacity
+                  << " bytes available";
+      return false;
+    }
   }
-  size_t buffer_length = compressor.GetCompressedImageSize();
-  if (out_frame->SetDataSize(buffer_length)) {
+  if (out_frame->SetDataSize(buffer_size)) {
     return false;
   }
-  memcpy(out_frame->GetData(), compressor.GetCompressedImagePtr(),
-         buffer_length);
+  camera3_jpeg_blob_t blob;
+  blob.jpeg_blob_id = CAMERA3_JPEG_BLOB_ID;
+  blob.jpeg_size = jpeg_size;
+  memcpy(out_frame->GetData() + capacity, &blob, sizeof(blob));
   return true;
 }
 
@@ -13,6 +13,7 @@
 #include <system/graphics.h>
 
 #include "frame_buffer.h"
+#include "frame_buffer_pool.h"
 
 namespace arc {
 
@@ -29,16 +30,28 @@ struct ImageProcessor {
 
   // Convert format from |in_frame.fourcc| to |out_frame->fourcc|. Caller should
   // fill |data|, |buffer_size|, |width|, and |height| of |out_frame|. The
-  // function will fill |out_frame->data_size|. Return non-zero error code on
-  // failure; return 0 on success.
+  // function will fill |out_frame->data_size|. Any scratch buffers needed
+  // (e.g. for JPEG encoding) are borrowed from |pool| if given. Return non-zero
+  // error code on failure; return 0 on success.
   static int ConvertFormat(const android::CameraMetadata& metadata,
-                           const FrameBuffer& in_frame, FrameBuffer* out_frame);
+                           const FrameBuffer& in_frame, FrameBuffer* out_frame,
+                           FrameBufferPool* pool = nullptr);
 
   // Scale image size according to |in_frame| and |out_frame|. Only support
   // V4L2_PIX_FMT_YUV420 format. Caller should fill |data|, |width|, |height|,
   // and |buffer_size| of |out_frame|. The function will fill |data_size| and
   // |fourcc| of |out_frame|.
   static int Scale(const FrameBuffer& in_frame, FrameBuffer* out_frame);
+
+  // Decode the V4L2_PIX_FMT_MJPEG |in_frame| straight into |out_frame|, which
+  // may be smaller and in any YUV or RGB format ConvertFormat() produces from
+  // YU12. The image is shrunk by DCT scaling while decoding where possible,
+  // and scaled the rest of the way. Caller should fill |data|, |buffer_size|,
+  // |width|, |height| and |fourcc| of |out_frame|. Scratch buffers are borrowed
+  // from |pool| if given. Return -ENOTSUP if the frame or conversion can't be
+  // handled this way, so the caller can decode to YU12 first instead.
+  static int DecodeMjpeg(const FrameBuffer& in_frame, FrameBuffer* out_frame,
+                         FrameBufferPool* pool = nullptr);
 };
 
 }  // namespace arc
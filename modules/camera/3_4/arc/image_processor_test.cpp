@@ -0,0 +1,197 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/image_processor.h"
+
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <hardware/camera3.h>
+#include "stream_format.h"
+
+using android::CameraMetadata;
+using testing::Test;
+
+namespace arc {
+
+// A frame with padded rows and a caller-chosen chroma arrangement, like the
+// ones gralloc hands out.
+class PaddedFrameBuffer : public FrameBuffer {
+ public:
+  PaddedFrameBuffer(uint32_t width, uint32_t height, uint32_t fourcc,
+                    int stride, int chroma_step, bool cb_first)
+      : memory_(stride * height * 2, 0xEE) {
+    width_ = width;
+    height_ = height;
+    fourcc_ = fourcc;
+    data_ = memory_.data();
+    buffer_size_ = memory_.size();
+    layout_.y = data_;
+    layout_.y_stride = stride;
+    layout_.c_stride = stride;
+    layout_.chroma_step = chroma_step;
+    uint8_t* chroma = data_ + stride * height;
+    uint8_t* second =
+        chroma_step == 2 ? chroma + 1 : chroma + stride * height / 2;
+    layout_.cb = cb_first ? chroma : second;
+    layout_.cr = cb_first ? second : chroma;
+  }
+
+  int Map() override { return 0; }
+  int Unmap() override { return 0; }
+  int GetYuvLayout(YuvLayout* layout) const override {
+    *layout = layout_;
+    return 0;
+  }
+
+  const YuvLayout& layout() const { return layout_; }
+
+ private:
+  std::vector<uint8_t> memory_;
+  YuvLayout layout_;
+};
+
+// A buffer at the start of a larger allocation whose remainder is left
+// untouched, to catch writes past the end of the buffer.
+class GuardedFrameBuffer : public FrameBuffer {
+ public:
+  GuardedFrameBuffer(uint32_t width, uint32_t height, uint32_t fourcc,
+                     size_t buffer_size, size_t guard_size)
+      : memory_(buffer_size + guard_size, 0xEE) {
+    width_ = width;
+    height_ = height;
+    fourcc_ = fourcc;
+    data_ = memory_.data();
+    buffer_size_ = buffer_size;
+  }
+
+  int Map() override { return 0; }
+  int Unmap() override { return 0; }
+
+  const std::vector<uint8_t>& memory() const { return memory_; }
+
+ private:
+  std::vector<uint8_t> memory_;
+};
+
+class ImageProcessorTest : public Test {
+ protected:
+  static const int kWidth = 8;
+  static const int kHeight = 4;
+  static const int kStride = 32;
+
+  ImageProcessorTest() : yu12_(kWidth * kHeight * 3 / 2) {
+    yu12_.SetWidth(kWidth);
+    yu12_.SetHeight(kHeight);
+    yu12_.SetFourcc(V4L2_PIX_FMT_YUV420);
+    yu12_.SetDataSize(kWidth * kHeight * 3 / 2);
+    uint8_t* data = yu12_.GetData();
+    for (int i = 0; i < kWidth * kHeight; ++i) {
+      data[i] = i;  // Y
+    }
+    for (int i = 0; i < kWidth * kHeight / 4; ++i) {
+      data[kWidth * kHeight + i] = 100 + i;          // U
+      data[kWidth * kHeight * 5 / 4 + i] = 200 + i;  // V
+    }
+  }
+
+  // Checks |frame| holds |yu12_| and nothing was written to the padding.
+  void ExpectConverted(const PaddedFrameBuffer& frame) {
+    const YuvLayout& layout = frame.layout();
+    for (int row = 0; row < kHeight; ++row) {
+      for (int col = 0; col < kWidth; ++col) {
+        EXPECT_EQ(layout.y[row * layout.y_stride + col], row * kWidth + col);
+      }
+      EXPECT_EQ(layout.y[row * layout.y_stride + kWidth], 0xEE);
+    }
+    for (int row = 0; row < kHeight / 2; ++row) {
+      for (int col = 0; col < kWidth / 2; ++col) {
+        int offset = row * layout.c_stride + col * layout.chroma_step;
+        EXPECT_EQ(layout.cb[offset], 100 + row * kWidth / 2 + col);
+        EXPECT_EQ(layout.cr[offset], 200 + row * kWidth / 2 + col);
+      }
+    }
+  }
+
+  AllocatedFrameBuffer yu12_;
+};
+
+TEST_F(ImageProcessorTest, PaddedPlanar) {
+  PaddedFrameBuffer dut(kWidth, kHeight, V4L2_PIX_FMT_YVU420, kStride, 1,
+                        false);
+  ASSERT_EQ(ImageProcessor::ConvertFormat(CameraMetadata(), yu12_, &dut), 0);
+  ExpectConverted(dut);
+}
+
+TEST_F(ImageProcessorTest, PaddedNV12) {
+  // A flexible YUV buffer that gralloc allocated as NV12.
+  PaddedFrameBuffer dut(kWidth, kHeight, V4L2_PIX_FMT_YUV420, kStride, 2,
+                        true);
+  ASSERT_EQ(ImageProcessor::ConvertFormat(CameraMetadata(), yu12_, &dut), 0);
+  ExpectConverted(dut);
+}
+
+TEST_F(ImageProcessorTest, PaddedNV21) {
+  PaddedFrameBuffer dut(kWidth, kHeight, V4L2_PIX_FMT_NV21, kStride, 2, false);
+  ASSERT_EQ(ImageProcessor::ConvertFormat(CameraMetadata(), yu12_, &dut), 0);
+  ExpectConverted(dut);
+}
+
+TEST_F(ImageProcessorTest, PackedNV21) {
+  AllocatedFrameBuffer dut(kWidth * kHeight * 3 / 2);
+  dut.SetWidth(kWidth);
+  dut.SetHeight(kHeight);
+  dut.SetFourcc(V4L2_PIX_FMT_NV21);
+  ASSERT_EQ(ImageProcessor::ConvertFormat(CameraMetadata(), yu12_, &dut), 0);
+  const uint8_t* vu = dut.GetData() + kWidth * kHeight;
+  EXPECT_EQ(vu[0], 200);
+  EXPECT_EQ(vu[1], 100);
+  EXPECT_EQ(vu[2], 201);
+  EXPECT_EQ(vu[3], 101);
+}
+
+TEST_F(ImageProcessorTest, JpegBlobTrailerAtEndOfSmallBuffer) {
+  // A JPEG stream below the largest resolution gets a BLOB buffer smaller
+  // than ANDROID_JPEG_MAX_SIZE; the trailer goes at the end of that one.
+  size_t blob_size = v4l2_camera_hal::StreamFormat::JpegBufferSize(
+      kWidth, kHeight, kWidth * 4, kHeight * 4);
+  ASSERT_LT(blob_size, v4l2_camera_hal::kV4L2MaxJpegSize);
+  EXPECT_EQ(v4l2_camera_hal::StreamFormat::JpegBufferSize(
+                kWidth * 4, kHeight * 4, kWidth * 4, kHeight * 4),
+            v4l2_camera_hal::kV4L2MaxJpegSize);
+  GuardedFrameBuffer dut(kWidth, kHeight, V4L2_PIX_FMT_JPEG, blob_size, 64);
+
+  CameraMetadata metadata;
+  const float kFocalLength = 3.0f;
+  metadata.update(ANDROID_LENS_FOCAL_LENGTH, &kFocalLength, 1);
+  ASSERT_EQ(ImageProcessor::ConvertFormat(metadata, yu12_, &dut), 0);
+
+  const std::vector<uint8_t>& memory = dut.memory();
+  camera3_jpeg_blob_t blob;
+  memcpy(&blob, memory.data() + blob_size - sizeof(blob), sizeof(blob));
+  EXPECT_EQ(blob.jpeg_blob_id, CAMERA3_JPEG_BLOB_ID);
+  EXPECT_GT(blob.jpeg_size, 0u);
+  EXPECT_LE(blob.jpeg_size, blob_size - sizeof(blob));
+  // JPEG SOI marker at the start of the buffer.
+  EXPECT_EQ(memory[0], 0xFF);
+  EXPECT_EQ(memory[1], 0xD8);
+  for (size_t i = blob_size; i < memory.size(); ++i) {
+    EXPECT_EQ(memory[i], 0xEE) << "written past the BLOB buffer at " << i;
+  }
+}
+
+}  // namespace arc
@@ -6,6 +6,7 @@
 
 #include "arc/jpeg_compressor.h"
 
+#include <algorithm>
 #include <memory>
 
 #include "arc/common.h"
@@ -19,57 +20,154 @@ struct destination_mgr {
   JpegCompressor* compressor;
 };
 
-JpegCompressor::JpegCompressor() {}
+JpegCompressor::JpegCompressor(FrameBufferPool* pool)
+    : pool_(pool),
+      initial_size_(kBlockSize),
+      out_buffer_(nullptr),
+      out_capacity_(0),
+      in_place_(false),
+      result_size_(0) {}
 
-JpegCompressor::~JpegCompressor() {}
+JpegCompressor::~JpegCompressor() { ReleaseBuffer(std::move(result_buffer_)); }
 
 bool JpegCompressor::CompressImage(const void* image, int width, int height,
                                    int quality, const void* app1Buffer,
-                                   unsigned int app1Size) {
+                                   unsigned int app1Size, void* out_buffer,
+                                   size_t out_capacity) {
   if (width % 8 != 0 || height % 2 != 0) {
     LOGF(ERROR) << "Image size can not be handled: " << width << "x" << height;
     return false;
   }
 
-  result_buffer_.clear();
-  if (!Encode(image, width, height, quality, app1Buffer, app1Size)) {
+  result_size_ = 0;
+  out_buffer_ = static_cast<uint8_t*>(out_buffer);
+  out_capacity_ = out_buffer_ ? out_capacity : 0;
+  in_place_ = out_buffer_ != nullptr;
+  if (pool_) {
+    initial_size_ = width * height * 3 / 2;
+  }
+  const uint8_t* y_plane = static_cast<const uint8_t*>(image);
+  const uint8_t* u_plane = y_plane + width * height;
+  const uint8_t* v_plane = u_plane + width * height / 4;
+  if (!Encode(y_plane, u_plane, v_plane, width, height, quality, app1Buffer,
+              app1Size, 0)) {
     return false;
   }
   LOGF(INFO) << "Compressed JPEG: " << (width * height * 12) / 8 << "[" << width
-             << "x" << height << "] -> " << result_buffer_.size() << " bytes";
+             << "x" << height << "] -> " << result_size_ << " bytes";
   return true;
 }
 
-const void* JpegCompressor::GetCompressedImagePtr() {
-  return result_buffer_.data();
+bool JpegCompressor::CompressStrip(const void* image, int width, int height,
+                                   int quality, int first_row, int num_rows,
+                                   unsigned int restart_interval) {
+  if (width % 8 != 0 || height % 2 != 0 || first_row % 16 != 0 ||
+      num_rows % 2 != 0 || first_row + num_rows > height) {
+    LOGF(ERROR) << "Strip can not be handled: rows " << first_row << "+"
+                << num_rows << " of " << width << "x" << height;
+    return false;
+  }
+
+  result_size_ = 0;
+  out_buffer_ = nullptr;
+  out_capacity_ = 0;
+  in_place_ = false;
+  if (pool_) {
+    initial_size_ = width * num_rows * 3 / 2;
+  }
+  const uint8_t* y_plane = static_cast<const uint8_t*>(image);
+  const uint8_t* u_plane = y_plane + width * height;
+  const uint8_t* v_plane = u_plane + width * height / 4;
+  return Encode(y_plane + first_row * width,
+                u_plane + first_row / 2 * (width / 2),
+                v_plane + first_row / 2 * (width / 2), width, num_rows,
+                quality, nullptr, 0, restart_interval);
 }
 
-size_t JpegCompressor::GetCompressedImageSize() {
-  return result_buffer_.size();
+const void* JpegCompressor::GetCompressedImagePtr() {
+  if (in_place_) {
+    return out_buffer_;
+  }
+  return result_buffer_->GetData();
 }
 
+bool JpegCompressor::IsCompressedInPlace() { return in_place_; }
+
+size_t JpegCompressor::GetCompressedImageSize() { return result_size_; }
+
 void JpegCompressor::InitDestination(j_compress_ptr cinfo) {
   destination_mgr* dest = reinterpret_cast<destination_mgr*>(cinfo->dest);
-  std::vector<JOCTET>& buffer = dest->compressor->result_buffer_;
-  buffer.resize(kBlockSize);
-  dest->mgr.next_output_byte = &buffer[0];
-  dest->mgr.free_in_buffer = buffer.size();
+  JpegCompressor* compressor = dest->compressor;
+  if (compressor->in_place_) {
+    dest->mgr.next_output_byte = compressor->out_buffer_;
+    dest->mgr.free_in_buffer = compressor->out_capacity_;
+    return;
+  }
+  if (!compressor->result_buffer_ ||
+      compressor->result_buffer_->GetBufferSize() < compressor->initial_size_) {
+    compressor->ReleaseBuffer(std::move(compressor->result_buffer_));
+    compressor->result_buffer_ =
+        compressor->AcquireBuffer(compressor->initial_size_);
+  }
+  dest->mgr.next_output_byte = compressor->result_buffer_->GetData();
+  dest->mgr.free_in_buffer = compressor->result_buffer_->GetBufferSize();
 }
 
 boolean JpegCompressor::EmptyOutputBuffer(j_compress_ptr cinfo) {
   destination_mgr* dest = reinterpret_cast<destination_mgr*>(cinfo->dest);
-  std::vector<JOCTET>& buffer = dest->compressor->result_buffer_;
-  size_t oldsize = buffer.size();
-  buffer.resize(oldsize + kBlockSize);
-  dest->mgr.next_output_byte = &buffer[oldsize];
-  dest->mgr.free_in_buffer = kBlockSize;
+  JpegCompressor* compressor = dest->compressor;
+  // libjpeg only calls this once the whole buffer is full.
+  if (compressor->in_place_) {
+    // The image doesn't fit in the caller's buffer; carry on in our own.
+    size_t oldsize = compressor->out_capacity_;
+    LOGF(WARNING) << "JPEG output overflows " << oldsize
+                  << " bytes, falling back to an intermediate buffer";
+    compressor->ReleaseBuffer(std::move(compressor->result_buffer_));
+    compressor->result_buffer_ = compressor->AcquireBuffer(
+        std::max(oldsize * 2, compressor->initial_size_));
+    memcpy(compressor->result_buffer_->GetData(), compressor->out_buffer_,
+           oldsize);
+    compressor->in_place_ = false;
+    dest->mgr.next_output_byte =
+        compressor->result_buffer_->GetData() + oldsize;
+    dest->mgr.free_in_buffer =
+        compressor->result_buffer_->GetBufferSize() - oldsize;
+    return true;
+  }
+  size_t oldsize = compressor->result_buffer_->GetBufferSize();
+  std::unique_ptr<AllocatedFrameBuffer> buffer =
+      compressor->AcquireBuffer(oldsize * 2);
+  memcpy(buffer->GetData(), compressor->result_buffer_->GetData(), oldsize);
+  compressor->ReleaseBuffer(std::move(compressor->result_buffer_));
+  compressor->result_buffer_ = std::move(buffer);
+  dest->mgr.next_output_byte = compressor->result_buffer_->GetData() + oldsize;
+  dest->mgr.free_in_buffer =
+      compressor->result_buffer_->GetBufferSize() - oldsize;
   return true;
 }
 
 void JpegCompressor::TerminateDestination(j_compress_ptr cinfo) {
   destination_mgr* dest = reinterpret_cast<destination_mgr*>(cinfo->dest);
-  std::vector<JOCTET>& buffer = dest->compressor->result_buffer_;
-  buffer.resize(buffer.size() - dest->mgr.free_in_buffer);
+  JpegCompressor* compressor = dest->compressor;
+  size_t capacity = compressor->in_place_
+                        ? compressor->out_capacity_
+                        : compressor->result_buffer_->GetBufferSize();
+  compressor->result_size_ = capacity - dest->mgr.free_in_buffer;
+}
+
+std::unique_ptr<AllocatedFrameBuffer> JpegCompressor::AcquireBuffer(
+    size_t size) {
+  if (pool_) {
+    return pool_->Acquire(size);
+  }
+  return std::unique_ptr<AllocatedFrameBuffer>(new AllocatedFrameBuffer(size));
+}
+
+void JpegCompressor::ReleaseBuffer(
+    std::unique_ptr<AllocatedFrameBuffer> buffer) {
+  if (pool_) {
+    pool_->Release(std::move(buffer));
+  }
 }
 
 void JpegCompressor::OutputErrorMessage(j_common_ptr cinfo) {
@@ -80,9 +178,11 @@ void JpegCompressor::OutputErrorMessage(j_common_ptr cinfo) {
   LOGF(ERROR) << buffer;
 }
 
-bool JpegCompressor::Encode(const void* inYuv, int width, int height,
+bool JpegCompressor::Encode(const uint8_t* y_plane, const uint8_t* u_plane,
+                            const uint8_t* v_plane, int width, int height,
                             int jpegQuality, const void* app1Buffer,
-                            unsigned int app1Size) {
+                            unsigned int app1Size,
+                            unsigned int restart_interval) {
   jpeg_compress_struct cinfo;
   jpeg_error_mgr jerr;
 
@@ -92,7 +192,7 @@ bool JpegCompressor::Encode(const void* inYuv, int width, int height,
   jpeg_create_compress(&cinfo);
   SetJpegDestination(&cinfo);
 
-  SetJpegCompressStruct(width, height, jpegQuality, &cinfo);
+  SetJpegCompressStruct(width, height, jpegQuality, restart_interval, &cinfo);
   jpeg_start_compress(&cinfo, TRUE);
 
   if (app1Buffer != nullptr && app1Size > 0) {
@@ -100,10 +200,12 @@ bool JpegCompressor::Encode(const void* inYuv, int width, int height,
                       static_cast<const JOCTET*>(app1Buffer), app1Size);
   }
 
-  if (!Compress(&cinfo, static_cast<const uint8_t*>(inYuv))) {
+  if (!Compress(&cinfo, y_plane, u_plane, v_plane)) {
+    jpeg_destroy_compress(&cinfo);
     return false;
   }
   jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
   return true;
 }
 
@@ -119,6 +221,7 @@ void JpegCompressor::SetJpegDestination(jpeg_compress_struct* cinfo) {
 }
 
 void JpegCompressor::SetJpegCompressStruct(int width, int height, int quality,
+                                           unsigned int restart_interval,
                                            jpeg_compress_struct* cinfo) {
   cinfo->image_width = width;
   cinfo->image_height = height;
@@ -130,6 +233,7 @@ void JpegCompressor::SetJpegCompressStruct(int width, int height, int quality,
   jpeg_set_colorspace(cinfo, JCS_YCbCr);
   cinfo->raw_data_in = TRUE;
   cinfo->dct_method = JDCT_IFAST;
+  cinfo->restart_interval = restart_interval;
 
   // Configure sampling factors. The sampling factor is JPEG subsampling 420
   // because the source format is YUV420.
@@ -141,27 +245,26 @@ void JpegCompressor::SetJpegCompressStruct(int width, int height, int quality,
   cinfo->comp_info[2].v_samp_factor = 1;
 }
 
-bool JpegCompressor::Compress(jpeg_compress_struct* cinfo, const uint8_t* yuv) {
+bool JpegCompressor::Compress(jpeg_compress_struct* cinfo,
+                              const uint8_t* y_plane, const uint8_t* u_plane,
+                              const uint8_t* v_plane) {
   JSAMPROW y[kCompressBatchSize];
   JSAMPROW cb[kCompressBatchSize / 2];
   JSAMPROW cr[kCompressBatchSize / 2];
   JSAMPARRAY planes[3]{y, cb, cr};
 
-  size_t y_plane_size = cinfo->image_width * cinfo->image_height;
-  size_t uv_plane_size = y_plane_size / 4;
-  uint8_t* y_plane = const_cast<uint8_t*>(yuv);
-  uint8_t* u_plane = const_cast<uint8_t*>(yuv + y_plane_size);
-  uint8_t* v_plane = const_cast<uint8_t*>(yuv + y_plane_size + uv_plane_size);
-  std::unique_ptr<uint8_t[]> empty(new uint8_t[cinfo->image_width]);
-  memset(empty.get(), 0, cinfo->image_width);
+  std::unique_ptr<AllocatedFrameBuffer> empty_row =
+      AcquireBuffer(cinfo->image_width);
+  uint8_t* empty = empty_row->GetData();
+  memset(empty, 0, cinfo->image_width);
 
   while (cinfo->next_scanline < cinfo->image_height) {
     for (int i = 0; i < kCompressBatchSize; ++i) {
       size_t scanline = cinfo->next_scanline + i;
       if (scanline < cinfo->image_height) {
-        y[i] = y_plane + scanline * cinfo->image_width;
+        y[i] = const_cast<uint8_t*>(y_plane) + scanline * cinfo->image_width;
       } else {
-        y[i] = empty.get();
+        y[i] = empty;
       }
     }
     // cb, cr only have half scanlines
@@ -169,19 +272,21 @@ bool JpegCompressor::Compress(jpeg_compress_struct* cinfo, const uint8_t* yuv) {
       size_t scanline = cinfo->next_scanline / 2 + i;
       if (scanline < cinfo->image_height / 2) {
         int offset = scanline * (cinfo->image_width / 2);
-        cb[i] = u_plane + offset;
-        cr[i] = v_plane + offset;
+        cb[i] = const_cast<uint8_t*>(u_plane) + offset;
+        cr[i] = const_cast<uint8_t*>(v_plane) + offset;
       } else {
-        cb[i] = cr[i] = empty.get();
+        cb[i] = cr[i] = empty;
       }
     }
 
     int processed = jpeg_write_raw_data(cinfo, planes, kCompressBatchSize);
     if (processed != kCompressBatchSize) {
       LOGF(ERROR) << "Number of processed lines does not equal input lines.";
+      ReleaseBuffer(std::move(empty_row));
       return false;
     }
   }
+  ReleaseBuffer(std::move(empty_row));
   return true;
 }
 
@@ -9,20 +9,24 @@
 
 // We must include cstdio before jpeglib.h. It is a requirement of libjpeg.
 #include <cstdio>
-#include <vector>
+#include <memory>
 
 extern "C" {
 #include <jerror.h>
 #include <jpeglib.h>
 }
 
+#include "arc/frame_buffer_pool.h"
+
 namespace arc {
 
 // Encapsulates a converter from YU12 to JPEG format. This class is not
 // thread-safe.
 class JpegCompressor {
  public:
-  JpegCompressor();
+  // If |pool| is given, the output and scratch buffers are borrowed from it
+  // and returned on destruction.
+  explicit JpegCompressor(FrameBufferPool* pool = nullptr);
   ~JpegCompressor();
 
   // Compresses YU12 image to JPEG format. After calling this method, call
@@ -30,13 +34,32 @@ class JpegCompressor {
   // image quality. It ranges from 1 (poorest quality) to 100 (highest quality).
   // |app1Buffer| is the buffer of APP1 segment (exif) which will be added to
   // the compressed image. Returns false if errors occur during compression.
+  // If |out_buffer| is given, the image is encoded directly into its first
+  // |out_capacity| bytes, and only moves to an internal buffer if it does not
+  // fit.
   bool CompressImage(const void* image, int width, int height, int quality,
-                     const void* app1Buffer, unsigned int app1Size);
+                     const void* app1Buffer, unsigned int app1Size,
+                     void* out_buffer = nullptr, size_t out_capacity = 0);
 
   // Returns the compressed JPEG buffer pointer. This method must be called only
   // after calling CompressImage().
   const void* GetCompressedImagePtr();
 
+  // Returns true if the compressed image is in the |out_buffer| passed to
+  // CompressImage(). This method must be called only after calling
+  // CompressImage().
+  bool IsCompressedInPlace();
+
+  // Compresses rows [|first_row|, |first_row| + |num_rows|) of the
+  // |width|x|height| YU12 |image| as a stand-alone JPEG whose restart interval
+  // is |restart_interval| MCUs. Strips compressed with the same settings can be
+  // joined into one image by ParallelJpegCompressor. |first_row| must be a
+  // multiple of 16, and so must |num_rows| unless the strip is the last one.
+  // Returns false if errors occur during compression.
+  bool CompressStrip(const void* image, int width, int height, int quality,
+                     int first_row, int num_rows,
+                     unsigned int restart_interval);
+
   // Returns the compressed JPEG buffer size. This method must be called only
   // after calling CompressImage().
   size_t GetCompressedImageSize();
@@ -49,14 +72,22 @@ class JpegCompressor {
   static void TerminateDestination(j_compress_ptr cinfo);
   static void OutputErrorMessage(j_common_ptr cinfo);
 
-  // Returns false if errors occur.
-  bool Encode(const void* inYuv, int width, int height, int jpegQuality,
-              const void* app1Buffer, unsigned int app1Size);
+  // Encodes the |height| rows starting at the given planes, which have
+  // |width| luma samples per row. Returns false if errors occur.
+  bool Encode(const uint8_t* y_plane, const uint8_t* u_plane,
+              const uint8_t* v_plane, int width, int height, int jpegQuality,
+              const void* app1Buffer, unsigned int app1Size,
+              unsigned int restart_interval);
   void SetJpegDestination(jpeg_compress_struct* cinfo);
   void SetJpegCompressStruct(int width, int height, int quality,
+                             unsigned int restart_interval,
                              jpeg_compress_struct* cinfo);
   // Returns false if errors occur.
-  bool Compress(jpeg_compress_struct* cinfo, const uint8_t* yuv);
+  bool Compress(jpeg_compress_struct* cinfo, const uint8_t* y_plane,
+                const uint8_t* u_plane, const uint8_t* v_plane);
+  // Returns a buffer of at least |size| bytes, from |pool_| if set.
+  std::unique_ptr<AllocatedFrameBuffer> AcquireBuffer(size_t size);
+  void ReleaseBuffer(std::unique_ptr<AllocatedFrameBuffer> buffer);
 
   // The block size for encoded jpeg image buffer.
   static const int kBlockSize = 16384;
@@ -64,8 +95,21 @@ class JpegCompressor {
   // We must pass at least 16 scanlines according to libjpeg documentation.
   static const int kCompressBatchSize = 16;
 
-  // The buffer that holds the compressed result.
-  std::vector<JOCTET> result_buffer_;
+  FrameBufferPool* pool_;
+  // Capacity to start the output with; the image size when pooled, since
+  // growing the output means a copy.
+  size_t initial_size_;
+
+  // The caller's buffer to compress into, and whether the result is still in
+  // it.
+  uint8_t* out_buffer_;
+  size_t out_capacity_;
+  bool in_place_;
+
+  // The buffer that holds the compressed result once it doesn't fit in
+  // |out_buffer_|, and how much of the result buffer is used.
+  std::unique_ptr<AllocatedFrameBuffer> result_buffer_;
+  size_t result_size_;
 };
 
 }  // namespace arc
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/jpeg_decompressor.h"
+
+#include "arc/common.h"
+
+namespace arc {
+
+// The size of the blocks libjpeg decodes |component| to.
+static int ScaledBlockWidth(const jpeg_component_info& component) {
+#if JPEG_LIB_VERSION >= 70
+  return component.DCT_h_scaled_size;
+#else
+  return component.DCT_scaled_size;
+#endif
+}
+
+static int ScaledBlockHeight(const jpeg_component_info& component) {
+#if JPEG_LIB_VERSION >= 70
+  return component.DCT_v_scaled_size;
+#else
+  return component.DCT_scaled_size;
+#endif
+}
+
+JpegDecompressor::JpegDecompressor(FrameBufferPool* pool)
+    : pool_(pool),
+      y_rows_per_imcu_(0),
+      uv_rows_per_imcu_(0),
+      chroma_stride_(0),
+      width_(0),
+      height_(0),
+      y_plane_(nullptr),
+      u_plane_(nullptr),
+      v_plane_(nullptr),
+      y_stride_(0),
+      uv_stride_(0) {
+  cinfo_.err = jpeg_std_error(&error_manager_.mgr);
+  error_manager_.mgr.error_exit = &ErrorExit;
+  error_manager_.mgr.output_message = &OutputErrorMessage;
+  jpeg_create_decompress(&cinfo_);
+}
+
+JpegDecompressor::~JpegDecompressor() {
+  jpeg_destroy_decompress(&cinfo_);
+  if (pool_) {
+    pool_->Release(std::move(buffer_));
+  }
+}
+
+bool JpegDecompressor::Decompress(const uint8_t* jpeg, size_t size,
+                                  uint32_t min_width, uint32_t min_height) {
+  if (!Start(jpeg, size, min_width, min_height)) {
+    jpeg_abort_decompress(&cinfo_);
+    return false;
+  }
+
+  // libjpeg writes whole blocks, so the planes are padded out to whole iMCUs.
+  const jpeg_component_info& y_info = cinfo_.comp_info[0];
+  const jpeg_component_info& uv_info = cinfo_.comp_info[1];
+  y_stride_ = y_info.width_in_blocks * ScaledBlockWidth(y_info);
+  chroma_stride_ = uv_info.width_in_blocks * ScaledBlockWidth(uv_info);
+  y_rows_per_imcu_ = y_info.v_samp_factor * ScaledBlockHeight(y_info);
+  uv_rows_per_imcu_ = uv_info.v_samp_factor * ScaledBlockHeight(uv_info);
+  bool full_width_chroma =
+      ScaledBlockWidth(uv_info) == 2 * ScaledBlockWidth(y_info);
+  size_t y_size = y_stride_ * y_rows_per_imcu_ * cinfo_.total_iMCU_rows;
+  size_t uv_size = chroma_stride_ * uv_rows_per_imcu_ * cinfo_.total_iMCU_rows;
+  if (pool_) {
+    if (!buffer_ || buffer_->GetBufferSize() < y_size + 2 * uv_size) {
+      pool_->Release(std::move(buffer_));
+      buffer_ = pool_->Acquire(y_size + 2 * uv_size);
+    }
+  } else {
+    buffer_.reset(new AllocatedFrameBuffer(y_size + 2 * uv_size));
+  }
+  width_ = cinfo_.output_width;
+  height_ = cinfo_.output_height;
+  y_plane_ = buffer_->GetData();
+  u_plane_ = y_plane_ + y_size;
+  v_plane_ = u_plane_ + uv_size;
+
+  if (!ReadPlanes()) {
+    jpeg_abort_decompress(&cinfo_);
+    return false;
+  }
+  SubsampleChroma(full_width_chroma);
+  VLOGF(1) << "Decompressed " << cinfo_.image_width << "x"
+           << cinfo_.image_height << " JPEG to " << width_ << "x" << height_;
+  return true;
+}
+
+bool JpegDecompressor::Start(const uint8_t* jpeg, size_t size,
+                             uint32_t min_width, uint32_t min_height) {
+  // Errors longjmp() back here, so no C++ object may be alive across the
+  // libjpeg calls below.
+  if (setjmp(error_manager_.jump)) {
+    return false;
+  }
+  jpeg_mem_src(&cinfo_, const_cast<uint8_t*>(jpeg), size);
+  jpeg_read_header(&cinfo_, TRUE);
+
+  if (cinfo_.num_components != 3 || cinfo_.jpeg_color_space != JCS_YCbCr ||
+      cinfo_.comp_info[0].h_samp_factor != 2 ||
+      cinfo_.comp_info[0].v_samp_factor > 2 ||
+      cinfo_.comp_info[1].h_samp_factor != 1 ||
+      cinfo_.comp_info[1].v_samp_factor != 1 ||
+      cinfo_.comp_info[2].h_samp_factor != 1 ||
+      cinfo_.comp_info[2].v_samp_factor != 1) {
+    LOGF(ERROR) << "Unsupported JPEG sampling";
+    return false;
+  }
+
+  cinfo_.raw_data_out = TRUE;
+  cinfo_.dct_method = JDCT_IFAST;
+  cinfo_.scale_num = 1;
+  for (unsigned int denom = 8; denom >= 1; denom /= 2) {
+    cinfo_.scale_denom = denom;
+    jpeg_calc_output_dimensions(&cinfo_);
+    if (cinfo_.output_width >= min_width &&
+        cinfo_.output_height >= min_height) {
+      break;
+    }
+  }
+  jpeg_start_decompress(&cinfo_);
+  return true;
+}
+
+bool JpegDecompressor::ReadPlanes() {
+  // Errors longjmp() back here, so no C++ object may be alive across the
+  // libjpeg calls below.
+  if (setjmp(error_manager_.jump)) {
+    return false;
+  }
+  JSAMPROW y[2 * DCTSIZE];
+  JSAMPROW cb[2 * DCTSIZE];
+  JSAMPROW cr[2 * DCTSIZE];
+  JSAMPARRAY planes[3]{y, cb, cr};
+
+  for (JDIMENSION imcu = 0; imcu < cinfo_.total_iMCU_rows; ++imcu) {
+    for (int i = 0; i < y_rows_per_imcu_; ++i) {
+      y[i] = y_plane_ + (imcu * y_rows_per_imcu_ + i) * y_stride_;
+    }
+    for (int i = 0; i < uv_rows_per_imcu_; ++i) {
+      int offset = (imcu * uv_rows_per_imcu_ + i) * chroma_stride_;
+      cb[i] = u_plane_ + offset;
+      cr[i] = v_plane_ + offset;
+    }
+    if (jpeg_read_raw_data(&cinfo_, planes, y_rows_per_imcu_) !=
+        static_cast<JDIMENSION>(y_rows_per_imcu_)) {
+      LOGF(ERROR) << "JPEG data ended early";
+      return false;
+    }
+  }
+  jpeg_finish_decompress(&cinfo_);
+  return true;
+}
+
+void JpegDecompressor::SubsampleChroma(bool full_width) {
+  bool full_height = uv_rows_per_imcu_ == y_rows_per_imcu_;
+  // Rows can always be skipped with the stride.
+  uv_stride_ = full_height ? 2 * chroma_stride_ : chroma_stride_;
+  if (!full_width) {
+    return;
+  }
+  // Columns can't, so compact the planes in place. Every sample is read
+  // before anything is written over it.
+  int uv_width = (width_ + 1) / 2;
+  int uv_height = (height_ + 1) / 2;
+  int dst_stride = chroma_stride_ / 2;
+  for (uint8_t* plane : {u_plane_, v_plane_}) {
+    for (int row = 0; row < uv_height; ++row) {
+      const uint8_t* src = plane + row * uv_stride_;
+      uint8_t* dst = plane + row * dst_stride;
+      for (int col = 0; col < uv_width; ++col) {
+        dst[col] = src[2 * col];
+      }
+    }
+  }
+  uv_stride_ = dst_stride;
+}
+
+void JpegDecompressor::ErrorExit(j_common_ptr cinfo) {
+  (*cinfo->err->output_message)(cinfo);
+  longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+}
+
+void JpegDecompressor::OutputErrorMessage(j_common_ptr cinfo) {
+  char buffer[JMSG_LENGTH_MAX];
+
+  /* Create the message */
+  (*cinfo->err->format_message)(cinfo, buffer);
+  LOGF(ERROR) << buffer;
+}
+
+}  // namespace arc
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HAL_USB_JPEG_DECOMPRESSOR_H_
+#define HAL_USB_JPEG_DECOMPRESSOR_H_
+
+// We must include cstdio before jpeglib.h. It is a requirement of libjpeg.
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+
+extern "C" {
+#include <jerror.h>
+#include <jpeglib.h>
+}
+
+#include "arc/frame_buffer_pool.h"
+
+namespace arc {
+
+// Decodes (M)JPEG frames to planar YUV without color conversion or
+// upsampling, using libjpeg's DCT scaling to shrink the image by 1/2, 1/4 or
+// 1/8 while decoding when a smaller image is wanted. The result is exposed as
+// I420 planes; 4:2:2 images are viewed as 4:2:0 by skipping every other chroma
+// row. This class is not thread-safe.
+class JpegDecompressor {
+ public:
+  // If |pool| is given, the output buffer is borrowed from it and returned on
+  // destruction.
+  explicit JpegDecompressor(FrameBufferPool* pool = nullptr);
+  ~JpegDecompressor();
+
+  // Decodes the |size| bytes of |jpeg| at the smallest DCT scale whose output
+  // is still at least |min_width|x|min_height|. Returns false if the image is
+  // corrupt or is not 4:2:0 or 4:2:2 YCbCr.
+  bool Decompress(const uint8_t* jpeg, size_t size, uint32_t min_width,
+                  uint32_t min_height);
+
+  // The decoded image. These methods must be called only after Decompress()
+  // succeeded.
+  uint32_t GetWidth() const { return width_; }
+  uint32_t GetHeight() const { return height_; }
+  const uint8_t* GetY() const { return y_plane_; }
+  const uint8_t* GetU() const { return u_plane_; }
+  const uint8_t* GetV() const { return v_plane_; }
+  int GetYStride() const { return y_stride_; }
+  int GetUVStride() const { return uv_stride_; }
+
+ private:
+  struct ErrorManager {
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+  };
+
+  // Reads the header of |jpeg|, picks the scale and starts decompression.
+  bool Start(const uint8_t* jpeg, size_t size, uint32_t min_width,
+             uint32_t min_height);
+  // Reads the whole image into |buffer_|.
+  bool ReadPlanes();
+  // Sets |uv_stride_| for a half resolution view of the chroma planes,
+  // point-sampling them in place if they are |full_width|.
+  void SubsampleChroma(bool full_width);
+
+  static void ErrorExit(j_common_ptr cinfo);
+  static void OutputErrorMessage(j_common_ptr cinfo);
+
+  FrameBufferPool* pool_;
+  jpeg_decompress_struct cinfo_;
+  ErrorManager error_manager_;
+
+  std::unique_ptr<AllocatedFrameBuffer> buffer_;
+  // Rows libjpeg writes to each plane of |buffer_| per iMCU row, and the
+  // stride libjpeg writes the chroma planes with. libjpeg may scale chroma up
+  // to full resolution in the IDCT rather than leaving it subsampled.
+  int y_rows_per_imcu_;
+  int uv_rows_per_imcu_;
+  int chroma_stride_;
+
+  uint32_t width_;
+  uint32_t height_;
+  uint8_t* y_plane_;
+  uint8_t* u_plane_;
+  uint8_t* v_plane_;
+  int y_stride_;
+  int uv_stride_;
+};
+
+}  // namespace arc
+
+#endif  // HAL_USB_JPEG_DECOMPRESSOR_H_
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/jpeg_decompressor.h"
+
+#include <cstdlib>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "arc/jpeg_compressor.h"
+
+using testing::Test;
+
+namespace arc {
+
+class JpegDecompressorTest : public Test {
+ protected:
+  static const int kWidth = 1280;
+  static const int kHeight = 720;
+
+  virtual void SetUp() {
+    // A flat gray YU12 image, so scaled decodes are easy to check.
+    std::vector<uint8_t> image(kWidth * kHeight * 3 / 2, 128);
+    JpegCompressor compressor;
+    ASSERT_TRUE(compressor.CompressImage(image.data(), kWidth, kHeight, 90,
+                                         nullptr, 0));
+    const uint8_t* data =
+        static_cast<const uint8_t*>(compressor.GetCompressedImagePtr());
+    jpeg_.assign(data, data + compressor.GetCompressedImageSize());
+  }
+
+  void ExpectGray() {
+    EXPECT_NEAR(dut_.GetY()[(dut_.GetHeight() / 2) * dut_.GetYStride() +
+                            dut_.GetWidth() / 2],
+                128, 2);
+    int row = dut_.GetHeight() / 4;
+    int col = dut_.GetWidth() / 4;
+    EXPECT_NEAR(dut_.GetU()[row * dut_.GetUVStride() + col], 128, 2);
+    EXPECT_NEAR(dut_.GetV()[row * dut_.GetUVStride() + col], 128, 2);
+  }
+
+  JpegDecompressor dut_;
+  std::vector<uint8_t> jpeg_;
+};
+
+TEST_F(JpegDecompressorTest, FullSize) {
+  ASSERT_TRUE(dut_.Decompress(jpeg_.data(), jpeg_.size(), kWidth, kHeight));
+  EXPECT_EQ(dut_.GetWidth(), static_cast<uint32_t>(kWidth));
+  EXPECT_EQ(dut_.GetHeight(), static_cast<uint32_t>(kHeight));
+  ExpectGray();
+}
+
+TEST_F(JpegDecompressorTest, ScalesInIdct) {
+  // The smallest power of two reduction that still covers the target.
+  ASSERT_TRUE(dut_.Decompress(jpeg_.data(), jpeg_.size(), 320, 240));
+  EXPECT_EQ(dut_.GetWidth(), static_cast<uint32_t>(kWidth / 2));
+  EXPECT_EQ(dut_.GetHeight(), static_cast<uint32_t>(kHeight / 2));
+  ExpectGray();
+
+  ASSERT_TRUE(dut_.Decompress(jpeg_.data(), jpeg_.size(), 160, 90));
+  EXPECT_EQ(dut_.GetWidth(), static_cast<uint32_t>(kWidth / 8));
+  EXPECT_EQ(dut_.GetHeight(), static_cast<uint32_t>(kHeight / 8));
+  ExpectGray();
+}
+
+TEST_F(JpegDecompressorTest, RejectsCorruptData) {
+  std::vector<uint8_t> garbage(jpeg_.size(), 0x55);
+  EXPECT_FALSE(dut_.Decompress(garbage.data(), garbage.size(), kWidth,
+                               kHeight));
+  // Still usable afterwards.
+  EXPECT_TRUE(dut_.Decompress(jpeg_.data(), jpeg_.size(), kWidth, kHeight));
+}
+
+}  // namespace arc
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/parallel_jpeg_compressor.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "arc/common.h"
+
+namespace arc {
+
+// JPEG marker codes, without their 0xFF prefix.
+static const uint8_t kMarkerSof0 = 0xC0;
+static const uint8_t kMarkerRst0 = 0xD0;
+static const uint8_t kMarkerEoi = 0xD9;
+static const uint8_t kMarkerSos = 0xDA;
+static const uint8_t kMarkerApp0 = 0xE0;
+static const uint8_t kMarkerApp1 = 0xE1;
+// The restart interval is a 16 bit field of the DRI segment.
+static const int kMaxRestartInterval = 65535;
+
+// Walks the marker segments of the JPEG in |data| up to the start of the
+// entropy-coded data. Sets |header_end| to the end of the SOI and JFIF APP0
+// segments, where an APP1 segment belongs, |sof_offset| to the start of the
+// SOF0 segment and |scan_offset| to the first byte after the SOS segment.
+static bool ParseHeaders(const uint8_t* data, size_t size, size_t* header_end,
+                         size_t* sof_offset, size_t* scan_offset) {
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    LOGF(ERROR) << "JPEG strip does not start with SOI";
+    return false;
+  }
+  size_t pos = 2;
+  *header_end = pos;
+  *sof_offset = 0;
+  while (pos + 4 <= size) {
+    if (data[pos] != 0xFF) {
+      LOGF(ERROR) << "Malformed JPEG strip header at " << pos;
+      return false;
+    }
+    uint8_t marker = data[pos + 1];
+    size_t length = (data[pos + 2] << 8) | data[pos + 3];
+    if (marker == kMarkerApp0 && *header_end == pos) {
+      *header_end = pos + 2 + length;
+    } else if (marker == kMarkerSof0) {
+      *sof_offset = pos;
+    } else if (marker == kMarkerSos) {
+      *scan_offset = pos + 2 + length;
+      return *sof_offset != 0 && *scan_offset + 2 <= size;
+    }
+    pos += 2 + length;
+  }
+  LOGF(ERROR) << "No scan found in JPEG strip";
+  return false;
+}
+
+// Returns true if the JPEG in |data| ends with EOI.
+static bool EndsWithEoi(const uint8_t* data, size_t size) {
+  return size >= 2 && data[size - 2] == 0xFF && data[size - 1] == kMarkerEoi;
+}
+
+ParallelJpegCompressor::ParallelJpegCompressor(FrameBufferPool* pool)
+    : pool_(pool) {}
+
+ParallelJpegCompressor::~ParallelJpegCompressor() { Join(); }
+
+bool ParallelJpegCompressor::Start(const void* image, int width, int height,
+                                   int quality, int max_strips) {
+  Join();
+  strips_.clear();
+  if (width % 8 != 0 || height % 2 != 0 || max_strips < 1) {
+    LOGF(ERROR) << "Image size can not be handled: " << width << "x" << height;
+    return false;
+  }
+
+  // Split the image on MCU row boundaries, keeping each strip small enough to
+  // be a single restart interval.
+  int mcus_per_row = (width + kMcuSize - 1) / kMcuSize;
+  int mcu_rows = (height + kMcuSize - 1) / kMcuSize;
+  int strip_mcu_rows = (mcu_rows + max_strips - 1) / max_strips;
+  strip_mcu_rows =
+      std::max(1, std::min(strip_mcu_rows, kMaxRestartInterval / mcus_per_row));
+  unsigned int restart_interval = strip_mcu_rows * mcus_per_row;
+
+  for (int first_row = 0; first_row < height;
+       first_row += strip_mcu_rows * kMcuSize) {
+    std::unique_ptr<Strip> strip(new Strip(pool_));
+    strip->first_row = first_row;
+    strip->num_rows = std::min(strip_mcu_rows * kMcuSize, height - first_row);
+    strips_.push_back(std::move(strip));
+  }
+  VLOGF(1) << "Compressing " << width << "x" << height << " JPEG in "
+           << strips_.size() << " strips";
+
+  for (auto& strip : strips_) {
+    Strip* s = strip.get();
+    s->thread = std::thread([=]() {
+      s->result = s->compressor.CompressStrip(image, width, height, quality,
+                                              s->first_row, s->num_rows,
+                                              restart_interval);
+    });
+  }
+  return true;
+}
+
+bool ParallelJpegCompressor::Finish(const void* app1Buffer,
+                                    unsigned int app1Size, void* out_buffer,
+                                    size_t out_capacity, size_t* jpeg_size) {
+  *jpeg_size = 0;
+  if (strips_.empty()) {
+    LOGF(ERROR) << "No JPEG compression was started";
+    return false;
+  }
+  if (!Join()) {
+    LOGF(ERROR) << "JPEG strip compression failed";
+    return false;
+  }
+
+  // The first strip provides the headers; the SOF0 height is patched to the
+  // full image and the APP1 segment is spliced in after SOI/APP0. The other
+  // strips only contribute their entropy-coded data.
+  const uint8_t* first = static_cast<const uint8_t*>(
+      strips_[0]->compressor.GetCompressedImagePtr());
+  size_t first_size = strips_[0]->compressor.GetCompressedImageSize();
+  size_t header_end, sof_offset, scan_offset;
+  if (!ParseHeaders(first, first_size, &header_end, &sof_offset,
+                    &scan_offset) ||
+      !EndsWithEoi(first, first_size)) {
+    return false;
+  }
+  size_t app1_segment_size = app1Size > 0 ? 4 + app1Size : 0;
+  size_t total = first_size + app1_segment_size;
+  std::vector<size_t> scan_offsets(strips_.size(), scan_offset);
+  for (size_t i = 1; i < strips_.size(); ++i) {
+    const uint8_t* data = static_cast<const uint8_t*>(
+        strips_[i]->compressor.GetCompressedImagePtr());
+    size_t size = strips_[i]->compressor.GetCompressedImageSize();
+    size_t unused_header_end, unused_sof_offset;
+    if (!ParseHeaders(data, size, &unused_header_end, &unused_sof_offset,
+                      &scan_offsets[i]) ||
+        !EndsWithEoi(data, size)) {
+      return false;
+    }
+    // The strip's scan, minus its EOI, plus the RSTn marker before it.
+    total += size - scan_offsets[i];
+  }
+  *jpeg_size = total;
+  if (total > out_capacity) {
+    LOGF(ERROR) << "JPEG image of " << total << " bytes does not fit in "
+                << out_capacity << " bytes";
+    return false;
+  }
+
+  uint8_t* out = static_cast<uint8_t*>(out_buffer);
+  memcpy(out, first, header_end);
+  out += header_end;
+  if (app1_segment_size) {
+    size_t length = app1Size + 2;
+    *out++ = 0xFF;
+    *out++ = kMarkerApp1;
+    *out++ = (length >> 8) & 0xFF;
+    *out++ = length & 0xFF;
+    memcpy(out, app1Buffer, app1Size);
+    out += app1Size;
+  }
+  uint8_t* sof = out + (sof_offset - header_end);
+  memcpy(out, first + header_end, first_size - 2 - header_end);
+  out += first_size - 2 - header_end;
+  // SOF0 is FF C0, length(2), precision(1), height(2), width(2), ...
+  int height = strips_.back()->first_row + strips_.back()->num_rows;
+  sof[5] = (height >> 8) & 0xFF;
+  sof[6] = height & 0xFF;
+
+  for (size_t i = 1; i < strips_.size(); ++i) {
+    const uint8_t* data = static_cast<const uint8_t*>(
+        strips_[i]->compressor.GetCompressedImagePtr());
+    size_t size = strips_[i]->compressor.GetCompressedImageSize();
+    *out++ = 0xFF;
+    *out++ = kMarkerRst0 + (i - 1) % 8;
+    memcpy(out, data + scan_offsets[i], size - 2 - scan_offsets[i]);
+    out += size - 2 - scan_offsets[i];
+  }
+  *out++ = 0xFF;
+  *out++ = kMarkerEoi;
+  return true;
+}
+
+bool ParallelJpegCompressor::Join() {
+  bool result = true;
+  for (auto& strip : strips_) {
+    if (strip->thread.joinable()) {
+      strip->thread.join();
+    }
+    result = result && strip->result;
+  }
+  return result;
+}
+
+}  // namespace arc
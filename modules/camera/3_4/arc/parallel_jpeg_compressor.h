@@ -0,0 +1,78 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HAL_USB_PARALLEL_JPEG_COMPRESSOR_H_
+#define HAL_USB_PARALLEL_JPEG_COMPRESSOR_H_
+
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "arc/frame_buffer_pool.h"
+#include "arc/jpeg_compressor.h"
+
+namespace arc {
+
+// Compresses a YU12 image to baseline JPEG as horizontal strips on worker
+// threads. Each strip is one restart interval of the final image, so the
+// strips' entropy-coded data can be concatenated with RSTn markers in between.
+// The caller is free to do other work, such as generating the EXIF thumbnail,
+// between Start() and Finish(). This class is not thread-safe.
+class ParallelJpegCompressor {
+ public:
+  // If |pool| is given, the strip buffers are borrowed from it.
+  explicit ParallelJpegCompressor(FrameBufferPool* pool = nullptr);
+  // Waits for any strips still being compressed.
+  ~ParallelJpegCompressor();
+
+  // Starts compressing the |width|x|height| YU12 |image| in at most
+  // |max_strips| strips. |image| must stay valid until Finish() returns.
+  // Returns false if the image can not be handled.
+  bool Start(const void* image, int width, int height, int quality,
+             int max_strips);
+
+  // Waits for the strips and writes them, with the APP1 segment
+  // |app1Buffer| (if any), as one JPEG into |out_buffer|. Sets |jpeg_size| to
+  // the size of the image. Returns false if compression failed or the image
+  // does not fit in |out_capacity| bytes.
+  bool Finish(const void* app1Buffer, unsigned int app1Size, void* out_buffer,
+              size_t out_capacity, size_t* jpeg_size);
+
+ private:
+  struct Strip {
+    explicit Strip(FrameBufferPool* pool) : compressor(pool), result(false) {}
+
+    JpegCompressor compressor;
+    int first_row;
+    int num_rows;
+    bool result;
+    std::thread thread;
+  };
+
+  // Joins all the strip threads. Returns true if every strip succeeded.
+  bool Join();
+
+  // Luma rows in one JPEG MCU, given the 4:2:0 sampling JpegCompressor uses.
+  static const int kMcuSize = 16;
+
+  FrameBufferPool* pool_;
+  std::vector<std::unique_ptr<Strip>> strips_;
+};
+
+}  // namespace arc
+
+#endif  // HAL_USB_PARALLEL_JPEG_COMPRESSOR_H_
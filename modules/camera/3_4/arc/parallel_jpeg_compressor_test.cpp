@@ -0,0 +1,107 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arc/parallel_jpeg_compressor.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using testing::Test;
+
+namespace arc {
+
+class ParallelJpegCompressorTest : public Test {
+ protected:
+  // Fills |image_| with a |width|x|height| YU12 pattern.
+  void MakeImage(int width, int height) {
+    width_ = width;
+    height_ = height;
+    image_.resize(width * height * 3 / 2);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        image_[y * width + x] = (x * 7 + y * 3 + (x * y) % 31) & 0xFF;
+      }
+    }
+    for (size_t i = width * height; i < image_.size(); ++i) {
+      image_[i] = 128 + i % 17;
+    }
+  }
+
+  // Decodes the luma of |jpeg|. Returns false if libjpeg had any complaint.
+  bool DecodeLuma(const uint8_t* jpeg, size_t size,
+                  std::vector<uint8_t>* luma) {
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<uint8_t*>(jpeg), size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(&cinfo);
+    EXPECT_EQ(cinfo.output_width, static_cast<JDIMENSION>(width_));
+    EXPECT_EQ(cinfo.output_height, static_cast<JDIMENSION>(height_));
+    luma->resize(cinfo.output_width * cinfo.output_height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+      JSAMPROW row = luma->data() + cinfo.output_scanline * cinfo.output_width;
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return jerr.num_warnings == 0;
+  }
+
+  ParallelJpegCompressor dut_;
+  std::vector<uint8_t> image_;
+  int width_;
+  int height_;
+};
+
+TEST_F(ParallelJpegCompressorTest, MatchesSerialCompression) {
+  // Not a whole number of MCU rows, so the last strip is partial.
+  MakeImage(1928, 1090);
+  const char app1[] = "Exif\0\0test";
+
+  JpegCompressor serial;
+  ASSERT_TRUE(serial.CompressImage(image_.data(), width_, height_, 90, app1,
+                                   sizeof(app1)));
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(DecodeLuma(
+      static_cast<const uint8_t*>(serial.GetCompressedImagePtr()),
+      serial.GetCompressedImageSize(), &expected));
+
+  std::vector<uint8_t> jpeg(image_.size());
+  size_t jpeg_size;
+  ASSERT_TRUE(dut_.Start(image_.data(), width_, height_, 90, 4));
+  ASSERT_TRUE(dut_.Finish(app1, sizeof(app1), jpeg.data(), jpeg.size(),
+                          &jpeg_size));
+  std::vector<uint8_t> actual;
+  ASSERT_TRUE(DecodeLuma(jpeg.data(), jpeg_size, &actual));
+  // Restart intervals don't change the coded blocks.
+  EXPECT_EQ(actual, expected);
+}
+
+TEST_F(ParallelJpegCompressorTest, FailsIfOutputTooSmall) {
+  MakeImage(640, 480);
+  std::vector<uint8_t> jpeg(1024);
+  size_t jpeg_size;
+  ASSERT_TRUE(dut_.Start(image_.data(), width_, height_, 90, 4));
+  EXPECT_FALSE(
+      dut_.Finish(nullptr, 0, jpeg.data(), jpeg.size(), &jpeg_size));
+  EXPECT_GT(jpeg_size, jpeg.size());
+}
+
+}  // namespace arc
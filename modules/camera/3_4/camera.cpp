@@ -519,6 +519,7 @@ void Camera::dump(int fd)
     android::Mutex::Autolock dl(mDeviceLock);
 
     dprintf(fd, "Camera ID: %d (Busy: %d)\n", mId, mBusy);
+    dumpDevice(fd);
 
     // TODO: dump all settings
 }
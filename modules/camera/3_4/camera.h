@@ -85,6 +85,8 @@ class Camera {
             std::shared_ptr<CaptureRequest> request) = 0;
         // Flush in flight buffers.
         virtual int flushBuffers() = 0;
+        // Dump device specific state.
+        virtual void dumpDevice(int fd) = 0;
 
 
         // Callback for when the device has filled in the requested data.
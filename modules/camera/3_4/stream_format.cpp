@@ -19,6 +19,9 @@
 
 #include "stream_format.h"
 
+#include <algorithm>
+
+#include <hardware/camera3.h>
 #include <system/graphics.h>
 #include "arc/image_processor.h"
 #include "common.h"
@@ -41,7 +44,8 @@ StreamFormat::StreamFormat(int format, uint32_t width, uint32_t height)
       v4l2_pixel_format_(StreamFormat::HalToV4L2PixelFormat(format)),
       width_(width),
       height_(height),
-      bytes_per_line_(0) {}
+      bytes_per_line_(0),
+      size_image_(0) {}
 
 StreamFormat::StreamFormat(const v4l2_format& format)
     : type_(format.type),
@@ -49,14 +53,16 @@ StreamFormat::StreamFormat(const v4l2_format& format)
       v4l2_pixel_format_(format.fmt.pix.pixelformat),
       width_(format.fmt.pix.width),
       height_(format.fmt.pix.height),
-      bytes_per_line_(format.fmt.pix.bytesperline) {}
+      bytes_per_line_(format.fmt.pix.bytesperline),
+      size_image_(format.fmt.pix.sizeimage) {}
 
 StreamFormat::StreamFormat(const arc::SupportedFormat& format)
     : type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
       v4l2_pixel_format_(format.fourcc),
       width_(format.width),
       height_(format.height),
-      bytes_per_line_(0) {}
+      bytes_per_line_(0),
+      size_image_(0) {}
 
 void StreamFormat::FillFormatRequest(v4l2_format* format) const {
   memset(format, 0, sizeof(*format));
@@ -142,6 +148,23 @@ uint32_t StreamFormat::HalToV4L2PixelFormat(int hal_pixel_format) {
   return -1;
 }
 
+size_t StreamFormat::JpegBufferSize(uint32_t width, uint32_t height,
+                                    uint32_t max_width, uint32_t max_height) {
+  // Same as the framework's computation, float rounding included, so the
+  // result is never larger than the buffer it allocated.
+  const size_t kMinJpegBufferSize = 256 * 1024 + sizeof(camera3_jpeg_blob_t);
+  uint64_t max_area = static_cast<uint64_t>(max_width) * max_height;
+  if (max_area == 0) {
+    // Largest resolution unknown; only the largest one gets the full size.
+    return kV4L2MaxJpegSize;
+  }
+  float scale_factor =
+      static_cast<float>(static_cast<uint64_t>(width) * height) / max_area;
+  size_t size = scale_factor * (kV4L2MaxJpegSize - kMinJpegBufferSize) +
+                kMinJpegBufferSize;
+  return std::min(size, kV4L2MaxJpegSize);
+}
+
 // Copy the qualified format into out_format and return true if there is a
 // proper and fitting format in the given format lists.
 bool StreamFormat::FindBestFitFormat(const SupportedFormats& supported_formats,
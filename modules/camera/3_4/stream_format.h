@@ -24,6 +24,11 @@
 
 namespace v4l2_camera_hal {
 
+// Size of the buffers allocated for JPEG (BLOB) streams of the largest JPEG
+// resolution, as advertised in ANDROID_JPEG_MAX_SIZE. Generously allow up to
+// 6MB (the largest size on the RPi Camera is about 5MB).
+const size_t kV4L2MaxJpegSize = 6000000;
+
 enum FormatCategory {
   kFormatCategoryRaw,
   kFormatCategoryStalling,
@@ -48,6 +53,7 @@ class StreamFormat {
   inline uint32_t height() const { return height_; };
   inline uint32_t v4l2_pixel_format() const { return v4l2_pixel_format_; }
   inline uint32_t bytes_per_line() const { return bytes_per_line_; };
+  inline uint32_t size_image() const { return size_image_; };
 
   bool operator==(const StreamFormat& other) const;
   bool operator!=(const StreamFormat& other) const;
@@ -57,6 +63,12 @@ class StreamFormat {
   static uint32_t HalToV4L2PixelFormat(int hal_pixel_format);
   // Returns -1 for unrecognized.
   static int V4L2ToHalPixelFormat(uint32_t v4l2_pixel_format);
+  // Size of the BLOB buffers the framework allocates for a |width| x |height|
+  // JPEG stream, when the largest JPEG resolution is |max_width| x
+  // |max_height|. Smaller resolutions get kV4L2MaxJpegSize scaled down by
+  // area, as in Camera3Device::getJpegBufferSize.
+  static size_t JpegBufferSize(uint32_t width, uint32_t height,
+                               uint32_t max_width, uint32_t max_height);
 
   // ARC++ SupportedFormat Helpers
   static bool FindBestFitFormat(const arc::SupportedFormats& supported_formats,
@@ -76,6 +88,7 @@ class StreamFormat {
   uint32_t width_;
   uint32_t height_;
   uint32_t bytes_per_line_;
+  uint32_t size_image_;
 };
 
 }  // namespace v4l2_camera_hal
@@ -19,14 +19,17 @@
 
 #include "v4l2_camera.h"
 
+#include <cinttypes>
 #include <cstdlib>
 #include <fcntl.h>
 
+#include <android-base/properties.h>
 #include <camera/CameraMetadata.h>
 #include <hardware/camera3.h>
 #include <linux/videodev2.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include "arc/image_processor.h"
 #include "common.h"
 #include "function_thread.h"
 #include "metadata/metadata_common.h"
@@ -37,6 +40,14 @@
 
 namespace v4l2_camera_hal {
 
+// Number of threads converting dequeued frames in parallel.
+const size_t kNumConversionThreads = 2;
+
+// Set to true to capture single YUV streams straight into the framework's
+// buffers. Off by default, as it relies on gralloc laying the buffers out
+// exactly as the driver writes them.
+const char kDmabufCaptureProperty[] = "ro.camera.v4l2.dmabuf_capture";
+
 V4L2Camera* V4L2Camera::NewV4L2Camera(int id, const std::string path) {
   HAL_LOG_ENTER();
 
@@ -45,6 +56,12 @@ V4L2Camera* V4L2Camera::NewV4L2Camera(int id, const std::string path) {
     HAL_LOGE("Failed to initialize V4L2 wrapper.");
     return nullptr;
   }
+  return NewV4L2Camera(id, std::move(v4l2_wrapper));
+}
+
+V4L2Camera* V4L2Camera::NewV4L2Camera(
+    int id, std::shared_ptr<V4L2Wrapper> v4l2_wrapper) {
+  HAL_LOG_ENTER();
 
   std::unique_ptr<Metadata> metadata;
   int res = GetV4L2Metadata(v4l2_wrapper, &metadata);
@@ -62,13 +79,19 @@ V4L2Camera::V4L2Camera(int id,
     : default_camera_hal::Camera(id),
       device_(std::move(v4l2_wrapper)),
       metadata_(std::move(metadata)),
+      in_flight_buffer_count_(0),
       buffer_enqueuer_(new FunctionThread(
           std::bind(&V4L2Camera::enqueueRequestBuffers, this))),
       buffer_dequeuer_(new FunctionThread(
           std::bind(&V4L2Camera::dequeueRequestBuffers, this))),
+      delivering_conversions_(false),
       max_input_streams_(0),
       max_output_streams_({{0, 0, 0}}) {
   HAL_LOG_ENTER();
+  for (size_t i = 0; i < kNumConversionThreads; ++i) {
+    buffer_converters_.emplace_back(new FunctionThread(
+        std::bind(&V4L2Camera::convertRequestBuffers, this)));
+  }
 }
 
 V4L2Camera::~V4L2Camera() {
@@ -112,7 +135,21 @@ void V4L2Camera::disconnect() {
 
 int V4L2Camera::flushBuffers() {
   HAL_LOG_ENTER();
-  return device_->StreamOff();
+  int res = device_->StreamOff();
+  // Turning the stream off returned every buffer, so the dequeue thread
+  // must go back to waiting for new requests.
+  std::lock_guard<std::mutex> guard(in_flight_lock_);
+  in_flight_buffer_count_ = 0;
+  return res;
+}
+
+void V4L2Camera::dumpDevice(int fd) {
+  arc::FrameBufferPool::Stats stats = device_->frame_buffer_pool()->GetStats();
+  dprintf(fd, "Conversion buffers: %zu idle, %" PRIu64 " reserved (%" PRIu64
+          " bytes)\n", stats.pooled, stats.reserved, stats.reserved_bytes);
+  dprintf(fd, "Conversion buffer allocations: %" PRIu64 " of %" PRIu64
+          " acquisitions (%" PRIu64 " bytes)\n", stats.allocated,
+          stats.acquired, stats.allocated_bytes);
 }
 
 int V4L2Camera::initStaticInfo(android::CameraMetadata* out) {
@@ -138,6 +175,23 @@ int V4L2Camera::initStaticInfo(android::CameraMetadata* out) {
     return res;
   }
 
+  // The framework sizes BLOB buffers against the largest JPEG resolution.
+  camera_metadata_entry_t configs =
+      out->find(ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS);
+  uint32_t max_jpeg_width = 0;
+  uint32_t max_jpeg_height = 0;
+  for (size_t i = 0; i + 3 < configs.count; i += 4) {
+    // Each configuration is {format, width, height, direction}.
+    const int32_t* config = configs.data.i32 + i;
+    if (config[0] == HAL_PIXEL_FORMAT_BLOB &&
+        static_cast<uint64_t>(config[1]) * config[2] >
+            static_cast<uint64_t>(max_jpeg_width) * max_jpeg_height) {
+      max_jpeg_width = config[1];
+      max_jpeg_height = config[2];
+    }
+  }
+  device_->SetMaxJpegResolution(max_jpeg_width, max_jpeg_height);
+
   return 0;
 }
 
@@ -175,6 +229,15 @@ int V4L2Camera::initDevice() {
       return -ENODEV;
     }
   }
+  for (auto& converter : buffer_converters_) {
+    if (!converter->isRunning()) {
+      android::status_t res = converter->run("Convert buffers");
+      if (res != android::OK) {
+        HAL_LOGE("Failed to start buffer conversion thread: %d", res);
+        return -ENODEV;
+      }
+    }
+  }
 
   return 0;
 }
@@ -184,7 +247,7 @@ int V4L2Camera::enqueueRequest(
   HAL_LOG_ENTER();
 
   // Assume request validated before calling this function.
-  // (For now, always exactly 1 output buffer, no inputs).
+  // (For now, no inputs).
   {
     std::lock_guard<std::mutex> guard(request_queue_lock_);
     request_queue_.push(request);
@@ -213,7 +276,7 @@ bool V4L2Camera::enqueueRequestBuffers() {
       dequeueRequest();
 
   // Assume request validated before being added to the queue
-  // (For now, always exactly 1 output buffer, no inputs).
+  // (For now, no inputs).
 
   // Setting and getting settings are best effort here,
   // since there's no way to know through V4L2 exactly what
@@ -266,35 +329,125 @@ bool V4L2Camera::enqueueRequestBuffers() {
 }
 
 bool V4L2Camera::dequeueRequestBuffers() {
+  // Sleep until there is something in flight to wait for.
+  {
+    std::unique_lock<std::mutex> lock(in_flight_lock_);
+    while (in_flight_buffer_count_ == 0) {
+      buffers_in_flight_.wait(lock);
+    }
+  }
+
+  // Block on the device until a frame is ready, rather than spinning on
+  // DequeueBuffer returning EAGAIN.
+  int res = device_->WaitForBuffers();
+  if (res == -EINTR) {
+    // Woken by a flush or disconnect; recheck what is in flight.
+    return true;
+  } else if (res) {
+    HAL_LOGE("Device failed to wait for buffers: %d", res);
+    cancelInFlightRequests();
+    return true;
+  }
+
   // Dequeue a buffer.
+  uint32_t index;
   std::shared_ptr<default_camera_hal::CaptureRequest> request;
-  int res;
-
   {
     std::unique_lock<std::mutex> lock(in_flight_lock_);
-    res = device_->DequeueRequest(&request);
-    if (!res) {
-      if (request) {
-        completeRequest(request, res);
-        in_flight_buffer_count_--;
-      }
-      return true;
+    res = device_->DequeueBuffer(&index, &request);
+    if (!res && request) {
+      in_flight_buffer_count_--;
     }
   }
 
-  if (res == -EAGAIN) {
-    // EAGAIN just means nothing to dequeue right now.
-    // Wait until something is available before looping again.
-    std::unique_lock<std::mutex> lock(in_flight_lock_);
-    while (in_flight_buffer_count_ == 0) {
-      buffers_in_flight_.wait(lock);
+  if (res) {
+    if (res != -EAGAIN) {
+      HAL_LOGE("Device failed to dequeue buffer: %d", res);
+      cancelInFlightRequests();
     }
-  } else {
-    HAL_LOGW("Device failed to dequeue buffer: %d", res);
+    return true;
+  }
+  if (!request) {
+    // Flushed since it was dequeued; nothing to convert.
+    device_->ReleaseBuffer(index, request);
+    return true;
   }
+
+  // Hand the buffer off for conversion so the next one can be dequeued.
+  std::lock_guard<std::mutex> guard(conversion_lock_);
+  auto conversion =
+      std::make_shared<Conversion>(Conversion{index, request, false, 0});
+  pending_conversions_.push(conversion);
+  ordered_conversions_.push_back(conversion);
+  conversions_available_.notify_one();
   return true;
 }
 
+void V4L2Camera::cancelInFlightRequests() {
+  // None of the buffers queued to a failed device will come back. Fail their
+  // requests, so the dequeue thread sleeps until new ones are queued (or a
+  // flush) instead of polling the device again straight away.
+  std::vector<std::shared_ptr<default_camera_hal::CaptureRequest>> requests;
+  {
+    std::lock_guard<std::mutex> guard(in_flight_lock_);
+    device_->CancelQueuedBuffers(&requests);
+    in_flight_buffer_count_ = 0;
+  }
+  for (const auto& request : requests) {
+    completeRequest(request, -ENODEV);
+  }
+}
+
+bool V4L2Camera::convertRequestBuffers() {
+  std::shared_ptr<Conversion> conversion;
+  {
+    std::unique_lock<std::mutex> lock(conversion_lock_);
+    while (pending_conversions_.empty()) {
+      conversions_available_.wait(lock);
+    }
+    conversion = pending_conversions_.front();
+    pending_conversions_.pop();
+  }
+
+  // A flush may have reused the buffer since it was dequeued, in which case
+  // this fails and the request completes with an error.
+  conversion->result =
+      device_->ProcessBuffer(conversion->index, conversion->request);
+  device_->ReleaseBuffer(conversion->index, conversion->request);
+
+  // Conversions may finish out of order; results go back in capture order,
+  // so complete everything at the front that is done. Only one thread
+  // delivers at a time, without holding the lock; it picks up whatever
+  // other threads finish meanwhile.
+  {
+    std::lock_guard<std::mutex> guard(conversion_lock_);
+    conversion->done = true;
+    if (delivering_conversions_) {
+      return true;
+    }
+    delivering_conversions_ = true;
+  }
+  std::vector<std::shared_ptr<Conversion>> ready;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> guard(conversion_lock_);
+      while (!ordered_conversions_.empty() &&
+             ordered_conversions_.front()->done) {
+        ready.push_back(ordered_conversions_.front());
+        ordered_conversions_.pop_front();
+      }
+      if (ready.empty()) {
+        delivering_conversions_ = false;
+        return true;
+      }
+    }
+    for (const std::shared_ptr<Conversion>& next : ready) {
+      completeRequest(next->request, next->result);
+    }
+    ready.clear();
+  }
+}
+
 bool V4L2Camera::validateDataspacesAndRotations(
     const camera3_stream_configuration_t* stream_config) {
   HAL_LOG_ENTER();
@@ -323,37 +476,20 @@ int V4L2Camera::setupStreams(camera3_stream_configuration_t* stream_config) {
   in_flight_buffer_count_ = 0;
 
   // stream_config should have been validated; assume at least 1 stream.
+  // V4L2 only captures one format at a time, so capture at the largest
+  // stream's configuration and convert each frame for every other stream.
   camera3_stream_t* stream = stream_config->streams[0];
+  for (uint32_t i = 1; i < stream_config->num_streams; ++i) {
+    camera3_stream_t* candidate = stream_config->streams[i];
+    if (static_cast<uint64_t>(candidate->width) * candidate->height >
+        static_cast<uint64_t>(stream->width) * stream->height) {
+      stream = candidate;
+    }
+  }
   int format = stream->format;
   uint32_t width = stream->width;
   uint32_t height = stream->height;
 
-  if (stream_config->num_streams > 1) {
-    // TODO(b/29939583):  V4L2 doesn't actually support more than 1
-    // stream at a time. If not all streams are the same format
-    // and size, error. Note that this means the HAL is not spec-compliant.
-    // Technically, this error should be thrown during validation, but
-    // since it isn't a spec-valid error validation isn't set up to check it.
-    for (uint32_t i = 1; i < stream_config->num_streams; ++i) {
-      stream = stream_config->streams[i];
-      if (stream->format != format || stream->width != width ||
-          stream->height != height) {
-        HAL_LOGE(
-            "V4L2 only supports 1 stream configuration at a time "
-            "(stream 0 is format %d, width %u, height %u, "
-            "stream %d is format %d, width %u, height %u).",
-            format,
-            width,
-            height,
-            i,
-            stream->format,
-            stream->width,
-            stream->height);
-        return -EINVAL;
-      }
-    }
-  }
-
   // Ensure the stream is off.
   int res = device_->StreamOff();
   if (res) {
@@ -361,9 +497,21 @@ int V4L2Camera::setupStreams(camera3_stream_configuration_t* stream_config) {
     return -ENODEV;
   }
 
+  // Let the device own the capture buffers, unless capturing straight into
+  // the framework's buffers is enabled for this device. JPEG always needs
+  // encoding and each frame of a multi-stream configuration fans out to
+  // several buffers, so those can never be captured into directly. The
+  // wrapper falls back to MMAP if the stream, the driver or the gralloc
+  // layout of the buffers can't do this.
+  uint32_t memory = V4L2_MEMORY_MMAP;
+  if (android::base::GetBoolProperty(kDmabufCaptureProperty, false) &&
+      format != HAL_PIXEL_FORMAT_BLOB && stream_config->num_streams == 1) {
+    memory = V4L2_MEMORY_DMABUF;
+  }
+
   StreamFormat stream_format(format, width, height);
   uint32_t max_buffers = 0;
-  res = device_->SetFormat(stream_format, &max_buffers);
+  res = device_->SetFormat(stream_format, memory, &max_buffers);
   if (res) {
     HAL_LOGE("Failed to set device to correct format for stream: %d.", res);
     return -ENODEV;
@@ -376,6 +524,26 @@ int V4L2Camera::setupStreams(camera3_stream_configuration_t* stream_config) {
     return -ENODEV;
   }
 
+  // Reserve what each converter thread needs to convert one frame: the YU12
+  // copy of the capture, a scaled copy per other stream size, and the JPEG
+  // encoder's padding row (it encodes straight into the BLOB buffer).
+  std::vector<size_t> conversion_sizes;
+  conversion_sizes.push_back(arc::ImageProcessor::GetConvertedSize(
+      V4L2_PIX_FMT_YUV420, width, height));
+  for (uint32_t i = 0; i < stream_config->num_streams; ++i) {
+    stream = stream_config->streams[i];
+    size_t yu12_size = arc::ImageProcessor::GetConvertedSize(
+        V4L2_PIX_FMT_YUV420, stream->width, stream->height);
+    if (stream->width != width || stream->height != height) {
+      conversion_sizes.push_back(yu12_size);
+    }
+    if (stream->format == HAL_PIXEL_FORMAT_BLOB) {
+      conversion_sizes.push_back(stream->width);
+    }
+  }
+  device_->frame_buffer_pool()->Reserve(conversion_sizes,
+                                        kNumConversionThreads);
+
   // Set all the streams dataspaces, usages, and max buffers.
   for (uint32_t i = 0; i < stream_config->num_streams; ++i) {
     stream = stream_config->streams[i];
@@ -395,6 +563,11 @@ int V4L2Camera::setupStreams(camera3_stream_configuration_t* stream_config) {
         break;
       case CAMERA3_STREAM_OUTPUT:
         stream->usage = GRALLOC_USAGE_SW_WRITE_OFTEN;
+        // The device may write into the buffers, but software still does
+        // if the wrapper falls back to MMAP.
+        if (memory == V4L2_MEMORY_DMABUF) {
+          stream->usage |= GRALLOC_USAGE_HW_CAMERA_WRITE;
+        }
         break;
       case CAMERA3_STREAM_BIDIRECTIONAL:
         stream->usage =
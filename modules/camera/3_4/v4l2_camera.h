@@ -21,8 +21,10 @@
 
 #include <array>
 #include <condition_variable>
+#include <deque>
 #include <queue>
 #include <string>
+#include <vector>
 
 #include <camera/CameraMetadata.h>
 #include <utils/StrongPointer.h>
@@ -42,6 +44,9 @@ class V4L2Camera : public default_camera_hal::Camera {
   // Use this method to create V4L2Camera objects. Functionally equivalent
   // to "new V4L2Camera", except that it may return nullptr in case of failure.
   static V4L2Camera* NewV4L2Camera(int id, const std::string path);
+  // As above, but for an already created device, such as a fake one.
+  static V4L2Camera* NewV4L2Camera(int id,
+                                   std::shared_ptr<V4L2Wrapper> v4l2_wrapper);
   ~V4L2Camera();
 
  private:
@@ -77,6 +82,8 @@ class V4L2Camera : public default_camera_hal::Camera {
       std::shared_ptr<default_camera_hal::CaptureRequest> request) override;
   // Flush in flight buffers.
   int flushBuffers() override;
+  // Dump conversion buffer usage.
+  void dumpDevice(int fd) override;
 
   // Async request processing helpers.
   // Dequeue a request from the waiting queue.
@@ -88,6 +95,18 @@ class V4L2Camera : public default_camera_hal::Camera {
   bool enqueueRequestBuffers();
   // Retreive buffers from the device.
   bool dequeueRequestBuffers();
+  // Convert retrieved buffers and complete their requests.
+  bool convertRequestBuffers();
+  // Fail the requests of every buffer queued to the device, after it failed.
+  void cancelInFlightRequests();
+
+  // A dequeued buffer on its way through the conversion stage.
+  struct Conversion {
+    uint32_t index;
+    std::shared_ptr<default_camera_hal::CaptureRequest> request;
+    bool done;
+    int result;
+  };
 
   // V4L2 helper.
   std::shared_ptr<V4L2Wrapper> device_;
@@ -101,8 +120,20 @@ class V4L2Camera : public default_camera_hal::Camera {
   // Threads require holding an Android strong pointer.
   android::sp<android::Thread> buffer_enqueuer_;
   android::sp<android::Thread> buffer_dequeuer_;
+  std::vector<android::sp<android::Thread>> buffer_converters_;
   std::condition_variable requests_available_;
   std::condition_variable buffers_in_flight_;
+  // Conversions are bounded by the number of device buffers, since each
+  // holds on to its buffer until converted.
+  std::mutex conversion_lock_;
+  std::condition_variable conversions_available_;
+  // Dequeued buffers waiting for a converter thread.
+  std::queue<std::shared_ptr<Conversion>> pending_conversions_;
+  // All undelivered conversions, in capture order.
+  std::deque<std::shared_ptr<Conversion>> ordered_conversions_;
+  // Whether a converter thread is completing the finished conversions at
+  // the front of |ordered_conversions_|.
+  bool delivering_conversions_;
 
   int32_t max_input_streams_;
   std::array<int, 3> max_output_streams_;  // {raw, non-stalling, stalling}.
@@ -0,0 +1,651 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Drives the V4L2 Camera HAL through the camera3 interface against a fake
+// V4L2 device, and reports how long frames spend in each pipeline stage:
+//
+//   enqueue   processCaptureRequest() until the buffer is queued (QBUF).
+//   dqbuf     Frame captured by the device until it is dequeued (DQBUF).
+//   convert   Filling the output buffers of a frame without a JPEG output.
+//   jpeg      Filling the output buffers of a frame with a JPEG output.
+//   callback  Outputs filled until process_capture_result() is called.
+//   total     processCaptureRequest() until process_capture_result().
+//
+// Usage: camera.v4l2_benchmark [--format=yuyv|mjpeg] [--size=WxH] [--fps=N]
+//            [--count=N] [--jpeg-interval=N] [--input=FILE]
+//
+// --fps=0 captures as fast as the HAL keeps up. --jpeg-interval=N adds a JPEG
+// stream, captured instead of the YUV stream every Nth frame. --input replays
+// recorded frames (raw YUYV frames, or concatenated JPEGs for MJPEG) instead
+// of a synthetic pattern.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2CameraBenchmark"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <hardware/camera3.h>
+#include <ui/GraphicBuffer.h>
+#include "arc/jpeg_compressor.h"
+#include "stream_format.h"
+#include "v4l2_camera.h"
+#include "v4l2_wrapper_fake.h"
+
+namespace v4l2_camera_hal {
+
+// Number of synthetic frames to cycle through when no input is given.
+const int kNumSyntheticFrames = 8;
+// Quality of the synthetic MJPEG frames.
+const int kSyntheticJpegQuality = 80;
+// Longest to wait for outstanding frames before giving up.
+const int64_t kFrameTimeoutNs = 5000000000LL;
+
+static int64_t MonotonicNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Latency samples of one pipeline stage.
+class LatencyHistogram {
+ public:
+  explicit LatencyHistogram(const char* name) : name_(name) {}
+
+  void Add(int64_t ns) { samples_.push_back(std::max<int64_t>(ns, 0)); }
+
+  // Prints percentiles, then the sample counts in power of two buckets.
+  void Print() {
+    if (samples_.empty()) {
+      printf("%-9s no samples\n", name_);
+      return;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    int64_t sum = 0;
+    for (int64_t sample : samples_) {
+      sum += sample;
+    }
+    printf("%-9s n=%zu mean=%.3fms p50=%.3fms p90=%.3fms p99=%.3fms "
+           "max=%.3fms\n",
+           name_, samples_.size(), Ms(sum / samples_.size()), Percentile(50),
+           Percentile(90), Percentile(99), Ms(samples_.back()));
+
+    std::map<int, size_t> buckets;
+    for (int64_t sample : samples_) {
+      int bucket = 0;
+      for (int64_t us = sample / 1000; us > 1; us >>= 1) {
+        ++bucket;
+      }
+      ++buckets[bucket];
+    }
+    for (const auto& bucket : buckets) {
+      int bar = (bucket.second * 50 + samples_.size() - 1) / samples_.size();
+      printf("  < %8" PRId64 "us %6zu %s\n", int64_t{2} << bucket.first,
+             bucket.second, std::string(bar, '#').c_str());
+    }
+  }
+
+ private:
+  static double Ms(int64_t ns) { return ns / 1000000.0; }
+  double Percentile(int percent) {
+    size_t index = (samples_.size() - 1) * percent / 100;
+    return Ms(samples_[index]);
+  }
+
+  const char* name_;
+  std::vector<int64_t> samples_;
+};
+
+// Times of the stage boundaries of one frame, in CLOCK_MONOTONIC ns.
+struct FrameTimes {
+  bool jpeg = false;
+  int64_t submitted = 0;
+  int64_t enqueued = 0;
+  int64_t captured = 0;
+  int64_t dequeued = 0;
+  int64_t processed = 0;
+};
+
+// Collects stage timings from the HAL threads.
+class PipelineStats {
+ public:
+  PipelineStats()
+      : enqueue_("enqueue"),
+        dqbuf_("dqbuf"),
+        convert_("convert"),
+        jpeg_("jpeg"),
+        callback_("callback"),
+        total_("total"),
+        completed_(0),
+        errors_(0) {}
+
+  void OnSubmitted(uint32_t frame_number, bool jpeg) {
+    std::lock_guard<std::mutex> guard(lock_);
+    FrameTimes& times = frames_[frame_number];
+    times.jpeg = jpeg;
+    times.submitted = MonotonicNs();
+  }
+  void OnEnqueued(uint32_t frame_number) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto frame = frames_.find(frame_number);
+    if (frame != frames_.end()) {
+      frame->second.enqueued = MonotonicNs();
+    }
+  }
+  void OnDequeued(uint32_t frame_number, uint32_t index, int64_t captured) {
+    std::lock_guard<std::mutex> guard(lock_);
+    buffer_frames_[index] = frame_number;
+    auto frame = frames_.find(frame_number);
+    if (frame != frames_.end()) {
+      frame->second.captured = captured;
+      frame->second.dequeued = MonotonicNs();
+    }
+  }
+  void OnProcessed(uint32_t index, int64_t start) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto buffer = buffer_frames_.find(index);
+    if (buffer == buffer_frames_.end()) {
+      return;
+    }
+    auto frame = frames_.find(buffer->second);
+    if (frame == frames_.end()) {
+      return;
+    }
+    FrameTimes& times = frame->second;
+    times.processed = MonotonicNs();
+    (times.jpeg ? jpeg_ : convert_).Add(times.processed - start);
+  }
+  void OnResult(uint32_t frame_number, bool error) {
+    int64_t now = MonotonicNs();
+    std::lock_guard<std::mutex> guard(lock_);
+    auto frame = frames_.find(frame_number);
+    if (frame == frames_.end()) {
+      return;
+    }
+    const FrameTimes& times = frame->second;
+    if (error) {
+      ++errors_;
+    } else {
+      enqueue_.Add(times.enqueued - times.submitted);
+      dqbuf_.Add(times.dequeued - times.captured);
+      callback_.Add(now - times.processed);
+      total_.Add(now - times.submitted);
+    }
+    ++completed_;
+    frames_.erase(frame);
+    completion_.notify_all();
+  }
+
+  // Waits until |count| frames have completed. Returns false on timeout.
+  bool WaitForCompleted(uint32_t count) {
+    std::unique_lock<std::mutex> lock(lock_);
+    return completion_.wait_for(
+        lock, std::chrono::nanoseconds(kFrameTimeoutNs),
+        [this, count] { return completed_ >= count; });
+  }
+
+  void Print() {
+    std::lock_guard<std::mutex> guard(lock_);
+    printf("Frames: %u completed, %u failed\n", completed_, errors_);
+    for (LatencyHistogram* histogram :
+         {&enqueue_, &dqbuf_, &convert_, &jpeg_, &callback_, &total_}) {
+      histogram->Print();
+    }
+  }
+
+ private:
+  std::mutex lock_;
+  std::condition_variable completion_;
+  std::map<uint32_t, FrameTimes> frames_;
+  // The frame last dequeued into each device buffer.
+  std::map<uint32_t, uint32_t> buffer_frames_;
+  LatencyHistogram enqueue_;
+  LatencyHistogram dqbuf_;
+  LatencyHistogram convert_;
+  LatencyHistogram jpeg_;
+  LatencyHistogram callback_;
+  LatencyHistogram total_;
+  uint32_t completed_;
+  uint32_t errors_;
+};
+
+// A fake device that reports when frames pass through the wrapper.
+class TimedV4L2Wrapper : public V4L2WrapperFake {
+ public:
+  static TimedV4L2Wrapper* NewTimedV4L2Wrapper(Options options,
+                                               PipelineStats* stats) {
+    if (!ValidateOptions(options)) {
+      return nullptr;
+    }
+    android::base::unique_fd wakeup_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    android::base::unique_fd ready_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (wakeup_fd.get() < 0 || ready_fd.get() < 0) {
+      return nullptr;
+    }
+    return new TimedV4L2Wrapper(std::move(options), std::move(wakeup_fd),
+                                std::move(ready_fd), stats);
+  }
+
+  int EnqueueRequest(
+      std::shared_ptr<default_camera_hal::CaptureRequest> request) override {
+    int res = V4L2WrapperFake::EnqueueRequest(request);
+    if (!res) {
+      stats_->OnEnqueued(request->frame_number);
+    }
+    return res;
+  }
+
+  int DequeueBuffer(
+      uint32_t* index,
+      std::shared_ptr<default_camera_hal::CaptureRequest>* request) override {
+    int res = V4L2WrapperFake::DequeueBuffer(index, request);
+    if (!res && *request) {
+      stats_->OnDequeued((*request)->frame_number, *index,
+                         GetCaptureTimestamp(*index));
+    }
+    return res;
+  }
+
+  int ProcessBuffer(uint32_t index,
+                    const std::shared_ptr<default_camera_hal::CaptureRequest>&
+                        request) override {
+    int64_t start = MonotonicNs();
+    int res = V4L2WrapperFake::ProcessBuffer(index, request);
+    stats_->OnProcessed(index, start);
+    return res;
+  }
+
+ private:
+  TimedV4L2Wrapper(Options options, android::base::unique_fd wakeup_fd,
+                   android::base::unique_fd ready_fd, PipelineStats* stats)
+      : V4L2WrapperFake(std::move(options), std::move(wakeup_fd),
+                        std::move(ready_fd)),
+        stats_(stats) {}
+
+  PipelineStats* stats_;
+};
+
+// Gralloc buffers for one stream, handed out round robin as they come back.
+class StreamBuffers {
+ public:
+  int Allocate(const camera3_stream_t& stream) {
+    // BLOB buffers are sized in bytes, like the framework allocates them.
+    bool blob = stream.format == HAL_PIXEL_FORMAT_BLOB;
+    for (uint32_t i = 0; i < stream.max_buffers; ++i) {
+      android::sp<android::GraphicBuffer> buffer(new android::GraphicBuffer(
+          blob ? kV4L2MaxJpegSize : stream.width, blob ? 1 : stream.height,
+          stream.format, 1, stream.usage, "camera.v4l2_benchmark"));
+      if (buffer->initCheck() != android::OK) {
+        fprintf(stderr, "Failed to allocate %ux%u buffer of format 0x%x\n",
+                stream.width, stream.height, stream.format);
+        return -ENOMEM;
+      }
+      buffers_.push_back(buffer);
+    }
+    handles_.resize(buffers_.size());
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      handles_[i] = buffers_[i]->handle;
+      free_.push_back(&handles_[i]);
+    }
+    return 0;
+  }
+
+  // Blocks until a buffer is free. Returns nullptr on timeout.
+  buffer_handle_t* Acquire() {
+    std::unique_lock<std::mutex> lock(lock_);
+    if (!returned_.wait_for(lock, std::chrono::nanoseconds(kFrameTimeoutNs),
+                            [this] { return !free_.empty(); })) {
+      return nullptr;
+    }
+    buffer_handle_t* handle = free_.back();
+    free_.pop_back();
+    return handle;
+  }
+
+  void Release(buffer_handle_t* handle) {
+    std::lock_guard<std::mutex> guard(lock_);
+    free_.push_back(handle);
+    returned_.notify_one();
+  }
+
+ private:
+  std::vector<android::sp<android::GraphicBuffer>> buffers_;
+  std::vector<buffer_handle_t> handles_;
+  std::mutex lock_;
+  std::condition_variable returned_;
+  std::vector<buffer_handle_t*> free_;
+};
+
+// The framework side of the camera3 interface.
+struct Framework : public camera3_callback_ops_t {
+  PipelineStats* stats;
+  std::map<const camera3_stream_t*, StreamBuffers*> streams;
+};
+
+static void ProcessCaptureResult(const camera3_callback_ops_t* ops,
+                                 const camera3_capture_result_t* result) {
+  const Framework* framework = static_cast<const Framework*>(ops);
+  bool error = false;
+  for (uint32_t i = 0; i < result->num_output_buffers; ++i) {
+    const camera3_stream_buffer_t& buffer = result->output_buffers[i];
+    error |= buffer.status != CAMERA3_BUFFER_STATUS_OK;
+    framework->streams.at(buffer.stream)->Release(buffer.buffer);
+  }
+  framework->stats->OnResult(result->frame_number, error);
+}
+
+static void Notify(const camera3_callback_ops_t* ops,
+                   const camera3_notify_msg_t* msg) {
+  const Framework* framework = static_cast<const Framework*>(ops);
+  if (msg->type == CAMERA3_MSG_ERROR) {
+    // The errored result follows; count it as failed.
+    framework->stats->OnResult(msg->message.error.frame_number, true);
+  }
+}
+
+// Splits |data| into the frames of a |fourcc| stream of |width|x|height|.
+static std::vector<std::vector<uint8_t>> SplitFrames(
+    const std::vector<uint8_t>& data, uint32_t fourcc, uint32_t width,
+    uint32_t height) {
+  std::vector<std::vector<uint8_t>> frames;
+  if (fourcc == V4L2_PIX_FMT_YUYV) {
+    size_t frame_size = width * height * 2;
+    for (size_t offset = 0; offset + frame_size <= data.size();
+         offset += frame_size) {
+      frames.emplace_back(data.begin() + offset,
+                          data.begin() + offset + frame_size);
+    }
+    return frames;
+  }
+  // Concatenated JPEGs: a frame starts with SOI right after the previous
+  // one's EOI.
+  size_t start = 0;
+  for (size_t i = 2; i + 1 < data.size(); ++i) {
+    if (data[i] == 0xFF && data[i + 1] == 0xD8 && data[i - 2] == 0xFF &&
+        data[i - 1] == 0xD9) {
+      frames.emplace_back(data.begin() + start, data.begin() + i);
+      start = i;
+    }
+  }
+  if (start < data.size()) {
+    frames.emplace_back(data.begin() + start, data.end());
+  }
+  return frames;
+}
+
+// Makes a moving test pattern of |fourcc| frames.
+static std::vector<std::vector<uint8_t>> SyntheticFrames(uint32_t fourcc,
+                                                         uint32_t width,
+                                                         uint32_t height) {
+  std::vector<std::vector<uint8_t>> frames;
+  for (int i = 0; i < kNumSyntheticFrames; ++i) {
+    if (fourcc == V4L2_PIX_FMT_YUYV) {
+      std::vector<uint8_t> frame(width * height * 2);
+      for (uint32_t y = 0; y < height; ++y) {
+        uint8_t* row = frame.data() + y * width * 2;
+        for (uint32_t x = 0; x < width; x += 2) {
+          row[x * 2] = x + y + i * 8;
+          row[x * 2 + 1] = 128 + x / 8;
+          row[x * 2 + 2] = x + 1 + y + i * 8;
+          row[x * 2 + 3] = 128 + y / 8;
+        }
+      }
+      frames.push_back(std::move(frame));
+      continue;
+    }
+    std::vector<uint8_t> yu12(width * height * 3 / 2);
+    for (uint32_t y = 0; y < height; ++y) {
+      for (uint32_t x = 0; x < width; ++x) {
+        yu12[y * width + x] = x + y + i * 8;
+      }
+    }
+    std::fill(yu12.begin() + width * height, yu12.end(), 128);
+    arc::JpegCompressor compressor;
+    if (!compressor.CompressImage(yu12.data(), width, height,
+                                  kSyntheticJpegQuality, nullptr, 0)) {
+      return {};
+    }
+    const uint8_t* jpeg =
+        static_cast<const uint8_t*>(compressor.GetCompressedImagePtr());
+    frames.emplace_back(jpeg, jpeg + compressor.GetCompressedImageSize());
+  }
+  return frames;
+}
+
+struct BenchmarkOptions {
+  uint32_t fourcc = V4L2_PIX_FMT_YUYV;
+  uint32_t width = 1280;
+  uint32_t height = 720;
+  uint32_t fps = 30;
+  uint32_t count = 300;
+  uint32_t jpeg_interval = 0;
+  std::string input;
+};
+
+static bool ParseOptions(int argc, char** argv, BenchmarkOptions* options) {
+  static const option kOptions[] = {
+      {"format", required_argument, nullptr, 'f'},
+      {"size", required_argument, nullptr, 's'},
+      {"fps", required_argument, nullptr, 'r'},
+      {"count", required_argument, nullptr, 'n'},
+      {"jpeg-interval", required_argument, nullptr, 'j'},
+      {"input", required_argument, nullptr, 'i'},
+      {nullptr, 0, nullptr, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", kOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'f':
+        if (!strcmp(optarg, "yuyv")) {
+          options->fourcc = V4L2_PIX_FMT_YUYV;
+        } else if (!strcmp(optarg, "mjpeg")) {
+          options->fourcc = V4L2_PIX_FMT_MJPEG;
+        } else {
+          return false;
+        }
+        break;
+      case 's':
+        if (sscanf(optarg, "%ux%u", &options->width, &options->height) != 2) {
+          return false;
+        }
+        break;
+      case 'r':
+        options->fps = strtoul(optarg, nullptr, 10);
+        break;
+      case 'n':
+        options->count = strtoul(optarg, nullptr, 10);
+        break;
+      case 'j':
+        options->jpeg_interval = strtoul(optarg, nullptr, 10);
+        break;
+      case 'i':
+        options->input = optarg;
+        break;
+      default:
+        return false;
+    }
+  }
+  return options->width > 0 && options->height > 0 && options->count > 0;
+}
+
+static int Run(const BenchmarkOptions& options) {
+  V4L2WrapperFake::Options device_options;
+  device_options.fourcc = options.fourcc;
+  device_options.width = options.width;
+  device_options.height = options.height;
+  device_options.fps = options.fps;
+  if (options.input.empty()) {
+    device_options.frames =
+        SyntheticFrames(options.fourcc, options.width, options.height);
+  } else {
+    std::ifstream input(options.input, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                              std::istreambuf_iterator<char>());
+    device_options.frames =
+        SplitFrames(data, options.fourcc, options.width, options.height);
+  }
+
+  PipelineStats stats;
+  std::shared_ptr<TimedV4L2Wrapper> device(
+      TimedV4L2Wrapper::NewTimedV4L2Wrapper(std::move(device_options), &stats));
+  if (!device) {
+    fprintf(stderr, "Failed to create fake device\n");
+    return 1;
+  }
+  // Like the HAL's cameras, this lives as long as the process, since its
+  // worker threads never exit.
+  V4L2Camera* camera = V4L2Camera::NewV4L2Camera(0, device);
+  if (!camera) {
+    fprintf(stderr, "Failed to create camera\n");
+    return 1;
+  }
+
+  hw_device_t* hw_device;
+  if (camera->openDevice(nullptr, &hw_device)) {
+    fprintf(stderr, "Failed to open camera\n");
+    return 1;
+  }
+  Framework framework;
+  framework.process_capture_result = &ProcessCaptureResult;
+  framework.notify = &Notify;
+  framework.stats = &stats;
+  if (camera->initialize(&framework)) {
+    fprintf(stderr, "Failed to initialize camera\n");
+    return 1;
+  }
+
+  camera3_stream_t yuv_stream;
+  memset(&yuv_stream, 0, sizeof(yuv_stream));
+  yuv_stream.stream_type = CAMERA3_STREAM_OUTPUT;
+  yuv_stream.width = options.width;
+  yuv_stream.height = options.height;
+  yuv_stream.format = HAL_PIXEL_FORMAT_YCbCr_420_888;
+  camera3_stream_t jpeg_stream = yuv_stream;
+  jpeg_stream.format = HAL_PIXEL_FORMAT_BLOB;
+  std::vector<camera3_stream_t*> streams = {&yuv_stream};
+  if (options.jpeg_interval) {
+    streams.push_back(&jpeg_stream);
+  }
+  camera3_stream_configuration_t config;
+  memset(&config, 0, sizeof(config));
+  config.num_streams = streams.size();
+  config.streams = streams.data();
+  config.operation_mode = CAMERA3_STREAM_CONFIGURATION_NORMAL_MODE;
+  if (camera->configureStreams(&config)) {
+    fprintf(stderr, "Failed to configure streams\n");
+    return 1;
+  }
+
+  StreamBuffers yuv_buffers;
+  StreamBuffers jpeg_buffers;
+  if (yuv_buffers.Allocate(yuv_stream) ||
+      (options.jpeg_interval && jpeg_buffers.Allocate(jpeg_stream))) {
+    return 1;
+  }
+  framework.streams[&yuv_stream] = &yuv_buffers;
+  framework.streams[&jpeg_stream] = &jpeg_buffers;
+
+  const camera_metadata_t* settings =
+      camera->constructDefaultRequestSettings(CAMERA3_TEMPLATE_PREVIEW);
+  arc::FrameBufferPool::Stats pool_before =
+      device->frame_buffer_pool()->GetStats();
+  struct mallinfo heap_before = mallinfo();
+  int64_t start = MonotonicNs();
+
+  uint32_t submitted = 0;
+  for (; submitted < options.count; ++submitted) {
+    bool jpeg = options.jpeg_interval &&
+                submitted % options.jpeg_interval == options.jpeg_interval - 1;
+    camera3_stream_t* stream = jpeg ? &jpeg_stream : &yuv_stream;
+    camera3_stream_buffer_t output;
+    memset(&output, 0, sizeof(output));
+    output.stream = stream;
+    output.buffer = framework.streams[stream]->Acquire();
+    output.acquire_fence = -1;
+    output.release_fence = -1;
+    if (!output.buffer) {
+      fprintf(stderr, "Timed out waiting for frame %u\n", submitted);
+      break;
+    }
+
+    camera3_capture_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.frame_number = submitted;
+    request.settings = settings;
+    request.num_output_buffers = 1;
+    request.output_buffers = &output;
+    stats.OnSubmitted(submitted, jpeg);
+    if (camera->processCaptureRequest(&request)) {
+      fprintf(stderr, "Failed to submit frame %u\n", submitted);
+      break;
+    }
+  }
+  bool drained = stats.WaitForCompleted(submitted);
+  int64_t elapsed = MonotonicNs() - start;
+  struct mallinfo heap_after = mallinfo();
+  arc::FrameBufferPool::Stats pool_after =
+      device->frame_buffer_pool()->GetStats();
+  if (!drained) {
+    fprintf(stderr, "Timed out waiting for outstanding frames\n");
+  }
+  camera->close();
+
+  char fourcc[5] = {};
+  memcpy(fourcc, &options.fourcc, 4);
+  printf("Device: %s %ux%u at %u fps, %" PRIu64 " frames dropped\n", fourcc,
+         options.width, options.height, options.fps,
+         device->GetDroppedFrameCount());
+  printf("Throughput: %.2f frames/s\n", submitted * 1e9 / elapsed);
+  printf("Conversion buffer allocations: %" PRIu64 " of %" PRIu64
+         " acquisitions (%" PRIu64 " bytes)\n",
+         pool_after.allocated - pool_before.allocated,
+         pool_after.acquired - pool_before.acquired,
+         pool_after.allocated_bytes - pool_before.allocated_bytes);
+  printf("Heap growth: %ld bytes\n",
+         static_cast<long>(heap_after.uordblks - heap_before.uordblks));
+  stats.Print();
+  return drained ? 0 : 1;
+}
+
+}  // namespace v4l2_camera_hal
+
+int main(int argc, char** argv) {
+  v4l2_camera_hal::BenchmarkOptions options;
+  if (!v4l2_camera_hal::ParseOptions(argc, argv, &options)) {
+    fprintf(stderr,
+            "Usage: %s [--format=yuyv|mjpeg] [--size=WxH] [--fps=N] "
+            "[--count=N] [--jpeg-interval=N] [--input=FILE]\n",
+            argv[0]);
+    return 1;
+  }
+  return v4l2_camera_hal::Run(options);
+}
@@ -25,8 +25,11 @@
 
 #include <android-base/unique_fd.h>
 #include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "arc/cached_frame.h"
 
 namespace v4l2_camera_hal {
@@ -50,12 +53,28 @@ const int32_t kStandardSizes[][2] = {
   { 176,  144}  // QCIF
 };
 
+// Number of buffers to ask the device for. More than one lets the device
+// capture the next frame while earlier ones are still being converted.
+const uint32_t kNumRequestedBuffers = 4;
+
 V4L2Wrapper* V4L2Wrapper::NewV4L2Wrapper(const std::string device_path) {
-  return new V4L2Wrapper(device_path);
+  android::base::unique_fd wakeup_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (wakeup_fd.get() < 0) {
+    HAL_LOGE("failed to create eventfd (%s)", strerror(errno));
+    return nullptr;
+  }
+  return new V4L2Wrapper(device_path, std::move(wakeup_fd));
 }
 
-V4L2Wrapper::V4L2Wrapper(const std::string device_path)
-    : device_path_(std::move(device_path)), connection_count_(0) {}
+V4L2Wrapper::V4L2Wrapper(const std::string device_path,
+                         android::base::unique_fd wakeup_fd)
+    : device_path_(std::move(device_path)),
+      wakeup_fd_(std::move(wakeup_fd)),
+      memory_(V4L2_MEMORY_USERPTR),
+      dmabuf_verified_(false),
+      max_jpeg_width_(0),
+      max_jpeg_height_(0),
+      connection_count_(0) {}
 
 V4L2Wrapper::~V4L2Wrapper() {}
 
@@ -69,8 +88,7 @@ int V4L2Wrapper::Connect() {
     return 0;
   }
 
-  // Open in nonblocking mode (DQBUF may return EAGAIN).
-  int fd = TEMP_FAILURE_RETRY(open(device_path_.c_str(), O_RDWR | O_NONBLOCK));
+  int fd = OpenDevice(device_path_);
   if (fd < 0) {
     HAL_LOGE("failed to open %s (%s)", device_path_.c_str(), strerror(errno));
     return -ENODEV;
@@ -114,6 +132,8 @@ void V4L2Wrapper::Disconnect() {
     return;
   }
 
+  // Don't leave a dequeue thread blocked on the fd being closed.
+  InterruptWait();
   device_fd_.reset(-1);  // Includes close().
   format_.reset();
   {
@@ -132,7 +152,16 @@ int V4L2Wrapper::IoctlLocked(unsigned long request, T data) {
     HAL_LOGE("Device %s not connected.", device_path_.c_str());
     return -ENODEV;
   }
-  return TEMP_FAILURE_RETRY(ioctl(device_fd_.get(), request, data));
+  return TEMP_FAILURE_RETRY(DeviceIoctl(device_fd_.get(), request, data));
+}
+
+int V4L2Wrapper::OpenDevice(const std::string& device_path) {
+  // Open in nonblocking mode (DQBUF may return EAGAIN).
+  return TEMP_FAILURE_RETRY(open(device_path.c_str(), O_RDWR | O_NONBLOCK));
+}
+
+int V4L2Wrapper::DeviceIoctl(int fd, unsigned long request, void* data) {
+  return ioctl(fd, request, data);
 }
 
 int V4L2Wrapper::StreamOn() {
@@ -166,11 +195,14 @@ int V4L2Wrapper::StreamOff() {
     HAL_LOGE("STREAMOFF fails: %s", strerror(errno));
     return -ENODEV;
   }
-  std::lock_guard<std::mutex> lock(buffer_queue_lock_);
-  for (auto& buffer : buffers_) {
-    buffer.active = false;
-    buffer.request.reset();
+  {
+    std::lock_guard<std::mutex> lock(buffer_queue_lock_);
+    for (auto& buffer : buffers_) {
+      buffer.active = false;
+      buffer.request.reset();
+    }
   }
+  InterruptWait();
   HAL_LOGV("Stream turned off.");
   return 0;
 }
@@ -489,10 +521,11 @@ int V4L2Wrapper::GetFormatFrameDurationRange(
 }
 
 int V4L2Wrapper::SetFormat(const StreamFormat& desired_format,
+                           uint32_t memory,
                            uint32_t* result_max_buffers) {
   HAL_LOG_ENTER();
 
-  if (format_ && desired_format == *format_) {
+  if (format_ && desired_format == *format_ && memory == memory_) {
     HAL_LOGV("Already in correct format, skipping format setting.");
     *result_max_buffers = buffers_.size();
     return 0;
@@ -545,21 +578,68 @@ int V4L2Wrapper::SetFormat(const StreamFormat& desired_format,
   // Keep track of our new format.
   format_.reset(new StreamFormat(new_format));
 
-  // Format changed, request new buffers.
-  int res = RequestBuffers(1);
+  // Output buffers can only be handed to the device when the frame needs
+  // no conversion before being returned to the framework.
+  if (memory == V4L2_MEMORY_DMABUF &&
+      (format_->v4l2_pixel_format() != desired_format.v4l2_pixel_format() ||
+       format_->width() != desired_format.width() ||
+       format_->height() != desired_format.height())) {
+    HAL_LOGV("Stream needs conversion, capturing to MMAP buffers instead.");
+    memory = V4L2_MEMORY_MMAP;
+  }
+
+  // Format changed, request new buffers. Fall back to less direct buffer
+  // modes if the driver doesn't support the preferred one.
+  int res = -ENODEV;
+  for (;;) {
+    res = SetupBuffers(memory);
+    if (!res || memory == V4L2_MEMORY_USERPTR) {
+      break;
+    }
+    HAL_LOGW("Buffer memory type %u unavailable, falling back.", memory);
+    memory = memory == V4L2_MEMORY_DMABUF ? V4L2_MEMORY_MMAP
+                                          : V4L2_MEMORY_USERPTR;
+  }
   if (res) {
     HAL_LOGE("Requesting buffers for new format failed.");
     return res;
   }
+  // The layout of the output buffers is only known once the first is queued.
+  dmabuf_verified_ = false;
   *result_max_buffers = buffers_.size();
   return 0;
 }
 
+void V4L2Wrapper::SetMaxJpegResolution(uint32_t width, uint32_t height) {
+  max_jpeg_width_ = width;
+  max_jpeg_height_ = height;
+}
+
+int V4L2Wrapper::SetupBuffers(uint32_t memory) {
+  memory_ = memory;
+  int res = RequestBuffers(kNumRequestedBuffers);
+  if (!res && memory_ == V4L2_MEMORY_MMAP) {
+    res = MapDeviceBuffers();
+    if (res) {
+      RequestBuffers(0);
+    }
+  }
+  return res;
+}
+
 int V4L2Wrapper::RequestBuffers(uint32_t num_requested) {
+  // The exported mappings keep the driver buffers busy; release them first.
+  {
+    std::lock_guard<std::mutex> guard(buffer_queue_lock_);
+    for (auto& buffer : buffers_) {
+      buffer.device_buffer.reset();
+    }
+  }
+
   v4l2_requestbuffers req_buffers;
   memset(&req_buffers, 0, sizeof(req_buffers));
   req_buffers.type = format_->type();
-  req_buffers.memory = V4L2_MEMORY_USERPTR;
+  req_buffers.memory = memory_;
   req_buffers.count = num_requested;
 
   int res = IoctlLocked(VIDIOC_REQBUFS, &req_buffers);
@@ -574,10 +654,118 @@ int V4L2Wrapper::RequestBuffers(uint32_t num_requested) {
     HAL_LOGE("REQBUFS claims it can't handle any buffers.");
     return -ENODEV;
   }
+  std::lock_guard<std::mutex> guard(buffer_queue_lock_);
   buffers_.resize(req_buffers.count);
   return 0;
 }
 
+int V4L2Wrapper::MapDeviceBuffers() {
+  std::lock_guard<std::mutex> guard(buffer_queue_lock_);
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    v4l2_buffer device_buffer;
+    memset(&device_buffer, 0, sizeof(device_buffer));
+    device_buffer.type = format_->type();
+    device_buffer.memory = V4L2_MEMORY_MMAP;
+    device_buffer.index = i;
+    if (IoctlLocked(VIDIOC_QUERYBUF, &device_buffer) < 0) {
+      HAL_LOGE("QUERYBUF fails: %s", strerror(errno));
+      return -ENODEV;
+    }
+
+    v4l2_exportbuffer export_buffer;
+    memset(&export_buffer, 0, sizeof(export_buffer));
+    export_buffer.type = format_->type();
+    export_buffer.index = i;
+    export_buffer.flags = O_RDONLY | O_CLOEXEC;
+    if (IoctlLocked(VIDIOC_EXPBUF, &export_buffer) < 0) {
+      HAL_LOGE("EXPBUF fails: %s", strerror(errno));
+      return -ENODEV;
+    }
+
+    auto mapped = std::make_shared<arc::V4L2FrameBuffer>(
+        base::ScopedFD(export_buffer.fd), device_buffer.length,
+        format_->width(), format_->height(), format_->v4l2_pixel_format());
+    if (mapped->Map()) {
+      HAL_LOGE("Failed to map device buffer %zu.", i);
+      return -ENODEV;
+    }
+    buffers_[i].device_buffer = std::move(mapped);
+  }
+  return 0;
+}
+
+bool V4L2Wrapper::DmabufLayoutMatches(
+    const camera3_stream_buffer_t& stream_buffer) {
+  const camera3_stream_t* stream = stream_buffer.stream;
+  if (!(stream->usage & GRALLOC_USAGE_HW_CAMERA_WRITE)) {
+    HAL_LOGV("Output buffers aren't allocated for camera writes.");
+    return false;
+  }
+  if ((*stream_buffer.buffer)->numFds < 1) {
+    HAL_LOGV("Output buffer has no dma-buf to capture into.");
+    return false;
+  }
+
+  // Where the driver writes each plane of a frame. Only YUV layouts can be
+  // checked; gralloc doesn't report the stride of other formats.
+  uint32_t width = format_->width();
+  uint32_t height = format_->height();
+  int y_stride = format_->bytes_per_line();
+  size_t y_size = static_cast<size_t>(y_stride) * height;
+  int c_stride;
+  int chroma_step;
+  size_t cb_offset;
+  size_t cr_offset;
+  switch (format_->v4l2_pixel_format()) {
+    case V4L2_PIX_FMT_YUV420:
+      c_stride = y_stride / 2;
+      chroma_step = 1;
+      cb_offset = y_size;
+      cr_offset = cb_offset + static_cast<size_t>(c_stride) * (height / 2);
+      break;
+    case V4L2_PIX_FMT_YVU420:
+      c_stride = y_stride / 2;
+      chroma_step = 1;
+      cr_offset = y_size;
+      cb_offset = cr_offset + static_cast<size_t>(c_stride) * (height / 2);
+      break;
+    case V4L2_PIX_FMT_NV12:
+      c_stride = y_stride;
+      chroma_step = 2;
+      cb_offset = y_size;
+      cr_offset = cb_offset + 1;
+      break;
+    case V4L2_PIX_FMT_NV21:
+      c_stride = y_stride;
+      chroma_step = 2;
+      cr_offset = y_size;
+      cb_offset = cr_offset + 1;
+      break;
+    default:
+      HAL_LOGV("Can't check the gralloc layout of format 0x%x.",
+               format_->v4l2_pixel_format());
+      return false;
+  }
+  if (y_stride <= 0 || format_->size_image() < y_size + y_size / 2) {
+    HAL_LOGV("Driver reported an unexpected frame layout.");
+    return false;
+  }
+
+  // The device writes the Y plane at the start of the dma-buf, so the planes
+  // gralloc locks must follow it at the offsets the driver uses.
+  arc::GrallocFrameBuffer output_frame(
+      *stream_buffer.buffer, width, height, format_->v4l2_pixel_format(),
+      format_->size_image(), stream->usage);
+  arc::YuvLayout layout;
+  if (output_frame.Map() || output_frame.GetYuvLayout(&layout)) {
+    HAL_LOGV("Failed to lock the output buffer layout.");
+    return false;
+  }
+  return layout.y_stride == y_stride && layout.c_stride == c_stride &&
+         layout.chroma_step == chroma_step &&
+         layout.cb == layout.y + cb_offset && layout.cr == layout.y + cr_offset;
+}
+
 int V4L2Wrapper::EnqueueRequest(
     std::shared_ptr<default_camera_hal::CaptureRequest> request) {
   if (!format_) {
@@ -585,6 +773,30 @@ int V4L2Wrapper::EnqueueRequest(
     return -ENODEV;
   }
 
+  // Gralloc lays every buffer of a stream out alike, so the first one queued
+  // since the format was set tells whether the device can write into them.
+  // Nothing is queued and the stream is off then, so the buffers can still
+  // be swapped for device owned ones.
+  if (memory_ == V4L2_MEMORY_DMABUF && !dmabuf_verified_) {
+    if (!DmabufLayoutMatches(request->output_buffers[0])) {
+      HAL_LOGV("Output buffer layout differs, capturing to MMAP instead.");
+      size_t num_buffers = buffers_.size();
+      int res = RequestBuffers(0);
+      if (!res) {
+        res = SetupBuffers(V4L2_MEMORY_MMAP);
+      }
+      if (res) {
+        HAL_LOGE("Failed to fall back to MMAP buffers.");
+        return res;
+      }
+      if (buffers_.size() < num_buffers) {
+        HAL_LOGW("Device gave %zu MMAP buffers, %zu were advertised.",
+                 buffers_.size(), num_buffers);
+      }
+    }
+    dmabuf_verified_ = true;
+  }
+
   // Find a free buffer index. Could use some sort of persistent hinting
   // here to improve expected efficiency, but buffers_.size() is expected
   // to be low enough (<10 experimentally) that it's not worth it.
@@ -621,21 +833,29 @@ int V4L2Wrapper::EnqueueRequest(
     return -ENODEV;
   }
 
-  // Setup our request context and fill in the user pointer field.
+  // Setup our request context and point the device at the capture memory.
   RequestContext* request_context;
-  void* data;
   {
     std::lock_guard<std::mutex> guard(buffer_queue_lock_);
     request_context = &buffers_[index];
-    request_context->camera_buffer->SetDataSize(device_buffer.length);
-    request_context->camera_buffer->Reset();
-    request_context->camera_buffer->SetFourcc(format_->v4l2_pixel_format());
-    request_context->camera_buffer->SetWidth(format_->width());
-    request_context->camera_buffer->SetHeight(format_->height());
     request_context->request = request;
-    data = request_context->camera_buffer->GetData();
+    request_context->dequeued = false;
+    if (memory_ == V4L2_MEMORY_USERPTR) {
+      request_context->camera_buffer->SetDataSize(device_buffer.length);
+      request_context->camera_buffer->Reset();
+      request_context->camera_buffer->SetFourcc(format_->v4l2_pixel_format());
+      request_context->camera_buffer->SetWidth(format_->width());
+      request_context->camera_buffer->SetHeight(format_->height());
+      device_buffer.m.userptr = reinterpret_cast<unsigned long>(
+          request_context->camera_buffer->GetData());
+    } else if (memory_ == V4L2_MEMORY_DMABUF) {
+      // Capture directly into the gralloc buffer, whose layout was checked
+      // against the one the driver writes.
+      device_buffer.m.fd = (*request->output_buffers[0].buffer)->data[0];
+      device_buffer.length = format_->size_image();
+    }
+    // V4L2_MEMORY_MMAP buffers are already owned and mapped by the device.
   }
-  device_buffer.m.userptr = reinterpret_cast<unsigned long>(data);
 
   // Pass the buffer to the camera.
   if (IoctlLocked(VIDIOC_QBUF, &device_buffer) < 0) {
@@ -651,6 +871,22 @@ int V4L2Wrapper::EnqueueRequest(
 }
 
 int V4L2Wrapper::DequeueRequest(std::shared_ptr<CaptureRequest>* request) {
+  uint32_t index;
+  std::shared_ptr<CaptureRequest> dequeued;
+  int res = DequeueBuffer(&index, &dequeued);
+  if (res) {
+    return res;
+  }
+  res = ProcessBuffer(index, dequeued);
+  ReleaseBuffer(index, dequeued);
+  if (request) {
+    *request = dequeued;
+  }
+  return res;
+}
+
+int V4L2Wrapper::DequeueBuffer(uint32_t* index,
+                               std::shared_ptr<CaptureRequest>* request) {
   if (!format_) {
     HAL_LOGV(
         "Format not set, so stream can't be on, "
@@ -661,7 +897,7 @@ int V4L2Wrapper::DequeueRequest(std::shared_ptr<CaptureRequest>* request) {
   v4l2_buffer buffer;
   memset(&buffer, 0, sizeof(buffer));
   buffer.type = format_->type();
-  buffer.memory = V4L2_MEMORY_USERPTR;
+  buffer.memory = memory_;
   int res = IoctlLocked(VIDIOC_DQBUF, &buffer);
   if (res) {
     if (errno == EAGAIN) {
@@ -676,52 +912,162 @@ int V4L2Wrapper::DequeueRequest(std::shared_ptr<CaptureRequest>* request) {
 
   std::lock_guard<std::mutex> guard(buffer_queue_lock_);
   RequestContext* request_context = &buffers_[buffer.index];
+  request_context->dequeued = true;
+  request_context->length = buffer.length;
+  if (memory_ == V4L2_MEMORY_MMAP) {
+    request_context->device_buffer->SetDataSize(buffer.bytesused);
+  }
+  *index = buffer.index;
+  *request = request_context->request;
+  return 0;
+}
 
-  // Lock the camera stream buffer for painting.
-  const camera3_stream_buffer_t* stream_buffer =
-      &request_context->request->output_buffers[0];
-  uint32_t fourcc =
-      StreamFormat::HalToV4L2PixelFormat(stream_buffer->stream->format);
+int V4L2Wrapper::ProcessBuffer(
+    uint32_t index, const std::shared_ptr<CaptureRequest>& request) {
+  // Take references to the context under the lock, then convert without
+  // holding it so other buffers can be queued and dequeued meanwhile.
+  std::shared_ptr<arc::FrameBuffer> camera_buffer;
+  uint32_t length;
+  {
+    std::lock_guard<std::mutex> guard(buffer_queue_lock_);
+    if (!request) {
+      HAL_LOGE("Buffer %u has no request to process.", index);
+      return -EINVAL;
+    }
+    if (index >= buffers_.size() || buffers_[index].request != request) {
+      // Flushed since it was dequeued; the capture data is gone, and may
+      // already be another request's.
+      HAL_LOGE("Buffer %u no longer holds the frame of request %u.", index,
+               request->frame_number);
+      return -ENODEV;
+    }
+    RequestContext* request_context = &buffers_[index];
+    length = request_context->length;
+    if (memory_ == V4L2_MEMORY_MMAP) {
+      camera_buffer = request_context->device_buffer;
+    } else if (memory_ == V4L2_MEMORY_USERPTR) {
+      camera_buffer = request_context->camera_buffer;
+    }
+  }
 
-  if (request) {
-    *request = request_context->request;
+  if (!camera_buffer) {
+    // DMABUF: the device wrote the frame into the output buffer directly.
+    return 0;
+  }
+
+  // The frame is decoded to YU12 at most once, on first use, and shared by
+  // every output that needs conversion.
+  arc::CachedFrame cached_frame(&frame_buffer_pool_);
+  bool cached = false;
+  // With only one output, an MJPEG frame is better decoded straight into it.
+  bool decode_direct = request->output_buffers.size() == 1;
+  for (const camera3_stream_buffer_t& stream_buffer : request->output_buffers) {
+    int res = FillOutputBuffer(*camera_buffer, length, request->settings,
+                               stream_buffer, decode_direct, &cached_frame,
+                               &cached);
+    if (res) {
+      return res;
+    }
+  }
+
+  // The device may have been handed the buffer again by a flush during the
+  // conversion, and written another frame over the one being read.
+  std::lock_guard<std::mutex> guard(buffer_queue_lock_);
+  if (index >= buffers_.size() || buffers_[index].request != request) {
+    HAL_LOGE("Buffer %u was flushed while converting request %u.", index,
+             request->frame_number);
+    return -ENODEV;
   }
+  return 0;
+}
+
+int V4L2Wrapper::FillOutputBuffer(
+    const arc::FrameBuffer& camera_buffer, uint32_t length,
+    const android::CameraMetadata& settings,
+    const camera3_stream_buffer_t& stream_buffer, bool decode_direct,
+    arc::CachedFrame* cached_frame, bool* cached) {
+  // Lock the camera stream buffer for painting.
+  uint32_t fourcc =
+      StreamFormat::HalToV4L2PixelFormat(stream_buffer.stream->format);
 
   // Note that the device buffer length is passed to the output frame. If the
   // GrallocFrameBuffer does not have support for the transformation to
   // |fourcc|, it will assume that the amount of data to lock is based on
-  // |buffer.length|, otherwise it will use the ImageProcessor::ConvertedSize.
+  // |length|, otherwise it will use the ImageProcessor::ConvertedSize.
+  // JPEG buffers are only allocated at the advertised maximum JPEG size for
+  // the largest resolution; lock no more than the framework allocated.
+  if (fourcc == V4L2_PIX_FMT_JPEG) {
+    length = StreamFormat::JpegBufferSize(
+        stream_buffer.stream->width, stream_buffer.stream->height,
+        max_jpeg_width_, max_jpeg_height_);
+  }
   arc::GrallocFrameBuffer output_frame(
-      *stream_buffer->buffer, stream_buffer->stream->width,
-      stream_buffer->stream->height, fourcc, buffer.length,
-      stream_buffer->stream->usage);
-  res = output_frame.Map();
+      *stream_buffer.buffer, stream_buffer.stream->width,
+      stream_buffer.stream->height, fourcc, length,
+      stream_buffer.stream->usage);
+  int res = output_frame.Map();
   if (res) {
     HAL_LOGE("Failed to map output frame.");
-    request_context->request.reset();
     return -EINVAL;
   }
-  if (request_context->camera_buffer->GetFourcc() == fourcc &&
-      request_context->camera_buffer->GetWidth() ==
-          stream_buffer->stream->width &&
-      request_context->camera_buffer->GetHeight() ==
-          stream_buffer->stream->height) {
+  if (camera_buffer.GetFourcc() == fourcc &&
+      camera_buffer.GetWidth() == stream_buffer.stream->width &&
+      camera_buffer.GetHeight() == stream_buffer.stream->height) {
     // If no format conversion needs to be applied, directly copy the data over.
-    memcpy(output_frame.GetData(), request_context->camera_buffer->GetData(),
-           request_context->camera_buffer->GetDataSize());
-  } else {
-    // Perform the format conversion.
-    arc::CachedFrame cached_frame;
-    cached_frame.SetSource(request_context->camera_buffer.get(), 0);
-    cached_frame.Convert(request_context->request->settings, &output_frame);
+    // Gralloc may pad or interleave YUV planes, so those are copied plane by
+    // plane.
+    if (fourcc == V4L2_PIX_FMT_YUV420) {
+      return arc::ImageProcessor::ConvertFormat(settings, camera_buffer,
+                                                &output_frame);
+    }
+    memcpy(output_frame.GetData(), camera_buffer.GetData(),
+           camera_buffer.GetDataSize());
+    return 0;
   }
 
-  request_context->request.reset();
-  // Mark the buffer as not in flight.
-  request_context->active = false;
+  if (decode_direct && camera_buffer.GetFourcc() == V4L2_PIX_FMT_MJPEG) {
+    // Decode, scale and convert in one go, scaling in the IDCT if the output
+    // is small enough.
+    res = arc::ImageProcessor::DecodeMjpeg(camera_buffer, &output_frame,
+                                           &frame_buffer_pool_);
+    if (res != -ENOTSUP) {
+      if (res) {
+        HAL_LOGE("Failed to decode frame: %d", res);
+      }
+      return res;
+    }
+  }
+
+  // Perform the format conversion.
+  if (!*cached) {
+    res = cached_frame->SetSource(&camera_buffer, 0);
+    if (res) {
+      HAL_LOGE("Failed to decode frame: %d", res);
+      return res;
+    }
+    *cached = true;
+  }
+  res = cached_frame->Convert(settings, &output_frame);
+  if (res) {
+    HAL_LOGE("Failed to convert frame: %d", res);
+    return res;
+  }
   return 0;
 }
 
+void V4L2Wrapper::ReleaseBuffer(uint32_t index,
+                                const std::shared_ptr<CaptureRequest>& request) {
+  std::lock_guard<std::mutex> guard(buffer_queue_lock_);
+  // A StreamOff since the buffer was dequeued may already have released it,
+  // and it may have been handed to a new request since.
+  if (index >= buffers_.size() || buffers_[index].request != request) {
+    return;
+  }
+  buffers_[index].request.reset();
+  // Mark the buffer as not in flight.
+  buffers_[index].active = false;
+}
+
 int V4L2Wrapper::GetInFlightBufferCount() {
   int count = 0;
   std::lock_guard<std::mutex> guard(buffer_queue_lock_);
@@ -733,4 +1079,59 @@ int V4L2Wrapper::GetInFlightBufferCount() {
   return count;
 }
 
+void V4L2Wrapper::CancelQueuedBuffers(
+    std::vector<std::shared_ptr<CaptureRequest>>* requests) {
+  std::lock_guard<std::mutex> guard(buffer_queue_lock_);
+  for (auto& buffer : buffers_) {
+    if (buffer.active && !buffer.dequeued) {
+      if (buffer.request) {
+        requests->push_back(buffer.request);
+      }
+      buffer.request.reset();
+      buffer.active = false;
+    }
+  }
+}
+
+int V4L2Wrapper::WaitForBuffers() {
+  int device_fd;
+  {
+    std::lock_guard<std::mutex> lock(device_lock_);
+    if (!connected()) {
+      HAL_LOGE("Device %s not connected.", device_path_.c_str());
+      return -ENODEV;
+    }
+    device_fd = device_fd_.get();
+  }
+
+  pollfd fds[2] = {{device_fd, POLLIN, 0}, {wakeup_fd_.get(), POLLIN, 0}};
+  int res = TEMP_FAILURE_RETRY(poll(fds, 2, -1));
+  if (res < 0) {
+    HAL_LOGE("poll fails: %s", strerror(errno));
+    return -ENODEV;
+  }
+
+  if (fds[1].revents & POLLIN) {
+    // Drain the eventfd so the next wait blocks again.
+    uint64_t count;
+    TEMP_FAILURE_RETRY(read(wakeup_fd_.get(), &count, sizeof(count)));
+    return -EINTR;
+  }
+  if (fds[0].revents & (POLLERR | POLLNVAL)) {
+    // The stream is off or the device went away.
+    return -ENODEV;
+  }
+  return 0;
+}
+
+void V4L2Wrapper::InterruptWait() {
+  if (wakeup_fd_.get() < 0) {
+    return;
+  }
+  uint64_t count = 1;
+  if (TEMP_FAILURE_RETRY(write(wakeup_fd_.get(), &count, sizeof(count))) < 0) {
+    HAL_LOGE("Failed to signal eventfd: %s", strerror(errno));
+  }
+}
+
 }  // namespace v4l2_camera_hal
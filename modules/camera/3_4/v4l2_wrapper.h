@@ -25,8 +25,10 @@
 #include <vector>
 
 #include <android-base/unique_fd.h>
+#include "arc/cached_frame.h"
 #include "arc/common_types.h"
 #include "arc/frame_buffer.h"
+#include "arc/frame_buffer_pool.h"
 #include "capture_request.h"
 #include "common.h"
 #include "stream_format.h"
@@ -78,19 +80,69 @@ class V4L2Wrapper {
       uint32_t v4l2_format,
       const std::array<int32_t, 2>& size,
       std::array<int64_t, 2>* duration_range);
+  // |memory| is the preferred V4L2_MEMORY_* buffer mode for the stream.
+  // V4L2_MEMORY_DMABUF queues the framework's output buffers directly and is
+  // only honored when no conversion is needed; otherwise (or if the driver
+  // refuses it) this falls back to V4L2_MEMORY_MMAP, then V4L2_MEMORY_USERPTR.
+  // EnqueueRequest also falls back to V4L2_MEMORY_MMAP if the output buffers
+  // aren't laid out the way the driver writes frames.
   virtual int SetFormat(const StreamFormat& desired_format,
+                        uint32_t memory,
                         uint32_t* result_max_buffers);
+  // The largest JPEG resolution advertised, which the framework sizes the
+  // BLOB buffers of smaller JPEG streams against.
+  virtual void SetMaxJpegResolution(uint32_t width, uint32_t height);
   // Manage buffers.
   virtual int EnqueueRequest(
       std::shared_ptr<default_camera_hal::CaptureRequest> request);
+  // Dequeue a buffer and fill its request's output buffer in one step.
   virtual int DequeueRequest(
       std::shared_ptr<default_camera_hal::CaptureRequest>* request);
+  // The steps of DequeueRequest, for callers that process frames on other
+  // threads. A dequeued buffer stays in flight (and its capture data stays
+  // valid) until ReleaseBuffer is called for it.
+  virtual int DequeueBuffer(
+      uint32_t* index,
+      std::shared_ptr<default_camera_hal::CaptureRequest>* request);
+  // Convert the frame captured in buffer |index| into each of |request|'s
+  // output buffers. Safe to call concurrently for different buffers. Returns
+  // -ENODEV if the buffer no longer holds |request|'s frame, as when it was
+  // flushed and handed to another request since being dequeued.
+  virtual int ProcessBuffer(
+      uint32_t index,
+      const std::shared_ptr<default_camera_hal::CaptureRequest>& request);
+  virtual void ReleaseBuffer(
+      uint32_t index,
+      const std::shared_ptr<default_camera_hal::CaptureRequest>& request);
   virtual int GetInFlightBufferCount();
+  // Give up on the buffers queued to the device, as when it stopped
+  // responding, and return the requests they were capturing for. Dequeued
+  // buffers are left to be released by their converters.
+  virtual void CancelQueuedBuffers(
+      std::vector<std::shared_ptr<default_camera_hal::CaptureRequest>>*
+          requests);
+  // Scratch buffers used when converting frames. Reserve this for the
+  // configured streams so conversion doesn't allocate per frame.
+  inline arc::FrameBufferPool* frame_buffer_pool() {
+    return &frame_buffer_pool_;
+  }
+  // Block until the device has a buffer ready to dequeue. Returns -EINTR if
+  // woken early by StreamOff or Disconnect instead.
+  virtual int WaitForBuffers();
+
+ protected:
+  // Raw device access. Fake devices override these to stand in for a driver;
+  // both follow the open(2)/ioctl(2) convention of returning -1 and setting
+  // errno on failure. The returned fd must become readable when a buffer is
+  // ready to dequeue.
+  virtual int OpenDevice(const std::string& device_path);
+  virtual int DeviceIoctl(int fd, unsigned long request, void* data);
 
  private:
   // Constructor is private to allow failing on bad input.
   // Use NewV4L2Wrapper instead.
-  V4L2Wrapper(const std::string device_path);
+  V4L2Wrapper(const std::string device_path,
+              android::base::unique_fd wakeup_fd);
 
   // Connect or disconnect to the device. Access by creating/destroying
   // a V4L2Wrapper::Connection object.
@@ -99,10 +151,30 @@ class V4L2Wrapper {
   // Perform an ioctl call in a thread-safe fashion.
   template <typename T>
   int IoctlLocked(unsigned long request, T data);
-  // Request/release userspace buffer mode via VIDIOC_REQBUFS.
+  // Request/release buffers of |memory_| type via VIDIOC_REQBUFS.
   int RequestBuffers(uint32_t num_buffers);
+  // Export and map the device-allocated buffers (V4L2_MEMORY_MMAP only).
+  int MapDeviceBuffers();
+  // Switch |memory_| to |memory| and request buffers of that type, mapping
+  // them if they are device-allocated.
+  int SetupBuffers(uint32_t memory);
+  // Whether the device can capture straight into buffers of the stream of
+  // |stream_buffer|: they are allocated for camera writes and the planes
+  // gralloc locks match the strides and plane offsets of |format_|.
+  bool DmabufLayoutMatches(const camera3_stream_buffer_t& stream_buffer);
+  // Fill one output buffer of a request from |camera_buffer|. |cached_frame|
+  // holds the frame's YU12 conversion once |cached| is set, so it is shared
+  // between the outputs of a request. If |decode_direct| is set, MJPEG frames
+  // are decoded straight into the output instead where possible.
+  int FillOutputBuffer(const arc::FrameBuffer& camera_buffer, uint32_t length,
+                       const android::CameraMetadata& settings,
+                       const camera3_stream_buffer_t& stream_buffer,
+                       bool decode_direct, arc::CachedFrame* cached_frame,
+                       bool* cached);
 
   inline bool connected() { return device_fd_.get() >= 0; }
+  // Wake up any thread blocked in WaitForBuffers.
+  void InterruptWait();
 
   // Format management.
   const arc::SupportedFormats GetSupportedFormats();
@@ -111,12 +183,22 @@ class V4L2Wrapper {
   const std::string device_path_;
   // The opened device fd.
   android::base::unique_fd device_fd_;
+  // eventfd used to interrupt WaitForBuffers.
+  android::base::unique_fd wakeup_fd_;
   // The underlying gralloc module.
   // std::unique_ptr<V4L2Gralloc> gralloc_;
   // Whether or not the device supports the extended control query.
   bool extended_query_supported_;
   // The format this device is set up for.
   std::unique_ptr<StreamFormat> format_;
+  // The buffer memory mode (V4L2_MEMORY_*) used with |format_|.
+  uint32_t memory_;
+  // Whether the output buffers were checked for V4L2_MEMORY_DMABUF capture
+  // since |format_| was set.
+  bool dmabuf_verified_;
+  // The largest JPEG resolution advertised, 0x0 until set.
+  uint32_t max_jpeg_width_;
+  uint32_t max_jpeg_height_;
   // Lock protecting use of the buffer tracker.
   std::mutex buffer_queue_lock_;
   // Lock protecting use of the device.
@@ -129,17 +211,28 @@ class V4L2Wrapper {
   arc::SupportedFormats supported_formats_;
   // Qualified formats.
   arc::SupportedFormats qualified_formats_;
+  // Conversion scratch buffers.
+  arc::FrameBufferPool frame_buffer_pool_;
 
   class RequestContext {
    public:
     RequestContext()
         : active(false),
+          dequeued(false),
+          length(0),
           camera_buffer(std::make_shared<arc::AllocatedFrameBuffer>(0)){};
     ~RequestContext(){};
     // Indicates whether this request context is in use.
     bool active;
-    // Buffer handles of the context.
+    // Whether the buffer came back from the device and waits to be released.
+    bool dequeued;
+    // Length of the device buffer, as reported when it was dequeued.
+    uint32_t length;
+    // Buffer handles of the context. |camera_buffer| backs USERPTR capture,
+    // |device_buffer| is the exported driver buffer used for MMAP capture.
+    // DMABUF capture writes straight into the request's output buffer.
     std::shared_ptr<arc::AllocatedFrameBuffer> camera_buffer;
+    std::shared_ptr<arc::V4L2FrameBuffer> device_buffer;
     std::shared_ptr<default_camera_hal::CaptureRequest> request;
   };
 
@@ -150,6 +243,7 @@ class V4L2Wrapper {
 
   friend class Connection;
   friend class V4L2WrapperMock;
+  friend class V4L2WrapperFake;
 
   DISALLOW_COPY_AND_ASSIGN(V4L2Wrapper);
 };
@@ -0,0 +1,462 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2WrapperFake"
+
+#include "v4l2_wrapper_fake.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace v4l2_camera_hal {
+
+// The most buffers the device hands out, like the limit of a real driver.
+const uint32_t kMaxDeviceBuffers = 8;
+// The frame rate advertised when capturing unthrottled.
+const uint32_t kDefaultFps = 30;
+
+static int64_t MonotonicNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+V4L2WrapperFake* V4L2WrapperFake::NewV4L2WrapperFake(Options options) {
+  if (!ValidateOptions(options)) {
+    return nullptr;
+  }
+  android::base::unique_fd wakeup_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  android::base::unique_fd ready_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (wakeup_fd.get() < 0 || ready_fd.get() < 0) {
+    HAL_LOGE("failed to create eventfd (%s)", strerror(errno));
+    return nullptr;
+  }
+  return new V4L2WrapperFake(std::move(options), std::move(wakeup_fd),
+                             std::move(ready_fd));
+}
+
+bool V4L2WrapperFake::ValidateOptions(const Options& options) {
+  if (options.fourcc != V4L2_PIX_FMT_YUYV &&
+      options.fourcc != V4L2_PIX_FMT_MJPEG) {
+    HAL_LOGE("Unsupported fake device format 0x%x.", options.fourcc);
+    return false;
+  }
+  size_t buffer_size = options.width * options.height * 2;
+  if (options.width == 0 || options.height == 0 || options.frames.empty()) {
+    HAL_LOGE("Fake device needs a size and at least one frame.");
+    return false;
+  }
+  for (const auto& frame : options.frames) {
+    if (frame.empty() || frame.size() > buffer_size) {
+      HAL_LOGE("Frame of %zu bytes doesn't fit a %zu byte buffer.",
+               frame.size(), buffer_size);
+      return false;
+    }
+  }
+  return true;
+}
+
+V4L2WrapperFake::V4L2WrapperFake(Options options,
+                                 android::base::unique_fd wakeup_fd,
+                                 android::base::unique_fd ready_fd)
+    : V4L2Wrapper("fake", std::move(wakeup_fd)),
+      options_(std::move(options)),
+      buffer_size_(options_.width * options_.height * 2),
+      ready_fd_(std::move(ready_fd)),
+      buffer_memory_(V4L2_MEMORY_MMAP),
+      streaming_(false),
+      sequence_(0),
+      dropped_frames_(0) {}
+
+V4L2WrapperFake::~V4L2WrapperFake() {
+  std::unique_lock<std::mutex> lock(lock_);
+  IoctlStreamOff(&lock);
+  FreeBuffers();
+}
+
+int64_t V4L2WrapperFake::GetCaptureTimestamp(uint32_t index) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (index >= device_buffers_.size()) {
+    return 0;
+  }
+  return device_buffers_[index].timestamp;
+}
+
+uint64_t V4L2WrapperFake::GetDroppedFrameCount() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return dropped_frames_;
+}
+
+int V4L2WrapperFake::OpenDevice(const std::string& /*device_path*/) {
+  // A duplicate, since the wrapper closes what it opened.
+  return fcntl(ready_fd_.get(), F_DUPFD_CLOEXEC, 0);
+}
+
+int V4L2WrapperFake::DeviceIoctl(int /*fd*/, unsigned long request,
+                                 void* data) {
+  std::unique_lock<std::mutex> lock(lock_);
+  int res;
+  switch (request) {
+    case VIDIOC_ENUM_FMT:
+      res = IoctlEnumFormat(static_cast<v4l2_fmtdesc*>(data));
+      break;
+    case VIDIOC_ENUM_FRAMESIZES:
+      res = IoctlEnumFrameSizes(static_cast<v4l2_frmsizeenum*>(data));
+      break;
+    case VIDIOC_ENUM_FRAMEINTERVALS:
+      res = IoctlEnumFrameIntervals(static_cast<v4l2_frmivalenum*>(data));
+      break;
+    case VIDIOC_S_FMT:
+      res = IoctlSetFormat(static_cast<v4l2_format*>(data));
+      break;
+    case VIDIOC_REQBUFS:
+      res = IoctlRequestBuffers(static_cast<v4l2_requestbuffers*>(data));
+      break;
+    case VIDIOC_QUERYBUF:
+      res = IoctlQueryBuffer(static_cast<v4l2_buffer*>(data));
+      break;
+    case VIDIOC_EXPBUF:
+      res = IoctlExportBuffer(static_cast<v4l2_exportbuffer*>(data));
+      break;
+    case VIDIOC_QBUF:
+      res = IoctlQueueBuffer(static_cast<v4l2_buffer*>(data));
+      break;
+    case VIDIOC_DQBUF:
+      res = IoctlDequeueBuffer(static_cast<v4l2_buffer*>(data));
+      break;
+    case VIDIOC_STREAMON:
+      res = IoctlStreamOn();
+      break;
+    case VIDIOC_STREAMOFF:
+      res = IoctlStreamOff(&lock);
+      break;
+    case VIDIOC_QUERYCTRL:
+    case VIDIOC_QUERY_EXT_CTRL:
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL:
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+      // No controls.
+      res = EINVAL;
+      break;
+    default:
+      HAL_LOGV("Unsupported ioctl 0x%lx.", request);
+      res = ENOTTY;
+      break;
+  }
+  if (res) {
+    errno = res;
+    return -1;
+  }
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlEnumFormat(v4l2_fmtdesc* format) {
+  if (format->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || format->index != 0) {
+    return EINVAL;
+  }
+  format->flags =
+      options_.fourcc == V4L2_PIX_FMT_MJPEG ? V4L2_FMT_FLAG_COMPRESSED : 0;
+  format->pixelformat = options_.fourcc;
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlEnumFrameSizes(v4l2_frmsizeenum* size) {
+  if (size->pixel_format != options_.fourcc || size->index != 0) {
+    return EINVAL;
+  }
+  size->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+  size->discrete.width = options_.width;
+  size->discrete.height = options_.height;
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlEnumFrameIntervals(v4l2_frmivalenum* interval) {
+  if (interval->pixel_format != options_.fourcc ||
+      interval->width != options_.width ||
+      interval->height != options_.height || interval->index != 0) {
+    return EINVAL;
+  }
+  interval->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+  interval->discrete.numerator = 1;
+  interval->discrete.denominator = options_.fps ? options_.fps : kDefaultFps;
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlSetFormat(v4l2_format* format) {
+  if (format->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+    return EINVAL;
+  }
+  if (!device_buffers_.empty()) {
+    return EBUSY;
+  }
+  // Like a driver, adjust the request to what the device can do.
+  v4l2_pix_format* pix = &format->fmt.pix;
+  pix->pixelformat = options_.fourcc;
+  pix->width = options_.width;
+  pix->height = options_.height;
+  pix->field = V4L2_FIELD_NONE;
+  pix->bytesperline =
+      options_.fourcc == V4L2_PIX_FMT_YUYV ? options_.width * 2 : 0;
+  pix->sizeimage = buffer_size_;
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlRequestBuffers(v4l2_requestbuffers* request) {
+  if (request->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+      (request->memory != V4L2_MEMORY_MMAP &&
+       request->memory != V4L2_MEMORY_USERPTR)) {
+    return EINVAL;
+  }
+  if (streaming_) {
+    return EBUSY;
+  }
+
+  FreeBuffers();
+  buffer_memory_ = request->memory;
+  request->count = std::min(request->count, kMaxDeviceBuffers);
+  device_buffers_.resize(request->count);
+  for (Buffer& buffer : device_buffers_) {
+    buffer.mapping = nullptr;
+    buffer.userptr = nullptr;
+    buffer.length = buffer_size_;
+    buffer.bytesused = 0;
+    buffer.sequence = 0;
+    buffer.timestamp = 0;
+    buffer.queued = false;
+    buffer.done = false;
+    if (buffer_memory_ != V4L2_MEMORY_MMAP) {
+      continue;
+    }
+    buffer.memfd.reset(memfd_create("v4l2_fake", MFD_CLOEXEC));
+    if (buffer.memfd.get() < 0 ||
+        ftruncate(buffer.memfd.get(), buffer_size_) < 0) {
+      int res = errno;
+      FreeBuffers();
+      return res;
+    }
+    void* mapping = mmap(nullptr, buffer_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, buffer.memfd.get(), 0);
+    if (mapping == MAP_FAILED) {
+      int res = errno;
+      FreeBuffers();
+      return res;
+    }
+    buffer.mapping = static_cast<uint8_t*>(mapping);
+  }
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlQueryBuffer(v4l2_buffer* buffer) {
+  if (buffer->index >= device_buffers_.size()) {
+    return EINVAL;
+  }
+  FillBufferInfo(buffer->index, buffer);
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlExportBuffer(v4l2_exportbuffer* buffer) {
+  if (buffer_memory_ != V4L2_MEMORY_MMAP ||
+      buffer->index >= device_buffers_.size()) {
+    return EINVAL;
+  }
+  int fd = fcntl(device_buffers_[buffer->index].memfd.get(), F_DUPFD_CLOEXEC,
+                 0);
+  if (fd < 0) {
+    return errno;
+  }
+  buffer->fd = fd;
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlQueueBuffer(v4l2_buffer* buffer) {
+  if (buffer->index >= device_buffers_.size() ||
+      buffer->memory != buffer_memory_) {
+    return EINVAL;
+  }
+  Buffer& device_buffer = device_buffers_[buffer->index];
+  if (device_buffer.queued || device_buffer.done) {
+    return EINVAL;
+  }
+  if (buffer_memory_ == V4L2_MEMORY_USERPTR) {
+    if (!buffer->m.userptr || buffer->length < buffer_size_) {
+      return EINVAL;
+    }
+    device_buffer.userptr = reinterpret_cast<uint8_t*>(buffer->m.userptr);
+  }
+  device_buffer.queued = true;
+  queued_.push_back(buffer->index);
+  wake_.notify_all();
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlDequeueBuffer(v4l2_buffer* buffer) {
+  if (buffer->memory != buffer_memory_) {
+    return EINVAL;
+  }
+  if (done_.empty()) {
+    return EAGAIN;
+  }
+  uint32_t index = done_.front();
+  done_.pop_front();
+  device_buffers_[index].done = false;
+  FillBufferInfo(index, buffer);
+  if (done_.empty()) {
+    SetReady(false);
+  }
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlStreamOn() {
+  if (device_buffers_.empty()) {
+    return EINVAL;
+  }
+  if (streaming_) {
+    return 0;
+  }
+  streaming_ = true;
+  capture_thread_ = std::thread(&V4L2WrapperFake::CaptureLoop, this);
+  return 0;
+}
+
+int V4L2WrapperFake::IoctlStreamOff(std::unique_lock<std::mutex>* lock) {
+  if (streaming_) {
+    // The capture thread needs the lock to finish its frame.
+    streaming_ = false;
+    wake_.notify_all();
+    lock->unlock();
+    capture_thread_.join();
+    lock->lock();
+  }
+  ReturnBuffers();
+  return 0;
+}
+
+void V4L2WrapperFake::FillBufferInfo(uint32_t index, v4l2_buffer* buffer) {
+  const Buffer& device_buffer = device_buffers_[index];
+  buffer->index = index;
+  buffer->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer->memory = buffer_memory_;
+  buffer->length = device_buffer.length;
+  buffer->bytesused = device_buffer.bytesused;
+  buffer->sequence = device_buffer.sequence;
+  buffer->field = V4L2_FIELD_NONE;
+  buffer->timestamp.tv_sec = device_buffer.timestamp / 1000000000LL;
+  buffer->timestamp.tv_usec = device_buffer.timestamp % 1000000000LL / 1000;
+  buffer->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+  if (device_buffer.queued) {
+    buffer->flags |= V4L2_BUF_FLAG_QUEUED;
+  }
+  if (device_buffer.done) {
+    buffer->flags |= V4L2_BUF_FLAG_DONE;
+  }
+  if (buffer_memory_ == V4L2_MEMORY_USERPTR) {
+    buffer->m.userptr = reinterpret_cast<unsigned long>(device_buffer.userptr);
+  } else {
+    buffer->m.offset = index * buffer_size_;
+  }
+}
+
+void V4L2WrapperFake::FreeBuffers() {
+  ReturnBuffers();
+  for (Buffer& buffer : device_buffers_) {
+    if (buffer.mapping) {
+      munmap(buffer.mapping, buffer_size_);
+    }
+  }
+  device_buffers_.clear();
+}
+
+void V4L2WrapperFake::ReturnBuffers() {
+  for (Buffer& buffer : device_buffers_) {
+    buffer.queued = false;
+    buffer.done = false;
+  }
+  queued_.clear();
+  done_.clear();
+  SetReady(false);
+}
+
+void V4L2WrapperFake::SetReady(bool ready) {
+  uint64_t count = 1;
+  if (ready) {
+    TEMP_FAILURE_RETRY(write(ready_fd_.get(), &count, sizeof(count)));
+  } else {
+    // Fails with EAGAIN if it wasn't ready; either way it isn't now.
+    TEMP_FAILURE_RETRY(read(ready_fd_.get(), &count, sizeof(count)));
+  }
+}
+
+void V4L2WrapperFake::CaptureLoop() {
+  const auto period = std::chrono::nanoseconds(
+      options_.fps ? 1000000000LL / options_.fps : 0);
+  auto next_frame = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(lock_);
+  while (streaming_) {
+    if (options_.fps) {
+      // Frames arrive on schedule whether or not anyone is ready for them.
+      wake_.wait_until(lock, next_frame, [this] { return !streaming_; });
+      if (!streaming_) {
+        break;
+      }
+      next_frame += period;
+      if (queued_.empty()) {
+        ++sequence_;
+        ++dropped_frames_;
+        continue;
+      }
+    } else {
+      // Unthrottled: capture as soon as a buffer is queued.
+      wake_.wait(lock, [this] { return !streaming_ || !queued_.empty(); });
+      if (!streaming_) {
+        break;
+      }
+    }
+
+    uint32_t index = queued_.front();
+    queued_.pop_front();
+    Buffer& buffer = device_buffers_[index];
+    buffer.queued = false;
+    const std::vector<uint8_t>& frame =
+        options_.frames[sequence_ % options_.frames.size()];
+    uint8_t* dest = buffer.mapping ? buffer.mapping : buffer.userptr;
+
+    // "DMA" the frame in without holding up the caller's ioctls. StreamOff
+    // waits for this thread, so the buffer can't go away meanwhile.
+    lock.unlock();
+    std::copy(frame.begin(), frame.end(), dest);
+    int64_t timestamp = MonotonicNs();
+    lock.lock();
+
+    buffer.bytesused = frame.size();
+    buffer.sequence = sequence_++;
+    buffer.timestamp = timestamp;
+    buffer.done = true;
+    done_.push_back(index);
+    SetReady(true);
+  }
+}
+
+}  // namespace v4l2_camera_hal
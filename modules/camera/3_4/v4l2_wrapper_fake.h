@@ -0,0 +1,134 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Wrapper around a fake, userspace V4L2 capture device.
+
+#ifndef V4L2_CAMERA_HAL_V4L2_WRAPPER_FAKE_H_
+#define V4L2_CAMERA_HAL_V4L2_WRAPPER_FAKE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <linux/videodev2.h>
+#include "v4l2_wrapper.h"
+
+namespace v4l2_camera_hal {
+
+// A V4L2Wrapper whose device is emulated in-process instead of opened from
+// /dev. The device has a single capture format and size, and plays |frames|
+// back in a loop at |fps|, like a sensor: a frame arriving while no buffer is
+// queued is dropped. MMAP and USERPTR buffers are supported; DMABUF is
+// refused, so the wrapper falls back to MMAP. Controls are not supported.
+class V4L2WrapperFake : public V4L2Wrapper {
+ public:
+  struct Options {
+    // V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_MJPEG.
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    // Frames per second to capture at. 0 captures as fast as buffers are
+    // queued.
+    uint32_t fps;
+    // The frames to play back. Each must fit the device's buffer size: 2 bytes
+    // per pixel.
+    std::vector<std::vector<uint8_t>> frames;
+  };
+
+  // Returns nullptr if |options| is invalid.
+  static V4L2WrapperFake* NewV4L2WrapperFake(Options options);
+  ~V4L2WrapperFake() override;
+
+  // The CLOCK_MONOTONIC time, in ns, at which the frame in buffer |index| was
+  // captured. Valid from when the buffer is dequeued until it is queued again.
+  int64_t GetCaptureTimestamp(uint32_t index);
+  // Frames dropped so far because no buffer was queued.
+  uint64_t GetDroppedFrameCount();
+
+ protected:
+  // For subclasses. Use NewV4L2WrapperFake otherwise.
+  V4L2WrapperFake(Options options, android::base::unique_fd wakeup_fd,
+                  android::base::unique_fd ready_fd);
+  static bool ValidateOptions(const Options& options);
+
+  int OpenDevice(const std::string& device_path) override;
+  int DeviceIoctl(int fd, unsigned long request, void* data) override;
+
+ private:
+  struct Buffer {
+    // Backing memory of MMAP buffers.
+    android::base::unique_fd memfd;
+    uint8_t* mapping;
+    // The caller's memory while a USERPTR buffer is queued.
+    uint8_t* userptr;
+    uint32_t length;
+    uint32_t bytesused;
+    uint32_t sequence;
+    int64_t timestamp;
+    bool queued;
+    bool done;
+  };
+
+  // Ioctl handlers, called with |lock_| held. Each returns 0 or an errno.
+  int IoctlEnumFormat(v4l2_fmtdesc* format);
+  int IoctlEnumFrameSizes(v4l2_frmsizeenum* size);
+  int IoctlEnumFrameIntervals(v4l2_frmivalenum* interval);
+  int IoctlSetFormat(v4l2_format* format);
+  int IoctlRequestBuffers(v4l2_requestbuffers* request);
+  int IoctlQueryBuffer(v4l2_buffer* buffer);
+  int IoctlExportBuffer(v4l2_exportbuffer* buffer);
+  int IoctlQueueBuffer(v4l2_buffer* buffer);
+  int IoctlDequeueBuffer(v4l2_buffer* buffer);
+  int IoctlStreamOn();
+  // Releases |lock| while waiting for the capture thread to stop.
+  int IoctlStreamOff(std::unique_lock<std::mutex>* lock);
+
+  void FillBufferInfo(uint32_t index, v4l2_buffer* buffer);
+  void FreeBuffers();
+  // Returns all queued and done buffers to the caller.
+  void ReturnBuffers();
+  void SetReady(bool ready);
+
+  // Captures frames into queued buffers until streaming stops.
+  void CaptureLoop();
+
+  const Options options_;
+  const uint32_t buffer_size_;
+  // Readable (via OpenDevice) while a buffer is done.
+  android::base::unique_fd ready_fd_;
+
+  std::mutex lock_;
+  // Signalled when a buffer is queued or streaming stops.
+  std::condition_variable wake_;
+  uint32_t buffer_memory_;
+  std::vector<Buffer> device_buffers_;
+  std::deque<uint32_t> queued_;
+  std::deque<uint32_t> done_;
+  bool streaming_;
+  std::thread capture_thread_;
+  uint32_t sequence_;
+  uint64_t dropped_frames_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2WrapperFake);
+};
+
+}  // namespace v4l2_camera_hal
+
+#endif  // V4L2_CAMERA_HAL_V4L2_WRAPPER_FAKE_H_
@@ -27,7 +27,7 @@ namespace v4l2_camera_hal {
 
 class V4L2WrapperMock : public V4L2Wrapper {
  public:
-  V4L2WrapperMock() : V4L2Wrapper(""){};
+  V4L2WrapperMock() : V4L2Wrapper("", android::base::unique_fd()){};
   MOCK_METHOD0(StreamOn, int());
   MOCK_METHOD0(StreamOff, int());
   MOCK_METHOD2(QueryControl,
@@ -43,7 +43,8 @@ class V4L2WrapperMock : public V4L2Wrapper {
                int(uint32_t,
                    const std::array<int32_t, 2>&,
                    std::array<int64_t, 2>*));
-  MOCK_METHOD2(SetFormat, int(const StreamFormat& desired_format,
+  MOCK_METHOD3(SetFormat, int(const StreamFormat& desired_format,
+                              uint32_t memory,
                               uint32_t* result_max_buffers));
   MOCK_METHOD2(EnqueueBuffer,
                int(const camera3_stream_buffer_t* camera_buffer,
@@ -14,7 +14,10 @@
  * limitations under the License.
  */
 
-#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <algorithm>
 
@@ -23,28 +26,70 @@
 #include <hardware/sensors.h>
 #include "SensorEventQueue.h"
 
-SensorEventQueue::SensorEventQueue(int capacity) {
-    mCapacity = capacity;
+SensorEventSignal::SensorEventSignal() : mWaiting(false) {
+    mFd = eventfd(0, EFD_CLOEXEC);
+    LOG_ALWAYS_FATAL_IF(mFd < 0, "eventfd() failed: %d", errno);
+}
+
+SensorEventSignal::~SensorEventSignal() {
+    close(mFd);
+}
+
+void SensorEventSignal::signal() {
+    if (!mWaiting.load()) return;
+    uint64_t value = 1;
+    if (write(mFd, &value, sizeof(value)) < 0) {
+        ALOGE("eventfd write() failed: %d", errno);
+    }
+}
+
+void SensorEventSignal::prepareToWait() {
+    // Sequentially consistent, like the loads of the queue counts after it, so that either the
+    // waiting thread sees the change it waits for, or the signaling thread sees mWaiting.
+    mWaiting.store(true);
+}
+
+void SensorEventSignal::wait() {
+    uint64_t value;
+    // Also consumes the signals that arrived after a cancelWait(), so this may return early.
+    while (read(mFd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    }
+    mWaiting.store(false);
+}
+
+void SensorEventSignal::cancelWait() {
+    mWaiting.store(false);
+}
 
-    mStart = 0;
-    mSize = 0;
+SensorEventQueue::SensorEventQueue(int capacity, SensorEventSignal* dataAvailable)
+        : mCapacity(capacity), mWriteCount(0), mReadCount(0), mDataAvailable(dataAvailable) {
     mData = new sensors_event_t[mCapacity];
-    pthread_cond_init(&mSpaceAvailableCondition, NULL);
 }
 
 SensorEventQueue::~SensorEventQueue() {
     delete[] mData;
     mData = NULL;
-    pthread_cond_destroy(&mSpaceAvailableCondition);
+}
+
+// The counts wrap around at twice the capacity, so that a full queue can be told from an empty one.
+static int advanceCount(int count, int increment, int capacity) {
+    return (count + increment) % (2 * capacity);
+}
+
+static int countDifference(int laterCount, int count, int capacity) {
+    return (laterCount - count + 2 * capacity) % (2 * capacity);
 }
 
 int SensorEventQueue::getWritableRegion(int requestedLength, sensors_event_t** out) {
-    if (mSize == mCapacity || requestedLength <= 0) {
+    int writeCount = mWriteCount.load(std::memory_order_relaxed);
+    int readCount = mReadCount.load(std::memory_order_acquire);
+    if (countDifference(writeCount, readCount, mCapacity) == mCapacity || requestedLength <= 0) {
         *out = NULL;
         return 0;
     }
+    int start = readCount % mCapacity;
     // Start writing after the last readable record.
-    int firstWritable = (mStart + mSize) % mCapacity;
+    int firstWritable = writeCount % mCapacity;
 
     int lastWritable = firstWritable + requestedLength - 1;
 
@@ -53,41 +98,66 @@ int SensorEventQueue::getWritableRegion(int requestedLength, sensors_event_t** o
         lastWritable = mCapacity - 1;
     }
     // Don't go into the readable region.
-    if (firstWritable < mStart && lastWritable >= mStart) {
-        lastWritable = mStart - 1;
+    if (firstWritable < start && lastWritable >= start) {
+        lastWritable = start - 1;
     }
     *out = &mData[firstWritable];
     return lastWritable - firstWritable + 1;
 }
 
 void SensorEventQueue::markAsWritten(int count) {
-    mSize += count;
+    if (count <= 0) return;
+    mWriteCount.store(advanceCount(mWriteCount.load(std::memory_order_relaxed), count, mCapacity));
+    if (mDataAvailable != NULL) {
+        mDataAvailable->signal();
+    }
 }
 
 int SensorEventQueue::getSize() {
-    return mSize;
+    return countDifference(mWriteCount.load(), mReadCount.load(std::memory_order_relaxed),
+                           mCapacity);
 }
 
 sensors_event_t* SensorEventQueue::peek() {
-    if (mSize == 0) return NULL;
-    return &mData[mStart];
+    if (getSize() == 0) return NULL;
+    return &mData[mReadCount.load(std::memory_order_relaxed) % mCapacity];
 }
 
 void SensorEventQueue::dequeue() {
-    if (mSize == 0) return;
-    if (mSize == mCapacity) {
-        pthread_cond_broadcast(&mSpaceAvailableCondition);
+    markAsRead(1);
+}
+
+int SensorEventQueue::getReadableRegion(sensors_event_t** out) {
+    int size = getSize();
+    if (size == 0) {
+        *out = NULL;
+        return 0;
     }
-    mSize--;
-    mStart = (mStart + 1) % mCapacity;
+    int start = mReadCount.load(std::memory_order_relaxed) % mCapacity;
+    *out = &mData[start];
+    return std::min(size, mCapacity - start);
+}
+
+void SensorEventQueue::markAsRead(int count) {
+    count = std::min(count, getSize());
+    if (count <= 0) return;
+    mReadCount.store(advanceCount(mReadCount.load(std::memory_order_relaxed), count, mCapacity));
+    mSpaceAvailable.signal();
 }
 
 // returns true if it waited, or false if it was a no-op.
-bool SensorEventQueue::waitForSpace(pthread_mutex_t* mutex) {
+bool SensorEventQueue::waitForSpace() {
     bool waited = false;
-    while (mSize == mCapacity) {
+    while (countDifference(mWriteCount.load(std::memory_order_relaxed), mReadCount.load(),
+                           mCapacity) == mCapacity) {
+        mSpaceAvailable.prepareToWait();
+        if (countDifference(mWriteCount.load(std::memory_order_relaxed), mReadCount.load(),
+                            mCapacity) != mCapacity) {
+            mSpaceAvailable.cancelWait();
+            break;
+        }
         waited = true;
-        pthread_cond_wait(&mSpaceAvailableCondition, mutex);
+        mSpaceAvailable.wait();
     }
     return waited;
 }
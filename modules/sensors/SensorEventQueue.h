@@ -18,7 +18,35 @@
 #define SENSOREVENTQUEUE_H_
 
 #include <hardware/sensors.h>
-#include <pthread.h>
+
+#include <atomic>
+
+/*
+ * Wakes up a thread waiting for other threads, with an eventfd. Signaling is a single atomic load
+ * while nobody waits.
+ *
+ * The waiting thread calls prepareToWait(), checks again what it waits for, then either calls
+ * wait(), or cancelWait() if it no longer needs to. This way a signal() that happens after the
+ * check can't be missed. There can only be one waiting thread at a time.
+ */
+class SensorEventSignal {
+    int mFd;
+    std::atomic<bool> mWaiting;
+
+public:
+    SensorEventSignal();
+    ~SensorEventSignal();
+
+    // Wakes up the waiting thread, if there is one.
+    void signal();
+
+    void prepareToWait();
+
+    // Blocks until signal() is called after prepareToWait(). May return early.
+    void wait();
+
+    void cancelWait();
+};
 
 /*
  * Fixed-size circular queue, with an API developed around the sensor HAL poll() method.
@@ -27,50 +55,67 @@
  * write to, instead of using an intermediate buffer and a memcpy.
  *
  * Thread safety:
- * Reading can be done safely after grabbing the mutex lock, while poll() writing in a separate
- * thread without a mutex lock. But there can only be one writer at a time.
+ * The queue is lock-free, for a single writer and a single reader thread. The writer calls
+ * waitForSpace(), getWritableRegion() and markAsWritten(), and the reader the other methods.
+ * Neither ever waits for the other except in waitForSpace() when the queue is full.
  */
 class SensorEventQueue {
-    int mCapacity;
-    int mStart; // start of readable region
-    int mSize; // number of readable items
+    const int mCapacity;
+    // Counts of the records written and read, modulo twice the capacity. Each is only changed by
+    // its own side, and the reader sees the records written before mWriteCount is stored.
+    std::atomic<int> mWriteCount;
+    std::atomic<int> mReadCount;
     sensors_event_t* mData;
-    pthread_cond_t mSpaceAvailableCondition;
+    SensorEventSignal mSpaceAvailable;
+    // Signaled when records are written, if not NULL.
+    SensorEventSignal* mDataAvailable;
 
 public:
-    explicit SensorEventQueue(int capacity);
+    // dataAvailable can be shared by the queues read by the same thread.
+    explicit SensorEventQueue(int capacity, SensorEventSignal* dataAvailable = NULL);
     ~SensorEventQueue();
 
     // Returns length of region, between zero and min(capacity, requestedLength). If there is any
     // writable space, it will return a region of at least one. Because it must return
     // a pointer to a contiguous region, it may return smaller regions as we approach the end of
     // the data array.
-    // Only call while holding the lock.
+    // Only call from the writer.
     // The region is not marked internally in any way. Subsequent calls may return overlapping
     // regions. This class expects there to be exactly one writer at a time.
     int getWritableRegion(int requestedLength, sensors_event_t** out);
 
     // After writing to the region returned by getWritableRegion(), call this to indicate how
     // many records were actually written.
-    // This increases size() by count.
-    // Only call while holding the lock.
+    // This increases size() by count, and signals the reader.
+    // Only call from the writer.
     void markAsWritten(int count);
 
     // Gets the number of readable records.
-    // Only call while holding the lock.
+    // Only call from the reader.
     int getSize();
 
     // Returns pointer to the first readable record, or NULL if size() is zero.
-    // Only call this while holding the lock.
+    // Only call from the reader.
     sensors_event_t* peek();
 
     // This will decrease the size by one, freeing up the oldest readable event's slot for writing.
-    // Only call while holding the lock.
+    // Only call from the reader.
     void dequeue();
 
+    // Returns the length of the contiguous region of readable records starting at the first one,
+    // which is less than size() when the readable records wrap around the end of the data array.
+    // Only call from the reader.
+    int getReadableRegion(sensors_event_t** out);
+
+    // After reading from the region returned by getReadableRegion(), call this to free the slots
+    // of the first count records for writing, like count calls to dequeue().
+    // Only call from the reader.
+    void markAsRead(int count);
+
     // Blocks until space is available. No-op if there is already space.
     // Returns true if it had to wait.
-    bool waitForSpace(pthread_mutex_t* mutex);
+    // Only call from the writer.
+    bool waitForSpace();
 };
 
 #endif // SENSOREVENTQUEUE_H_
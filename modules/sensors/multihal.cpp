@@ -20,12 +20,14 @@
 #define LOG_NDEBUG 1
 #include <log/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 #include <hardware/sensors.h>
 
 #include <vector>
 #include <string>
 #include <fstream>
 #include <map>
+#include <algorithm>
 
 #include <dirent.h>
 #include <dlfcn.h>
@@ -42,13 +44,6 @@
 static pthread_mutex_t init_modules_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t init_sensors_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// This mutex is shared by all queues
-static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Used to pause the multihal poll(). Broadcasted by sub-polling tasks if waiting_for_data.
-static pthread_cond_t data_available_cond = PTHREAD_COND_INITIALIZER;
-bool waiting_for_data = false;
-
 // Vector of sub modules, whose indexes are referred to in this file as module_index.
 static std::vector<hw_module_t *> *sub_hw_modules = nullptr;
 
@@ -127,8 +122,80 @@ static int get_global_handle(FullHandle* full_handle) {
     return global_handle;
 }
 
+/*
+ * Global handles of the sensors of a sub-HAL, indexed by local handle - minLocalHandle, or -1 for
+ * the unused local handles. Remaps the handles of polled events without a map lookup.
+ */
+struct HandleTable {
+    int minLocalHandle;
+    std::vector<int> globalHandles;
+};
+
+// Largest HandleTable. The sub-HALs with local handles spread wider are remapped with
+// full_to_global instead.
+static const int MAX_HANDLE_TABLE_SIZE = 4096;
+
+// Parallel to sub_hw_modules, filled by lazy_init_sensors_list().
+static std::vector<HandleTable> handle_tables;
+
+static void init_handle_table(HandleTable* table, const struct sensor_t* sensors, int count) {
+    table->globalHandles.clear();
+    if (count <= 0) {
+        return;
+    }
+    int min_local_handle = sensors[0].handle;
+    int max_local_handle = sensors[0].handle;
+    for (int i = 1; i < count; i++) {
+        min_local_handle = std::min(min_local_handle, sensors[i].handle);
+        max_local_handle = std::max(max_local_handle, sensors[i].handle);
+    }
+    if ((int64_t)max_local_handle - min_local_handle >= MAX_HANDLE_TABLE_SIZE) {
+        ALOGW("Local handles %d to %d too sparse for a HandleTable",
+                min_local_handle, max_local_handle);
+        return;
+    }
+    table->minLocalHandle = min_local_handle;
+    table->globalHandles.assign(max_local_handle - min_local_handle + 1, -1);
+}
+
+// Returns the global handle for the local handle of the sub-HAL, or -1 if it is unknown.
+static int get_global_handle(const HandleTable& table, int module_index, int local_handle) {
+    if (table.globalHandles.empty()) {
+        FullHandle full_handle;
+        full_handle.moduleIndex = module_index;
+        full_handle.localHandle = local_handle;
+        return get_global_handle(&full_handle);
+    }
+    // Unsigned, so that local handles below minLocalHandle are out of range too.
+    unsigned int index = (unsigned int)local_handle - (unsigned int)table.minLocalHandle;
+    if (index >= table.globalHandles.size() || table.globalHandles[index] == -1) {
+        ALOGW("Unknown FullHandle: moduleIndex %d, localHandle %d", module_index, local_handle);
+        return -1;
+    }
+    return table.globalHandles[index];
+}
+
 static const int SENSOR_EVENT_QUEUE_CAPACITY = 36;
 
+// When set, poll() returns the events of the sub-HALs in timestamp order instead of round-robin.
+static const char* MERGE_BY_TIMESTAMP_PROPERTY = "ro.vendor.sensors.multihal.merge_by_timestamp";
+
+/*
+ * The first readable event of a queue, kept in a min-heap by timestamp to merge the queues.
+ */
+struct QueueHead {
+    int64_t timestamp;
+    int queueIndex;
+
+    // Orders the heap with the earliest event on top, and the lowest queue index on ties.
+    bool operator<(const QueueHead &that) const {
+        if (timestamp != that.timestamp) {
+            return timestamp > that.timestamp;
+        }
+        return queueIndex > that.queueIndex;
+    }
+};
+
 struct TaskContext {
   sensors_poll_device_t* device;
   SensorEventQueue* queue;
@@ -142,13 +209,10 @@ void *writerTask(void* ptr) {
     sensors_event_t* buffer;
     int eventsPolled;
     while (1) {
-        pthread_mutex_lock(&queue_mutex);
-        if (queue->waitForSpace(&queue_mutex)) {
+        if (queue->waitForSpace()) {
             ALOGV("writerTask waited for space");
         }
         int bufferSize = queue->getWritableRegion(SENSOR_EVENT_QUEUE_CAPACITY, &buffer);
-        // Do blocking poll outside of lock
-        pthread_mutex_unlock(&queue_mutex);
 
         ALOGV("writerTask before poll() - bufferSize = %d", bufferSize);
         eventsPolled = device->poll(device, buffer, bufferSize);
@@ -160,14 +224,9 @@ void *writerTask(void* ptr) {
             }
             continue;
         }
-        pthread_mutex_lock(&queue_mutex);
+        // Wakes up poll() if it waits for data.
         queue->markAsWritten(eventsPolled);
         ALOGV("writerTask wrote %d events", eventsPolled);
-        if (waiting_for_data) {
-            ALOGV("writerTask - broadcast data_available_cond");
-            pthread_cond_broadcast(&data_available_cond);
-        }
-        pthread_mutex_unlock(&queue_mutex);
     }
     // never actually returns
     return NULL;
@@ -206,9 +265,15 @@ struct sensors_poll_context_t {
     int close();
 
     std::vector<hw_device_t*> sub_hw_devices;
+    // Each queue is written by the writerTask of its sub-HAL and read by poll(), without locks.
     std::vector<SensorEventQueue*> queues;
+    // Signaled by the writerTasks when poll() waits for data.
+    SensorEventSignal dataAvailable;
     std::vector<pthread_t> threads;
     int nextReadIndex;
+    bool mergeByTimestamp;
+    // Scratch heap of read_merged_events(), with room for every queue.
+    std::vector<QueueHead> mergeHeads;
 
     sensors_poll_device_t* get_v0_device_by_handle(int global_handle);
     sensors_poll_device_1_t* get_v1_device_by_handle(int global_handle);
@@ -216,14 +281,20 @@ struct sensors_poll_context_t {
     int get_device_version_by_handle(int global_handle);
 
     void copy_event_remap_handle(sensors_event_t* src, sensors_event_t* dest, int sub_index);
+    int remap_event_handles(sensors_event_t* events, int count, int sub_index);
+    int read_events(sensors_event_t* data, int maxReads);
+    int read_round_robin_events(sensors_event_t* data, int maxReads);
+    int read_merged_events(sensors_event_t* data, int maxReads);
 };
 
 void sensors_poll_context_t::addSubHwDevice(struct hw_device_t* sub_hw_device) {
     ALOGV("addSubHwDevice");
     this->sub_hw_devices.push_back(sub_hw_device);
 
-    SensorEventQueue *queue = new SensorEventQueue(SENSOR_EVENT_QUEUE_CAPACITY);
+    SensorEventQueue *queue = new SensorEventQueue(SENSOR_EVENT_QUEUE_CAPACITY,
+            &this->dataAvailable);
     this->queues.push_back(queue);
+    this->mergeHeads.reserve(this->queues.size());
 
     TaskContext* taskContext = new TaskContext();
     taskContext->device = (sensors_poll_device_t*) sub_hw_device;
@@ -336,65 +407,147 @@ int sensors_poll_context_t::setDelay(int handle, int64_t ns) {
     return retval;
 }
 
-void sensors_poll_context_t::copy_event_remap_handle(sensors_event_t* dest, sensors_event_t* src,
+static void remap_with_handle_table(const HandleTable& table, sensors_event_t* event,
         int sub_index) {
-    memcpy(dest, src, sizeof(struct sensors_event_t));
     // A normal event's "sensor" field is a local handle. Convert it to a global handle.
     // A meta-data event must have its sensor set to 0, but it has a nested event
     // with a local handle that needs to be converted to a global handle.
-    FullHandle full_handle;
-    full_handle.moduleIndex = sub_index;
 
     // If it's a metadata event, rewrite the inner payload, not the sensor field.
     // If the event's sensor field is unregistered for any reason, rewrite the sensor field
     // with a -1, instead of writing an incorrect but plausible sensor number, because
-    // get_global_handle() returns -1 for unknown FullHandles.
-    if (dest->type == SENSOR_TYPE_META_DATA) {
-        full_handle.localHandle = dest->meta_data.sensor;
-        dest->meta_data.sensor = get_global_handle(&full_handle);
+    // get_global_handle() returns -1 for unknown local handles.
+    if (event->type == SENSOR_TYPE_META_DATA) {
+        event->meta_data.sensor = get_global_handle(table, sub_index, event->meta_data.sensor);
     } else {
-        full_handle.localHandle = dest->sensor;
-        dest->sensor = get_global_handle(&full_handle);
+        event->sensor = get_global_handle(table, sub_index, event->sensor);
+    }
+}
+
+void sensors_poll_context_t::copy_event_remap_handle(sensors_event_t* dest, sensors_event_t* src,
+        int sub_index) {
+    memcpy(dest, src, sizeof(struct sensors_event_t));
+    remap_with_handle_table(handle_tables[sub_index], dest, sub_index);
+}
+
+// Remaps the handles of count events copied from the sub-HAL, in place, and drops the events with
+// a bad handle. Returns the number of events kept at the start of events.
+int sensors_poll_context_t::remap_event_handles(sensors_event_t* events, int count,
+        int sub_index) {
+    const HandleTable& table = handle_tables[sub_index];
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        remap_with_handle_table(table, &events[i], sub_index);
+        if (events[i].sensor == SENSORS_HANDLE_BASE - 1) {
+            // Bad handle, do not pass corrupted event upstream !
+            ALOGW("Dropping bad local handle event packet on the floor");
+            continue;
+        }
+        if (kept != i) {
+            memcpy(&events[kept], &events[i], sizeof(struct sensors_event_t));
+        }
+        kept++;
+    }
+    return kept;
+}
+
+// Reads up to maxReads events, one at a time from each queue in turn.
+int sensors_poll_context_t::read_round_robin_events(sensors_event_t* data, int maxReads) {
+    int queueCount = (int)this->queues.size();
+    int empties = 0;
+    int eventsRead = 0;
+    while (empties < queueCount && eventsRead < maxReads) {
+        SensorEventQueue* queue = this->queues.at(this->nextReadIndex);
+        sensors_event_t* event = queue->peek();
+        if (event == NULL) {
+            empties++;
+        } else {
+            empties = 0;
+            this->copy_event_remap_handle(&data[eventsRead], event, nextReadIndex);
+            if (data[eventsRead].sensor == SENSORS_HANDLE_BASE - 1) {
+                // Bad handle, do not pass corrupted event upstream !
+                ALOGW("Dropping bad local handle event packet on the floor");
+            } else {
+                eventsRead++;
+            }
+            queue->dequeue();
+        }
+        this->nextReadIndex = (this->nextReadIndex + 1) % queueCount;
+    }
+    return eventsRead;
+}
+
+// Reads up to maxReads events, merging the queues in timestamp order. The events of a queue stay
+// in their order, and are copied in runs until one is later than the first event of the other
+// queues, so only the first event of each queue is compared.
+int sensors_poll_context_t::read_merged_events(sensors_event_t* data, int maxReads) {
+    std::vector<QueueHead>& heads = this->mergeHeads;
+    heads.clear();
+    for (int i = 0; i < (int)this->queues.size(); i++) {
+        sensors_event_t* event = this->queues[i]->peek();
+        if (event != NULL) {
+            heads.push_back({event->timestamp, i});
+        }
+    }
+    std::make_heap(heads.begin(), heads.end());
+
+    int eventsRead = 0;
+    while (!heads.empty() && eventsRead < maxReads) {
+        std::pop_heap(heads.begin(), heads.end());
+        int queueIndex = heads.back().queueIndex;
+        heads.pop_back();
+        int64_t nextTimestamp = heads.empty() ? INT64_MAX : heads.front().timestamp;
+
+        SensorEventQueue* queue = this->queues[queueIndex];
+        sensors_event_t* events;
+        int available = std::min(queue->getReadableRegion(&events), maxReads - eventsRead);
+        // The first event is the earliest of all the queues.
+        int runLength = 1;
+        while (runLength < available && events[runLength].timestamp <= nextTimestamp) {
+            runLength++;
+        }
+        memcpy(&data[eventsRead], events, runLength * sizeof(sensors_event_t));
+        queue->markAsRead(runLength);
+        eventsRead += this->remap_event_handles(&data[eventsRead], runLength, queueIndex);
+
+        // The run can also end where the queue wraps around, so its next event may still be
+        // the earliest.
+        sensors_event_t* event = queue->peek();
+        if (event != NULL) {
+            heads.push_back({event->timestamp, queueIndex});
+            std::push_heap(heads.begin(), heads.end());
+        }
     }
+    return eventsRead;
+}
+
+// Reads the events of the queues, as their only reader, so it must not be called concurrently.
+int sensors_poll_context_t::read_events(sensors_event_t* data, int maxReads) {
+    if (this->mergeByTimestamp) {
+        return this->read_merged_events(data, maxReads);
+    }
+    return this->read_round_robin_events(data, maxReads);
 }
 
 int sensors_poll_context_t::poll(sensors_event_t *data, int maxReads) {
     ALOGV("poll");
-    int empties = 0;
-    int queueCount = 0;
     int eventsRead = 0;
 
-    pthread_mutex_lock(&queue_mutex);
-    queueCount = (int)this->queues.size();
     while (eventsRead == 0) {
-        while (empties < queueCount && eventsRead < maxReads) {
-            SensorEventQueue* queue = this->queues.at(this->nextReadIndex);
-            sensors_event_t* event = queue->peek();
-            if (event == NULL) {
-                empties++;
+        eventsRead = this->read_events(data, maxReads);
+        if (eventsRead == 0) {
+            // The queues have been scanned and none contain data. Scan them again once the
+            // writerTasks know to signal, as events written before wouldn't wake this up.
+            this->dataAvailable.prepareToWait();
+            eventsRead = this->read_events(data, maxReads);
+            if (eventsRead == 0) {
+                ALOGV("poll stopping to wait for data");
+                this->dataAvailable.wait();
             } else {
-                empties = 0;
-                this->copy_event_remap_handle(&data[eventsRead], event, nextReadIndex);
-                if (data[eventsRead].sensor == SENSORS_HANDLE_BASE - 1) {
-                    // Bad handle, do not pass corrupted event upstream !
-                    ALOGW("Dropping bad local handle event packet on the floor");
-                } else {
-                    eventsRead++;
-                }
-                queue->dequeue();
+                this->dataAvailable.cancelWait();
             }
-            this->nextReadIndex = (this->nextReadIndex + 1) % queueCount;
-        }
-        if (eventsRead == 0) {
-            // The queues have been scanned and none contain data, so wait.
-            ALOGV("poll stopping to wait for data");
-            waiting_for_data = true;
-            pthread_cond_wait(&data_available_cond, &queue_mutex);
-            waiting_for_data = false;
-            empties = 0;
         }
     }
-    pthread_mutex_unlock(&queue_mutex);
     ALOGV("poll returning %d events.", eventsRead);
 
     return eventsRead;
@@ -673,8 +826,20 @@ static void lazy_init_modules() {
     pthread_mutex_unlock(&init_modules_mutex);
 }
 
+void set_multi_hal_sub_modules(struct hw_module_t** modules, int count) {
+    pthread_mutex_lock(&init_modules_mutex);
+    if (sub_hw_modules != NULL) {
+        ALOGE("set_multi_hal_sub_modules() called after the sub-HALs were loaded");
+        pthread_mutex_unlock(&init_modules_mutex);
+        return;
+    }
+    sub_hw_modules = new std::vector<hw_module_t *>(modules, modules + count);
+    so_handles = new std::vector<void *>();
+    pthread_mutex_unlock(&init_modules_mutex);
+}
+
 /*
- * Lazy-initializes global_sensors_count, global_sensors_list, and module_sensor_handles.
+ * Lazy-initializes global_sensors_count, global_sensors_list, and handle_tables.
  */
 static void lazy_init_sensors_list() {
     ALOGV("lazy_init_sensors_list");
@@ -706,6 +871,7 @@ static void lazy_init_sensors_list() {
     // index of the next sensor to set in mutable_sensor_list
     int mutable_sensor_index = 0;
     int module_index = 0;
+    handle_tables.resize(sub_hw_modules->size());
 
     for (std::vector<hw_module_t*>::iterator it = sub_hw_modules->begin();
             it != sub_hw_modules->end(); it++) {
@@ -715,6 +881,8 @@ static void lazy_init_sensors_list() {
         struct sensors_module_t *module = (struct sensors_module_t*) hw_module;
         int module_sensor_count = module->get_sensors_list(module, &subhal_sensors_list);
         ALOGV("the module has %d sensors", module_sensor_count);
+        HandleTable* handle_table = &handle_tables[module_index];
+        init_handle_table(handle_table, subhal_sensors_list, module_sensor_count);
 
         // Copy the HAL's sensor list into global_sensors_list,
         // with the handle changed to be a global handle.
@@ -735,6 +903,10 @@ static void lazy_init_sensors_list() {
             int global_handle = assign_global_handle(module_index, local_handle);
 
             mutable_sensor_list[mutable_sensor_index].handle = global_handle;
+            if (!handle_table->globalHandles.empty()) {
+                handle_table->globalHandles[local_handle - handle_table->minLocalHandle] =
+                        global_handle;
+            }
             ALOGV("module_index %d, local_handle %d, global_handle %d",
                     module_index, local_handle, global_handle);
 
@@ -788,7 +960,8 @@ static int open_sensors(const struct hw_module_t* hw_module, const char* name,
         struct hw_device_t** hw_device_out) {
     ALOGV("open_sensors begin...");
 
-    lazy_init_modules();
+    // The handle tables remap the events polled by the writerTasks started below.
+    lazy_init_sensors_list();
 
     // Create proxy device, to return later.
     sensors_poll_context_t *dev = new sensors_poll_context_t();
@@ -807,6 +980,8 @@ static int open_sensors(const struct hw_module_t* hw_module, const char* name,
     dev->proxy_device.config_direct_report = device__config_direct_report;
 
     dev->nextReadIndex = 0;
+    dev->mergeByTimestamp = property_get_bool(MERGE_BY_TIMESTAMP_PROPERTY, false);
+    ALOGV("mergeByTimestamp %d", dev->mergeByTimestamp);
 
     // Open() the subhal modules. Remember their devices in a vector parallel to sub_hw_modules.
     for (std::vector<hw_module_t*>::iterator it = sub_hw_modules->begin();
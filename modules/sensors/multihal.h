@@ -26,4 +26,9 @@ static const char* DEPRECATED_MULTI_HAL_CONFIG_FILE_PATH = "/system/etc/sensors/
 
 struct sensors_module_t *get_multi_hal_module_info(void);
 
+// Makes the multihal use these sub-HAL modules instead of loading the ones listed in
+// MULTI_HAL_CONFIG_FILE_PATH, for tests and benchmarks. Must be called before the multihal module
+// is first used.
+void set_multi_hal_sub_modules(struct hw_module_t** modules, int count);
+
 #endif // HARDWARE_LIBHARDWARE_MODULES_SENSORS_MULTIHAL_H_
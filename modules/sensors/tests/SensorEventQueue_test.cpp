@@ -88,6 +88,37 @@ bool testWrappingWriteSizeCounts() {
     return true;
 }
 
+bool testWrappingReadableRegion() {
+    printf("testWrappingReadableRegion\n");
+    SensorEventQueue* queue = new SensorEventQueue(10);
+    sensors_event_t* buffer;
+    if (!checkInt("empty readable region", 0, queue->getReadableRegion(&buffer))) return false;
+
+    queue->markAsWritten(8);
+    if (!checkInt("readable region", 8, queue->getReadableRegion(&buffer))) return false;
+    queue->markAsRead(6);
+    if (!checkSize(queue, 2)) return false;
+
+    // Write around the end; the readable region stops at the end of the data array.
+    if (!checkWritableBufferSize(queue, 100, 2)) return false;
+    queue->markAsWritten(2);
+    if (!checkWritableBufferSize(queue, 100, 6)) return false;
+    queue->markAsWritten(3);
+    if (!checkSize(queue, 7)) return false;
+    if (!checkInt("readable region before wrap", 4, queue->getReadableRegion(&buffer))) {
+        return false;
+    }
+    queue->markAsRead(4);
+    if (!checkInt("readable region after wrap", 3, queue->getReadableRegion(&buffer))) {
+        return false;
+    }
+    queue->markAsRead(100);
+    if (!checkSize(queue, 0)) return false;
+
+    printf("passed\n");
+    return true;
+}
+
 
 
 struct TaskContext {
@@ -95,8 +126,7 @@ struct TaskContext {
   SensorEventQueue* queue;
 };
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t dataAvailableCond = PTHREAD_COND_INITIALIZER;
+static SensorEventSignal dataAvailable;
 
 int FULL_QUEUE_CAPACITY = 5;
 int FULL_QUEUE_EVENT_COUNT = 31;
@@ -110,8 +140,7 @@ void *fullQueueWriterTask(void* ptr) {
     sensors_event_t* buffer;
 
     while (totalWrites < FULL_QUEUE_EVENT_COUNT) {
-        pthread_mutex_lock(&mutex);
-        if (queue->waitForSpace(&mutex)) {
+        if (queue->waitForSpace()) {
             totalWaits++;
             printf(".");
         }
@@ -121,8 +150,6 @@ void *fullQueueWriterTask(void* ptr) {
         for (int i = 0; i < writableSize; i++) {
             printf("w");
         }
-        pthread_cond_broadcast(&dataAvailableCond);
-        pthread_mutex_unlock(&mutex);
     }
     printf("\n");
 
@@ -145,16 +172,19 @@ void* fullQueueReaderTask(void* ptr) {
     SensorEventQueue* queue = ctx->queue;
     int totalReads = 0;
     while (totalReads < FULL_QUEUE_EVENT_COUNT) {
-        pthread_mutex_lock(&mutex);
         // Only read if there are events,
         // and either the queue is full, or if we're reading the last few events.
         while (!fullQueueReaderShouldRead(queue->getSize(), totalReads)) {
-            pthread_cond_wait(&dataAvailableCond, &mutex);
+            dataAvailable.prepareToWait();
+            if (fullQueueReaderShouldRead(queue->getSize(), totalReads)) {
+                dataAvailable.cancelWait();
+                break;
+            }
+            dataAvailable.wait();
         }
         queue->dequeue();
         totalReads++;
         printf("r");
-        pthread_mutex_unlock(&mutex);
     }
     printf("\n");
     ctx->success = ctx->success && checkInt("totalreads", FULL_QUEUE_EVENT_COUNT, totalReads);
@@ -164,7 +194,7 @@ void* fullQueueReaderTask(void* ptr) {
 // Test internal queue-full waiting and broadcasting.
 bool testFullQueueIo() {
     printf("testFullQueueIo\n");
-    SensorEventQueue* queue = new SensorEventQueue(FULL_QUEUE_CAPACITY);
+    SensorEventQueue* queue = new SensorEventQueue(FULL_QUEUE_CAPACITY, &dataAvailable);
 
     TaskContext readerCtx;
     readerCtx.success = true;
@@ -190,6 +220,7 @@ bool testFullQueueIo() {
 int main(int argc __attribute((unused)), char **argv __attribute((unused))) {
     if (testSimpleWriteSizeCounts() &&
             testWrappingWriteSizeCounts() &&
+            testWrappingReadableRegion() &&
             testFullQueueIo()) {
         printf("ALL PASSED\n");
     } else {
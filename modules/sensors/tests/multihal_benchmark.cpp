@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <hardware/sensors.h>
+
+#include <vector>
+
+#include "multihal.h"
+
+// Micro-benchmark of the multihal poll(), with synthetic sub-HALs whose poll() returns events
+// as fast as they are asked for. Measures the events per second going through the multihal
+// queues and the remapping of their handles.
+
+// Run it like this:
+//
+// m multihal_benchmark && \
+// out/host/linux-x86/nativetest64/multihal_benchmark/multihal_benchmark \
+//     [--sub-hals=N] [--sensors=N] [--batch=N] [--seconds=N]
+
+static int64_t monotonicNs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+struct SyntheticSubHal;
+
+struct SyntheticModule {
+    sensors_module_t module; // must be first
+    SyntheticSubHal* subHal;
+};
+
+struct SyntheticDevice {
+    sensors_poll_device_1_t device; // must be first
+    SyntheticSubHal* subHal;
+};
+
+struct SyntheticSubHal {
+    SyntheticModule module;
+    SyntheticDevice device;
+    std::vector<sensor_t> sensors;
+    int nextSensor;
+};
+
+static int syntheticGetSensorsList(struct sensors_module_t* module, struct sensor_t const** list) {
+    SyntheticSubHal* subHal = ((SyntheticModule*)module)->subHal;
+    *list = subHal->sensors.data();
+    return (int)subHal->sensors.size();
+}
+
+static int syntheticActivate(struct sensors_poll_device_t*, int, int) {
+    return 0;
+}
+
+static int syntheticSetDelay(struct sensors_poll_device_t*, int, int64_t) {
+    return 0;
+}
+
+// Returns count events, of the sensors of the sub-HAL in turn.
+static int syntheticPoll(struct sensors_poll_device_t* device, sensors_event_t* data, int count) {
+    SyntheticSubHal* subHal = ((SyntheticDevice*)device)->subHal;
+    int64_t timestamp = monotonicNs();
+    for (int i = 0; i < count; i++) {
+        const sensor_t& sensor = subHal->sensors[subHal->nextSensor];
+        subHal->nextSensor = (subHal->nextSensor + 1) % (int)subHal->sensors.size();
+        memset(&data[i], 0, sizeof(sensors_event_t));
+        data[i].version = sizeof(sensors_event_t);
+        data[i].sensor = sensor.handle;
+        data[i].type = sensor.type;
+        data[i].timestamp = timestamp;
+    }
+    return count;
+}
+
+static int syntheticClose(struct hw_device_t*) {
+    return 0;
+}
+
+static int syntheticOpen(const struct hw_module_t* module, const char*,
+        struct hw_device_t** device) {
+    SyntheticSubHal* subHal = ((SyntheticModule*)module)->subHal;
+    sensors_poll_device_1_t* pollDevice = &subHal->device.device;
+    memset(pollDevice, 0, sizeof(*pollDevice));
+    pollDevice->common.tag = HARDWARE_DEVICE_TAG;
+    pollDevice->common.version = SENSORS_DEVICE_API_VERSION_1_4;
+    pollDevice->common.module = const_cast<hw_module_t*>(module);
+    pollDevice->common.close = syntheticClose;
+    pollDevice->activate = syntheticActivate;
+    pollDevice->setDelay = syntheticSetDelay;
+    pollDevice->poll = syntheticPoll;
+    subHal->device.subHal = subHal;
+    *device = &pollDevice->common;
+    return 0;
+}
+
+static struct hw_module_methods_t syntheticMethods = {
+    .open = syntheticOpen
+};
+
+// The sub-HALs number their sensors from a different base, as real ones do.
+static SyntheticSubHal* newSyntheticSubHal(int index, int sensorCount) {
+    SyntheticSubHal* subHal = new SyntheticSubHal();
+    memset(&subHal->module, 0, sizeof(subHal->module));
+    subHal->module.module.common.tag = HARDWARE_MODULE_TAG;
+    subHal->module.module.common.id = SENSORS_HARDWARE_MODULE_ID;
+    subHal->module.module.common.name = "Synthetic Sensor Module";
+    subHal->module.module.common.methods = &syntheticMethods;
+    subHal->module.module.get_sensors_list = syntheticGetSensorsList;
+    subHal->module.subHal = subHal;
+    subHal->nextSensor = 0;
+    for (int i = 0; i < sensorCount; i++) {
+        sensor_t sensor;
+        memset(&sensor, 0, sizeof(sensor));
+        sensor.name = "Synthetic Accelerometer";
+        sensor.vendor = "AOSP";
+        sensor.version = 1;
+        sensor.handle = index * 100 + i + 1;
+        sensor.type = SENSOR_TYPE_ACCELEROMETER;
+        sensor.minDelay = 1000;
+        subHal->sensors.push_back(sensor);
+    }
+    return subHal;
+}
+
+int main(int argc, char** argv) {
+    int subHalCount = 4;
+    int sensorCount = 8;
+    int batch = 64;
+    int seconds = 5;
+
+    static const struct option options[] = {
+        {"sub-hals", required_argument, NULL, 'h'},
+        {"sensors", required_argument, NULL, 's'},
+        {"batch", required_argument, NULL, 'b'},
+        {"seconds", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+        case 'h':
+            subHalCount = atoi(optarg);
+            break;
+        case 's':
+            sensorCount = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (subHalCount <= 0 || sensorCount <= 0 || batch <= 0 || seconds <= 0) {
+        printf("All the options must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<hw_module_t*> modules;
+    for (int i = 0; i < subHalCount; i++) {
+        modules.push_back(&newSyntheticSubHal(i, sensorCount)->module.module.common);
+    }
+    set_multi_hal_sub_modules(modules.data(), subHalCount);
+
+    sensors_module_t* multiHal = get_multi_hal_module_info();
+    struct sensor_t const* sensorList;
+    int globalSensorCount = multiHal->get_sensors_list(multiHal, &sensorList);
+    hw_device_t* device;
+    if (multiHal->common.methods->open(&multiHal->common, SENSORS_HARDWARE_POLL, &device) != 0) {
+        printf("Could not open the multihal\n");
+        return EXIT_FAILURE;
+    }
+    sensors_poll_device_1_t* pollDevice = (sensors_poll_device_1_t*)device;
+    printf("%d sub-HALs, %d sensors, poll() of up to %d events for %d s\n",
+            subHalCount, globalSensorCount, batch, seconds);
+
+    std::vector<sensors_event_t> buffer(batch);
+    int64_t events = 0;
+    int64_t polls = 0;
+    int64_t badHandles = 0;
+    int64_t start = monotonicNs();
+    int64_t end = start + seconds * 1000000000LL;
+    int64_t now = start;
+    while (now < end) {
+        int count = pollDevice->poll(&pollDevice->v0, buffer.data(), batch);
+        for (int i = 0; i < count; i++) {
+            if (buffer[i].sensor < SENSORS_HANDLE_BASE + 1 ||
+                    buffer[i].sensor > globalSensorCount) {
+                badHandles++;
+            }
+        }
+        events += count;
+        polls++;
+        now = monotonicNs();
+    }
+
+    double elapsed = (now - start) / 1e9;
+    printf("%lld events in %lld polls: %.0f events/s, %.1f events/poll\n",
+            (long long)events, (long long)polls, events / elapsed, (double)events / polls);
+    if (badHandles != 0) {
+        printf("%lld events with a bad handle\n", (long long)badHandles);
+        return EXIT_FAILURE;
+    }
+    // The writer threads of the multihal never stop, so skip closing it.
+    return EXIT_SUCCESS;
+}
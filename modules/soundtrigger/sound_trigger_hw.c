@@ -26,8 +26,13 @@
  * ls : Lists all models that have been loaded.
  * trig <uuid> : Sends a recognition event for the model at the given uuid
  * update <uuid> : Sends a model update event for the model at the given uuid.
+ * inject <path> : Captures the raw 16 kHz mono 16-bit PCM file at path, instead of silence.
  * close : Closes the network connection.
  *
+ * Captured audio is kept for CAPTURE_HISTORY_MS. After a trigger, sound_trigger_open_for_streaming
+ * returns a handle from which sound_trigger_read_samples reads from CAPTURE_PREROLL_MS before the
+ * trigger.
+ *
  * To enable this file, you can make with command line parameter
  * SOUND_TRIGGER_USE_STUB_MODULE=1
  */
@@ -45,14 +50,28 @@
 #define COMMAND_RECOGNITION_ABORT "abort"  // Argument: model index.
 #define COMMAND_RECOGNITION_FAILURE "fail"  // Argument: model index.
 #define COMMAND_UPDATE "update"  // Argument: model index.
+#define COMMAND_INJECT "inject"  // Argument: path of a raw 16 kHz mono 16-bit PCM file.
 #define COMMAND_CLEAR "clear" // Removes all models from the list.
 #define COMMAND_CLOSE "close" // Close just closes the network port, keeps thread running.
 #define COMMAND_END "end" // Closes connection and stops the thread.
 
 #define ERROR_BAD_COMMAND "Bad command"
 
+#define MAX_SOUND_MODELS 64
+#define MODEL_HASH_BUCKETS 32  // Power of two, buckets of the model maps.
+
+#define CAPTURE_SAMPLE_RATE 16000
+#define CAPTURE_PERIOD_MS 10  // The capture thread adds a period of audio at a time.
+#define CAPTURE_HISTORY_MS 2000  // Audio kept for the streaming clients.
+#define CAPTURE_PREROLL_MS 500  // Audio before the trigger read first by a streaming client.
+#define CAPTURE_MAX_CLIENTS 4
+#define CAPTURE_PERIOD_FRAMES (CAPTURE_SAMPLE_RATE * CAPTURE_PERIOD_MS / 1000)
+#define CAPTURE_HISTORY_FRAMES (CAPTURE_SAMPLE_RATE * CAPTURE_HISTORY_MS / 1000)
+#define CAPTURE_PREROLL_FRAMES (CAPTURE_SAMPLE_RATE * CAPTURE_PREROLL_MS / 1000)
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <netinet/in.h>
 #include <stdarg.h>
@@ -62,6 +81,7 @@
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <log/log.h>
@@ -75,18 +95,26 @@ static const struct sound_trigger_properties hw_properties = {
         "Sound Trigger stub HAL", // description
         1, // version
         { 0xed7a7d60, 0xc65e, 0x11e3, 0x9be4, { 0x00, 0x02, 0xa5, 0xd5, 0xc5, 0x1b } }, // uuid
-        4, // max_sound_models
+        MAX_SOUND_MODELS, // max_sound_models
         1, // max_key_phrases
         1, // max_users
         RECOGNITION_MODE_VOICE_TRIGGER, // recognition_modes
         false, // capture_transition
-        0, // max_buffer_ms
+        CAPTURE_HISTORY_MS, // max_buffer_ms
         true, // concurrent_capture
         false, // trigger_in_event
         0 // power_consumption_mw
 };
 
 struct recognition_context {
+    // Protects the information added in start_recognition and serializes the callbacks of the
+    // model, independently of the other models.
+    pthread_mutex_t lock;
+
+    // References to the context, under the device lock: one while the model is loaded and one
+    // for each thread using it. Freed when the last one is released.
+    int ref_count;
+
     // Sound Model information, added in method load_sound_model
     sound_model_handle_t model_handle;
     sound_trigger_uuid_t model_uuid;
@@ -101,8 +129,11 @@ struct recognition_context {
 
     bool model_started;
 
-    // Next recognition_context in the linked list
-    struct recognition_context *next;
+    // Links of the loaded models, under the device lock.
+    struct recognition_context *next;  // In load order.
+    struct recognition_context *previous;
+    struct recognition_context *next_in_handle_bucket;
+    struct recognition_context *next_in_uuid_bucket;
 };
 
 char tmp_write_buffer[PARSE_BUF_LEN];
@@ -115,12 +146,41 @@ struct stub_sound_trigger_device {
     // into the stub HAL.
     pthread_t control_thread;
 
-    // Recognition contexts are stored as a linked list
+    // The loaded models, in load order and indexed by handle and by UUID. Lookups take
+    // a reference to the context and only hold the lock while doing so; it is never taken while
+    // holding the lock of a recognition_context.
     struct recognition_context *root_model_context;
+    struct recognition_context *last_model_context;
+    struct recognition_context *models_by_handle[MODEL_HASH_BUCKETS];
+    struct recognition_context *models_by_uuid[MODEL_HASH_BUCKETS];
+    unsigned int model_count;
 
     int next_sound_model_id;
 };
 
+// The audio captured by the capture thread, in a ring of CAPTURE_HISTORY_FRAMES. The streaming
+// functions have no device, so this is global.
+struct capture_buffer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // Signaled when audio is captured and when the capture stops.
+    pthread_t thread;
+    bool running;
+
+    int16_t samples[CAPTURE_HISTORY_FRAMES];
+    uint64_t written;  // Frames captured since the HAL was opened.
+    uint64_t trigger_position;  // Value of written at the last trigger.
+    FILE *source;  // Injected audio, or NULL to capture silence.
+
+    // Position of each streaming client, by audio handle - 1.
+    bool client_open[CAPTURE_MAX_CLIENTS];
+    uint64_t client_position[CAPTURE_MAX_CLIENTS];
+};
+
+static struct capture_buffer capture = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
 static bool check_uuid_equality(sound_trigger_uuid_t uuid1, sound_trigger_uuid_t uuid2) {
     if (uuid1.timeLow != uuid2.timeLow ||
         uuid1.timeMid != uuid2.timeMid ||
@@ -197,49 +257,253 @@ static void write_uuid(int conn_socket, sound_trigger_uuid_t uuid) {
                 uuid.node[3], uuid.node[4], uuid.node[5]);
 }
 
-// Returns model at the given index, null otherwise (error, doesn't exist, etc).
-// Note that here index starts from zero.
-struct recognition_context* fetch_model_with_handle(
-        struct stub_sound_trigger_device* stdev, sound_model_handle_t* model_handle) {
-    ALOGI("%s", __func__);
-    struct recognition_context *model_context = NULL;
-    struct recognition_context *last_model_context = stdev->root_model_context;
-    while(last_model_context) {
-        if (last_model_context->model_handle == *model_handle) {
-            model_context = last_model_context;
-            break;
-        }
-        last_model_context = last_model_context->next;
+// Returns the bucket of models_by_handle for the handle.
+static unsigned int handle_bucket(sound_model_handle_t handle) {
+    return (unsigned int)handle & (MODEL_HASH_BUCKETS - 1);
+}
+
+// Returns the bucket of models_by_uuid for the UUID, from a hash of all its fields.
+static unsigned int uuid_bucket(sound_trigger_uuid_t uuid) {
+    uint32_t hash = uuid.timeLow ^ ((uint32_t)uuid.timeMid << 16) ^ uuid.timeHiAndVersion ^
+            ((uint32_t)uuid.clockSeq << 16);
+    for (int i = 0; i < 6; i++) {
+        hash = hash * 31 + uuid.node[i];
+    }
+    return (hash ^ (hash >> 16)) & (MODEL_HASH_BUCKETS - 1);
+}
+
+// Must be called with the device lock held.
+static struct recognition_context* find_model_with_handle_l(
+        struct stub_sound_trigger_device* stdev, sound_model_handle_t handle) {
+    struct recognition_context *model_context = stdev->models_by_handle[handle_bucket(handle)];
+    while (model_context && model_context->model_handle != handle) {
+        model_context = model_context->next_in_handle_bucket;
     }
     return model_context;
 }
 
-// Returns the first model that matches the sound model UUID.
-static sound_model_handle_t* get_model_handle_with_uuid(struct stub_sound_trigger_device* stdev,
-                                                        sound_trigger_uuid_t uuid) {
-    sound_model_handle_t* model_handle_str = NULL;
-    struct recognition_context *last_model_context = stdev->root_model_context;
-    while(last_model_context) {
-        if (check_uuid_equality(last_model_context->model_uuid, uuid)) {
-            model_handle_str = &last_model_context->model_handle;
-            break;
-        }
-        last_model_context = last_model_context->next;
+// Returns the model with the handle, with a reference to release with put_model, or NULL.
+static struct recognition_context* get_model_with_handle(
+        struct stub_sound_trigger_device* stdev, sound_model_handle_t handle) {
+    pthread_mutex_lock(&stdev->lock);
+    struct recognition_context *model_context = find_model_with_handle_l(stdev, handle);
+    if (model_context) {
+        model_context->ref_count++;
+    }
+    pthread_mutex_unlock(&stdev->lock);
+    return model_context;
+}
+
+// Returns the first model loaded that matches the sound model UUID, with a reference to release
+// with put_model, or NULL.
+static struct recognition_context* get_model_with_uuid(struct stub_sound_trigger_device* stdev,
+                                                       sound_trigger_uuid_t uuid) {
+    pthread_mutex_lock(&stdev->lock);
+    struct recognition_context *model_context = stdev->models_by_uuid[uuid_bucket(uuid)];
+    while (model_context && !check_uuid_equality(model_context->model_uuid, uuid)) {
+        model_context = model_context->next_in_uuid_bucket;
+    }
+    if (model_context) {
+        model_context->ref_count++;
     }
-    return model_handle_str;
+    pthread_mutex_unlock(&stdev->lock);
+    return model_context;
 }
 
-/* Will reuse ids when overflow occurs */
+// Returns the number of loaded models stored in models, with a reference to each.
+static unsigned int get_all_models(struct stub_sound_trigger_device* stdev,
+                                   struct recognition_context *models[MAX_SOUND_MODELS]) {
+    unsigned int model_count = 0;
+    pthread_mutex_lock(&stdev->lock);
+    struct recognition_context *model_context = stdev->root_model_context;
+    while (model_context) {
+        model_context->ref_count++;
+        models[model_count++] = model_context;
+        model_context = model_context->next;
+    }
+    pthread_mutex_unlock(&stdev->lock);
+    return model_count;
+}
+
+static void put_model(struct stub_sound_trigger_device* stdev,
+                      struct recognition_context *model_context) {
+    pthread_mutex_lock(&stdev->lock);
+    bool last_reference = --model_context->ref_count == 0;
+    pthread_mutex_unlock(&stdev->lock);
+    if (last_reference) {
+        ALOGI("Deleting model with handle: %d", model_context->model_handle);
+        pthread_mutex_destroy(&model_context->lock);
+        free(model_context->config);
+        free(model_context);
+    }
+}
+
+// Must be called with the device lock held.
+static void add_model_l(struct stub_sound_trigger_device* stdev,
+                        struct recognition_context *model_context) {
+    model_context->ref_count = 1;
+    model_context->next = NULL;
+    model_context->previous = stdev->last_model_context;
+    if (stdev->last_model_context) {
+        stdev->last_model_context->next = model_context;
+    } else {
+        stdev->root_model_context = model_context;
+    }
+    stdev->last_model_context = model_context;
+
+    struct recognition_context **bucket =
+            &stdev->models_by_handle[handle_bucket(model_context->model_handle)];
+    model_context->next_in_handle_bucket = *bucket;
+    *bucket = model_context;
+
+    // Appended, so that the first model loaded with a UUID is found first.
+    bucket = &stdev->models_by_uuid[uuid_bucket(model_context->model_uuid)];
+    while (*bucket) {
+        bucket = &(*bucket)->next_in_uuid_bucket;
+    }
+    model_context->next_in_uuid_bucket = NULL;
+    *bucket = model_context;
+
+    stdev->model_count++;
+}
+
+// Must be called with the device lock held. The reference of the registry is left to release.
+static void remove_model_l(struct stub_sound_trigger_device* stdev,
+                           struct recognition_context *model_context) {
+    if (model_context->previous) {
+        model_context->previous->next = model_context->next;
+    } else {
+        stdev->root_model_context = model_context->next;
+    }
+    if (model_context->next) {
+        model_context->next->previous = model_context->previous;
+    } else {
+        stdev->last_model_context = model_context->previous;
+    }
+
+    struct recognition_context **bucket =
+            &stdev->models_by_handle[handle_bucket(model_context->model_handle)];
+    while (*bucket != model_context) {
+        bucket = &(*bucket)->next_in_handle_bucket;
+    }
+    *bucket = model_context->next_in_handle_bucket;
+
+    bucket = &stdev->models_by_uuid[uuid_bucket(model_context->model_uuid)];
+    while (*bucket != model_context) {
+        bucket = &(*bucket)->next_in_uuid_bucket;
+    }
+    *bucket = model_context->next_in_uuid_bucket;
+
+    stdev->model_count--;
+}
+
+/* Will reuse ids when overflow occurs, skipping the ones still in use.
+ * Must be called with the device lock held. */
 static sound_model_handle_t generate_sound_model_handle(const struct sound_trigger_hw_device *dev) {
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)dev;
-    int new_id = stdev->next_sound_model_id;
-    ++stdev->next_sound_model_id;
-    if (stdev->next_sound_model_id == 0) {
-        stdev->next_sound_model_id = 1;
-    }
+    int new_id;
+    do {
+        new_id = stdev->next_sound_model_id;
+        ++stdev->next_sound_model_id;
+        if (stdev->next_sound_model_id <= 0) {
+            stdev->next_sound_model_id = 1;
+        }
+    } while (find_model_with_handle_l(stdev, (sound_model_handle_t) new_id) != NULL);
     return (sound_model_handle_t) new_id;
 }
 
+// Captures a period every CAPTURE_PERIOD_MS, from the injected file if any, like a DSP that
+// keeps listening.
+static void *capture_thread_loop(void *context) {
+    struct timespec next_period;
+    clock_gettime(CLOCK_MONOTONIC, &next_period);
+
+    pthread_mutex_lock(&capture.lock);
+    while (capture.running) {
+        pthread_mutex_unlock(&capture.lock);
+        next_period.tv_nsec += CAPTURE_PERIOD_MS * 1000000L;
+        if (next_period.tv_nsec >= 1000000000L) {
+            next_period.tv_nsec -= 1000000000L;
+            next_period.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_period, NULL);
+        pthread_mutex_lock(&capture.lock);
+
+        // CAPTURE_HISTORY_FRAMES is a multiple of CAPTURE_PERIOD_FRAMES, so a period doesn't wrap.
+        int16_t *period = &capture.samples[capture.written % CAPTURE_HISTORY_FRAMES];
+        size_t frames = 0;
+        if (capture.source != NULL) {
+            frames = fread(period, sizeof(int16_t), CAPTURE_PERIOD_FRAMES, capture.source);
+            if (frames < CAPTURE_PERIOD_FRAMES) {
+                ALOGI("%s end of injected audio", __func__);
+                fclose(capture.source);
+                capture.source = NULL;
+            }
+        }
+        memset(period + frames, 0, (CAPTURE_PERIOD_FRAMES - frames) * sizeof(int16_t));
+        capture.written += CAPTURE_PERIOD_FRAMES;
+        pthread_cond_broadcast(&capture.cond);
+    }
+    pthread_mutex_unlock(&capture.lock);
+    return NULL;
+}
+
+// Restarts the capture from scratch, as the capture state is global and outlives a previous
+// session of the HAL.
+static void capture_start() {
+    pthread_mutex_lock(&capture.lock);
+    capture.written = 0;
+    capture.trigger_position = 0;
+    for (int i = 0; i < CAPTURE_MAX_CLIENTS; i++) {
+        capture.client_position[i] = 0;
+    }
+    capture.running = true;
+    pthread_mutex_unlock(&capture.lock);
+    pthread_create(&capture.thread, (const pthread_attr_t *) NULL, capture_thread_loop, NULL);
+}
+
+static void capture_stop() {
+    pthread_mutex_lock(&capture.lock);
+    capture.running = false;
+    pthread_cond_broadcast(&capture.cond);
+    pthread_mutex_unlock(&capture.lock);
+    pthread_join(capture.thread, NULL);
+
+    pthread_mutex_lock(&capture.lock);
+    if (capture.source != NULL) {
+        fclose(capture.source);
+        capture.source = NULL;
+    }
+    pthread_mutex_unlock(&capture.lock);
+}
+
+// Marks the audio preceding a recognition event, for the streaming clients opened after it.
+static void capture_mark_trigger() {
+    pthread_mutex_lock(&capture.lock);
+    capture.trigger_position = capture.written;
+    pthread_mutex_unlock(&capture.lock);
+}
+
+static void inject_audio(int conn_socket) {
+    char* path = strtok(NULL, " \r\n");
+    if (path == NULL) {
+        write_string(conn_socket, "Missing file path.\n");
+        return;
+    }
+    FILE *source = fopen(path, "rb");
+    if (source == NULL) {
+        write_vastr(conn_socket, "Can't open %s: %s.\n", path, strerror(errno));
+        return;
+    }
+    pthread_mutex_lock(&capture.lock);
+    if (capture.source != NULL) {
+        fclose(capture.source);
+    }
+    capture.source = source;
+    pthread_mutex_unlock(&capture.lock);
+    write_vastr(conn_socket, "Injecting %s.\n", path);
+}
+
 bool parse_socket_data(int conn_socket, struct stub_sound_trigger_device* stdev);
 static void unload_all_sound_models(struct stub_sound_trigger_device *stdev);
 
@@ -273,6 +537,7 @@ static char *sound_trigger_keyphrase_event_alloc(sound_model_handle_t handle,
     event->phrase_extras[0].levels[0].user_id = 0;
     // Signify that all the data is comming through streaming, not through the buffer.
     event->common.capture_available = true;
+    event->common.capture_preamble_ms = CAPTURE_PREROLL_MS;
     event->common.audio_config = AUDIO_CONFIG_INITIALIZER;
     event->common.audio_config.sample_rate = 16000;
     event->common.audio_config.channel_mask = AUDIO_CHANNEL_IN_MONO;
@@ -293,6 +558,7 @@ static char *sound_trigger_generic_event_alloc(sound_model_handle_t handle,
 
     // Signify that all the data is comming through streaming, not through the buffer.
     event->common.capture_available = true;
+    event->common.capture_preamble_ms = CAPTURE_PREROLL_MS;
     event->common.audio_config = AUDIO_CONFIG_INITIALIZER;
     event->common.audio_config.sample_rate = 16000;
     event->common.audio_config.channel_mask = AUDIO_CHANNEL_IN_MONO;
@@ -300,17 +566,19 @@ static char *sound_trigger_generic_event_alloc(sound_model_handle_t handle,
     return (char*) event;
 }
 
-void send_event_with_handle(sound_model_handle_t* model_handle_str,
-                            struct stub_sound_trigger_device* stdev, int event_type,
-                            int status) {
+// Must be called with the lock of model_context held.
+void send_event_to_model_l(struct recognition_context *model_context, int event_type,
+                           int status) {
     ALOGI("%s", __func__);
-    struct recognition_context *model_context = fetch_model_with_handle(stdev, model_handle_str);
     if (model_context) {
         if (event_type == EVENT_RECOGNITION) {
             if (model_context->recognition_callback == NULL) {
                 ALOGI("%s No matching callback", __func__);
                 return;
             }
+            if (status == RECOGNITION_STATUS_SUCCESS) {
+                capture_mark_trigger();
+            }
 
             if (model_context->model_type == SOUND_MODEL_TYPE_KEYPHRASE) {
                 struct sound_trigger_phrase_recognition_event *event;
@@ -358,50 +626,22 @@ static void send_event(int conn_socket, struct stub_sound_trigger_device* stdev,
     char* model_uuid_str = strtok(NULL, " \r\n");
     sound_trigger_uuid_t model_uuid;
     if (str_to_uuid(model_uuid_str, &model_uuid)) {
-        sound_model_handle_t* model_handle_str = get_model_handle_with_uuid(stdev, model_uuid);
-        if (model_handle_str == NULL) {
+        struct recognition_context *model_context = get_model_with_uuid(stdev, model_uuid);
+        if (model_context == NULL) {
             ALOGI("%s Bad sound model handle.", __func__);
             write_string(conn_socket, "Bad sound model handle.\n");
             return;
         }
-        send_event_with_handle(model_handle_str, stdev, event_type, status);
+        pthread_mutex_lock(&model_context->lock);
+        send_event_to_model_l(model_context, event_type, status);
+        pthread_mutex_unlock(&model_context->lock);
+        put_model(stdev, model_context);
     } else {
         ALOGI("%s Not a valid UUID", __func__);
         write_string(conn_socket, "Not a valid UUID.\n");
     }
 }
 
-static bool recognition_callback_exists(struct stub_sound_trigger_device *stdev) {
-    bool callback_found = false;
-    if (stdev->root_model_context) {
-        struct recognition_context *current_model_context = stdev->root_model_context;
-        while(current_model_context) {
-            if (current_model_context->recognition_callback != NULL) {
-                callback_found = true;
-                break;
-            }
-            current_model_context = current_model_context->next;
-        }
-    }
-    return callback_found;
-}
-
-static struct recognition_context * get_model_context(struct stub_sound_trigger_device *stdev,
-            sound_model_handle_t handle) {
-    struct recognition_context *model_context = NULL;
-    if (stdev->root_model_context) {
-        struct recognition_context *current_model_context = stdev->root_model_context;
-        while(current_model_context) {
-            if (current_model_context->model_handle == handle) {
-                model_context = current_model_context;
-                break;
-            }
-            current_model_context = current_model_context->next;
-        }
-    }
-    return model_context;
-}
-
 static void *control_thread_loop(void *context) {
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)context;
     struct sockaddr_in incoming_info;
@@ -467,14 +707,17 @@ static void *control_thread_loop(void *context) {
 void list_models(int conn_socket, char* buffer,
                  struct stub_sound_trigger_device* stdev) {
     ALOGI("%s", __func__);
-    struct recognition_context *last_model_context = stdev->root_model_context;
+    struct recognition_context *models[MAX_SOUND_MODELS];
+    const unsigned int model_count = get_all_models(stdev, models);
     unsigned int model_index = 0;
     write_string(conn_socket, "-----------------------\n");
-    if (!last_model_context) {
+    if (model_count == 0) {
         ALOGI("ZERO Models exist.");
         write_string(conn_socket, "Zero models exist.\n");
     }
-    while (last_model_context) {
+    for (; model_index < model_count; model_index++) {
+        struct recognition_context *last_model_context = models[model_index];
+        pthread_mutex_lock(&last_model_context->lock);
         write_vastr(conn_socket, "Model Index: %d\n", model_index);
         ALOGI("Model Index: %d", model_index);
         write_vastr(conn_socket, "Model handle: %d\n", last_model_context->model_handle);
@@ -502,8 +745,8 @@ void list_models(int conn_socket, char* buffer,
         }
         write_string(conn_socket, "-----------------------\n\n");
         ALOGI("----\n\n");
-        last_model_context = last_model_context->next;
-        model_index++;
+        pthread_mutex_unlock(&last_model_context->lock);
+        put_model(stdev, last_model_context);
     }
 }
 
@@ -527,12 +770,11 @@ bool parse_socket_data(int conn_socket, struct stub_sound_trigger_device* stdev)
     FILE* input_fp = fdopen(conn_socket, "r");
     bool continue_listening = true;
 
-    // Note: Since we acquire a lock inside this loop, do not use break or other
-    // exit methods without releasing this lock.
+    // The commands take the locks they need, so that a command for a model doesn't wait for
+    // the others.
     write_string(conn_socket, "\n>>> ");
     while(!input_done) {
         if (fgets(buffer, PARSE_BUF_LEN, input_fp) != NULL) {
-            pthread_mutex_lock(&stdev->lock);
             char* command = strtok(buffer, " \r\n");
             if (command == NULL) {
                 write_bad_command_error(conn_socket, command);
@@ -546,6 +788,8 @@ bool parse_socket_data(int conn_socket, struct stub_sound_trigger_device* stdev)
                 send_event(conn_socket, stdev, EVENT_RECOGNITION, RECOGNITION_STATUS_FAILURE);
             } else if (strcmp(command, COMMAND_UPDATE) == 0) {
                 send_event(conn_socket, stdev, EVENT_SOUND_MODEL, SOUND_MODEL_STATUS_UPDATED);
+            } else if (strcmp(command, COMMAND_INJECT) == 0) {
+                inject_audio(conn_socket);
             } else if (strncmp(command, COMMAND_CLEAR, 5) == 0) {
                 unload_all_sound_models(stdev);
             } else if (strncmp(command, COMMAND_CLOSE, 5) == 0) {
@@ -560,7 +804,6 @@ bool parse_socket_data(int conn_socket, struct stub_sound_trigger_device* stdev)
             } else {
                 write_vastr(conn_socket, "\nBad command %s.\n\n", command);
             }
-            pthread_mutex_unlock(&stdev->lock);
         } else {
             ALOGI("parse_socket_data done (got null)");
             input_done = true;  // break.
@@ -606,15 +849,12 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)dev;
     ALOGI("%s stdev %p", __func__, stdev);
     int status = 0;
-    pthread_mutex_lock(&stdev->lock);
 
     if (handle == NULL || sound_model == NULL) {
-        pthread_mutex_unlock(&stdev->lock);
         return -EINVAL;
     }
     if (sound_model->data_size == 0 ||
             sound_model->data_offset < sizeof(struct sound_trigger_sound_model)) {
-        pthread_mutex_unlock(&stdev->lock);
         return -EINVAL;
     }
 
@@ -622,32 +862,9 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
     model_context = malloc(sizeof(struct recognition_context));
     if(!model_context) {
         ALOGW("Could not allocate recognition_context");
-        pthread_mutex_unlock(&stdev->lock);
         return -ENOSYS;
     }
 
-    // Add the new model context to the recognition_context linked list
-    if (stdev->root_model_context) {
-        // Find the tail
-        struct recognition_context *current_model_context = stdev->root_model_context;
-        unsigned int model_count = 0;
-        while(current_model_context->next) {
-            current_model_context = current_model_context->next;
-            model_count++;
-            if (model_count >= hw_properties.max_sound_models) {
-                ALOGW("Can't load model: reached max sound model limit");
-                free(model_context);
-                pthread_mutex_unlock(&stdev->lock);
-                return -ENOSYS;
-            }
-        }
-        current_model_context->next = model_context;
-    } else {
-        stdev->root_model_context = model_context;
-    }
-
-    model_context->model_handle = generate_sound_model_handle(dev);
-    *handle = model_context->model_handle;
     model_context->model_type = sound_model->type;
 
     char *data = (char *)sound_model + sound_model->data_offset;
@@ -659,27 +876,39 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
     model_context->config = NULL;
     model_context->recognition_callback = NULL;
     model_context->recognition_cookie = NULL;
-    model_context->next = NULL;
     model_context->model_started = false;
-    ALOGI("Sound model loaded: Handle %d ", *handle);
+    pthread_mutex_init(&model_context->lock, (const pthread_mutexattr_t *) NULL);
 
+    pthread_mutex_lock(&stdev->lock);
+    if (stdev->model_count >= hw_properties.max_sound_models) {
+        pthread_mutex_unlock(&stdev->lock);
+        ALOGW("Can't load model: reached max sound model limit");
+        pthread_mutex_destroy(&model_context->lock);
+        free(model_context);
+        return -ENOSYS;
+    }
+    model_context->model_handle = generate_sound_model_handle(dev);
+    *handle = model_context->model_handle;
+    add_model_l(stdev, model_context);
     pthread_mutex_unlock(&stdev->lock);
+
+    ALOGI("Sound model loaded: Handle %d ", *handle);
     return status;
 }
 
 static void unload_all_sound_models(struct stub_sound_trigger_device *stdev) {
     ALOGI("%s", __func__);
-    struct recognition_context *model_context = stdev->root_model_context;
-    stdev->root_model_context = NULL;
+    struct recognition_context *models[MAX_SOUND_MODELS];
+    unsigned int model_count = 0;
     pthread_mutex_lock(&stdev->lock);
-    while (model_context) {
-        ALOGI("Deleting model with handle: %d", model_context->model_handle);
-        struct recognition_context *temp = model_context;
-        model_context = model_context->next;
-        free(temp->config);
-        free(temp);
+    while (stdev->root_model_context) {
+        models[model_count] = stdev->root_model_context;
+        remove_model_l(stdev, models[model_count++]);
     }
     pthread_mutex_unlock(&stdev->lock);
+    for (unsigned int i = 0; i < model_count; i++) {
+        put_model(stdev, models[i]);
+    }
 }
 
 static int stdev_unload_sound_model(const struct sound_trigger_hw_device *dev,
@@ -691,32 +920,16 @@ static int stdev_unload_sound_model(const struct sound_trigger_hw_device *dev,
     ALOGI("unload_sound_model:%d", handle);
     pthread_mutex_lock(&stdev->lock);
 
-    struct recognition_context *model_context = NULL;
-    struct recognition_context *previous_model_context = NULL;
-    if (stdev->root_model_context) {
-        struct recognition_context *current_model_context = stdev->root_model_context;
-        while(current_model_context) {
-            if (current_model_context->model_handle == handle) {
-                model_context = current_model_context;
-                break;
-            }
-            previous_model_context = current_model_context;
-            current_model_context = current_model_context->next;
-        }
-    }
+    struct recognition_context *model_context = find_model_with_handle_l(stdev, handle);
     if (!model_context) {
         ALOGW("Can't find sound model handle %d in registered list", handle);
         pthread_mutex_unlock(&stdev->lock);
         return -ENOSYS;
     }
-    if (previous_model_context) {
-        previous_model_context->next = model_context->next;
-    } else {
-        stdev->root_model_context = model_context->next;
-    }
-    free(model_context->config);
-    free(model_context);
+    remove_model_l(stdev, model_context);
     pthread_mutex_unlock(&stdev->lock);
+    // Freed here, or once the last event or command using it is done.
+    put_model(stdev, model_context);
     return status;
 }
 
@@ -727,57 +940,60 @@ static int stdev_start_recognition(const struct sound_trigger_hw_device *dev,
                                    void *cookie) {
     ALOGI("%s", __func__);
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)dev;
-    pthread_mutex_lock(&stdev->lock);
-
-    /* If other models running with callbacks, don't start trigger thread */
-    bool other_callbacks_found = recognition_callback_exists(stdev);
+    int ret = 0;
 
-    struct recognition_context *model_context = get_model_context(stdev, handle);
+    struct recognition_context *model_context = get_model_with_handle(stdev, handle);
     if (!model_context) {
         ALOGW("Can't find sound model handle %d in registered list", handle);
-        pthread_mutex_unlock(&stdev->lock);
         return -ENOSYS;
     }
+    pthread_mutex_lock(&model_context->lock);
 
     free(model_context->config);
     model_context->config = NULL;
     if (config) {
         model_context->config = malloc(sizeof(*config));
         if (!model_context->config) {
-            pthread_mutex_unlock(&stdev->lock);
-            return -ENOMEM;
+            ret = -ENOMEM;
+            goto exit;
         }
         memcpy(model_context->config, config, sizeof(*config));
     }
     model_context->recognition_callback = callback;
     model_context->recognition_cookie = cookie;
     model_context->model_started = true;
-
-    pthread_mutex_unlock(&stdev->lock);
     ALOGI("%s done for handle %d", __func__, handle);
-    return 0;
+
+exit:
+    pthread_mutex_unlock(&model_context->lock);
+    put_model(stdev, model_context);
+    return ret;
+}
+
+// Must be called with the lock of model_context held.
+static void stop_recognition_l(struct recognition_context *model_context) {
+    free(model_context->config);
+    model_context->config = NULL;
+    model_context->recognition_callback = NULL;
+    model_context->recognition_cookie = NULL;
+    model_context->model_started = false;
 }
 
 static int stdev_stop_recognition(const struct sound_trigger_hw_device *dev,
             sound_model_handle_t handle) {
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)dev;
     ALOGI("%s", __func__);
-    pthread_mutex_lock(&stdev->lock);
 
-    struct recognition_context *model_context = get_model_context(stdev, handle);
+    struct recognition_context *model_context = get_model_with_handle(stdev, handle);
     if (!model_context) {
         ALOGW("Can't find sound model handle %d in registered list", handle);
-        pthread_mutex_unlock(&stdev->lock);
         return -ENOSYS;
     }
 
-    free(model_context->config);
-    model_context->config = NULL;
-    model_context->recognition_callback = NULL;
-    model_context->recognition_cookie = NULL;
-    model_context->model_started = false;
-
-    pthread_mutex_unlock(&stdev->lock);
+    pthread_mutex_lock(&model_context->lock);
+    stop_recognition_l(model_context);
+    pthread_mutex_unlock(&model_context->lock);
+    put_model(stdev, model_context);
     ALOGI("%s done for handle %d", __func__, handle);
 
     return 0;
@@ -786,22 +1002,17 @@ static int stdev_stop_recognition(const struct sound_trigger_hw_device *dev,
 static int stdev_stop_all_recognitions(const struct sound_trigger_hw_device *dev) {
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)dev;
     ALOGI("%s", __func__);
-    pthread_mutex_lock(&stdev->lock);
 
-    struct recognition_context *model_context = stdev->root_model_context;
-    while (model_context) {
-        free(model_context->config);
-        model_context->config = NULL;
-        model_context->recognition_callback = NULL;
-        model_context->recognition_cookie = NULL;
-        model_context->model_started = false;
-        ALOGI("%s stopped handle %d", __func__, model_context->model_handle);
-
-        model_context = model_context->next;
+    struct recognition_context *models[MAX_SOUND_MODELS];
+    const unsigned int model_count = get_all_models(stdev, models);
+    for (unsigned int i = 0; i < model_count; i++) {
+        pthread_mutex_lock(&models[i]->lock);
+        stop_recognition_l(models[i]);
+        pthread_mutex_unlock(&models[i]->lock);
+        ALOGI("%s stopped handle %d", __func__, models[i]->model_handle);
+        put_model(stdev, models[i]);
     }
 
-    pthread_mutex_unlock(&stdev->lock);
-
     return 0;
 }
 
@@ -810,14 +1021,13 @@ static int stdev_get_model_state(const struct sound_trigger_hw_device *dev,
     int ret = 0;
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)dev;
     ALOGI("%s", __func__);
-    pthread_mutex_lock(&stdev->lock);
 
-    struct recognition_context *model_context = get_model_context(stdev, handle);
+    struct recognition_context *model_context = get_model_with_handle(stdev, handle);
     if (!model_context) {
         ALOGW("Can't find sound model handle %d in registered list", handle);
-        ret = -ENOSYS;
-        goto exit;
+        return -ENOSYS;
     }
+    pthread_mutex_lock(&model_context->lock);
 
     if (!model_context->model_started) {
         ALOGW("Sound model %d not started", handle);
@@ -834,26 +1044,90 @@ static int stdev_get_model_state(const struct sound_trigger_hw_device *dev,
     // TODO(mdooley): trigger recognition event
 
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    pthread_mutex_unlock(&model_context->lock);
+    put_model(stdev, model_context);
     ALOGI("%s done for handle %d", __func__, handle);
 
     return ret;
 }
 
+// Returns a handle to read the captured audio from CAPTURE_PREROLL_MS before the last trigger, or
+// as much of it as is still kept, or 0 if no more clients can stream.
 __attribute__ ((visibility ("default")))
 int sound_trigger_open_for_streaming() {
     int ret = 0;
+    pthread_mutex_lock(&capture.lock);
+    for (int i = 0; i < CAPTURE_MAX_CLIENTS; i++) {
+        if (!capture.client_open[i]) {
+            uint64_t position = capture.trigger_position > CAPTURE_PREROLL_FRAMES ?
+                    capture.trigger_position - CAPTURE_PREROLL_FRAMES : 0;
+            if (capture.written - position > CAPTURE_HISTORY_FRAMES) {
+                position = capture.written - CAPTURE_HISTORY_FRAMES;
+            }
+            capture.client_open[i] = true;
+            capture.client_position[i] = position;
+            ret = i + 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&capture.lock);
+    ALOGI("%s handle %d", __func__, ret);
     return ret;
 }
 
+// Waits for buffer_len bytes of audio and returns them, or returns 0 if the handle is closed.
+// A client that falls more than CAPTURE_HISTORY_MS behind skips to the oldest audio kept.
 __attribute__ ((visibility ("default")))
 size_t sound_trigger_read_samples(int audio_handle, void *buffer, size_t  buffer_len) {
+    const int client = audio_handle - 1;
+    if (client < 0 || client >= CAPTURE_MAX_CLIENTS) {
+        return 0;
+    }
+    int16_t *samples = (int16_t *)buffer;
+    size_t frames = buffer_len / sizeof(int16_t);
     size_t ret = 0;
+
+    pthread_mutex_lock(&capture.lock);
+    while (frames > 0 && capture.running && capture.client_open[client]) {
+        uint64_t *position = &capture.client_position[client];
+        if (capture.written - *position > CAPTURE_HISTORY_FRAMES) {
+            ALOGW("%s handle %d lost %" PRIu64 " frames", __func__, audio_handle,
+                  capture.written - CAPTURE_HISTORY_FRAMES - *position);
+            *position = capture.written - CAPTURE_HISTORY_FRAMES;
+        }
+        if (*position == capture.written) {
+            pthread_cond_wait(&capture.cond, &capture.lock);
+            continue;
+        }
+        const size_t offset = *position % CAPTURE_HISTORY_FRAMES;
+        size_t count = capture.written - *position;
+        if (count > frames) {
+            count = frames;
+        }
+        if (count > CAPTURE_HISTORY_FRAMES - offset) {
+            count = CAPTURE_HISTORY_FRAMES - offset;
+        }
+        memcpy(samples, &capture.samples[offset], count * sizeof(int16_t));
+        *position += count;
+        samples += count;
+        frames -= count;
+        ret += count * sizeof(int16_t);
+    }
+    pthread_mutex_unlock(&capture.lock);
     return ret;
 }
 
 __attribute__ ((visibility ("default")))
-int sound_trigger_close_for_streaming(int audio_handle __unused) {
+int sound_trigger_close_for_streaming(int audio_handle) {
+    const int client = audio_handle - 1;
+    if (client < 0 || client >= CAPTURE_MAX_CLIENTS) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&capture.lock);
+    capture.client_open[client] = false;
+    pthread_cond_broadcast(&capture.cond);
+    pthread_mutex_unlock(&capture.lock);
+    ALOGI("%s handle %d", __func__, audio_handle);
     return 0;
 }
 
@@ -863,6 +1137,7 @@ static int stdev_close(hw_device_t *device) {
     // would register a signal handler for the control thread so that any
     // blocking socket calls can be interrupted. We would send that signal here
     // to interrupt and quit the thread.
+    capture_stop();
     free(device);
     return 0;
 }
@@ -902,6 +1177,8 @@ static int stdev_open(const hw_module_t* module, const char* name,
                 control_thread_loop, stdev);
     ALOGI("Starting control thread for the stub hal.");
 
+    capture_start();
+
     return 0;
 }
 
@@ -41,6 +41,7 @@
 #include <tinyalsa/asoundlib.h>
 
 #include <audio_utils/channels.h>
+#include <audio_utils/format.h>
 
 #include "alsa_device_profile.h"
 #include "alsa_device_proxy.h"
@@ -49,6 +50,17 @@
 /* Lock play & record samples rates at or above this threshold */
 #define RATELOCK_THRESHOLD 96000
 
+/* Write to each device of an output stream from its own thread, see out_start_writers_l() */
+#define PARALLEL_WRITE_PROPERTY "ro.vendor.audio.usb.parallel_write"
+
+/* Gains of the device_clock filter for the position and the rate */
+#define CLOCK_POSITION_GAIN 0.05
+#define CLOCK_RATE_GAIN 0.0001
+/* A device_clock restarts from a position this far from the estimate, in seconds */
+#define CLOCK_MAX_ERROR 0.02
+/* and bounds the rate to the nominal rate +/- this ratio */
+#define CLOCK_MAX_DRIFT 0.01
+
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -79,10 +91,98 @@ struct stream_lock {
     pthread_mutex_t pre_lock;           /* acquire before lock to avoid DOS by playback thread */
 };
 
+/* Number of frames remixed at a time, small enough for the intermediate buffers to stay in
+ * the L1 cache */
+#define REMIX_BLOCK_FRAMES 32
+
+enum remix_mode {
+    REMIX_MODE_PASSTHROUGH, /* Same channel count at unity gain, the frames are used as is */
+    REMIX_MODE_COPY,        /* Each output channel is a copy of an input channel, or silent */
+    REMIX_MODE_SCALE,       /* Same channel count, each channel is scaled by its gain */
+    REMIX_MODE_MATRIX,      /* Each output channel is a weighted sum of input channels */
+    REMIX_MODE_ADJUST,      /* More than FCC_24 channels, see adjust_channels() */
+};
+
+/*
+ * Conversion of interleaved frames from one channel count to another, with a gain applied to
+ * each input channel. Precomputed from the channel counts and gains so that converting a buffer
+ * takes a single pass over it.
+ */
+struct channel_remix {
+    audio_format_t format;
+    unsigned in_channels;
+    unsigned out_channels;
+    float left;                         /* gain of the first input channel, and of the
+                                         * input channels after the second one */
+    float right;                        /* gain of the second input channel */
+    enum remix_mode mode;
+    int copy_from[FCC_24];              /* REMIX_MODE_COPY: the input channel copied to each
+                                         * output channel, -1 for silence */
+    float scale[FCC_24];                /* REMIX_MODE_SCALE: the gain of each channel */
+    unsigned term_count[FCC_24];        /* REMIX_MODE_MATRIX: the number of input channels
+                                         * summed into each output channel */
+    uint8_t term_channel[FCC_24][FCC_24];   /* and these input channels */
+    float term_gain[FCC_24][FCC_24];        /* with these gains */
+};
+
+/*
+ * Position of a device over CLOCK_MONOTONIC, fitted to the positions and htimestamps read from
+ * the device with an alpha-beta filter. USB devices advance by packets, so the positions read
+ * jitter by a millisecond or more while the fitted one advances steadily, at the rate of the
+ * device clock.
+ */
+struct device_clock {
+    bool valid;
+    double frames;                      /* The estimated position at time_ns */
+    int64_t time_ns;
+    double rate;                        /* The estimated rate of the device, in frames per second */
+    unsigned sample_rate;               /* The nominal rate */
+    uint64_t last_frames;               /* The last position read from the device */
+    uint64_t last_estimate;             /* The last position returned, to keep it monotonic */
+};
+
 struct alsa_device_info {
     alsa_device_profile profile;        /* The profile of the ALSA device */
     alsa_device_proxy proxy;            /* The state */
+    struct channel_remix remix;         /* Between the HAL and the device channel counts */
+    struct device_writer *writer;       /* Writing to the device if not NULL */
+    struct device_clock clock;          /* For the positions reported by the stream */
+    struct listnode list_node;
+};
+
+/*
+ * Frames written by out_write() and read by the device_writer of each device of the stream.
+ * out_write() waits for the slowest device to read before overwriting frames.
+ */
+struct write_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                /* signaled when frames are written or read, and when
+                                         * stopping */
+    struct listnode writers;            /* The device_writer reading the ring */
+    uint8_t *buffer;                    /* NULL if the writers aren't running */
+    size_t capacity;                    /* in frames */
+    size_t frame_size;
+    audio_format_t format;
+    unsigned channel_count;
+    uint64_t written;                   /* Frames written to the ring since the writers started */
+    float volume_left;                  /* The stream volume when the frames were written */
+    float volume_right;
+    bool stopping;
+};
+
+struct device_writer {
+    struct write_ring *ring;
+    struct alsa_device_info *device_info;
+    pthread_t thread;
+    pthread_mutex_t lock;               /* Held by the thread while writing to the device, and
+                                         * by the stream while reading the device position.
+                                         * Taken after ring->lock, never before */
     struct listnode list_node;
+    uint64_t read;                      /* Frames read from the ring, under ring->lock */
+    void *buffer;                       /* The frames being written to the device */
+    size_t buffer_frames;
+    unsigned write_errors;              /* under ring->lock */
+    struct device_clock clock;          /* Updated by the thread after each write, under lock */
 };
 
 struct stream_out {
@@ -113,6 +213,8 @@ struct stream_out {
                                          * they could come from here too if
                                          * there was a previous conversion */
     size_t conversion_buffer_size;      /* in bytes */
+    unsigned io_allocation_count;       /* times the conversion buffer was grown by
+                                         * out_write() */
 
     struct pcm_config config;
 
@@ -122,6 +224,15 @@ struct stream_out {
 
     bool is_bit_perfect; // True if the stream is open with bit-perfect output flag
 
+    bool is_mmap; // True if the stream is open with the MMAP no-IRQ output flag
+
+    // Volume applied by channel_remix_process() if there is no mixer volume control
+    float volume_left;
+    float volume_right;
+
+    bool parallel_write; // True to write to each device from a thread, see PARALLEL_WRITE_PROPERTY
+    struct write_ring write_ring;
+
     // Mixer information used for volume handling
     struct mixer* mixer;
     struct mixer_ctl* volume_ctl;
@@ -159,12 +270,16 @@ struct stream_in {
                                          * they could come from here too if
                                          * there was a previous conversion */
     size_t conversion_buffer_size;      /* in bytes */
+    unsigned io_allocation_count;       /* times the conversion buffer was grown by
+                                         * in_read() */
 
     struct pcm_config config;
 
     audio_io_handle_t handle; // Unique identifier for a stream
 
     audio_patch_handle_t patch_handle; // Patch handle for this stream
+
+    bool is_mmap; // True if the stream is open with the MMAP no-IRQ input flag
 };
 
 // Map channel count to output channel mask
@@ -265,6 +380,10 @@ static void stream_lock(struct stream_lock *lock) {
     pthread_mutex_unlock(&lock->pre_lock);
 }
 
+static int stream_try_lock(struct stream_lock *lock) {
+    return pthread_mutex_trylock(&lock->lock);
+}
+
 static void stream_unlock(struct stream_lock *lock) {
     pthread_mutex_unlock(&lock->lock);
 }
@@ -552,6 +671,61 @@ static void out_stream_find_mixer_volume_control(struct stream_out* out, int car
     ALOGI("%s, no volume control found", __func__);
 }
 
+/*
+ * Device clock
+ */
+static int64_t timespec_to_ns(const struct timespec *timespec)
+{
+    return timespec->tv_sec * 1000000000LL + timespec->tv_nsec;
+}
+
+/*
+ * Fit clock to the position frames of a device at time_ns, and return the fitted position at
+ * time_ns, which is at most max_frames. The fit restarts when the device restarts or jumps.
+ */
+static uint64_t device_clock_update(struct device_clock *clock, unsigned sample_rate,
+                                    uint64_t frames, int64_t time_ns, uint64_t max_frames)
+{
+    if (clock->valid && clock->sample_rate == sample_rate && frames >= clock->last_frames &&
+            time_ns >= clock->time_ns) {
+        const double elapsed = (time_ns - clock->time_ns) / 1000000000.0;
+        const double estimate = clock->frames + clock->rate * elapsed;
+        const double error = frames - estimate;
+        if (fabs(error) > sample_rate * CLOCK_MAX_ERROR) {
+            clock->valid = false;
+        } else if (elapsed > 0) {
+            clock->frames = estimate + CLOCK_POSITION_GAIN * error;
+            clock->rate += CLOCK_RATE_GAIN * error / elapsed;
+            clock->rate = fmax(clock->rate, sample_rate * (1.0 - CLOCK_MAX_DRIFT));
+            clock->rate = fmin(clock->rate, sample_rate * (1.0 + CLOCK_MAX_DRIFT));
+            clock->time_ns = time_ns;
+        }
+    } else {
+        clock->valid = false;
+    }
+
+    if (!clock->valid) {
+        clock->valid = true;
+        clock->frames = frames;
+        clock->time_ns = time_ns;
+        clock->rate = sample_rate;
+        clock->sample_rate = sample_rate;
+        clock->last_estimate = frames;
+    }
+    clock->last_frames = frames;
+
+    uint64_t estimate = clock->frames > 0 ? (uint64_t)llround(clock->frames) : 0;
+    estimate = min(max(estimate, clock->last_estimate), max_frames);
+    clock->last_estimate = estimate;
+    return estimate;
+}
+
+/* The drift of the device from CLOCK_MONOTONIC, in parts per million */
+static int device_clock_drift_ppm(const struct device_clock *clock)
+{
+    return clock->valid ? (int)lround((clock->rate / clock->sample_rate - 1.0) * 1000000.0) : 0;
+}
+
 /*
  * HAl Functions
  */
@@ -567,12 +741,52 @@ static struct alsa_device_info* stream_get_first_alsa_device(const struct listno
     return node_to_item(list_head(alsa_devices), struct alsa_device_info, list_node);
 }
 
+/**
+ * Stop the device_writer threads of alsa_devices, if any, once they finish writing to their
+ * device. Must be called with holding the stream's lock.
+ */
+static void stream_stop_writers_l(struct listnode *alsa_devices)
+{
+    struct alsa_device_info *first_device_info = stream_get_first_alsa_device(alsa_devices);
+    if (first_device_info == NULL || first_device_info->writer == NULL) {
+        return;
+    }
+    struct write_ring *ring = first_device_info->writer->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->stopping = true;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+
+    struct listnode *node;
+    list_for_each (node, alsa_devices) {
+        struct alsa_device_info *device_info =
+                node_to_item(node, struct alsa_device_info, list_node);
+        struct device_writer *writer = device_info->writer;
+        if (writer == NULL) {
+            continue;
+        }
+        pthread_join(writer->thread, NULL);
+        pthread_mutex_lock(&ring->lock);
+        list_remove(&writer->list_node);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer->buffer);
+        free(writer);
+        device_info->writer = NULL;
+    }
+
+    free(ring->buffer);
+    ring->buffer = NULL;
+}
+
 /**
  * Must be called with holding the stream's lock.
  */
 static void stream_standby_l(struct listnode *alsa_devices, bool *standby)
 {
     if (!*standby) {
+        stream_stop_writers_l(alsa_devices);
         struct listnode *node;
         list_for_each (node, alsa_devices) {
             struct alsa_device_info *device_info =
@@ -635,7 +849,48 @@ exit:
     return status;
 }
 
-static void stream_dump_alsa_devices(const struct listnode *alsa_devices, int fd) {
+/*
+ * Grow the conversion buffer to hold a period of any of alsa_devices, so that out_write() and
+ * in_read() don't allocate.  Not to be called from the I/O path.
+ */
+static void stream_reserve_conversion_buffer(const struct listnode *alsa_devices,
+                                             void **buffer, size_t *buffer_size)
+{
+    size_t max_frames = 0;
+    size_t max_frame_size = 0;
+    struct listnode *node;
+    list_for_each(node, alsa_devices) {
+        struct alsa_device_info *device_info =
+                node_to_item(node, struct alsa_device_info, list_node);
+        const alsa_device_proxy *proxy = &device_info->proxy;
+        const size_t frames = proxy_get_period_size(proxy);
+        const size_t frame_size = audio_bytes_per_frame(proxy_get_channel_count(proxy),
+                audio_format_from_pcm_format(proxy_get_format(proxy)));
+        if (frames > max_frames) {
+            max_frames = frames;
+        }
+        if (frame_size > max_frame_size) {
+            max_frame_size = frame_size;
+        }
+    }
+
+    const size_t required_size = max_frames * max_frame_size;
+    if (required_size > *buffer_size) {
+        void *new_buffer = realloc(*buffer, required_size);
+        if (new_buffer == NULL) {
+            ALOGE("%s failed to allocate %zu bytes", __func__, required_size);
+            return;
+        }
+        *buffer = new_buffer;
+        *buffer_size = required_size;
+    }
+}
+
+/*
+ * The device clocks are updated by the position queries under the stream's lock, so they are
+ * only dumped if locked, when holding it.
+ */
+static void stream_dump_alsa_devices(const struct listnode *alsa_devices, bool locked, int fd) {
     struct listnode *node;
     size_t i = 0;
     list_for_each(node, alsa_devices) {
@@ -647,7 +902,521 @@ static void stream_dump_alsa_devices(const struct listnode *alsa_devices, int fd
 
         dprintf(fd, "%s Proxy %zu:\n", direction, i);
         proxy_dump(&device_info->proxy, fd);
+
+        if (locked) {
+            dprintf(fd, "%s Clock %zu: drift %d ppm\n",
+                    direction, i, device_clock_drift_ppm(&device_info->clock));
+        } else {
+            dprintf(fd, "%s Clock %zu: stream busy\n", direction, i);
+        }
+    }
+}
+
+/*
+ * Channel remix
+ */
+/*
+ * Precompute the conversion of frames in format from in_channels to out_channels, unless remix
+ * is already set up for it.  Channels are kept in place, except that mono is copied to the first
+ * two output channels and the first two input channels are averaged to mono.  The gain left
+ * applies to the first input channel and the input channels after the second one, the gain
+ * right to the second input channel.
+ */
+static void channel_remix_update(struct channel_remix *remix, audio_format_t format,
+                                 unsigned in_channels, unsigned out_channels,
+                                 float left, float right)
+{
+    if (remix->format == format && remix->in_channels == in_channels &&
+            remix->out_channels == out_channels && remix->left == left &&
+            remix->right == right) {
+        return;
+    }
+    remix->format = format;
+    remix->in_channels = in_channels;
+    remix->out_channels = out_channels;
+    remix->left = left;
+    remix->right = right;
+
+    if (in_channels > FCC_24 || out_channels > FCC_24) {
+        remix->mode = in_channels == out_channels ? REMIX_MODE_PASSTHROUGH : REMIX_MODE_ADJUST;
+        return;
+    }
+
+    float matrix[FCC_24][FCC_24] = {{0}}; /* [out][in] */
+    if (in_channels == 1 && out_channels >= 2) {
+        matrix[0][0] = matrix[1][0] = 1.0f;
+    } else if (in_channels >= 2 && out_channels == 1) {
+        matrix[0][0] = matrix[0][1] = 0.5f;
+    } else {
+        for (unsigned c = 0; c < min(in_channels, out_channels); ++c) {
+            matrix[c][c] = 1.0f;
+        }
+    }
+    for (unsigned i = 0; i < in_channels; ++i) {
+        const float gain = i == 1 ? right : left;
+        for (unsigned o = 0; o < out_channels; ++o) {
+            matrix[o][i] *= gain;
+        }
+    }
+
+    bool copy = true;
+    bool diagonal = in_channels == out_channels;
+    bool identity = in_channels == out_channels;
+    for (unsigned o = 0; o < out_channels; ++o) {
+        remix->term_count[o] = 0;
+        remix->copy_from[o] = -1;
+        for (unsigned i = 0; i < in_channels; ++i) {
+            if (matrix[o][i] == 0.0f) {
+                continue;
+            }
+            const unsigned term = remix->term_count[o]++;
+            remix->term_channel[o][term] = i;
+            remix->term_gain[o][term] = matrix[o][i];
+            copy = copy && term == 0 && matrix[o][i] == 1.0f;
+            diagonal = diagonal && i == o;
+            identity = identity && i == o && matrix[o][i] == 1.0f;
+            remix->copy_from[o] = i;
+        }
+        remix->scale[o] = matrix[o][o < in_channels ? o : 0];
+        identity = identity && remix->term_count[o] == 1;
+    }
+
+    if (identity) {
+        remix->mode = REMIX_MODE_PASSTHROUGH;
+    } else if (copy) {
+        remix->mode = REMIX_MODE_COPY;
+    } else if (diagonal) {
+        remix->mode = REMIX_MODE_SCALE;
+    } else {
+        remix->mode = REMIX_MODE_MATRIX;
+    }
+}
+
+/* Copy samples between channels without conversion, so that it's bit exact for any format. */
+static void channel_remix_copy(const struct channel_remix *remix, const void *in, void *out,
+                               size_t frames, size_t sample_size)
+{
+    const unsigned in_channels = remix->in_channels;
+    const unsigned out_channels = remix->out_channels;
+    if (sample_size == sizeof(int16_t)) {
+        const int16_t *src = (const int16_t *)in;
+        int16_t *dst = (int16_t *)out;
+        for (size_t f = 0; f < frames; ++f, src += in_channels, dst += out_channels) {
+            for (unsigned o = 0; o < out_channels; ++o) {
+                dst[o] = remix->copy_from[o] < 0 ? 0 : src[remix->copy_from[o]];
+            }
+        }
+    } else if (sample_size == sizeof(int32_t)) {
+        const int32_t *src = (const int32_t *)in;
+        int32_t *dst = (int32_t *)out;
+        for (size_t f = 0; f < frames; ++f, src += in_channels, dst += out_channels) {
+            for (unsigned o = 0; o < out_channels; ++o) {
+                dst[o] = remix->copy_from[o] < 0 ? 0 : src[remix->copy_from[o]];
+            }
+        }
+    } else {
+        const uint8_t *src = (const uint8_t *)in;
+        uint8_t *dst = (uint8_t *)out;
+        for (size_t f = 0; f < frames; ++f) {
+            for (unsigned o = 0; o < out_channels; ++o, dst += sample_size) {
+                if (remix->copy_from[o] < 0) {
+                    memset(dst, 0, sample_size);
+                } else {
+                    memcpy(dst, src + remix->copy_from[o] * sample_size, sample_size);
+                }
+            }
+            src += in_channels * sample_size;
+        }
+    }
+}
+
+/*
+ * Convert frames from in to out as set up by channel_remix_update(). in and out must not
+ * overlap. Integer samples are converted to float and back a block at a time, with
+ * memcpy_by_audio_format() which clamps and is vectorized, and the float samples are remixed in
+ * between while they are in the cache.
+ */
+static void channel_remix_process(const struct channel_remix *remix, const void *in, void *out,
+                                  size_t frames)
+{
+    const size_t sample_size = audio_bytes_per_sample(remix->format);
+    const unsigned in_channels = remix->in_channels;
+    const unsigned out_channels = remix->out_channels;
+    switch (remix->mode) {
+    case REMIX_MODE_PASSTHROUGH:
+        memcpy(out, in, frames * in_channels * sample_size);
+        return;
+    case REMIX_MODE_ADJUST:
+        adjust_channels(in, in_channels, out, out_channels, sample_size,
+                        frames * in_channels * sample_size);
+        return;
+    case REMIX_MODE_COPY:
+        channel_remix_copy(remix, in, out, frames, sample_size);
+        return;
+    default:
+        break;
+    }
+
+    float in_block[REMIX_BLOCK_FRAMES * FCC_24];
+    float out_block[REMIX_BLOCK_FRAMES * FCC_24];
+    const uint8_t *src = (const uint8_t *)in;
+    uint8_t *dst = (uint8_t *)out;
+    while (frames > 0) {
+        const size_t block_frames = min(frames, REMIX_BLOCK_FRAMES);
+        memcpy_by_audio_format(in_block, AUDIO_FORMAT_PCM_FLOAT, src, remix->format,
+                               block_frames * in_channels);
+        if (remix->mode == REMIX_MODE_SCALE) {
+            for (size_t f = 0; f < block_frames; ++f) {
+                const float *x = in_block + f * in_channels;
+                float *y = out_block + f * out_channels;
+                for (unsigned c = 0; c < out_channels; ++c) {
+                    y[c] = x[c] * remix->scale[c];
+                }
+            }
+        } else {
+            for (size_t f = 0; f < block_frames; ++f) {
+                const float *x = in_block + f * in_channels;
+                float *y = out_block + f * out_channels;
+                for (unsigned o = 0; o < out_channels; ++o) {
+                    float sum = 0.0f;
+                    for (unsigned t = 0; t < remix->term_count[o]; ++t) {
+                        sum += x[remix->term_channel[o][t]] * remix->term_gain[o][t];
+                    }
+                    y[o] = sum;
+                }
+            }
+        }
+        memcpy_by_audio_format(dst, remix->format, out_block, AUDIO_FORMAT_PCM_FLOAT,
+                               block_frames * out_channels);
+        src += block_frames * in_channels * sample_size;
+        dst += block_frames * out_channels * sample_size;
+        frames -= block_frames;
+    }
+}
+
+/*
+ * Parallel output
+ */
+/*
+ * Keep the device_writer of device_info, if any, from writing to the device while its proxy is
+ * read. Must be called with holding the stream's lock, which keeps the writer running.
+ */
+static void device_writer_lock(const struct alsa_device_info *device_info)
+{
+    if (device_info->writer != NULL) {
+        pthread_mutex_lock(&device_info->writer->lock);
+    }
+}
+
+static void device_writer_unlock(const struct alsa_device_info *device_info)
+{
+    if (device_info->writer != NULL) {
+        pthread_mutex_unlock(&device_info->writer->lock);
+    }
+}
+
+/*
+ * Update the drift of the device of writer from its presentation position. Must be called with
+ * holding the writer's lock.
+ */
+static void device_writer_update_drift(struct device_writer *writer)
+{
+    const alsa_device_proxy *proxy = &writer->device_info->proxy;
+    uint64_t frames;
+    struct timespec timestamp;
+    if (proxy_get_presentation_position(proxy, &frames, &timestamp) != 0) {
+        return;
     }
+    device_clock_update(&writer->clock, proxy_get_sample_rate(proxy),
+                        frames, timespec_to_ns(&timestamp), frames);
+}
+
+/*
+ * Remix the frames written to the ring for the device of writer and write them to it, until the
+ * writers are stopped.
+ */
+static void *device_writer_thread(void *context)
+{
+    struct device_writer *writer = (struct device_writer *)context;
+    struct write_ring *ring = writer->ring;
+    struct alsa_device_info *device_info = writer->device_info;
+    const unsigned device_channel_count = proxy_get_channel_count(&device_info->proxy);
+    const size_t device_frame_size = audio_bytes_per_frame(device_channel_count, ring->format);
+
+    pthread_mutex_lock(&ring->lock);
+    while (!ring->stopping) {
+        if (writer->read == ring->written) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+            continue;
+        }
+        const size_t offset = writer->read % ring->capacity;
+        const size_t frames = min(min(ring->written - writer->read, writer->buffer_frames),
+                                  ring->capacity - offset);
+        channel_remix_update(&device_info->remix, ring->format,
+                             ring->channel_count, device_channel_count,
+                             ring->volume_left, ring->volume_right);
+        /* out_write() doesn't overwrite these frames until they are read */
+        pthread_mutex_unlock(&ring->lock);
+        channel_remix_process(&device_info->remix, ring->buffer + offset * ring->frame_size,
+                              writer->buffer, frames);
+
+        pthread_mutex_lock(&ring->lock);
+        writer->read += frames;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+
+        pthread_mutex_lock(&writer->lock);
+        const int ret = proxy_write(&device_info->proxy, writer->buffer,
+                                    frames * device_frame_size);
+        if (ret == 0) {
+            device_writer_update_drift(writer);
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        pthread_mutex_lock(&ring->lock);
+        if (ret != 0) {
+            writer->write_errors++;
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+/*
+ * Start a device_writer for each device of out, so that out_write() only copies the frames to
+ * the ring and the devices are written to in parallel. The ring holds a period, so a device is
+ * at most a period behind out_write(). The threads inherit the scheduling of the caller, the
+ * playback thread. Must be called with holding the stream's lock, after the devices are opened.
+ */
+static int out_start_writers_l(struct stream_out *out)
+{
+    struct write_ring *ring = &out->write_ring;
+    size_t period_frames = 0;
+    struct listnode *node;
+    list_for_each (node, &out->alsa_devices) {
+        struct alsa_device_info *device_info =
+                node_to_item(node, struct alsa_device_info, list_node);
+        period_frames = max(period_frames, proxy_get_period_size(&device_info->proxy));
+    }
+
+    ring->format = audio_format_from_pcm_format(out->config.format);
+    ring->channel_count = out->hal_channel_count;
+    ring->frame_size = audio_bytes_per_frame(ring->channel_count, ring->format);
+    ring->capacity = period_frames;
+    ring->written = 0;
+    ring->volume_left = out->volume_left;
+    ring->volume_right = out->volume_right;
+    ring->stopping = false;
+    ring->buffer = (uint8_t *)malloc(ring->capacity * ring->frame_size);
+    if (ring->buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    int status = 0;
+    list_for_each (node, &out->alsa_devices) {
+        struct alsa_device_info *device_info =
+                node_to_item(node, struct alsa_device_info, list_node);
+        struct device_writer *writer =
+                (struct device_writer *)calloc(1, sizeof(struct device_writer));
+        if (writer == NULL) {
+            status = -ENOMEM;
+            break;
+        }
+        writer->ring = ring;
+        writer->device_info = device_info;
+        writer->buffer_frames = period_frames;
+        writer->buffer = malloc(period_frames * audio_bytes_per_frame(
+                proxy_get_channel_count(&device_info->proxy), ring->format));
+        if (writer->buffer == NULL) {
+            free(writer);
+            status = -ENOMEM;
+            break;
+        }
+        pthread_mutex_init(&writer->lock, (const pthread_mutexattr_t *) NULL);
+        status = -pthread_create(&writer->thread, (const pthread_attr_t *) NULL,
+                                 device_writer_thread, writer);
+        if (status != 0) {
+            pthread_mutex_destroy(&writer->lock);
+            free(writer->buffer);
+            free(writer);
+            break;
+        }
+        pthread_mutex_lock(&ring->lock);
+        list_add_tail(&ring->writers, &writer->list_node);
+        pthread_mutex_unlock(&ring->lock);
+        device_info->writer = writer;
+    }
+
+    if (status != 0) {
+        stream_stop_writers_l(&out->alsa_devices);
+        free(ring->buffer);
+        ring->buffer = NULL;
+    }
+    return status;
+}
+
+/*
+ * Copy frames to the ring of the writers of out, waiting for the slowest writer to read the
+ * frames they overwrite. Must be called with holding the stream's lock.
+ */
+static void out_write_ring_l(struct stream_out *out, const void *buffer, size_t frames)
+{
+    struct write_ring *ring = &out->write_ring;
+    const uint8_t *src = (const uint8_t *)buffer;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->volume_left = out->volume_left;
+    ring->volume_right = out->volume_right;
+    while (frames > 0 && !ring->stopping) {
+        uint64_t min_read = ring->written;
+        struct listnode *node;
+        list_for_each (node, &ring->writers) {
+            const struct device_writer *writer =
+                    node_to_item(node, struct device_writer, list_node);
+            min_read = min(min_read, writer->read);
+        }
+        const size_t available = ring->capacity - (ring->written - min_read);
+        if (available == 0) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+            continue;
+        }
+
+        const size_t offset = ring->written % ring->capacity;
+        const size_t count = min(min(frames, available), ring->capacity - offset);
+        /* The writers don't read these frames until written is updated */
+        pthread_mutex_unlock(&ring->lock);
+        memcpy(ring->buffer + offset * ring->frame_size, src, count * ring->frame_size);
+        pthread_mutex_lock(&ring->lock);
+
+        ring->written += count;
+        pthread_cond_broadcast(&ring->cond);
+        src += count * ring->frame_size;
+        frames -= count;
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * MMAP functions
+ */
+/*
+ * Open the device of a stream in MMAP no-IRQ mode and share its DMA buffer in info, so that the
+ * client reads or writes the buffer directly and only polls the position. The stream must have a
+ * single device, with the stream channel count. Must be called with holding the stream's lock.
+ */
+static int stream_create_mmap_buffer_l(struct listnode *alsa_devices, bool *standby,
+                                       int32_t min_size_frames,
+                                       struct audio_mmap_buffer_info *info)
+{
+    if (info == NULL || min_size_frames <= 0) {
+        return -EINVAL;
+    }
+    struct alsa_device_info *device_info = stream_get_first_alsa_device(alsa_devices);
+    if (device_info == NULL || list_head(alsa_devices) != list_tail(alsa_devices)) {
+        return -ENODEV;
+    }
+    alsa_device_proxy *proxy = &device_info->proxy;
+    if (!*standby || proxy->pcm != NULL) {
+        return -ENOSYS;
+    }
+
+    struct pcm_config *config = &proxy->alsa_config;
+    if (config->period_size * config->period_count < (unsigned)min_size_frames) {
+        config->period_count = (min_size_frames + config->period_size - 1) / config->period_size;
+    }
+    /* The client doesn't move the application pointer, so xruns must not stop the device */
+    config->start_threshold = 0;
+    config->stop_threshold = INT32_MAX;
+    config->silence_threshold = 0;
+    config->silence_size = 0;
+    config->avail_min = config->period_size;
+
+    proxy->pcm = pcm_open(device_info->profile.card, device_info->profile.device,
+                          device_info->profile.direction | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC,
+                          config);
+    if (proxy->pcm == NULL || !pcm_is_ready(proxy->pcm)) {
+        ALOGE("%s failed to open card=%d;device=%d in mmap mode: %s", __func__,
+                device_info->profile.card, device_info->profile.device,
+                proxy->pcm == NULL ? "" : pcm_get_error(proxy->pcm));
+        goto error;
+    }
+
+    void *address;
+    unsigned int offset;
+    unsigned int frames = pcm_get_buffer_size(proxy->pcm);
+    if (pcm_mmap_begin(proxy->pcm, &address, &offset, &frames) != 0 || offset != 0 ||
+            frames != pcm_get_buffer_size(proxy->pcm)) {
+        ALOGE("%s failed to map the buffer: %s", __func__, pcm_get_error(proxy->pcm));
+        goto error;
+    }
+    if (device_info->profile.direction == PCM_OUT) {
+        /* Hand the whole buffer to the device, so that the frames available to write are the
+         * frames played, see stream_get_mmap_position_l() */
+        memset(address, 0, pcm_frames_to_bytes(proxy->pcm, frames));
+        if (pcm_mmap_commit(proxy->pcm, offset, frames) < 0) {
+            ALOGE("%s failed to commit the buffer: %s", __func__, pcm_get_error(proxy->pcm));
+            goto error;
+        }
+    }
+
+    info->shared_memory_address = address;
+    info->shared_memory_fd = pcm_get_poll_fd(proxy->pcm);
+    info->buffer_size_frames = frames;
+    info->burst_size_frames = config->period_size;
+    /* The fd is the PCM device, only the framework may map it */
+    info->flags = (audio_mmap_buffer_flag)0;
+    *standby = false;
+    return 0;
+
+error:
+    proxy_close(proxy);
+    return -ENODEV;
+}
+
+/*
+ * Must be called with holding the stream's lock.
+ */
+static int stream_get_mmap_position_l(const struct listnode *alsa_devices,
+                                      struct audio_mmap_position *position)
+{
+    const struct alsa_device_info *device_info = stream_get_first_alsa_device(alsa_devices);
+    if (device_info == NULL || device_info->proxy.pcm == NULL) {
+        return -ENOSYS;
+    }
+    unsigned int avail;
+    struct timespec timestamp;
+    if (pcm_get_htimestamp(device_info->proxy.pcm, &avail, &timestamp) != 0) {
+        return -ENODATA;
+    }
+    /* The application pointer doesn't move from a buffer ahead of the start for playback and the
+     * start for capture, so the frames available are the position of the device */
+    position->position_frames = (int32_t)avail;
+    position->time_nanoseconds = timespec_to_ns(&timestamp);
+    return 0;
+}
+
+/*
+ * Must be called with holding the stream's lock.
+ */
+static int stream_start_mmap_l(const struct listnode *alsa_devices)
+{
+    const struct alsa_device_info *device_info = stream_get_first_alsa_device(alsa_devices);
+    if (device_info == NULL || device_info->proxy.pcm == NULL) {
+        return -ENOSYS;
+    }
+    return pcm_start(device_info->proxy.pcm) == 0 ? 0 : -EIO;
+}
+
+/*
+ * Must be called with holding the stream's lock.
+ */
+static int stream_stop_mmap_l(const struct listnode *alsa_devices)
+{
+    const struct alsa_device_info *device_info = stream_get_first_alsa_device(alsa_devices);
+    if (device_info == NULL || device_info->proxy.pcm == NULL) {
+        return -ENOSYS;
+    }
+    return pcm_stop(device_info->proxy.pcm) == 0 ? 0 : -EIO;
 }
 
 /*
@@ -714,6 +1483,12 @@ static int out_standby(struct audio_stream *stream)
     struct stream_out *out = (struct stream_out *)stream;
 
     stream_lock(&out->lock);
+    if (out->is_mmap) {
+        /* The client keeps the buffer mapped until the stream is closed */
+        stream_stop_mmap_l(&out->alsa_devices);
+        stream_unlock(&out->lock);
+        return 0;
+    }
     device_lock(out->adev);
     stream_standby_l(&out->alsa_devices, &out->standby);
     device_unlock(out->adev);
@@ -725,7 +1500,29 @@ static int out_dump(const struct audio_stream *stream, int fd) {
     const struct stream_out* out_stream = (const struct stream_out*) stream;
 
     if (out_stream != NULL) {
-        stream_dump_alsa_devices(&out_stream->alsa_devices, fd);
+        /* Called by adev_dump() with the device lock held, so the stream's lock is only tried */
+        struct stream_lock *lock = (struct stream_lock *)&out_stream->lock;
+        const bool locked = stream_try_lock(lock) == 0;
+        stream_dump_alsa_devices(&out_stream->alsa_devices, locked, fd);
+        if (locked) {
+            stream_unlock(lock);
+        }
+        dprintf(fd, "Conversion buffer: %zu bytes, %u allocations in out_write\n",
+                out_stream->conversion_buffer_size, out_stream->io_allocation_count);
+
+        struct write_ring *ring = (struct write_ring *)&out_stream->write_ring;
+        pthread_mutex_lock(&ring->lock);
+        size_t i = 0;
+        struct listnode *node;
+        list_for_each (node, &ring->writers) {
+            struct device_writer *writer = node_to_item(node, struct device_writer, list_node);
+            pthread_mutex_lock(&writer->lock);
+            const int drift_ppm = device_clock_drift_ppm(&writer->clock);
+            pthread_mutex_unlock(&writer->lock);
+            dprintf(fd, "Writer %zu: %" PRIu64 " frames behind, drift %d ppm, %u write errors\n",
+                    i++, ring->written - writer->read, drift_ppm, writer->write_errors);
+        }
+        pthread_mutex_unlock(&ring->lock);
     }
 
     return 0;
@@ -756,13 +1553,24 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    struct alsa_device_info *device_info = stream_get_first_alsa_device(
-            &((struct stream_out*)stream)->alsa_devices);
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    struct alsa_device_info *device_info = stream_get_first_alsa_device(&out->alsa_devices);
     if (device_info == NULL) {
         ALOGW("%s device info is null", __func__);
+        stream_unlock(&out->lock);
         return 0;
     }
-    return proxy_get_latency(&device_info->proxy);
+    device_writer_lock(device_info);
+    uint32_t latency_ms = proxy_get_latency(&device_info->proxy);
+    device_writer_unlock(device_info);
+    const struct write_ring *ring = &out->write_ring;
+    if (ring->buffer != NULL) {
+        /* The frames wait in the ring for a period at most */
+        latency_ms += ring->capacity * 1000 / proxy_get_sample_rate(&device_info->proxy);
+    }
+    stream_unlock(&out->lock);
+    return latency_ms;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left, float right)
@@ -789,6 +1597,11 @@ static int out_set_volume(struct audio_stream_out *stream, float left, float rig
         if (result != 0) {
             ALOGE("%s error=%d left=%f right=%f", __func__, result, left, right);
         }
+    } else if (!out->is_bit_perfect) {
+        /* No hardware volume, apply it when remixing in out_write() */
+        out->volume_left = left;
+        out->volume_right = right;
+        result = 0;
     }
     stream_unlock(&out->lock);
     return result;
@@ -812,6 +1625,14 @@ static int start_output_stream(struct stream_out *out)
         }
     }
 
+    if (out->parallel_write && list_head(&out->alsa_devices) != list_tail(&out->alsa_devices)) {
+        const int writers_status = out_start_writers_l(out);
+        if (writers_status != 0) {
+            ALOGW("%s failed to start the writers, err=%d, writing serially",
+                    __func__, writers_status);
+        }
+    }
+
 exit:
     if (status != 0) {
         list_for_each(node, &out->alsa_devices) {
@@ -838,6 +1659,12 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer, si
         out->standby = false;
     }
 
+    if (out->write_ring.buffer != NULL) {
+        out_write_ring_l(out, buffer, bytes / audio_stream_out_frame_size(stream));
+        stream_unlock(&out->lock);
+        return bytes;
+    }
+
     struct listnode* node;
     list_for_each(node, &out->alsa_devices) {
         struct alsa_device_info* device_info =
@@ -847,22 +1674,36 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer, si
         int num_write_buff_bytes = bytes;
         const int num_device_channels = proxy_get_channel_count(proxy); /* what we told alsa */
         const int num_req_channels = out->hal_channel_count; /* what we told AudioFlinger */
-        if (num_device_channels != num_req_channels) {
+        const audio_format_t audio_format = out_get_format(&(out->stream.common));
+        channel_remix_update(&device_info->remix, audio_format,
+                             num_req_channels, num_device_channels,
+                             out->volume_left, out->volume_right);
+        if (device_info->remix.mode != REMIX_MODE_PASSTHROUGH) {
             /* allocate buffer */
             const size_t required_conversion_buffer_size =
                      bytes * num_device_channels / num_req_channels;
             if (required_conversion_buffer_size > out->conversion_buffer_size) {
+                /* More than a period, see stream_reserve_conversion_buffer() */
+                ALOGW_IF(out->conversion_buffer_size == 0,
+                         "%s conversion buffer was not reserved", __func__);
+                void *conversion_buffer = realloc(out->conversion_buffer,
+                                                  required_conversion_buffer_size);
+                if (conversion_buffer == NULL) {
+                    ALOGE("%s failed to allocate %zu bytes",
+                            __func__, required_conversion_buffer_size);
+                    continue;
+                }
+                out->conversion_buffer = conversion_buffer;
                 out->conversion_buffer_size = required_conversion_buffer_size;
-                out->conversion_buffer = realloc(out->conversion_buffer,
-                                                 out->conversion_buffer_size);
+                out->io_allocation_count++;
             }
             /* convert data */
-            const audio_format_t audio_format = out_get_format(&(out->stream.common));
-            const unsigned sample_size_in_bytes = audio_bytes_per_sample(audio_format);
-            num_write_buff_bytes =
-                    adjust_channels(write_buff, num_req_channels,
-                                    out->conversion_buffer, num_device_channels,
-                                    sample_size_in_bytes, num_write_buff_bytes);
+            const size_t frame_size = audio_bytes_per_frame(num_req_channels, audio_format);
+            const size_t frames = bytes / frame_size;
+            channel_remix_process(&device_info->remix, write_buff, out->conversion_buffer,
+                                  frames);
+            num_write_buff_bytes = frames * audio_bytes_per_frame(num_device_channels,
+                                                                  audio_format);
             write_buff = out->conversion_buffer;
         }
 
@@ -885,9 +1726,43 @@ err:
     return bytes;
 }
 
+/*
+ * The position and time of the first device of out, from its device_clock. Must be called with
+ * holding the stream's lock.
+ */
+static int out_get_presentation_position_l(struct stream_out *out,
+                                           uint64_t *frames, int64_t *time_ns)
+{
+    struct alsa_device_info *device_info = stream_get_first_alsa_device(&out->alsa_devices);
+    if (device_info == NULL) {
+        return -ENODEV;
+    }
+    struct timespec timestamp;
+    device_writer_lock(device_info);
+    const int ret = proxy_get_presentation_position(&device_info->proxy, frames, &timestamp);
+    if (ret == 0) {
+        *time_ns = timespec_to_ns(&timestamp);
+        /* The frames written to the device are presented at most */
+        *frames = device_clock_update(&device_info->clock,
+                                      proxy_get_sample_rate(&device_info->proxy),
+                                      *frames, *time_ns, device_info->proxy.transferred);
+    }
+    device_writer_unlock(device_info);
+    return ret;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream, uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    uint64_t frames;
+    int64_t time_ns;
+    const int ret = out_get_presentation_position_l(out, &frames, &time_ns);
+    if (ret == 0) {
+        *dsp_frames = (uint32_t)frames;
+    }
+    stream_unlock(&out->lock);
+    return ret == 0 ? 0 : -EINVAL;
 }
 
 static int out_get_presentation_position(const struct audio_stream_out *stream,
@@ -896,9 +1771,54 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
     struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
     stream_lock(&out->lock);
 
-    const struct alsa_device_info* device_info = stream_get_first_alsa_device(&out->alsa_devices);
-    const int ret = device_info == NULL ? -ENODEV :
-            proxy_get_presentation_position(&device_info->proxy, frames, timestamp);
+    int64_t time_ns;
+    const int ret = out_get_presentation_position_l(out, frames, &time_ns);
+    if (ret == 0) {
+        timestamp->tv_sec = time_ns / 1000000000LL;
+        timestamp->tv_nsec = time_ns % 1000000000LL;
+    }
+    stream_unlock(&out->lock);
+    return ret;
+}
+
+static int out_start(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    const int ret = out->is_mmap ? stream_start_mmap_l(&out->alsa_devices) : -ENOSYS;
+    stream_unlock(&out->lock);
+    return ret;
+}
+
+static int out_stop(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    const int ret = out->is_mmap ? stream_stop_mmap_l(&out->alsa_devices) : -ENOSYS;
+    stream_unlock(&out->lock);
+    return ret;
+}
+
+static int out_create_mmap_buffer(const struct audio_stream_out *stream,
+                                  int32_t min_size_frames,
+                                  struct audio_mmap_buffer_info *info)
+{
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    const int ret = out->is_mmap
+            ? stream_create_mmap_buffer_l(&out->alsa_devices, &out->standby, min_size_frames, info)
+            : -ENOSYS;
+    stream_unlock(&out->lock);
+    return ret;
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream,
+                                 struct audio_mmap_position *position)
+{
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    const int ret = out->is_mmap ? stream_get_mmap_position_l(&out->alsa_devices, position)
+                                 : -ENOSYS;
     stream_unlock(&out->lock);
     return ret;
 }
@@ -915,7 +1835,24 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream, int64_t *timestamp)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream; // discard const qualifier
+    stream_lock(&out->lock);
+    uint64_t frames;
+    int64_t time_ns;
+    int ret = out->standby || out->write_ring.buffer != NULL ? -EINVAL
+            : out_get_presentation_position_l(out, &frames, &time_ns);
+    if (ret == 0) {
+        /* The frames written so far are presented before the next write, at the device rate */
+        const struct alsa_device_info *device_info =
+                stream_get_first_alsa_device(&out->alsa_devices);
+        const double queued_frames = device_info->proxy.transferred - device_info->clock.frames;
+        *timestamp = (device_info->clock.time_ns +
+                (int64_t)(queued_frames * 1000000000.0 / device_info->clock.rate)) / 1000;
+    } else {
+        ret = -EINVAL;
+    }
+    stream_unlock(&out->lock);
+    return ret;
 }
 
 static int adev_open_output_stream(struct audio_hw_device *hw_dev,
@@ -964,9 +1901,15 @@ static int adev_open_output_stream(struct audio_hw_device *hw_dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_presentation_position = out_get_presentation_position;
+    out->stream.start = out_start;
+    out->stream.stop = out_stop;
+    out->stream.create_mmap_buffer = out_create_mmap_buffer;
+    out->stream.get_mmap_position = out_get_mmap_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
 
     out->handle = handle;
+    out->is_bit_perfect = is_bit_perfect;
+    out->is_mmap = (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) != AUDIO_OUTPUT_FLAG_NONE;
 
     stream_lock_init(&out->lock);
 
@@ -1067,6 +2010,11 @@ static int adev_open_output_stream(struct audio_hw_device *hw_dev,
                 __func__, config->channel_mask);
         return -EINVAL;
     }
+    if (out->is_mmap && proxy_config.channels != out->hal_channel_count) {
+        ALOGE("%s request mmap, but channel mask(%#x) cannot find exact match",
+                __func__, config->channel_mask);
+        return -EINVAL;
+    }
 
     ret = proxy_prepare(&device_info->proxy, &device_info->profile, &proxy_config, is_bit_perfect);
     if (is_bit_perfect && ret != 0) {
@@ -1088,6 +2036,17 @@ static int adev_open_output_stream(struct audio_hw_device *hw_dev,
 
     out->conversion_buffer = NULL;
     out->conversion_buffer_size = 0;
+    out->io_allocation_count = 0;
+    stream_reserve_conversion_buffer(&out->alsa_devices,
+                                     &out->conversion_buffer, &out->conversion_buffer_size);
+
+    out->volume_left = 1.0f;
+    out->volume_right = 1.0f;
+
+    out->parallel_write = property_get_bool(PARALLEL_WRITE_PROPERTY, false);
+    pthread_mutex_init(&out->write_ring.lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&out->write_ring.cond, (const pthread_condattr_t *) NULL);
+    list_init(&out->write_ring.writers);
 
     out->standby = true;
 
@@ -1114,6 +2073,9 @@ static void adev_close_output_stream(struct audio_hw_device *hw_dev,
     out->conversion_buffer = NULL;
     out->conversion_buffer_size = 0;
 
+    pthread_cond_destroy(&out->write_ring.cond);
+    pthread_mutex_destroy(&out->write_ring.lock);
+
     if (out->volume_ctl != NULL) {
         for (int i = 0; i < out->volume_ctl_num_values; ++i) {
             mixer_ctl_set_value(out->volume_ctl, i, out->max_volume_level);
@@ -1205,6 +2167,12 @@ static int in_standby(struct audio_stream *stream)
     struct stream_in *in = (struct stream_in *)stream;
 
     stream_lock(&in->lock);
+    if (in->is_mmap) {
+        /* The client keeps the buffer mapped until the stream is closed */
+        stream_stop_mmap_l(&in->alsa_devices);
+        stream_unlock(&in->lock);
+        return 0;
+    }
     device_lock(in->adev);
     stream_standby_l(&in->alsa_devices, &in->standby);
     device_unlock(in->adev);
@@ -1216,7 +2184,14 @@ static int in_dump(const struct audio_stream *stream, int fd)
 {
   const struct stream_in* in_stream = (const struct stream_in*)stream;
   if (in_stream != NULL) {
-      stream_dump_alsa_devices(&in_stream->alsa_devices, fd);
+      struct stream_lock *lock = (struct stream_lock *)&in_stream->lock;
+      const bool locked = stream_try_lock(lock) == 0;
+      stream_dump_alsa_devices(&in_stream->alsa_devices, locked, fd);
+      if (locked) {
+          stream_unlock(lock);
+      }
+      dprintf(fd, "Conversion buffer: %zu bytes, %u allocations in in_read\n",
+              in_stream->conversion_buffer_size, in_stream->io_allocation_count);
   }
 
   return 0;
@@ -1308,6 +2283,9 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer, size_t byte
     num_read_buff_bytes = bytes;
     int num_device_channels = proxy_get_channel_count(&device_info->proxy); /* what we told Alsa */
     int num_req_channels = in->hal_channel_count; /* what we told AudioFlinger */
+    const audio_format_t audio_format = in_get_format(&(in->stream.common));
+    channel_remix_update(&device_info->remix, audio_format,
+                         num_device_channels, num_req_channels, 1.0f, 1.0f);
 
     if (num_device_channels != num_req_channels) {
         num_read_buff_bytes = (num_device_channels * num_read_buff_bytes) / num_req_channels;
@@ -1316,10 +2294,18 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer, size_t byte
     /* Setup/Realloc the conversion buffer (if necessary). */
     if (num_read_buff_bytes != bytes) {
         if (num_read_buff_bytes > in->conversion_buffer_size) {
-            /*TODO Remove this when AudioPolicyManger/AudioFlinger support arbitrary formats
-              (and do these conversions themselves) */
+            /* More than a period, see stream_reserve_conversion_buffer() */
+            ALOGW_IF(in->conversion_buffer_size == 0,
+                     "%s conversion buffer was not reserved", __func__);
+            void *conversion_buffer = realloc(in->conversion_buffer, num_read_buff_bytes);
+            if (conversion_buffer == NULL) {
+                ALOGE("%s failed to allocate %zu bytes", __func__, num_read_buff_bytes);
+                num_read_buff_bytes = 0;
+                goto err;
+            }
+            in->conversion_buffer = conversion_buffer;
             in->conversion_buffer_size = num_read_buff_bytes;
-            in->conversion_buffer = realloc(in->conversion_buffer, in->conversion_buffer_size);
+            in->io_allocation_count++;
         }
         read_buff = in->conversion_buffer;
     }
@@ -1332,13 +2318,11 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer, size_t byte
             out_buff = buffer;
             /* Num Channels conversion */
             if (num_device_channels != num_req_channels) {
-                audio_format_t audio_format = in_get_format(&(in->stream.common));
-                unsigned sample_size_in_bytes = audio_bytes_per_sample(audio_format);
-
-                num_read_buff_bytes =
-                    adjust_channels(read_buff, num_device_channels,
-                                    out_buff, num_req_channels,
-                                    sample_size_in_bytes, num_read_buff_bytes);
+                const size_t frames = num_read_buff_bytes /
+                        audio_bytes_per_frame(num_device_channels, audio_format);
+                channel_remix_process(&device_info->remix, read_buff, out_buff, frames);
+                num_read_buff_bytes = frames * audio_bytes_per_frame(num_req_channels,
+                                                                     audio_format);
             }
         }
 
@@ -1369,7 +2353,54 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
 
     const int ret = device_info == NULL ? -ENODEV
             : proxy_get_capture_position(&device_info->proxy, frames, time);
+    if (ret == 0 && *frames >= 0) {
+        *frames = device_clock_update(&device_info->clock,
+                                      proxy_get_sample_rate(&device_info->proxy),
+                                      *frames, *time, UINT64_MAX);
+    }
+
+    stream_unlock(&in->lock);
+    return ret;
+}
+
+static int in_start(const struct audio_stream_in *stream)
+{
+    struct stream_in *in = (struct stream_in *)stream; // discard const qualifier
+    stream_lock(&in->lock);
+    const int ret = in->is_mmap ? stream_start_mmap_l(&in->alsa_devices) : -ENOSYS;
+    stream_unlock(&in->lock);
+    return ret;
+}
+
+static int in_stop(const struct audio_stream_in *stream)
+{
+    struct stream_in *in = (struct stream_in *)stream; // discard const qualifier
+    stream_lock(&in->lock);
+    const int ret = in->is_mmap ? stream_stop_mmap_l(&in->alsa_devices) : -ENOSYS;
+    stream_unlock(&in->lock);
+    return ret;
+}
 
+static int in_create_mmap_buffer(const struct audio_stream_in *stream,
+                                 int32_t min_size_frames,
+                                 struct audio_mmap_buffer_info *info)
+{
+    struct stream_in *in = (struct stream_in *)stream; // discard const qualifier
+    stream_lock(&in->lock);
+    const int ret = in->is_mmap
+            ? stream_create_mmap_buffer_l(&in->alsa_devices, &in->standby, min_size_frames, info)
+            : -ENOSYS;
+    stream_unlock(&in->lock);
+    return ret;
+}
+
+static int in_get_mmap_position(const struct audio_stream_in *stream,
+                                struct audio_mmap_position *position)
+{
+    struct stream_in *in = (struct stream_in *)stream; // discard const qualifier
+    stream_lock(&in->lock);
+    const int ret = in->is_mmap ? stream_get_mmap_position_l(&in->alsa_devices, position)
+                                : -ENOSYS;
     stream_unlock(&in->lock);
     return ret;
 }
@@ -1403,7 +2434,7 @@ static int adev_open_input_stream(struct audio_hw_device *hw_dev,
                                   audio_devices_t devicesSpec __unused,
                                   struct audio_config *config,
                                   struct audio_stream_in **stream_in,
-                                  audio_input_flags_t flags __unused,
+                                  audio_input_flags_t flags,
                                   const char *address,
                                   audio_source_t source __unused)
 {
@@ -1442,12 +2473,17 @@ static int adev_open_input_stream(struct audio_hw_device *hw_dev,
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
     in->stream.get_capture_position = in_get_capture_position;
+    in->stream.start = in_start;
+    in->stream.stop = in_stop;
+    in->stream.create_mmap_buffer = in_create_mmap_buffer;
+    in->stream.get_mmap_position = in_get_mmap_position;
 
     in->stream.get_active_microphones = in_get_active_microphones;
     in->stream.set_microphone_direction = in_set_microphone_direction;
     in->stream.set_microphone_field_dimension = in_set_microphone_field_dimension;
 
     in->handle = handle;
+    in->is_mmap = (flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) != AUDIO_INPUT_FLAG_NONE;
 
     stream_lock_init(&in->lock);
 
@@ -1580,11 +2616,18 @@ static int adev_open_input_stream(struct audio_hw_device *hw_dev,
                 profile_get_closest_channel_count(&device_info->profile, in->hal_channel_count);
         ret = proxy_prepare(&device_info->proxy, &device_info->profile, &in->config,
                             false /*require_exact_match*/);
+        if (ret == 0 && in->is_mmap &&
+                proxy_get_channel_count(&device_info->proxy) != in->hal_channel_count) {
+            ALOGE("%s request mmap, but channel mask(%#x) cannot find exact match",
+                    __func__, config->channel_mask);
+            ret = -EINVAL;
+        }
         if (ret == 0) {
             in->standby = true;
 
             in->conversion_buffer = NULL;
             in->conversion_buffer_size = 0;
+            in->io_allocation_count = 0;
 
             *stream_in = &in->stream;
 
@@ -1611,6 +2654,10 @@ static int adev_open_input_stream(struct audio_hw_device *hw_dev,
 
     list_add_tail(&in->alsa_devices, &device_info->list_node);
 
+    /* After adding the device, as the reservation is sized from the stream's devices */
+    stream_reserve_conversion_buffer(&in->alsa_devices,
+                                     &in->conversion_buffer, &in->conversion_buffer_size);
+
     device_lock(in->adev);
     ++in->adev->inputs_open;
     device_unlock(in->adev);
@@ -1823,6 +2870,13 @@ static int adev_create_audio_patch(struct audio_hw_device *dev,
         return 0;
     }
 
+    if (!wasStandby && (out == NULL ? in->is_mmap : out->is_mmap)) {
+        // The client maps the buffer of the current device until the stream is closed.
+        ALOGE("%s() can not reroute mmap stream with handle(%d)", __func__, io_handle);
+        stream_unlock(lock);
+        return -ENOSYS;
+    }
+
     device_lock(adev);
     stream_standby_l(alsa_devices, out == NULL ? &in->standby : &out->standby);
     device_unlock(adev);
@@ -1854,6 +2908,14 @@ static int adev_create_audio_patch(struct audio_hw_device *dev,
         if (device_info != NULL) device_info->proxy.transferred = saved_transferred_frames;
     }
 
+    if (out != NULL) {
+        stream_reserve_conversion_buffer(alsa_devices,
+                                         &out->conversion_buffer, &out->conversion_buffer_size);
+    } else {
+        stream_reserve_conversion_buffer(alsa_devices,
+                                         &in->conversion_buffer, &in->conversion_buffer_size);
+    }
+
     if (!wasStandby) {
         device_lock(adev);
         if (in != NULL) {